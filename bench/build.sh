@@ -0,0 +1,93 @@
+#!/bin/sh
+#
+# Build nginx with ngx_http_ziti_module linked against the loopback stand-in for libziti
+# (bench/ziti_loopback.c), for bench/run.sh.
+#
+#   bench/build.sh [nginx source dir] [ziti-sdk-c dir]
+#
+# Both default to the layout described under Installation in README.md.  The result is
+# bench/objs/sbin/nginx, or the same under BENCH_PREFIX.  BENCH_CFLAGS is added when compiling
+# and linking, e.g. BENCH_CFLAGS=-fsanitize=thread for a ThreadSanitizer build.  t/run.sh builds
+# its sanitizer variants this way, each under a prefix of its own.
+#
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+MODULE=$(dirname "$BENCH")
+TOP=$(dirname "$MODULE")
+
+NGINX_SRC=${1:-$(ls -d "$TOP"/nginx-* 2>/dev/null | head -n 1)}
+ZITI_SDK=${2:-$TOP/ziti-sdk-c}
+ZITI_BUILD=$ZITI_SDK/build
+PREFIX=${BENCH_PREFIX:-$BENCH/objs}
+
+if [ ! -x "$NGINX_SRC/configure" ]; then
+    echo "nginx source not found, pass its directory as the first argument" >&2
+    exit 1
+fi
+
+if [ ! -f "$ZITI_BUILD/library/libziti.a" ]; then
+    echo "$ZITI_BUILD/library/libziti.a not found, build ziti-sdk-c first" >&2
+    exit 1
+fi
+
+INCS="-I$ZITI_SDK/includes \
+      -I$ZITI_BUILD/_deps/uv-mbed-src/include \
+      -I$ZITI_BUILD/_deps/libuv-src/include \
+      -I$ZITI_BUILD/_deps/http_parser-src \
+      -I$ZITI_BUILD/_deps/uv_link-src/include"
+
+mkdir -p "$PREFIX"
+
+cc -c -O2 -g -fPIC $BENCH_CFLAGS $INCS -o "$PREFIX/ziti_loopback.o" "$BENCH/ziti_loopback.c"
+
+#
+# A libziti.a of our own: the SDK's, minus the members that define what ziti_loopback.o stands in
+# for, plus ziti_loopback.o.  The module's -lziti finds it first; logging, error strings and
+# uv_mbed still come from the SDK.
+#
+mkdir -p "$PREFIX/lib"
+cp "$ZITI_BUILD/library/libziti.a" "$PREFIX/lib/libziti.a"
+
+for member in ziti.c.o ziti_src.c.o connect.c.o; do
+    if ar t "$PREFIX/lib/libziti.a" | grep -qx "$member"; then
+        ar d "$PREFIX/lib/libziti.a" "$member"
+    fi
+done
+
+ar rs "$PREFIX/lib/libziti.a" "$PREFIX/ziti_loopback.o"
+
+cd "$NGINX_SRC"
+
+./configure \
+    --prefix="$PREFIX" \
+    --with-threads \
+    --with-http_dav_module \
+    --without-http_gzip_module \
+    --add-module="$MODULE" \
+    --with-ld-opt=" \
+        -L$PREFIX/lib \
+        $PREFIX/lib/libziti.a \
+        $ZITI_BUILD/_deps/libsodium-build/lib/libsodium.a \
+        $ZITI_BUILD/_deps/uv-mbed-build/libuv_mbed.a \
+        $ZITI_BUILD/_deps/libuv-build/libuv_a.a \
+        -lssl \
+        -lcrypto \
+        -lm \
+        $BENCH_CFLAGS" \
+    --with-cc-opt=" \
+        -O2 -g \
+        -fno-strict-aliasing \
+        -Wno-unused-variable \
+        -Wno-unused-but-set-variable \
+        -Wno-unused-value \
+        -Wno-unused-function \
+        -Wno-cast-function-type \
+        $BENCH_CFLAGS \
+        $INCS"
+
+make -j"$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 2)"
+make install
+
+echo "built $PREFIX/sbin/nginx"
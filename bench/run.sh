@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# Run the benchmark scenarios against the nginx built by bench/build.sh and print, for each,
+# requests/s, p50 and p99 latency, and worker CPU time per request.
+#
+#   bench/run.sh [scenario ...]
+#
+# Scenarios: baseline (the origin alone, no Ziti), small, large, upload, burst, and native and
+# native-upload (small and upload on ziti_http_engine native, to compare with those).  All of
+# them by default.  DURATION, THREADS and CONNS tune wrk; WORKERS sets worker_processes.
+#
+# The origin runs in the same worker processes, so CPU per request includes it; the baseline
+# row is what to subtract.
+#
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+PREFIX=$BENCH/objs
+NGINX=$PREFIX/sbin/nginx
+
+DURATION=${DURATION:-10s}
+THREADS=${THREADS:-4}
+CONNS=${CONNS:-64}
+WORKERS=${WORKERS:-1}
+
+export ZITI_LOOPBACK_ORIGIN=${ZITI_LOOPBACK_ORIGIN:-127.0.0.1:18080}
+
+if [ ! -x "$NGINX" ]; then
+    echo "$NGINX not found, run bench/build.sh first" >&2
+    exit 1
+fi
+
+command -v wrk >/dev/null || { echo "wrk not found" >&2; exit 1; }
+
+mkdir -p "$PREFIX/conf" "$PREFIX/logs" "$PREFIX/html"
+
+sed "s/^worker_processes .*/worker_processes  $WORKERS;/" "$BENCH/nginx.conf" > "$PREFIX/conf/bench.conf"
+echo '{}' > "$PREFIX/conf/identity.json"
+
+if [ ! -f "$PREFIX/html/large" ]; then
+    head -c 10485760 /dev/urandom > "$PREFIX/html/large"
+fi
+
+"$NGINX" -p "$PREFIX" -c conf/bench.conf
+trap '"$NGINX" -p "$PREFIX" -c conf/bench.conf -s stop' EXIT
+
+sleep 1
+
+MASTER=$(cat "$PREFIX/logs/nginx.pid")
+HZ=$(getconf CLK_TCK)
+
+# utime + stime of every worker, in clock ticks
+cpu_ticks() {
+    total=0
+    for pid in $(pgrep -P "$MASTER"); do
+        t=$(awk '{ print $14 + $15 }' "/proc/$pid/stat" 2>/dev/null || echo 0)
+        total=$((total + t))
+    done
+    echo $total
+}
+
+# scenario name, url, connections, extra wrk arguments
+run() {
+    name=$1 url=$2 conns=$3
+    shift 3
+
+    # warm the pools up
+    wrk -t1 -c"$conns" -d2s "$@" "$url" >/dev/null 2>&1 || true
+
+    before=$(cpu_ticks)
+    out=$(wrk -t"$THREADS" -c"$conns" -d"$DURATION" --latency "$@" "$url")
+    after=$(cpu_ticks)
+
+    echo "$out" | awk -v name="$name" -v ticks=$((after - before)) -v hz="$HZ" '
+        /^ +50%/                 { p50 = $2 }
+        /^ +99%/                 { p99 = $2 }
+        /requests in/            { reqs = $1 }
+        /^Requests\/sec/         { rps = $2 }
+        /Non-2xx or 3xx/         { errs = $NF }
+        /Socket errors/          { serrs = $0; sub(/.*Socket errors: */, "", serrs) }
+        END {
+            cpu = reqs ? ticks * 1000000 / hz / reqs : 0
+            printf "%-10s %12s %10s %10s %12.1f %8d  %s\n", name, rps, p50, p99, cpu, errs, serrs
+        }'
+}
+
+printf "%-10s %12s %10s %10s %12s %8s\n" scenario req/s p50 p99 cpu-us/req non-2xx
+
+SCENARIOS=${*:-baseline small large upload burst native native-upload}
+
+for s in $SCENARIOS; do
+    case $s in
+    baseline) run baseline "http://127.0.0.1:18080/small" "$CONNS" ;;
+    small)    run small    "http://127.0.0.1:18081/small" "$CONNS" ;;
+    large)    run large    "http://127.0.0.1:18081/large" 16 ;;
+    upload)   run upload   "http://127.0.0.1:18081/upload" 16 -s "$BENCH/upload.lua" ;;
+    burst)    run burst    "http://127.0.0.1:18081/burst/small" 256 ;;
+    native)   run native   "http://127.0.0.1:18081/native/small" "$CONNS" ;;
+    native-upload) run native-upload "http://127.0.0.1:18081/native/upload" 16 -s "$BENCH/upload.lua" ;;
+    *)        echo "unknown scenario $s" >&2; exit 1 ;;
+    esac
+done
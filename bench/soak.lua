@@ -0,0 +1,16 @@
+-- wrk script for bench/soak.sh: mostly small responses, with some 1 MB downloads, error
+-- statuses and connections the origin drops mixed in
+local paths = {}
+
+for i = 1, 16 do paths[#paths + 1] = "/small" end
+paths[#paths + 1] = "/medium"
+paths[#paths + 1] = "/medium"
+paths[#paths + 1] = "/soak/error"
+paths[#paths + 1] = "/soak/drop"
+
+local n = 0
+
+request = function()
+    n = n + 1
+    return wrk.format(nil, paths[n % #paths + 1])
+end
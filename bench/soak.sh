@@ -0,0 +1,156 @@
+#!/bin/sh
+#
+# Soak the nginx built by bench/build.sh and fail if worker memory keeps growing.
+#
+#   bench/soak.sh
+#
+# Runs ROUNDS rounds of ROUND each (20 x 30s by default, a few million requests on most
+# machines) of small responses, 1 MB downloads, origin errors and dropped origin connections
+# (bench/soak.lua), with clients giving up on 10 MB downloads halfway through alongside.  The
+# resident set of the workers is sampled after every round; the first WARMUP rounds fill the
+# pools and nginx's free lists, and growth past that, beyond RSS_BUDGET_KB, fails the run.
+#
+# HEAPTRACK=1 runs a single nginx process under heaptrack (https://github.com/KDE/heaptrack)
+# and prints the allocation sites still holding memory at exit, biggest first.  For leak
+# reports without it, build with BENCH_CFLAGS=-fsanitize=address; LeakSanitizer reports to
+# logs/error.log when the workers exit.
+#
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+PREFIX=$BENCH/objs
+NGINX=$PREFIX/sbin/nginx
+
+ROUNDS=${ROUNDS:-20}
+ROUND=${ROUND:-30s}
+WARMUP=${WARMUP:-2}
+THREADS=${THREADS:-4}
+CONNS=${CONNS:-64}
+WORKERS=${WORKERS:-1}
+RSS_BUDGET_KB=${RSS_BUDGET_KB:-16384}
+
+export ZITI_LOOPBACK_ORIGIN=${ZITI_LOOPBACK_ORIGIN:-127.0.0.1:18080}
+
+if [ ! -x "$NGINX" ]; then
+    echo "$NGINX not found, run bench/build.sh first" >&2
+    exit 1
+fi
+
+command -v wrk >/dev/null || { echo "wrk not found" >&2; exit 1; }
+
+if [ -n "$HEAPTRACK" ]; then
+    command -v heaptrack >/dev/null || { echo "heaptrack not found" >&2; exit 1; }
+fi
+
+mkdir -p "$PREFIX/conf" "$PREFIX/logs" "$PREFIX/html"
+
+sed "s/^worker_processes .*/worker_processes  $WORKERS;/" "$BENCH/nginx.conf" > "$PREFIX/conf/bench.conf"
+echo '{}' > "$PREFIX/conf/identity.json"
+
+if [ ! -f "$PREFIX/html/large" ]; then
+    head -c 10485760 /dev/urandom > "$PREFIX/html/large"
+fi
+
+if [ ! -f "$PREFIX/html/medium" ]; then
+    head -c 1048576 /dev/urandom > "$PREFIX/html/medium"
+fi
+
+rm -f "$PREFIX/logs/nginx.pid"
+
+if [ -n "$HEAPTRACK" ]; then
+    # one process, so that heaptrack sees the requests
+    (cd "$PREFIX/logs" && exec heaptrack "$NGINX" -p "$PREFIX" -c conf/bench.conf \
+        -g 'master_process off; daemon off;') > "$PREFIX/logs/heaptrack.out" 2>&1 &
+    HEAPTRACK_PID=$!
+else
+    "$NGINX" -p "$PREFIX" -c conf/bench.conf
+fi
+
+trap '"$NGINX" -p "$PREFIX" -c conf/bench.conf -s stop 2>/dev/null || true' EXIT
+
+sleep 2
+
+MASTER=$(cat "$PREFIX/logs/nginx.pid")
+
+# VmRSS of the processes serving requests, in kB
+rss() {
+    if [ -n "$HEAPTRACK" ]; then
+        pids=$MASTER
+    else
+        pids=$(pgrep -P "$MASTER")
+    fi
+
+    total=0
+    for pid in $pids; do
+        kb=$(awk '/^VmRSS:/ { print $2 }' "/proc/$pid/status" 2>/dev/null || echo 0)
+        total=$((total + ${kb:-0}))
+    done
+    echo $total
+}
+
+# clients that close the connection while a 10 MB response is still streaming
+abort_clients() {
+    command -v curl >/dev/null || return 0
+
+    end=$(($(date +%s) + $1))
+    while [ "$(date +%s)" -lt "$end" ]; do
+        curl -s -o /dev/null --max-time 0.05 "http://127.0.0.1:18081/large" || true
+    done
+}
+
+seconds=$(echo "$ROUND" | sed 's/s$//')
+
+printf "%-6s %12s %10s %10s %10s\n" round requests non-2xx rss-kB growth-kB
+
+base=0
+total=0
+round=1
+
+while [ "$round" -le "$ROUNDS" ]; do
+    abort_clients "$seconds" &
+
+    out=$(wrk -t"$THREADS" -c"$CONNS" -d"$ROUND" -s "$BENCH/soak.lua" "http://127.0.0.1:18081/")
+
+    wait $!
+
+    reqs=$(echo "$out" | awk '/requests in/ { print $1 }')
+    errs=$(echo "$out" | awk '/Non-2xx or 3xx/ { print $NF }')
+    total=$((total + ${reqs:-0}))
+
+    kb=$(rss)
+
+    if [ "$round" -eq "$WARMUP" ]; then
+        base=$kb
+    fi
+
+    growth=$((round > WARMUP ? kb - base : 0))
+
+    printf "%-6d %12d %10d %10d %10d\n" "$round" "${reqs:-0}" "${errs:-0}" "$kb" "$growth"
+
+    round=$((round + 1))
+done
+
+status=0
+
+if [ "$ROUNDS" -gt "$WARMUP" ] && [ "$growth" -gt "$RSS_BUDGET_KB" ]; then
+    echo "FAIL: RSS grew by $growth kB over $total requests, the budget is $RSS_BUDGET_KB kB" >&2
+    status=1
+else
+    echo "ok: $total requests"
+fi
+
+if [ -n "$HEAPTRACK" ]; then
+    "$NGINX" -p "$PREFIX" -c conf/bench.conf -s stop
+    wait "$HEAPTRACK_PID" || true
+    trap - EXIT
+
+    data=$(ls -t "$PREFIX"/logs/heaptrack.nginx.* | head -n 1)
+
+    echo
+    echo "allocation sites holding memory at exit ($data):"
+    heaptrack_print --print-leaks 1 --print-peaks 0 --print-allocators 0 --print-temporary 0 \
+        "$data" | sed -n '/^MEMORY LEAKS/,$p' | head -n 80
+fi
+
+exit $status
@@ -0,0 +1,4 @@
+-- wrk script for the upload scenario of bench/run.sh: POST a 1 MB body
+wrk.method = "POST"
+wrk.body = string.rep("x", 1024 * 1024)
+wrk.headers["Content-Type"] = "application/octet-stream"
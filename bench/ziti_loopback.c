@@ -0,0 +1,480 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+ * A stand-in for the parts of libziti the module calls, for benchmarking without a controller
+ * or edge routers.  Linked ahead of libziti.a (see bench/build.sh), so the linker takes these
+ * definitions and only pulls the rest of the SDK (logging, errors, uv_mbed) from the archive.
+ *
+ * Contexts come up on the next loop iteration.  ziti_src_init() gives each pooled client a
+ * plain TCP connection to the origin in ZITI_LOOPBACK_ORIGIN (host:port, 127.0.0.1:18080 by
+ * default) in place of a Ziti connection, so the handler, pool and buffer code run exactly as
+ * they do in production.  Raw connections, which ziti_http_engine native dials, get a plain TCP
+ * connection to the origin the same way.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+#include <uv_link_t.h>
+#include <ziti/ziti.h>
+#include <ziti/ziti_src.h>
+
+
+#define ZITI_LOOPBACK_ORIGIN  "127.0.0.1:18080"
+
+
+struct ziti_ctx {
+    uv_loop_t                  *loop;
+    ziti_options               *opts;
+    uv_timer_t                  up;
+    int                         shutdown;
+};
+
+
+/*
+ * The um_src_t of a pooled client.  The source link must come first: um_http chains onto
+ * src->link, which points here.
+ */
+typedef struct {
+    uv_link_source_t            source;
+    uv_loop_t                  *loop;
+    um_src_t                   *src;
+    uv_tcp_t                   *tcp;
+    uv_connect_t                req;
+} ziti_loopback_link_t;
+
+
+/*
+ * A raw connection: ziti_dial() connects it to the origin
+ */
+struct ziti_conn {
+    uv_tcp_t                    tcp;
+    uv_connect_t                req;
+    void                       *data;
+    ziti_conn_cb                conn_cb;
+    ziti_data_cb                data_cb;
+    ziti_close_cb               close_cb;
+};
+
+
+typedef struct {
+    uv_write_t                  req;
+    ziti_connection             conn;
+    ziti_write_cb               cb;
+    void                       *ctx;
+    size_t                      len;
+} ziti_loopback_write_t;
+
+
+static struct sockaddr_storage  origin;
+static int                      origin_ready;
+
+static ziti_version             loopback_version = {
+    .version = "loopback",
+    .revision = "0",
+    .build_date = "-",
+};
+
+static ziti_identity            loopback_identity = {
+    .id = "loopback",
+    .name = "loopback",
+};
+
+
+static int
+ziti_loopback_origin(void)
+{
+    char                       *env, *colon, host[256];
+    int                         port;
+
+    if (origin_ready) {
+        return 0;
+    }
+
+    env = getenv("ZITI_LOOPBACK_ORIGIN");
+    if (env == NULL || *env == '\0') {
+        env = ZITI_LOOPBACK_ORIGIN;
+    }
+
+    colon = strrchr(env, ':');
+    if (colon == NULL || (size_t) (colon - env) >= sizeof(host)) {
+        return UV_EINVAL;
+    }
+
+    memcpy(host, env, colon - env);
+    host[colon - env] = '\0';
+    port = atoi(colon + 1);
+
+    if (uv_ip4_addr(host, port, (struct sockaddr_in *) &origin) != 0
+        && uv_ip6_addr(host, port, (struct sockaddr_in6 *) &origin) != 0)
+    {
+        return UV_EINVAL;
+    }
+
+    origin_ready = 1;
+
+    return 0;
+}
+
+
+static void
+ziti_loopback_up(uv_timer_t *timer)
+{
+    struct ziti_ctx            *ztx = timer->data;
+    ziti_event_t                ev;
+
+    if (ztx->shutdown) {
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.type = ZitiContextEvent;
+    ev.event.ctx.ctrl_status = ZITI_OK;
+
+    ztx->opts->event_cb(ztx, &ev);
+
+    if (ztx->opts->events & ZitiRouterEvent) {
+        memset(&ev, 0, sizeof(ev));
+        ev.type = ZitiRouterEvent;
+        ev.event.router.status = EdgeRouterConnected;
+        ev.event.router.name = "loopback";
+        ev.event.router.address = getenv("ZITI_LOOPBACK_ORIGIN") ? getenv("ZITI_LOOPBACK_ORIGIN") : ZITI_LOOPBACK_ORIGIN;
+        ev.event.router.version = "loopback";
+
+        ztx->opts->event_cb(ztx, &ev);
+    }
+}
+
+
+int
+ziti_init_opts(ziti_options *options, uv_loop_t *loop)
+{
+    struct ziti_ctx            *ztx;
+
+    if (ziti_loopback_origin() != 0) {
+        return ZITI_CONFIG_NOT_FOUND;
+    }
+
+    ztx = calloc(1, sizeof(struct ziti_ctx));
+    if (ztx == NULL) {
+        return ZITI_CONFIG_NOT_FOUND;
+    }
+
+    ztx->loop = loop;
+    ztx->opts = options;
+
+    uv_timer_init(loop, &ztx->up);
+    ztx->up.data = ztx;
+    uv_timer_start(&ztx->up, ziti_loopback_up, 0, 0);
+
+    return ZITI_OK;
+}
+
+
+static void
+ziti_loopback_free_ctx(uv_handle_t *handle)
+{
+    free(handle->data);
+}
+
+
+int
+ziti_shutdown(ziti_context ztx)
+{
+    ztx->shutdown = 1;
+    uv_close((uv_handle_t *) &ztx->up, ziti_loopback_free_ctx);
+
+    return ZITI_OK;
+}
+
+
+void *
+ziti_app_ctx(ziti_context ztx)
+{
+    return ztx->opts->app_ctx;
+}
+
+
+const ziti_version *
+ziti_get_controller_version(ziti_context ztx)
+{
+    return &loopback_version;
+}
+
+
+const ziti_identity *
+ziti_get_identity(ziti_context ztx)
+{
+    return &loopback_identity;
+}
+
+
+const char *
+ziti_get_controller(ziti_context ztx)
+{
+    return "loopback";
+}
+
+
+void
+ziti_get_transfer_rates(ziti_context ztx, double *up, double *down)
+{
+    *up = 0;
+    *down = 0;
+}
+
+
+/* services never change here */
+void
+ziti_refresh(ziti_context ztx)
+{
+}
+
+
+int
+ziti_service_available(ziti_context ztx, const char *service, ziti_service_cb cb, void *ctx)
+{
+    ziti_service                svc;
+
+    memset(&svc, 0, sizeof(svc));
+    svc.id = (char *) service;
+    svc.name = (char *) service;
+    svc.perm_flags = ZITI_CAN_DIAL;
+
+    cb(ztx, &svc, ZITI_OK, ctx);
+
+    return ZITI_OK;
+}
+
+
+static void
+ziti_loopback_connected(uv_connect_t *req, int status)
+{
+    ziti_loopback_link_t       *lb = req->data;
+    um_src_t                   *src = lb->src;
+
+    if (status == 0) {
+        uv_tcp_nodelay(lb->tcp, 1);
+        uv_link_source_init(&lb->source, (uv_stream_t *) lb->tcp);
+    }
+
+    src->connect_cb(src, status, src->connect_ctx);
+}
+
+
+static int
+ziti_loopback_connect(um_src_t *src, const char *host, const char *port, um_src_connect_cb cb, void *ctx)
+{
+    ziti_loopback_link_t       *lb = (ziti_loopback_link_t *) src->link;
+
+    src->connect_cb = cb;
+    src->connect_ctx = ctx;
+
+    lb->tcp = calloc(1, sizeof(uv_tcp_t));
+    if (lb->tcp == NULL) {
+        return UV_ENOMEM;
+    }
+
+    uv_tcp_init(lb->loop, lb->tcp);
+
+    lb->req.data = lb;
+
+    return uv_tcp_connect(&lb->req, lb->tcp, (struct sockaddr *) &origin, ziti_loopback_connected);
+}
+
+
+static void
+ziti_loopback_free_tcp(uv_handle_t *handle)
+{
+    free(handle);
+}
+
+
+static void
+ziti_loopback_release(um_src_t *src)
+{
+    ziti_loopback_link_t       *lb = (ziti_loopback_link_t *) src->link;
+
+    if (lb->tcp) {
+        uv_close((uv_handle_t *) lb->tcp, ziti_loopback_free_tcp);
+        lb->tcp = NULL;
+    }
+}
+
+
+int
+ziti_src_init(uv_loop_t *l, um_src_t *st, const char *svc, ziti_context ztx)
+{
+    ziti_loopback_link_t       *lb;
+
+    lb = calloc(1, sizeof(ziti_loopback_link_t));
+    if (lb == NULL) {
+        return UV_ENOMEM;
+    }
+
+    lb->loop = l;
+    lb->src = st;
+
+    st->connect = ziti_loopback_connect;
+    st->release = ziti_loopback_release;
+    st->link = (uv_link_t *) &lb->source;
+
+    return 0;
+}
+
+
+int
+ziti_conn_init(ziti_context ztx, ziti_connection *conn, void *data)
+{
+    ziti_connection             c;
+
+    c = calloc(1, sizeof(struct ziti_conn));
+    if (c == NULL) {
+        return UV_ENOMEM;
+    }
+
+    uv_tcp_init(ztx->loop, &c->tcp);
+
+    c->tcp.data = c;
+    c->data = data;
+
+    *conn = c;
+
+    return ZITI_OK;
+}
+
+
+void *
+ziti_conn_data(ziti_connection conn)
+{
+    return conn->data;
+}
+
+
+static void
+ziti_loopback_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf)
+{
+    buf->base = malloc(suggested);
+    buf->len = buf->base ? suggested : 0;
+}
+
+
+static void
+ziti_loopback_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+    ziti_connection             conn = stream->data;
+
+    if (nread > 0) {
+        conn->data_cb(conn, (uint8_t *) buf->base, nread);
+
+    } else if (nread < 0) {
+        uv_read_stop(stream);
+        conn->data_cb(conn, NULL, nread == UV_EOF ? ZITI_EOF : nread);
+    }
+
+    free(buf->base);
+}
+
+
+static void
+ziti_loopback_dialed(uv_connect_t *req, int status)
+{
+    ziti_connection             conn = req->data;
+
+    if (status == 0) {
+        uv_tcp_nodelay(&conn->tcp, 1);
+        uv_read_start((uv_stream_t *) &conn->tcp, ziti_loopback_alloc, ziti_loopback_read);
+    }
+
+    conn->conn_cb(conn, status == 0 ? ZITI_OK : status);
+}
+
+
+int
+ziti_dial(ziti_connection conn, const char *service, ziti_conn_cb cb, ziti_data_cb data_cb)
+{
+    conn->conn_cb = cb;
+    conn->data_cb = data_cb;
+    conn->req.data = conn;
+
+    return uv_tcp_connect(&conn->req, &conn->tcp, (struct sockaddr *) &origin, ziti_loopback_dialed);
+}
+
+
+static void
+ziti_loopback_written(uv_write_t *req, int status)
+{
+    ziti_loopback_write_t      *wr = req->data;
+
+    wr->cb(wr->conn, status == 0 ? (ssize_t) wr->len : status, wr->ctx);
+
+    free(wr);
+}
+
+
+int
+ziti_write(ziti_connection conn, uint8_t *data, size_t length, ziti_write_cb write_cb, void *write_ctx)
+{
+    ziti_loopback_write_t      *wr;
+    uv_buf_t                    buf;
+    int                         rc;
+
+    wr = calloc(1, sizeof(ziti_loopback_write_t));
+    if (wr == NULL) {
+        return UV_ENOMEM;
+    }
+
+    wr->req.data = wr;
+    wr->conn = conn;
+    wr->cb = write_cb;
+    wr->ctx = write_ctx;
+    wr->len = length;
+
+    buf = uv_buf_init((char *) data, length);
+
+    rc = uv_write(&wr->req, (uv_stream_t *) &conn->tcp, &buf, 1, ziti_loopback_written);
+    if (rc != 0) {
+        free(wr);
+    }
+
+    return rc;
+}
+
+
+static void
+ziti_loopback_conn_closed(uv_handle_t *handle)
+{
+    ziti_connection             conn = handle->data;
+
+    if (conn->close_cb) {
+        conn->close_cb(conn);
+    }
+
+    free(conn);
+}
+
+
+int
+ziti_close(ziti_connection conn, ziti_close_cb close_cb)
+{
+    conn->close_cb = close_cb;
+
+    uv_close((uv_handle_t *) &conn->tcp, ziti_loopback_conn_closed);
+
+    return ZITI_OK;
+}
@@ -0,0 +1,905 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef DDEBUG
+#define DDEBUG 1
+#endif
+#include "ddebug.h"
+
+#include <sys/un.h>
+
+#include "ngx_http_ziti_module.h"
+#include "ngx_http_ziti_bind.h"
+
+
+/*
+ * ziti_bind: a server block that hosts a Ziti service.  Each loop of the server's identity
+ * binds the service, so every worker, and every loop in it, is a terminator the fabric can
+ * route clients to.
+ *
+ * An accepted Ziti connection is given to nginx as one end of a socketpair, which goes
+ * through ngx_http_init_connection() as if it had been accepted on a listening socket of the
+ * server; the request is then served by whatever the server's locations do, with no
+ * tunneler process in between.  The loop thread copies between the Ziti connection and the
+ * other end of the socketpair.  It writes what the service side sends straight from the SDK's
+ * buffer when the socket takes it, and only copies what the socket could not take yet.
+ */
+
+
+/* how often (ms) a listener waiting for its context looks again, and retries a failed bind */
+#define NGX_HTTP_ZITI_BIND_WAIT   1000
+#define NGX_HTTP_ZITI_BIND_RETRY  5000
+
+
+typedef struct {
+    /* the service bound */
+    char                               *service;
+    ngx_http_ziti_loc_conf_t           *zlcf;
+    ngx_http_core_srv_conf_t           *cscf;
+    /* what the accepted connections look like they came in on; not in cycle->listening */
+    ngx_listening_t                    *ls;
+    size_t                              buf_size;
+} ngx_http_ziti_bind_t;
+
+
+/*
+ * One binding of a service, on one loop
+ */
+typedef struct {
+    ngx_http_ziti_bind_t               *bind;
+    ngx_http_ziti_loop_t               *loop;
+
+    /* loop thread only */
+    ziti_connection                     server;
+    uv_work_t                           start_req;
+    uv_timer_t                          timer;
+    unsigned                            server_closing:1;
+
+    /* accepted connections on their way to the nginx thread, under lock */
+    uv_mutex_t                          lock;
+    ngx_queue_t                         accepted;
+    ngx_thread_task_t                  *task;
+    unsigned                            task_posted:1;
+} ngx_http_ziti_bind_listener_t;
+
+
+typedef struct {
+    ngx_queue_t                         queue;
+    ngx_socket_t                        fd;
+    size_t                              len;
+    /* the caller's identity name, for $remote_addr */
+    u_char                              caller[1];
+} ngx_http_ziti_bind_accepted_t;
+
+
+/*
+ * An accepted Ziti connection and the loop's end of its socketpair, owned by the loop thread
+ */
+typedef struct {
+    ngx_http_ziti_bind_listener_t      *listener;
+    ziti_connection                     conn;
+    uv_pipe_t                           pipe;
+    uv_write_t                          write_req;
+    uv_shutdown_t                       shutdown_req;
+    /* nginx's end, until it is handed over */
+    ngx_socket_t                        fd;
+    char                               *caller;
+    size_t                              size;
+    /* nginx -> Ziti client, and what the socket could not take yet of Ziti client -> nginx */
+    u_char                             *up;
+    u_char                             *down;
+    unsigned                            pipe_writing:1;
+    unsigned                            eof:1;
+    unsigned                            closing:1;
+    unsigned                            conn_closed:1;
+    unsigned                            pipe_closed:1;
+} ngx_http_ziti_bind_conn_t;
+
+
+static void ngx_http_ziti_bind_listen(uv_timer_t *timer);
+static void ngx_http_ziti_bind_conn_close(ngx_http_ziti_bind_conn_t *bc);
+
+
+/**
+ * ziti_bind <service>;
+ */
+char *
+ngx_http_ziti_bind(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ziti_loc_conf_t   *zlcf = conf;
+    ngx_str_t                  *value = cf->args->elts;
+    ngx_http_ziti_main_conf_t  *zmcf;
+    ngx_http_ziti_bind_t       *bind;
+
+    if (value[1].len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "empty service name in \"%V\"", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    zmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_ziti_module);
+
+    if (zmcf->binds == NULL) {
+        zmcf->binds = ngx_array_create(cf->pool, 2, sizeof(ngx_http_ziti_bind_t));
+        if (zmcf->binds == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    bind = ngx_array_push(zmcf->binds);
+    if (bind == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(bind, sizeof(ngx_http_ziti_bind_t));
+
+    bind->service = (char *) ngx_pnalloc(cf->pool, value[1].len + 1);
+    if (bind->service == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *ngx_cpymem(bind->service, value[1].data, value[1].len) = '\0';
+
+    // the identity is the server's; checked once the http block is parsed, since it may come later
+    bind->zlcf = zlcf;
+    bind->cscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_core_module);
+
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Set up the listening the accepted connections of each ziti_bind are attributed to.  It
+ * routes every request to the server of the ziti_bind, whatever its Host header says.
+ */
+ngx_int_t
+ngx_http_ziti_bind_postconfiguration(ngx_conf_t *cf, ngx_http_ziti_main_conf_t *zmcf)
+{
+    ngx_http_ziti_bind_t       *binds;
+    ngx_http_core_loc_conf_t   *clcf;
+    ngx_listening_t            *ls;
+    ngx_http_port_t            *hport;
+    ngx_http_in_addr_t         *addr;
+    struct sockaddr_un         *sun;
+    ngx_uint_t                  i;
+
+    if (zmcf->binds == NULL) {
+        return NGX_OK;
+    }
+
+    binds = zmcf->binds->elts;
+
+    for (i = 0; i < zmcf->binds->nelts; i++) {
+
+        if (binds[i].zlcf->identity == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0, "\"ziti_bind %s\" requires \"ziti_identity\" in its server",
+                          binds[i].service);
+            return NGX_ERROR;
+        }
+
+        binds[i].buf_size = binds[i].zlcf->buf_size;
+
+        ls = ngx_pcalloc(cf->pool, sizeof(ngx_listening_t));
+        sun = ngx_pcalloc(cf->pool, sizeof(struct sockaddr_un));
+        hport = ngx_pcalloc(cf->pool, sizeof(ngx_http_port_t));
+        addr = ngx_pcalloc(cf->pool, sizeof(ngx_http_in_addr_t));
+
+        if (ls == NULL || sun == NULL || hport == NULL || addr == NULL) {
+            return NGX_ERROR;
+        }
+
+        // $server_addr reads "unix:ziti:<service>"
+        sun->sun_family = AF_UNIX;
+        ngx_snprintf((u_char *) sun->sun_path, sizeof(sun->sun_path) - 1, "ziti:%s", binds[i].service);
+
+        addr->conf.default_server = binds[i].cscf;
+
+        hport->addrs = addr;
+        hport->naddrs = 1;
+
+        clcf = binds[i].cscf->ctx->loc_conf[ngx_http_core_module.ctx_index];
+
+        ls->fd = (ngx_socket_t) -1;
+        ls->sockaddr = (struct sockaddr *) sun;
+        ls->socklen = sizeof(struct sockaddr_un);
+        ls->type = SOCK_STREAM;
+        ls->handler = ngx_http_init_connection;
+        ls->servers = hport;
+        ls->pool_size = binds[i].cscf->connection_pool_size;
+        ls->logp = clcf->error_log;
+        ls->log = *ls->logp;
+
+        ls->addr_text.data = (u_char *) sun->sun_path;
+        ls->addr_text.len = ngx_strlen(sun->sun_path);
+
+        binds[i].ls = ls;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * nginx thread side
+ */
+
+/**
+ * What ngx_event_accept() does for a socket accepted on ls, for the nginx end of a socketpair
+ */
+static void
+ngx_http_ziti_bind_init_connection(ngx_http_ziti_bind_t *bind, ngx_http_ziti_bind_accepted_t *accepted)
+{
+    ngx_listening_t            *ls = bind->ls;
+    ngx_connection_t           *c;
+    ngx_log_t                  *log;
+    struct sockaddr_un         *sun;
+
+    c = ngx_get_connection(accepted->fd, ngx_cycle->log);
+    if (c == NULL) {
+        ngx_close_socket(accepted->fd);
+        return;
+    }
+
+    c->type = SOCK_STREAM;
+
+    c->pool = ngx_create_pool(ls->pool_size, ngx_cycle->log);
+    if (c->pool == NULL) {
+        goto failed;
+    }
+
+    sun = ngx_pcalloc(c->pool, sizeof(struct sockaddr_un));
+    log = ngx_palloc(c->pool, sizeof(ngx_log_t));
+    c->addr_text.data = ngx_pnalloc(c->pool, accepted->len);
+
+    if (sun == NULL || log == NULL || c->addr_text.data == NULL) {
+        goto failed;
+    }
+
+    sun->sun_family = AF_UNIX;
+
+    c->sockaddr = (struct sockaddr *) sun;
+    c->socklen = sizeof(struct sockaddr_un);
+
+    // $remote_addr is the identity the client dialed with
+    c->addr_text.len = accepted->len;
+    ngx_memcpy(c->addr_text.data, accepted->caller, accepted->len);
+
+    *log = ls->log;
+
+    c->recv = ngx_recv;
+    c->send = ngx_send;
+    c->recv_chain = ngx_recv_chain;
+    c->send_chain = ngx_send_chain;
+
+    c->log = log;
+    c->pool->log = log;
+
+    c->listening = ls;
+    c->local_sockaddr = ls->sockaddr;
+    c->local_socklen = ls->socklen;
+
+    c->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+    c->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+
+    c->read->log = log;
+    c->write->log = log;
+    c->write->ready = 1;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    c->start_time = ngx_current_msec;
+
+    if (ngx_add_conn && (ngx_event_flags & NGX_USE_EPOLL_EVENT) == 0) {
+        if (ngx_add_conn(c) == NGX_ERROR) {
+            goto failed;
+        }
+    }
+
+    log->data = NULL;
+    log->handler = NULL;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "ziti: connection from \"%V\" to service \"%s\"", &c->addr_text, bind->service);
+
+    ls->handler(c);
+
+    return;
+
+failed:
+
+    ngx_free_connection(c);
+
+    c->fd = (ngx_socket_t) -1;
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+    }
+
+    ngx_close_socket(accepted->fd);
+}
+
+
+static void
+ngx_http_ziti_bind_accept_func(void *data, ngx_log_t *log)
+{
+    /* this function is executed in a thread from the ziti thread_pool; see ngx_http_ziti_bind_accept_completion() */
+}
+
+
+/**
+ * Completion of listener->task, on the nginx thread: take in everything accepted since
+ */
+static void
+ngx_http_ziti_bind_accept_completion(ngx_event_t *ev)
+{
+    ngx_http_ziti_bind_listener_t *listener = ev->data;
+    ngx_http_ziti_bind_accepted_t *accepted;
+    ngx_queue_t                    queue, *q;
+
+    ngx_queue_init(&queue);
+
+    uv_mutex_lock(&listener->lock);
+
+    if (!ngx_queue_empty(&listener->accepted)) {
+        // move the whole list over
+        queue.next = listener->accepted.next;
+        queue.prev = listener->accepted.prev;
+        queue.next->prev = &queue;
+        queue.prev->next = &queue;
+
+        ngx_queue_init(&listener->accepted);
+    }
+
+    listener->task_posted = 0;
+
+    uv_mutex_unlock(&listener->lock);
+
+    while (!ngx_queue_empty(&queue)) {
+        q = ngx_queue_head(&queue);
+        ngx_queue_remove(q);
+
+        accepted = ngx_queue_data(q, ngx_http_ziti_bind_accepted_t, queue);
+
+        ngx_http_ziti_bind_init_connection(listener->bind, accepted);
+
+        ngx_free(accepted);
+    }
+}
+
+
+/*
+ * Loop thread side
+ */
+
+/**
+ * Queue nginx's end of an accepted connection for the nginx thread.  A wakeup already
+ * pending picks it up too.
+ */
+static void
+ngx_http_ziti_bind_hand_over(ngx_http_ziti_bind_conn_t *bc)
+{
+    ngx_http_ziti_bind_listener_t *listener = bc->listener;
+    ngx_http_ziti_bind_accepted_t *accepted;
+    ngx_thread_pool_t             *tp;
+    ngx_uint_t                     post;
+    size_t                         len;
+
+    len = ngx_strlen(bc->caller);
+
+    accepted = ngx_alloc(sizeof(ngx_http_ziti_bind_accepted_t) + len, ngx_cycle->log);
+    if (accepted == NULL) {
+        ngx_http_ziti_bind_conn_close(bc);
+        return;
+    }
+
+    accepted->fd = bc->fd;
+    accepted->len = len;
+    ngx_memcpy(accepted->caller, bc->caller, len);
+
+    // from now on the nginx thread closes it
+    bc->fd = (ngx_socket_t) -1;
+
+    uv_mutex_lock(&listener->lock);
+
+    ngx_queue_insert_tail(&listener->accepted, &accepted->queue);
+
+    post = !listener->task_posted;
+    listener->task_posted = 1;
+
+    uv_mutex_unlock(&listener->lock);
+
+    if (!post) {
+        return;
+    }
+
+    tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &ngx_http_ziti_thread_pool_name);
+
+    if (tp == NULL || ngx_thread_task_post(tp, listener->task) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0, "ziti: could not hand a connection to service \"%s\" over to nginx",
+                      listener->bind->service);
+    }
+}
+
+
+static void
+ngx_http_ziti_bind_conn_free(ngx_http_ziti_bind_conn_t *bc)
+{
+    if (bc->conn_closed && bc->pipe_closed) {
+        ngx_free(bc->caller);
+        ngx_free(bc);
+    }
+}
+
+
+static void
+ngx_http_ziti_bind_conn_closed(ziti_connection conn)
+{
+    ngx_http_ziti_bind_conn_t     *bc = ziti_conn_data(conn);
+
+    bc->conn = NULL;
+    bc->conn_closed = 1;
+
+    ngx_http_ziti_bind_conn_free(bc);
+}
+
+
+static void
+ngx_http_ziti_bind_pipe_closed(uv_handle_t *handle)
+{
+    ngx_http_ziti_bind_conn_t     *bc = handle->data;
+
+    bc->pipe_closed = 1;
+
+    ngx_http_ziti_bind_conn_free(bc);
+}
+
+
+static void
+ngx_http_ziti_bind_conn_close(ngx_http_ziti_bind_conn_t *bc)
+{
+    if (bc->closing) {
+        return;
+    }
+
+    bc->closing = 1;
+
+    if (bc->fd != (ngx_socket_t) -1) {
+        ngx_close_socket(bc->fd);
+        bc->fd = (ngx_socket_t) -1;
+    }
+
+    if (bc->conn) {
+        ziti_close(bc->conn, ngx_http_ziti_bind_conn_closed);
+
+    } else {
+        bc->conn_closed = 1;
+    }
+
+    uv_close((uv_handle_t *) &bc->pipe, ngx_http_ziti_bind_pipe_closed);
+}
+
+
+static void
+ngx_http_ziti_bind_shutdown(uv_shutdown_t *req, int status)
+{
+    ngx_http_ziti_bind_conn_t     *bc = req->data;
+
+    if (status < 0) {
+        ngx_http_ziti_bind_conn_close(bc);
+    }
+}
+
+
+/**
+ * The Ziti client is done sending: let nginx see the end of the request stream, and keep
+ * relaying the response until nginx closes its end
+ */
+static void
+ngx_http_ziti_bind_eof(ngx_http_ziti_bind_conn_t *bc)
+{
+    bc->shutdown_req.data = bc;
+
+    if (uv_shutdown(&bc->shutdown_req, (uv_stream_t *) &bc->pipe, ngx_http_ziti_bind_shutdown) != 0) {
+        ngx_http_ziti_bind_conn_close(bc);
+    }
+}
+
+
+static void
+ngx_http_ziti_bind_pipe_written(uv_write_t *req, int status)
+{
+    ngx_http_ziti_bind_conn_t     *bc = req->data;
+
+    bc->pipe_writing = 0;
+
+    if (bc->closing) {
+        return;
+    }
+
+    if (status < 0) {
+        ngx_http_ziti_bind_conn_close(bc);
+        return;
+    }
+
+    if (bc->eof) {
+        ngx_http_ziti_bind_eof(bc);
+    }
+}
+
+
+/**
+ * From the Ziti client to nginx.  Whatever the socket takes is written straight from the
+ * SDK's buffer; the rest is copied to bc->down, and nothing more is taken until that has
+ * been written, which is the backpressure on the client.
+ */
+static ssize_t
+ngx_http_ziti_bind_data(ziti_connection conn, uint8_t *data, ssize_t len)
+{
+    ngx_http_ziti_bind_conn_t     *bc = ziti_conn_data(conn);
+    uv_buf_t                       buf;
+    ssize_t                        n;
+    size_t                         rest;
+
+    if (bc->closing) {
+        return len;
+    }
+
+    if (len < 0) {
+        if (len != ZITI_EOF) {
+            ngx_http_ziti_bind_conn_close(bc);
+            return len;
+        }
+
+        bc->eof = 1;
+
+        if (!bc->pipe_writing) {
+            ngx_http_ziti_bind_eof(bc);
+        }
+
+        return len;
+    }
+
+    if (bc->pipe_writing) {
+        return 0;
+    }
+
+    buf = uv_buf_init((char *) data, (unsigned int) len);
+
+    n = uv_try_write((uv_stream_t *) &bc->pipe, &buf, 1);
+
+    if (n == len) {
+        return len;
+    }
+
+    if (n < 0) {
+        if (n != UV_EAGAIN) {
+            ngx_http_ziti_bind_conn_close(bc);
+            return len;
+        }
+
+        n = 0;
+    }
+
+    rest = ngx_min((size_t) (len - n), bc->size);
+
+    ngx_memcpy(bc->down, data + n, rest);
+
+    buf = uv_buf_init((char *) bc->down, (unsigned int) rest);
+
+    bc->write_req.data = bc;
+    bc->pipe_writing = 1;
+
+    if (uv_write(&bc->write_req, (uv_stream_t *) &bc->pipe, &buf, 1, ngx_http_ziti_bind_pipe_written) != 0) {
+        bc->pipe_writing = 0;
+        ngx_http_ziti_bind_conn_close(bc);
+        return len;
+    }
+
+    return n + rest;
+}
+
+
+static void ngx_http_ziti_bind_pipe_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+
+
+static void
+ngx_http_ziti_bind_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+    ngx_http_ziti_bind_conn_t     *bc = handle->data;
+
+    *buf = uv_buf_init((char *) bc->up, (unsigned int) bc->size);
+}
+
+
+static void
+ngx_http_ziti_bind_written(ziti_connection conn, ssize_t status, void *write_ctx)
+{
+    ngx_http_ziti_bind_conn_t     *bc = write_ctx;
+
+    if (bc->closing) {
+        return;
+    }
+
+    if (status < 0) {
+        ngx_http_ziti_bind_conn_close(bc);
+        return;
+    }
+
+    uv_read_start((uv_stream_t *) &bc->pipe, ngx_http_ziti_bind_alloc, ngx_http_ziti_bind_pipe_read);
+}
+
+
+/**
+ * From nginx to the Ziti client, one buffer at a time
+ */
+static void
+ngx_http_ziti_bind_pipe_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+    ngx_http_ziti_bind_conn_t     *bc = stream->data;
+
+    if (nread == 0) {
+        return;
+    }
+
+    if (nread < 0) {
+        // nginx closed the connection
+        ngx_http_ziti_bind_conn_close(bc);
+        return;
+    }
+
+    uv_read_stop(stream);
+
+    if (ziti_write(bc->conn, bc->up, nread, ngx_http_ziti_bind_written, bc) != ZITI_OK) {
+        ngx_http_ziti_bind_conn_close(bc);
+    }
+}
+
+
+static void
+ngx_http_ziti_bind_accepted(ziti_connection conn, int status)
+{
+    ngx_http_ziti_bind_conn_t     *bc = ziti_conn_data(conn);
+
+    if (status != ZITI_OK) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: accepting a connection to service \"%s\" failed: %s",
+                      bc->listener->bind->service, ziti_errorstr(status));
+        ngx_http_ziti_bind_conn_close(bc);
+        return;
+    }
+
+    uv_read_start((uv_stream_t *) &bc->pipe, ngx_http_ziti_bind_alloc, ngx_http_ziti_bind_pipe_read);
+
+    ngx_http_ziti_bind_hand_over(bc);
+}
+
+
+static void
+ngx_http_ziti_bind_server_closed(ziti_connection conn)
+{
+    ngx_http_ziti_bind_listener_t *listener = ziti_conn_data(conn);
+
+    listener->server = NULL;
+    listener->server_closing = 0;
+
+    uv_timer_start(&listener->timer, ngx_http_ziti_bind_listen, NGX_HTTP_ZITI_BIND_RETRY, NGX_HTTP_ZITI_BIND_WAIT);
+}
+
+
+/**
+ * The binding is gone (or never came to be): drop it and bind again later, on whichever
+ * context the loop has by then
+ */
+static void
+ngx_http_ziti_bind_rebind(ngx_http_ziti_bind_listener_t *listener, int status)
+{
+    if (listener->server_closing) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: binding service \"%s\" on loop %ui failed: %s",
+                  listener->bind->service, listener->loop->index, ziti_errorstr(status));
+
+    if (listener->server && !listener->server_closing) {
+        listener->server_closing = 1;
+        ziti_close(listener->server, ngx_http_ziti_bind_server_closed);
+    }
+}
+
+
+static void
+ngx_http_ziti_bind_client(ziti_connection server, ziti_connection client, int status, ziti_client_ctx *clt_ctx)
+{
+    ngx_http_ziti_bind_listener_t *listener = ziti_conn_data(server);
+    ngx_http_ziti_bind_conn_t     *bc;
+    ngx_socket_t                   fds[2];
+    const char                    *caller;
+    size_t                         size;
+    int                            rc;
+
+    if (status != ZITI_OK) {
+        ngx_http_ziti_bind_rebind(listener, status);
+        return;
+    }
+
+    size = listener->bind->buf_size;
+
+    bc = ngx_calloc(sizeof(ngx_http_ziti_bind_conn_t) + 2 * size, ngx_cycle->log);
+    if (bc == NULL) {
+        ziti_close(client, NULL);
+        return;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno, "ziti: socketpair() failed");
+        ngx_free(bc);
+        ziti_close(client, NULL);
+        return;
+    }
+
+    caller = (clt_ctx && clt_ctx->caller_id) ? clt_ctx->caller_id : "-";
+
+    bc->listener = listener;
+    bc->conn = client;
+    bc->fd = fds[0];
+    bc->size = size;
+    bc->up = (u_char *) (bc + 1);
+    bc->down = bc->up + size;
+    bc->caller = ngx_alloc(ngx_strlen(caller) + 1, ngx_cycle->log);
+
+    uv_pipe_init(listener->loop->uv_thread_loop, &bc->pipe, 0);
+    bc->pipe.data = bc;
+
+    if (bc->caller == NULL || ngx_nonblocking(fds[0]) == -1 || uv_pipe_open(&bc->pipe, fds[1]) != 0) {
+        ngx_close_socket(fds[1]);
+        ziti_conn_set_data(client, bc);
+        ngx_http_ziti_bind_conn_close(bc);
+        return;
+    }
+
+    ngx_cpystrn((u_char *) bc->caller, (u_char *) caller, ngx_strlen(caller) + 1);
+
+    ziti_conn_set_data(client, bc);
+
+    rc = ziti_accept(client, ngx_http_ziti_bind_accepted, ngx_http_ziti_bind_data);
+
+    if (rc != ZITI_OK) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: could not accept a connection to service \"%s\": %s",
+                      listener->bind->service, ziti_errorstr(rc));
+        ngx_http_ziti_bind_conn_close(bc);
+    }
+}
+
+
+static void
+ngx_http_ziti_bind_listening(ziti_connection server, int status)
+{
+    ngx_http_ziti_bind_listener_t *listener = ziti_conn_data(server);
+
+    if (status != ZITI_OK) {
+        ngx_http_ziti_bind_rebind(listener, status);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0, "ziti: service \"%s\" bound on loop %ui of worker %ui",
+                  listener->bind->service, listener->loop->index, ngx_worker);
+}
+
+
+/**
+ * Runs on the loop thread every NGX_HTTP_ZITI_BIND_WAIT ms until the loop's context is up,
+ * then binds the service
+ */
+static void
+ngx_http_ziti_bind_listen(uv_timer_t *timer)
+{
+    ngx_http_ziti_bind_listener_t *listener = timer->data;
+    ngx_http_ziti_loop_t          *loop = listener->loop;
+    int                            rc;
+
+    if (loop->state < ZS_LOC_ZITI_INIT_COMPLETED || loop->ztx == NGX_CONF_UNSET_PTR || listener->server) {
+        return;
+    }
+
+    uv_timer_stop(timer);
+
+    rc = ziti_conn_init(loop->ztx, &listener->server, listener);
+
+    if (rc == ZITI_OK) {
+        rc = ziti_listen(listener->server, listener->bind->service, ngx_http_ziti_bind_listening, ngx_http_ziti_bind_client);
+
+    } else {
+        listener->server = NULL;
+    }
+
+    if (rc != ZITI_OK) {
+        ngx_http_ziti_bind_rebind(listener, rc);
+
+        if (listener->server == NULL) {
+            uv_timer_start(timer, ngx_http_ziti_bind_listen, NGX_HTTP_ZITI_BIND_RETRY, NGX_HTTP_ZITI_BIND_WAIT);
+        }
+    }
+}
+
+
+static void
+ngx_http_ziti_bind_nop(uv_work_t *req)
+{
+    /* runs on the uv thread pool; the listener starts in ngx_http_ziti_bind_start() */
+}
+
+
+static void
+ngx_http_ziti_bind_start(uv_work_t *req, int status)
+{
+    ngx_http_ziti_bind_listener_t *listener = req->data;
+
+    uv_timer_init(listener->loop->uv_thread_loop, &listener->timer);
+    listener->timer.data = listener;
+
+    uv_timer_start(&listener->timer, ngx_http_ziti_bind_listen, 0, NGX_HTTP_ZITI_BIND_WAIT);
+}
+
+
+/**
+ * Bind every ziti_bind service on each loop of its server's identity, once the loops are running
+ */
+ngx_int_t
+ngx_http_ziti_bind_init_process(ngx_http_ziti_main_conf_t *zmcf, ngx_cycle_t *cycle)
+{
+    ngx_http_ziti_bind_t          *binds;
+    ngx_http_ziti_bind_listener_t *listener;
+    ngx_http_ziti_identity_t      *identity;
+    ngx_uint_t                     i, n;
+
+    if (zmcf->binds == NULL) {
+        return NGX_OK;
+    }
+
+    binds = zmcf->binds->elts;
+
+    for (i = 0; i < zmcf->binds->nelts; i++) {
+
+        identity = binds[i].zlcf->identity;
+
+        for (n = 0; n < identity->nloops; n++) {
+
+            listener = ngx_pcalloc(cycle->pool, sizeof(ngx_http_ziti_bind_listener_t));
+            if (listener == NULL) {
+                return NGX_ERROR;
+            }
+
+            listener->bind = &binds[i];
+            listener->loop = &identity->loops[n];
+            listener->start_req.data = listener;
+
+            ngx_queue_init(&listener->accepted);
+
+            if (uv_mutex_init(&listener->lock) != 0) {
+                return NGX_ERROR;
+            }
+
+            listener->task = ngx_thread_task_alloc(cycle->pool, 0);
+            if (listener->task == NULL) {
+                return NGX_ERROR;
+            }
+
+            listener->task->handler = ngx_http_ziti_bind_accept_func;
+            listener->task->event.handler = ngx_http_ziti_bind_accept_completion;
+            listener->task->event.data = listener;
+
+            uv_queue_work(listener->loop->uv_thread_loop, &listener->start_req, ngx_http_ziti_bind_nop, ngx_http_ziti_bind_start);
+        }
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,1492 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef DDEBUG
+#define DDEBUG 1
+#endif
+#include "ddebug.h"
+
+#include "ngx_http_ziti_module.h"
+#include "ngx_http_ziti_handler.h"
+#include "ngx_http_ziti_shm.h"
+#include "ngx_http_ziti_probes.h"
+#include "ngx_http_ziti_h1.h"
+
+
+/*
+ * ziti_http_engine native: HTTP/1.1 spoken directly on raw Ziti connections, in place of a
+ * pooled um_http client with its ziti_src.  The request line, headers and the body held in
+ * memory are serialized once, on the nginx thread, and go out in a single ziti_write(); the
+ * response is parsed as it arrives, straight into the buffers handed to the nginx thread.
+ *
+ * Connections are kept alive between requests, one request at a time each, and idle ones are
+ * kept per service and loop up to ziti_client_pool_size max=.  Everything here runs on the
+ * request's uv loop thread, except ngx_http_ziti_h1_start() and the request serialization,
+ * which run on the nginx thread.  Responses are handed over with the same header, chunk and
+ * completion tasks as um_http responses.
+ *
+ * What is written to the service is copied into a buffer of the connection's own, so that a
+ * write still in flight never points into a request that has been finalized.
+ *
+ * Each connection has one timer: ziti_connect_timeout while it is dialed, ziti_read_timeout
+ * while it carries a request, reset by every read and write, and ziti_keepalive_timeout while
+ * it is idle.
+ */
+
+#define NGX_HTTP_ZITI_H1_WRITE_SIZE     (64 * 1024)
+
+
+typedef enum {
+    NGX_HTTP_ZITI_H1_HEAD = 0,
+    NGX_HTTP_ZITI_H1_LENGTH,
+    NGX_HTTP_ZITI_H1_CHUNK_SIZE,
+    NGX_HTTP_ZITI_H1_CHUNK_EXT,
+    NGX_HTTP_ZITI_H1_CHUNK_SIZE_LF,
+    NGX_HTTP_ZITI_H1_CHUNK_DATA,
+    NGX_HTTP_ZITI_H1_CHUNK_DATA_CR,
+    NGX_HTTP_ZITI_H1_CHUNK_DATA_LF,
+    NGX_HTTP_ZITI_H1_TRAILER_START,
+    NGX_HTTP_ZITI_H1_TRAILER,
+    NGX_HTTP_ZITI_H1_TRAILER_LF,
+    NGX_HTTP_ZITI_H1_CLOSE,
+    NGX_HTTP_ZITI_H1_DONE
+} ngx_http_ziti_h1_state_e;
+
+
+typedef struct ngx_http_ziti_h1_conn_s ngx_http_ziti_h1_conn_t;
+
+
+/*
+ * The keepalive connections to one service from one set of pools, kept in its client pool
+ */
+typedef struct {
+    /* idle connections, most recently used first */
+    ngx_http_ziti_h1_conn_t            *idle;
+    ngx_uint_t                          nidle;
+    ngx_uint_t                          max_idle;
+    /* every connection, idle, busy or closing */
+    ngx_uint_t                          nconns;
+    /* size of a connection's response head buffer, ziti_buffer_size */
+    size_t                              head_size;
+    ngx_msec_t                          keepalive_timeout;
+    uv_loop_t                          *uv_loop;
+    ziti_context                        ztx;
+    char                               *servicename;
+    ngx_http_ziti_shm_stats_t          *stats;
+    unsigned                            closing:1;
+} ngx_http_ziti_h1_pool_t;
+
+
+struct ngx_http_ziti_h1_conn_s {
+    ngx_http_ziti_h1_conn_t            *next;
+    ngx_http_ziti_h1_pool_t            *pool;
+    ziti_connection                     conn;
+    uv_timer_t                          timer;
+    /* the request on the connection, NULL while idle */
+    ngx_http_ziti_h1_stream_t          *stream;
+
+    /* response head, until its empty line; head_line is where the current line starts */
+    u_char                             *head;
+    size_t                              head_len;
+    size_t                              head_scan;
+    size_t                              head_line;
+
+    ngx_http_ziti_h1_state_e            state;
+    /* body or chunk bytes still to come */
+    off_t                               rest;
+    size_t                              write_size;
+    int                                 dial_rc;
+
+    unsigned                            digits:1;
+    unsigned                            connected:1;
+    unsigned                            writing:1;
+    unsigned                            reused:1;
+    unsigned                            keepalive:1;
+    unsigned                            idle:1;
+    unsigned                            close_pending:1;
+    unsigned                            closing:1;
+};
+
+
+struct ngx_http_ziti_h1_stream_s {
+    ngx_http_ziti_request_ctx_t        *request_ctx;
+    ngx_http_ziti_loc_conf_t           *zlcf;
+    ngx_http_ziti_h1_pool_t            *pool;
+    ngx_http_ziti_h1_conn_t            *conn;
+    HttpsReq                           *attempt;
+    uv_work_t                           work;
+
+    /* request head, followed by as much of the body as nginx kept in memory ahead of the rest */
+    u_char                             *head;
+    size_t                              head_len;
+
+    /* rest of the body, from the first buffer spooled to file; out is where writing is at */
+    ngx_chain_t                        *body;
+    ngx_chain_t                        *out;
+    off_t                               out_offset;
+
+    unsigned                            head_written:1;
+    unsigned                            written:1;
+    unsigned                            header_sent:1;
+    /* take a new connection: the request already failed on a reused one */
+    unsigned                            fresh:1;
+    unsigned                            failed:1;
+};
+
+
+static ngx_str_t  ngx_http_ziti_h1_hop_by_hop[] = {
+    ngx_string("Connection"),
+    ngx_string("Keep-Alive"),
+    ngx_string("Proxy-Connection"),
+    ngx_string("TE"),
+    ngx_string("Transfer-Encoding"),
+    ngx_string("Upgrade"),
+    ngx_string("Content-Length"),
+    ngx_string("Expect"),
+    ngx_null_string
+};
+
+
+static void ngx_http_ziti_h1_dispatch(ngx_http_ziti_h1_stream_t *stream);
+static void ngx_http_ziti_h1_conn_close(ngx_http_ziti_h1_conn_t *conn);
+static void ngx_http_ziti_h1_conn_timeout(uv_timer_t *timer);
+
+
+/*
+ * nginx thread side
+ */
+
+/**
+ * Non-zero if a request header is not forwarded as is: it only concerns the client connection,
+ * or it is replaced by one of ours
+ */
+static ngx_uint_t
+ngx_http_ziti_h1_skip(ngx_str_t *key)
+{
+    ngx_str_t                     *h;
+
+    for (h = ngx_http_ziti_h1_hop_by_hop; h->len; h++) {
+        if (key->len == h->len && ngx_strncasecmp(key->data, h->data, h->len) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Serialize the request line, headers and in-memory body into stream->head, in r->pool
+ */
+static ngx_int_t
+ngx_http_ziti_h1_request(ngx_http_request_t *r, ngx_http_ziti_h1_stream_t *stream)
+{
+    ngx_list_part_t               *part;
+    ngx_table_elt_t               *h;
+    ngx_chain_t                   *cl;
+    ngx_uint_t                     i, host, framed;
+    off_t                          body_len;
+    size_t                         len;
+    u_char                        *p;
+
+    len = r->method_name.len + 1 + r->unparsed_uri.len + sizeof(" HTTP/1.1" CRLF) - 1 + sizeof(CRLF) - 1;
+
+    host = 0;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (ngx_http_ziti_h1_skip(&h[i].key)) {
+            continue;
+        }
+
+        if (h[i].key.len == sizeof("Host") - 1 && ngx_strncasecmp(h[i].key.data, (u_char *) "Host", h[i].key.len) == 0) {
+            host = 1;
+        }
+
+        len += h[i].key.len + sizeof(": ") - 1 + h[i].value.len + sizeof(CRLF) - 1;
+    }
+
+    if (!host) {
+        len += sizeof("Host: " CRLF) - 1 + ngx_strlen(stream->request_ctx->servicename);
+    }
+
+    // the body has been read in full, and is sent with its length rather than as it came
+    framed = (r->request_body && (r->headers_in.content_length_n >= 0 || r->headers_in.chunked));
+
+    body_len = 0;
+
+    if (framed) {
+        for (cl = r->request_body->bufs; cl; cl = cl->next) {
+            body_len += ngx_buf_size(cl->buf);
+        }
+
+        len += sizeof("Content-Length: " CRLF) - 1 + NGX_OFF_T_LEN;
+    }
+
+    cl = r->request_body ? r->request_body->bufs : NULL;
+
+    for ( /* void */ ; cl && ngx_buf_in_memory(cl->buf); cl = cl->next) {
+        len += ngx_buf_size(cl->buf);
+    }
+
+    stream->head = ngx_pnalloc(r->pool, len);
+    if (stream->head == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_sprintf(stream->head, "%V %V HTTP/1.1" CRLF, &r->method_name, &r->unparsed_uri);
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (ngx_http_ziti_h1_skip(&h[i].key)) {
+            continue;
+        }
+
+        p = ngx_sprintf(p, "%V: %V" CRLF, &h[i].key, &h[i].value);
+    }
+
+    if (!host) {
+        p = ngx_sprintf(p, "Host: %s" CRLF, stream->request_ctx->servicename);
+    }
+
+    if (framed) {
+        p = ngx_sprintf(p, "Content-Length: %O" CRLF, body_len);
+    }
+
+    *p++ = CR; *p++ = LF;
+
+    cl = r->request_body ? r->request_body->bufs : NULL;
+
+    for ( /* void */ ; cl && ngx_buf_in_memory(cl->buf); cl = cl->next) {
+        p = ngx_cpymem(p, cl->buf->pos, ngx_buf_size(cl->buf));
+    }
+
+    stream->head_len = p - stream->head;
+    stream->body = cl;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_ziti_h1_nop(uv_work_t *req)
+{
+    /* runs on the uv thread pool; the request is dispatched in ngx_http_ziti_h1_submit_cb() */
+}
+
+
+static void
+ngx_http_ziti_h1_submit_cb(uv_work_t *req, int status)
+{
+    ngx_http_ziti_h1_stream_t     *stream = req->data;
+
+    if (stream->failed) {
+        ngx_http_ziti_resp_done(stream->request_ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_http_ziti_h1_dispatch(stream);
+}
+
+
+/**
+ * The request body has been read, if there was one: serialize the request and hand it to the
+ * loop thread
+ */
+static void
+ngx_http_ziti_h1_body_read(ngx_http_request_t *r)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx;
+    ngx_http_ziti_h1_stream_t     *stream;
+
+    request_ctx = ngx_http_get_module_ctx(r, ngx_http_ziti_module);
+    stream = request_ctx->h1;
+
+    ngx_http_ziti_body_read_done(request_ctx);
+
+    // the loop thread fails the request, so that it ends the way every other one does
+    if (ngx_http_ziti_h1_request(r, stream) != NGX_OK) {
+        stream->failed = 1;
+    }
+
+    stream->work.data = stream;
+
+    uv_queue_work(request_ctx->loop->uv_thread_loop, &stream->work, ngx_http_ziti_h1_nop, ngx_http_ziti_h1_submit_cb);
+}
+
+
+/**
+ * Start the request on the native HTTP/1.1 engine.  The request body is read in full first, and
+ * ngx_http_ziti_h1_body_read() takes it from there.  Returns NGX_DONE, or the status to finish
+ * the request with.
+ */
+ngx_int_t
+ngx_http_ziti_h1_start(ngx_http_request_t *r, ngx_http_ziti_request_ctx_t *request_ctx)
+{
+    ngx_http_ziti_h1_stream_t     *stream;
+    ngx_int_t                      rc;
+
+    stream = ngx_pcalloc(request_ctx->pool, sizeof(ngx_http_ziti_h1_stream_t));
+    if (stream == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    stream->request_ctx = request_ctx;
+    stream->zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
+
+    stream->attempt = ngx_http_ziti_attempt_create(request_ctx);
+    if (stream->attempt == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    request_ctx->h1 = stream;
+    request_ctx->body_pending = 1;
+
+    rc = ngx_http_read_client_request_body(r, ngx_http_ziti_h1_body_read);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        request_ctx->body_pending = 0;
+        return rc;
+    }
+
+    return NGX_DONE;
+}
+
+
+/*
+ * Loop thread side
+ */
+
+static void
+ngx_http_ziti_h1_stream_done(ngx_http_ziti_h1_stream_t *stream, ngx_int_t status)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+
+    if (status) {
+        ngx_http_ziti_stat_add(stream->pool->stats, errors, 1);
+    }
+
+    if (status == 0) {
+        ngx_http_ziti_probe3(body__eof, request_ctx->r, request_ctx->bytes_received, uv_hrtime() - request_ctx->t_start);
+    }
+
+    ngx_http_ziti_resp_done(request_ctx, status);
+}
+
+
+/**
+ * Whether the request may be sent again: nothing of it was written yet, or, like
+ * proxy_next_upstream, its method is idempotent or non_idempotent is set
+ */
+static ngx_uint_t
+ngx_http_ziti_h1_replayable(ngx_http_ziti_h1_stream_t *stream)
+{
+    if (!stream->head_written) {
+        return 1;
+    }
+
+    return !(stream->request_ctx->r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH))
+           || (stream->zlcf->next_upstream & NGX_HTTP_UPSTREAM_FT_NON_IDEMPOTENT);
+}
+
+
+/**
+ * The request got no response.  If it may be sent again, try it on the next service named on
+ * ziti_pass as ziti_next_upstream allows; otherwise fail the request.
+ */
+static void
+ngx_http_ziti_h1_stream_fail(ngx_http_ziti_h1_stream_t *stream, ngx_uint_t replayable, int code)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+    ngx_http_ziti_loc_conf_t      *zlcf = stream->zlcf;
+    ngx_uint_t                     ft_type;
+
+    ngx_http_ziti_breaker_record(stream->attempt, code);
+
+    ft_type = (code == UV_ETIMEDOUT) ? NGX_HTTP_UPSTREAM_FT_TIMEOUT : NGX_HTTP_UPSTREAM_FT_ERROR;
+
+    if (replayable
+        && (zlcf->next_upstream & ft_type)
+        && request_ctx->tries < zlcf->next_upstream_tries)
+    {
+        ngx_log_error(NGX_LOG_WARN, request_ctx->r->connection->log, 0,
+                      "ziti: service \"%s\" failed (%s), retrying request, attempt %ui of %ui",
+                      request_ctx->servicename, ziti_errorstr(code), request_ctx->tries + 1, zlcf->next_upstream_tries);
+
+        ngx_http_ziti_stat_add(stream->pool->stats, errors, 1);
+        ngx_http_ziti_stat_add(stream->pool->stats, retries, 1);
+
+        request_ctx->service_index = (request_ctx->service_index + 1) % zlcf->servicenames->nelts;
+        request_ctx->servicename = ((char **) zlcf->servicenames->elts)[request_ctx->service_index];
+
+        stream->attempt = ngx_http_ziti_attempt_create(request_ctx);
+
+        if (stream->attempt != NULL) {
+            ngx_http_ziti_h1_dispatch(stream);
+            return;
+        }
+    }
+
+    ngx_http_ziti_h1_stream_done(stream, (code == UV_ETIMEDOUT) ? NGX_HTTP_GATEWAY_TIME_OUT : NGX_HTTP_BAD_GATEWAY);
+}
+
+
+/**
+ * Free the set of connections once the last of them is closed
+ */
+static void
+ngx_http_ziti_h1_pool_release(ngx_http_ziti_h1_pool_t *pool)
+{
+    if (!pool->closing || pool->nconns) {
+        return;
+    }
+
+    ngx_free(pool->servicename);
+    ngx_free(pool);
+}
+
+
+static void
+ngx_http_ziti_h1_conn_timer_closed(uv_handle_t *handle)
+{
+    ngx_http_ziti_h1_conn_t       *conn = handle->data;
+    ngx_http_ziti_h1_pool_t       *pool = conn->pool;
+
+    pool->nconns--;
+
+    ngx_free(conn->head);
+    ngx_free(conn);
+
+    ngx_http_ziti_h1_pool_release(pool);
+}
+
+
+static void
+ngx_http_ziti_h1_conn_free(ngx_http_ziti_h1_conn_t *conn)
+{
+    uv_close((uv_handle_t *) &conn->timer, ngx_http_ziti_h1_conn_timer_closed);
+}
+
+
+static void
+ngx_http_ziti_h1_conn_closed(ziti_connection zconn)
+{
+    ngx_http_ziti_h1_conn_free(ziti_conn_data(zconn));
+}
+
+
+/**
+ * Take a connection off the idle list
+ */
+static void
+ngx_http_ziti_h1_conn_unidle(ngx_http_ziti_h1_conn_t *conn)
+{
+    ngx_http_ziti_h1_conn_t      **cp;
+
+    if (!conn->idle) {
+        return;
+    }
+
+    for (cp = &conn->pool->idle; *cp; cp = &(*cp)->next) {
+        if (*cp == conn) {
+            *cp = conn->next;
+            break;
+        }
+    }
+
+    conn->idle = 0;
+    conn->next = NULL;
+    conn->pool->nidle--;
+
+    uv_timer_stop(&conn->timer);
+}
+
+
+/**
+ * Close a connection, once any write in flight has completed
+ */
+static void
+ngx_http_ziti_h1_conn_close(ngx_http_ziti_h1_conn_t *conn)
+{
+    if (conn->closing) {
+        return;
+    }
+
+    ngx_http_ziti_h1_conn_unidle(conn);
+
+    uv_timer_stop(&conn->timer);
+
+    if (conn->writing) {
+        conn->close_pending = 1;
+        return;
+    }
+
+    conn->closing = 1;
+
+    if (conn->conn) {
+        ziti_close(conn->conn, ngx_http_ziti_h1_conn_closed);
+        return;
+    }
+
+    ngx_http_ziti_h1_conn_free(conn);
+}
+
+
+/**
+ * The request is done with its connection: keep the connection for the next request if it
+ * is clean, otherwise close it
+ */
+static void
+ngx_http_ziti_h1_conn_release(ngx_http_ziti_h1_conn_t *conn)
+{
+    ngx_http_ziti_h1_pool_t       *pool = conn->pool;
+    ngx_http_ziti_h1_stream_t     *stream = conn->stream;
+
+    conn->stream = NULL;
+    stream->conn = NULL;
+
+    if (!conn->keepalive || conn->state != NGX_HTTP_ZITI_H1_DONE || !stream->written || conn->writing
+        || pool->closing || pool->nidle >= pool->max_idle)
+    {
+        ngx_http_ziti_h1_conn_close(conn);
+        return;
+    }
+
+    conn->idle = 1;
+    conn->next = pool->idle;
+    pool->idle = conn;
+    pool->nidle++;
+
+    uv_timer_start(&conn->timer, ngx_http_ziti_h1_conn_timeout, pool->keepalive_timeout, 0);
+}
+
+
+/**
+ * The connection broke, or the service sent something that is not HTTP/1.x: close it, and
+ * fail the request on it
+ */
+static void
+ngx_http_ziti_h1_conn_fail(ngx_http_ziti_h1_conn_t *conn, int code)
+{
+    ngx_http_ziti_h1_stream_t     *stream = conn->stream;
+    ngx_http_ziti_request_ctx_t   *request_ctx;
+    ngx_uint_t                     connected, stale;
+
+    connected = conn->connected;
+
+    // a reused connection the service closed, maybe before it read the request
+    stale = (conn->reused && conn->state == NGX_HTTP_ZITI_H1_HEAD && conn->head_len == 0
+             && code != UV_ETIMEDOUT);
+
+    conn->stream = NULL;
+    conn->keepalive = 0;
+
+    ngx_http_ziti_h1_conn_close(conn);
+
+    if (stream == NULL) {
+        return;
+    }
+
+    stream->conn = NULL;
+    request_ctx = stream->request_ctx;
+
+    if (stream->header_sent) {
+        ngx_log_error(NGX_LOG_ERR, request_ctx->r->connection->log, 0,
+                      "ziti: response from service \"%s\" failed mid-stream (%s) after %O bytes",
+                      stream->pool->servicename, ziti_errorstr(code), request_ctx->bytes_received);
+
+        ngx_http_ziti_h1_stream_done(stream, NGX_ERROR);
+        return;
+    }
+
+    // sent again at once, as the same try, unless the service may have acted on it already
+    if (stale && !stream->fresh && ngx_http_ziti_h1_replayable(stream)) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request_ctx->r->connection->log, 0,
+                       "ziti: keepalive connection to service \"%s\" was closed, resending on a new one", stream->pool->servicename);
+
+        stream->fresh = 1;
+        request_ctx->tries--;
+
+        ngx_http_ziti_h1_dispatch(stream);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, request_ctx->r->connection->log, 0, "ziti: no response from service \"%s\": %s",
+                  stream->pool->servicename, ziti_errorstr(code));
+
+    ngx_http_ziti_h1_stream_fail(stream, !connected || ngx_http_ziti_h1_replayable(stream), code);
+}
+
+
+/**
+ * The connection timer: close an idle connection, fail the request on a busy one
+ */
+static void
+ngx_http_ziti_h1_conn_timeout(uv_timer_t *timer)
+{
+    ngx_http_ziti_h1_conn_t       *conn = timer->data;
+
+    if (conn->stream == NULL) {
+        ngx_http_ziti_h1_conn_close(conn);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, conn->stream->request_ctx->r->connection->log, 0,
+                  "ziti: service \"%s\" timed out %s",
+                  conn->pool->servicename, conn->connected ? "reading the response" : "while connecting");
+
+    ngx_http_ziti_h1_conn_fail(conn, UV_ETIMEDOUT);
+}
+
+
+static void ngx_http_ziti_h1_send(ngx_http_ziti_h1_conn_t *conn);
+
+
+static void
+ngx_http_ziti_h1_written(ziti_connection zconn, ssize_t status, void *write_ctx)
+{
+    ngx_http_ziti_h1_conn_t       *conn = ziti_conn_data(zconn);
+    ngx_http_ziti_h1_stream_t     *stream = conn->stream;
+
+    ngx_free(write_ctx);
+
+    conn->writing = 0;
+
+    if (conn->close_pending) {
+        ngx_http_ziti_h1_conn_close(conn);
+        return;
+    }
+
+    if (stream == NULL) {      // the response came in full before the request went out
+        return;
+    }
+
+    if (status < 0) {
+        ngx_http_ziti_h1_conn_fail(conn, (int) status);
+        return;
+    }
+
+    ngx_http_ziti_stat_add(stream->pool->stats, bytes_in, conn->write_size);
+
+    uv_timer_start(&conn->timer, ngx_http_ziti_h1_conn_timeout, stream->zlcf->read_timeout, 0);
+
+    // once any of it is on the wire, a non-idempotent request is no longer safe to replay
+    stream->request_ctx->request_sent = 1;
+
+    ngx_http_ziti_h1_send(conn);
+}
+
+
+/**
+ * Write the next piece of the request: the head with the in-memory body first, then the rest of
+ * the body, up to NGX_HTTP_ZITI_H1_WRITE_SIZE bytes at a time
+ */
+static void
+ngx_http_ziti_h1_send(ngx_http_ziti_h1_conn_t *conn)
+{
+    ngx_http_ziti_h1_stream_t     *stream = conn->stream;
+    ngx_buf_t                     *b;
+    u_char                        *buf;
+    size_t                         size;
+    ssize_t                        n;
+    int                            rc;
+
+    buf = NULL;
+    size = 0;
+
+    if (!stream->head_written) {
+        size = stream->head_len;
+
+        buf = ngx_alloc(size, ngx_cycle->log);
+        if (buf == NULL) {
+            ngx_http_ziti_h1_conn_fail(conn, UV_ENOMEM);
+            return;
+        }
+
+        ngx_memcpy(buf, stream->head, size);
+
+        stream->head_written = 1;
+
+    } else {
+
+        while (stream->out) {
+            b = stream->out->buf;
+
+            size = ngx_min((size_t) (ngx_buf_size(b) - stream->out_offset), (size_t) NGX_HTTP_ZITI_H1_WRITE_SIZE);
+
+            if (size == 0) {
+                stream->out = stream->out->next;
+                stream->out_offset = 0;
+                continue;
+            }
+
+            buf = ngx_alloc(size, ngx_cycle->log);
+            if (buf == NULL) {
+                ngx_http_ziti_h1_conn_fail(conn, UV_ENOMEM);
+                return;
+            }
+
+            if (ngx_buf_in_memory(b)) {
+                ngx_memcpy(buf, b->pos + stream->out_offset, size);
+
+            } else {
+                n = ngx_read_file(b->file, buf, size, b->file_pos + stream->out_offset);
+
+                if (n != (ssize_t) size) {
+                    ngx_free(buf);
+                    ngx_http_ziti_h1_conn_fail(conn, UV_EIO);
+                    return;
+                }
+            }
+
+            stream->out_offset += size;
+            break;
+        }
+
+        if (buf == NULL) {
+            stream->written = 1;
+            return;
+        }
+    }
+
+    conn->writing = 1;
+    conn->write_size = size;
+
+    rc = ziti_write(conn->conn, buf, size, ngx_http_ziti_h1_written, buf);
+
+    if (rc != ZITI_OK) {
+        conn->writing = 0;
+        ngx_free(buf);
+
+        ngx_http_ziti_h1_conn_fail(conn, rc);
+    }
+}
+
+
+/**
+ * The final response head is in: set the status and headers on r and have the nginx thread
+ * send them, then work out how the body is delimited
+ */
+static ngx_int_t
+ngx_http_ziti_h1_response(ngx_http_ziti_h1_conn_t *conn, u_char *start, u_char *end)
+{
+    ngx_http_ziti_h1_stream_t     *stream = conn->stream;
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+    ngx_http_request_t            *r = request_ctx->r;
+    ngx_http_ziti_loop_t          *loop = request_ctx->loop;
+    u_char                        *p, *line, *last, *colon, *v;
+    ngx_str_t                      key, val;
+    ngx_int_t                      status;
+    ngx_uint_t                     chunked;
+    off_t                          length;
+
+    // "HTTP/1.1 200"
+    if (end - start < 12 || ngx_strncmp(start, "HTTP/1.", 7) != 0 || start[8] != ' ') {
+        return NGX_ERROR;
+    }
+
+    status = ngx_atoi(start + 9, 3);
+    if (status < 100 || status > 599) {
+        return NGX_ERROR;
+    }
+
+    // interim responses are not passed on; the final one follows on the same connection
+    if (status < NGX_HTTP_OK && status != NGX_HTTP_SWITCHING_PROTOCOLS) {
+        return NGX_OK;
+    }
+
+    conn->keepalive = (start[7] != '0');
+
+    chunked = 0;
+    length = -1;
+
+    for (line = start; line < end; line = p + 1) {
+
+        p = ngx_strlchr(line, end, LF);
+        if (p == NULL) {
+            break;
+        }
+
+        // the status line
+        if (line == start) {
+            continue;
+        }
+
+        last = p;
+
+        if (last > line && last[-1] == CR) {
+            last--;
+        }
+
+        if (last == line) {     // the empty line ending the head
+            break;
+        }
+
+        colon = ngx_strlchr(line, last, ':');
+        if (colon == NULL || colon == line) {
+            return NGX_ERROR;
+        }
+
+        for (v = colon + 1; v < last && (*v == ' ' || *v == '\t'); v++) { /* void */ }
+        while (last > v && (last[-1] == ' ' || last[-1] == '\t')) { last--; }
+
+        key.len = colon - line;
+        val.len = last - v;
+
+        if (key.len == sizeof("Content-Length") - 1 && ngx_strncasecmp(line, (u_char *) "Content-Length", key.len) == 0) {
+            length = ngx_atoof(v, val.len);
+
+            if (length == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        if (key.len == sizeof("Transfer-Encoding") - 1 && ngx_strncasecmp(line, (u_char *) "Transfer-Encoding", key.len) == 0) {
+            chunked = (ngx_strlcasestrn(v, last, (u_char *) "chunked", sizeof("chunked") - 2) != NULL);
+            continue;
+        }
+
+        if (key.len == sizeof("Connection") - 1 && ngx_strncasecmp(line, (u_char *) "Connection", key.len) == 0) {
+            if (ngx_strlcasestrn(v, last, (u_char *) "close", sizeof("close") - 2) != NULL) {
+                conn->keepalive = 0;
+
+            } else if (ngx_strlcasestrn(v, last, (u_char *) "keep-alive", sizeof("keep-alive") - 2) != NULL) {
+                conn->keepalive = 1;
+            }
+
+            continue;
+        }
+
+        if ((key.len == sizeof("Keep-Alive") - 1 && ngx_strncasecmp(line, (u_char *) "Keep-Alive", key.len) == 0)
+            || (key.len == sizeof("Proxy-Connection") - 1 && ngx_strncasecmp(line, (u_char *) "Proxy-Connection", key.len) == 0))
+        {
+            continue;
+        }
+
+        // like on_resp(), the nginx thread does not touch r until the header task runs
+        key.data = ngx_pnalloc(r->pool, key.len + 1 + val.len + 1);
+        if (key.data == NULL) {
+            continue;
+        }
+
+        val.data = key.data + key.len + 1;
+
+        ngx_cpystrn(key.data, line, key.len + 1);
+        ngx_cpystrn(val.data, v, val.len + 1);
+
+        ngx_http_ziti_set_header(r, &key, &val);
+    }
+
+    if (!chunked && length >= 0) {
+        r->headers_out.content_length_n = length;
+    }
+
+    if (r->method == NGX_HTTP_HEAD || status == NGX_HTTP_NO_CONTENT || status == NGX_HTTP_NOT_MODIFIED
+        || status == NGX_HTTP_SWITCHING_PROTOCOLS)
+    {
+        conn->state = NGX_HTTP_ZITI_H1_DONE;
+
+    } else if (chunked) {
+        conn->state = NGX_HTTP_ZITI_H1_CHUNK_SIZE;
+        conn->rest = 0;
+        conn->digits = 0;
+
+    } else if (length >= 0) {
+        conn->state = length ? NGX_HTTP_ZITI_H1_LENGTH : NGX_HTTP_ZITI_H1_DONE;
+        conn->rest = length;
+
+    } else {                    // delimited by the end of the connection
+        conn->state = NGX_HTTP_ZITI_H1_CLOSE;
+        conn->keepalive = 0;
+    }
+
+    if (status == NGX_HTTP_SWITCHING_PROTOCOLS) {   // only ziti_upgrade relays those
+        conn->keepalive = 0;
+    }
+
+    stream->header_sent = 1;
+
+    r->headers_out.status = status;
+
+    ngx_http_ziti_probe3(response, r, (int) status, uv_hrtime() - stream->attempt->sent);
+
+    ngx_http_ziti_breaker_record(stream->attempt, (int) status);
+
+    if (stream->pool->stats && stream->attempt->start) {
+        ngx_http_ziti_hist_add(&stream->pool->stats->ttfb, (ngx_msec_t) (uv_now(loop->uv_thread_loop) - stream->attempt->start));
+    }
+
+    request_ctx->t_header = uv_hrtime();
+
+    ngx_http_ziti_resp_header(request_ctx);
+
+    return NGX_OK;
+}
+
+
+/**
+ * Collect the response head until its empty line.  Returns NGX_AGAIN once everything given is
+ * taken and more is needed, NGX_OK once a head was processed, with *pos past it.
+ */
+static ngx_int_t
+ngx_http_ziti_h1_head(ngx_http_ziti_h1_conn_t *conn, u_char **pos, u_char *last)
+{
+    u_char                        *h = conn->head;
+    size_t                         n, old, i, end, line_end;
+    ngx_int_t                      rc;
+
+    n = ngx_min((size_t) (last - *pos), conn->pool->head_size - conn->head_len);
+
+    old = conn->head_len;
+
+    ngx_memcpy(h + old, *pos, n);
+    conn->head_len += n;
+
+    for (i = conn->head_scan; i < conn->head_len; i++) {
+
+        if (h[i] != LF) {
+            continue;
+        }
+
+        line_end = i;
+
+        if (line_end > conn->head_line && h[line_end - 1] == CR) {
+            line_end--;
+        }
+
+        if (line_end == conn->head_line && conn->head_line != 0) {
+            end = i + 1;
+
+            *pos += end - old;
+
+            conn->head_len = 0;
+            conn->head_scan = 0;
+            conn->head_line = 0;
+
+            rc = ngx_http_ziti_h1_response(conn, h, h + end);
+
+            return rc;
+        }
+
+        conn->head_line = i + 1;
+    }
+
+    conn->head_scan = conn->head_len;
+    *pos += n;
+
+    if (conn->head_len == conn->pool->head_size) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: service \"%s\" sent a response header larger than %uz bytes",
+                      conn->pool->servicename, conn->pool->head_size);
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+/**
+ * A piece of the response body: queue it for the nginx thread
+ */
+static ngx_int_t
+ngx_http_ziti_h1_body(ngx_http_ziti_h1_conn_t *conn, u_char *data, size_t len)
+{
+    ngx_http_ziti_h1_stream_t     *stream = conn->stream;
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    ngx_http_ziti_probe2(body__chunk, request_ctx->r, len);
+
+    ngx_http_ziti_stat_add(stream->pool->stats, bytes_out, len);
+
+    request_ctx->bytes_received += len;
+
+    return ngx_http_ziti_resp_chunk(request_ctx, data, len);
+}
+
+
+static void
+ngx_http_ziti_h1_chunk_size(ngx_http_ziti_h1_conn_t *conn)
+{
+    conn->state = conn->rest ? NGX_HTTP_ZITI_H1_CHUNK_DATA : NGX_HTTP_ZITI_H1_TRAILER_START;
+    conn->digits = 0;
+}
+
+
+/**
+ * Parse what the service sent.  Returns NGX_AGAIN when more is needed, NGX_DONE once the
+ * response is complete, NGX_ERROR if it is not valid HTTP/1.x or could not be queued.
+ */
+static ngx_int_t
+ngx_http_ziti_h1_parse(ngx_http_ziti_h1_conn_t *conn, u_char *p, u_char *last)
+{
+    ngx_int_t                      rc;
+    size_t                         n;
+    u_char                         ch, c;
+
+    for ( ;; ) {
+
+        switch (conn->state) {
+
+        case NGX_HTTP_ZITI_H1_HEAD:
+            if (p == last) {
+                return NGX_AGAIN;
+            }
+
+            rc = ngx_http_ziti_h1_head(conn, &p, last);
+
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            continue;
+
+        case NGX_HTTP_ZITI_H1_DONE:
+            if (p != last) {    // more than the response: not a connection to reuse
+                conn->keepalive = 0;
+            }
+
+            return NGX_DONE;
+
+        case NGX_HTTP_ZITI_H1_CLOSE:
+            return ngx_http_ziti_h1_body(conn, p, last - p) == NGX_OK ? NGX_AGAIN : NGX_ERROR;
+
+        default:
+            break;
+        }
+
+        if (p == last) {
+            return NGX_AGAIN;
+        }
+
+        switch (conn->state) {
+
+        case NGX_HTTP_ZITI_H1_LENGTH:
+        case NGX_HTTP_ZITI_H1_CHUNK_DATA:
+            n = (size_t) ngx_min((off_t) (last - p), conn->rest);
+
+            if (ngx_http_ziti_h1_body(conn, p, n) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            p += n;
+            conn->rest -= n;
+
+            if (conn->rest == 0) {
+                conn->state = (conn->state == NGX_HTTP_ZITI_H1_LENGTH) ? NGX_HTTP_ZITI_H1_DONE : NGX_HTTP_ZITI_H1_CHUNK_DATA_CR;
+            }
+
+            break;
+
+        case NGX_HTTP_ZITI_H1_CHUNK_SIZE:
+            ch = *p++;
+
+            if ((ch >= '0' && ch <= '9') || ((c = (u_char) (ch | 0x20)) >= 'a' && c <= 'f')) {
+
+                if (conn->rest > (NGX_MAX_OFF_T_VALUE - 15) / 16) {
+                    return NGX_ERROR;
+                }
+
+                conn->rest = conn->rest * 16 + ((ch <= '9') ? ch - '0' : (ch | 0x20) - 'a' + 10);
+                conn->digits = 1;
+                break;
+            }
+
+            if (!conn->digits) {
+                return NGX_ERROR;
+            }
+
+            if (ch == CR) {
+                conn->state = NGX_HTTP_ZITI_H1_CHUNK_SIZE_LF;
+
+            } else if (ch == LF) {
+                ngx_http_ziti_h1_chunk_size(conn);
+
+            } else if (ch == ';' || ch == ' ' || ch == '\t') {
+                conn->state = NGX_HTTP_ZITI_H1_CHUNK_EXT;
+
+            } else {
+                return NGX_ERROR;
+            }
+
+            break;
+
+        case NGX_HTTP_ZITI_H1_CHUNK_EXT:
+            if (*p++ == LF) {
+                ngx_http_ziti_h1_chunk_size(conn);
+            }
+
+            break;
+
+        case NGX_HTTP_ZITI_H1_CHUNK_SIZE_LF:
+            if (*p++ != LF) {
+                return NGX_ERROR;
+            }
+
+            ngx_http_ziti_h1_chunk_size(conn);
+            break;
+
+        case NGX_HTTP_ZITI_H1_CHUNK_DATA_CR:
+            ch = *p++;
+
+            if (ch == CR) {
+                conn->state = NGX_HTTP_ZITI_H1_CHUNK_DATA_LF;
+
+            } else if (ch == LF) {
+                conn->state = NGX_HTTP_ZITI_H1_CHUNK_SIZE;
+
+            } else {
+                return NGX_ERROR;
+            }
+
+            break;
+
+        case NGX_HTTP_ZITI_H1_CHUNK_DATA_LF:
+            if (*p++ != LF) {
+                return NGX_ERROR;
+            }
+
+            conn->state = NGX_HTTP_ZITI_H1_CHUNK_SIZE;
+            break;
+
+        // trailers are dropped; the response has already gone out with its header
+        case NGX_HTTP_ZITI_H1_TRAILER_START:
+            ch = *p++;
+
+            if (ch == CR) {
+                conn->state = NGX_HTTP_ZITI_H1_TRAILER_LF;
+
+            } else if (ch == LF) {
+                conn->state = NGX_HTTP_ZITI_H1_DONE;
+
+            } else {
+                conn->state = NGX_HTTP_ZITI_H1_TRAILER;
+            }
+
+            break;
+
+        case NGX_HTTP_ZITI_H1_TRAILER:
+            if (*p++ == LF) {
+                conn->state = NGX_HTTP_ZITI_H1_TRAILER_START;
+            }
+
+            break;
+
+        case NGX_HTTP_ZITI_H1_TRAILER_LF:
+            if (*p++ != LF) {
+                return NGX_ERROR;
+            }
+
+            conn->state = NGX_HTTP_ZITI_H1_DONE;
+            break;
+
+        default:
+            return NGX_ERROR;
+        }
+    }
+}
+
+
+/**
+ * The response is complete: release the connection and finish the request
+ */
+static void
+ngx_http_ziti_h1_complete(ngx_http_ziti_h1_conn_t *conn)
+{
+    ngx_http_ziti_h1_stream_t     *stream = conn->stream;
+
+    conn->state = NGX_HTTP_ZITI_H1_DONE;
+
+    ngx_http_ziti_h1_conn_release(conn);
+
+    ngx_http_ziti_h1_stream_done(stream, 0);
+}
+
+
+static ssize_t
+ngx_http_ziti_h1_data(ziti_connection zconn, uint8_t *data, ssize_t len)
+{
+    ngx_http_ziti_h1_conn_t       *conn = ziti_conn_data(zconn);
+    ngx_http_ziti_h1_stream_t     *stream = conn->stream;
+    ngx_int_t                      rc;
+
+    if (conn->closing || conn->close_pending) {
+        return len;
+    }
+
+    if (stream == NULL) {       // an idle connection closed by the service, or sending out of turn
+        ngx_http_ziti_h1_conn_close(conn);
+        return len;
+    }
+
+    if (len < 0) {
+        if (len == ZITI_EOF && conn->state == NGX_HTTP_ZITI_H1_CLOSE) {
+            ngx_http_ziti_h1_complete(conn);
+            return len;
+        }
+
+        ngx_http_ziti_h1_conn_fail(conn, (int) len);
+        return len;
+    }
+
+    uv_timer_start(&conn->timer, ngx_http_ziti_h1_conn_timeout, stream->zlcf->read_timeout, 0);
+
+    rc = ngx_http_ziti_h1_parse(conn, data, data + len);
+
+    if (rc == NGX_DONE) {
+        ngx_http_ziti_h1_complete(conn);
+
+    } else if (rc == NGX_ERROR) {
+        if (!stream->header_sent) {
+            ngx_log_error(NGX_LOG_ERR, stream->request_ctx->r->connection->log, 0,
+                          "ziti: service \"%s\" sent an invalid HTTP response", conn->pool->servicename);
+        }
+
+        ngx_http_ziti_h1_conn_fail(conn, UV_EPROTO);
+    }
+
+    return len;
+}
+
+
+static void
+ngx_http_ziti_h1_connected(ziti_connection zconn, int status)
+{
+    ngx_http_ziti_h1_conn_t       *conn = ziti_conn_data(zconn);
+
+    if (status != ZITI_OK) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: dial of service \"%s\" failed: %s",
+                      conn->pool->servicename, ziti_errorstr(status));
+
+        ngx_http_ziti_h1_conn_fail(conn, status);
+        return;
+    }
+
+    conn->connected = 1;
+
+    if (conn->stream) {
+        uv_timer_start(&conn->timer, ngx_http_ziti_h1_conn_timeout, conn->stream->zlcf->read_timeout, 0);
+
+        conn->stream->request_ctx->t_connect = uv_hrtime();
+
+        ngx_http_ziti_h1_send(conn);
+    }
+}
+
+
+/**
+ * A new connection to the pool's service; the request is written once the dial completes.  If
+ * the dial cannot even be started, conn->dial_rc says why.
+ */
+static ngx_http_ziti_h1_conn_t *
+ngx_http_ziti_h1_conn_create(ngx_http_ziti_h1_pool_t *pool)
+{
+    ngx_http_ziti_h1_conn_t       *conn;
+    int                            rc;
+
+    conn = ngx_calloc(sizeof(ngx_http_ziti_h1_conn_t), ngx_cycle->log);
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    conn->head = ngx_alloc(pool->head_size, ngx_cycle->log);
+    if (conn->head == NULL) {
+        ngx_free(conn);
+        return NULL;
+    }
+
+    conn->pool = pool;
+    pool->nconns++;
+
+    uv_timer_init(pool->uv_loop, &conn->timer);
+    conn->timer.data = conn;
+
+    rc = ziti_conn_init(pool->ztx, &conn->conn, conn);
+
+    if (rc == ZITI_OK) {
+        rc = ziti_dial(conn->conn, pool->servicename, ngx_http_ziti_h1_connected, ngx_http_ziti_h1_data);
+    } else {
+        conn->conn = NULL;
+    }
+
+    if (rc != ZITI_OK) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: could not dial service \"%s\": %s",
+                      pool->servicename, ziti_errorstr(rc));
+
+        conn->dial_rc = rc;
+    }
+
+    return conn;
+}
+
+
+/**
+ * The native connections of the request's current service, created on first use
+ */
+static ngx_http_ziti_h1_pool_t *
+ngx_http_ziti_h1_pool_get(ngx_http_ziti_h1_stream_t *stream)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+    ngx_http_ziti_h1_pool_t       *pool;
+    void                         **slot;
+    size_t                         len;
+
+    slot = ngx_http_ziti_pool_h1(request_ctx);
+
+    if (*slot) {
+        return *slot;
+    }
+
+    pool = ngx_calloc(sizeof(ngx_http_ziti_h1_pool_t), ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    len = ngx_strlen(request_ctx->servicename) + 1;
+
+    pool->servicename = ngx_alloc(len, ngx_cycle->log);
+    if (pool->servicename == NULL) {
+        ngx_free(pool);
+        return NULL;
+    }
+
+    ngx_memcpy(pool->servicename, request_ctx->servicename, len);
+
+    pool->ztx = ngx_http_ziti_pools_ztx(request_ctx->pools);
+    pool->stats = ngx_http_ziti_shm_stats_get(request_ctx->loop->identity->index, pool->servicename);
+    pool->max_idle = stream->zlcf->client_pool_size;
+    pool->head_size = stream->zlcf->buf_size;
+    pool->keepalive_timeout = stream->zlcf->keepalive_timeout;
+    pool->uv_loop = request_ctx->loop->uv_thread_loop;
+
+    *slot = pool;
+
+    return pool;
+}
+
+
+/**
+ * Put the request on the most recently used idle connection of its service, or on a new one
+ */
+static void
+ngx_http_ziti_h1_dispatch(ngx_http_ziti_h1_stream_t *stream)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+    ngx_http_ziti_h1_pool_t       *pool;
+    ngx_http_ziti_h1_conn_t       *conn;
+
+    pool = ngx_http_ziti_h1_pool_get(stream);
+    if (pool == NULL) {
+        ngx_http_ziti_resp_done(request_ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    stream->pool = pool;
+
+    stream->attempt->start = uv_now(request_ctx->loop->uv_thread_loop);
+    stream->attempt->sent = uv_hrtime();
+
+    stream->head_written = 0;
+    stream->written = 0;
+    stream->out = stream->body;
+    stream->out_offset = 0;
+
+    request_ctx->tries++;
+    request_ctx->request_sent = 0;
+    request_ctx->state = ZS_REQ_PROCESSING;
+
+    conn = stream->fresh ? NULL : pool->idle;
+
+    if (conn) {
+        ngx_http_ziti_h1_conn_unidle(conn);
+        conn->reused = 1;
+
+    } else {
+        conn = ngx_http_ziti_h1_conn_create(pool);
+
+        if (conn == NULL) {
+            ngx_http_ziti_resp_done(request_ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+    conn->state = NGX_HTTP_ZITI_H1_HEAD;
+    conn->keepalive = 0;
+    conn->stream = stream;
+    stream->conn = conn;
+
+    uv_timer_start(&conn->timer, ngx_http_ziti_h1_conn_timeout,
+                   conn->connected ? stream->zlcf->read_timeout : stream->zlcf->connect_timeout, 0);
+
+    ngx_http_ziti_probe4(request__sent, request_ctx->r, pool->servicename, conn, 0);
+
+    if (conn->dial_rc != ZITI_OK) {
+        ngx_http_ziti_h1_conn_fail(conn, conn->dial_rc);
+        return;
+    }
+
+    if (conn->connected) {
+        request_ctx->t_connect = uv_hrtime();
+
+        ngx_http_ziti_h1_send(conn);
+    }
+}
+
+
+/**
+ * Close the native connections of a set of pools that is being freed; all of them are idle
+ */
+void
+ngx_http_ziti_h1_pool_free(void *h1)
+{
+    ngx_http_ziti_h1_pool_t       *pool = h1;
+
+    pool->closing = 1;
+
+    while (pool->idle) {
+        ngx_http_ziti_h1_conn_close(pool->idle);
+    }
+
+    ngx_http_ziti_h1_pool_release(pool);
+}
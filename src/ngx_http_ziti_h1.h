@@ -0,0 +1,31 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef NGX_HTTP_ZITI_H1_H
+#define NGX_HTTP_ZITI_H1_H
+
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_ziti_module.h"
+#include "ngx_http_ziti_handler.h"
+
+
+ngx_int_t ngx_http_ziti_h1_start(ngx_http_request_t *r, ngx_http_ziti_request_ctx_t *request_ctx);
+void ngx_http_ziti_h1_pool_free(void *h1);
+
+
+#endif /* NGX_HTTP_ZITI_H1_H */
@@ -0,0 +1,1632 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef DDEBUG
+#define DDEBUG 1
+#endif
+#include "ddebug.h"
+
+#include <nghttp2/nghttp2.h>
+
+#include "ngx_http_ziti_module.h"
+#include "ngx_http_ziti_handler.h"
+#include "ngx_http_ziti_shm.h"
+#include "ngx_http_ziti_probes.h"
+#include "ngx_http_ziti_h2.h"
+
+
+/*
+ * ziti_http_version 2: requests are sent as HTTP/2 streams (h2c, prior knowledge) over a few raw
+ * Ziti connections per service and loop, instead of one pooled um_http client each.
+ *
+ * Everything here runs on the request's uv loop thread, except ngx_http_ziti_h2_start(),
+ * ngx_http_ziti_h2_consumed() and ngx_http_ziti_h2_trailers(), which the handler calls on the
+ * nginx thread.  Responses are handed over with the same header, chunk and completion tasks as
+ * um_http responses.
+ *
+ * Window updates are not sent automatically: a stream's window is only reopened for the bytes
+ * the nginx thread has taken off request_ctx->out_bufs, so a request whose response is not
+ * being drained stops its stream without holding up the others on the connection.
+ *
+ * Streams live in their request's pool, so the timeouts are kept by one timer per connection:
+ * ziti_connect_timeout while it is dialed, then the earliest ziti_read_timeout of its streams,
+ * counted from the last frame each sent or received, and ziti_keepalive_timeout once idle.
+ */
+
+#define NGX_HTTP_ZITI_H2_STREAMS        100
+#define NGX_HTTP_ZITI_H2_STREAM_WINDOW  (256 * 1024)
+#define NGX_HTTP_ZITI_H2_WRITE_SIZE     (64 * 1024)
+
+
+typedef struct ngx_http_ziti_h2_conn_s ngx_http_ziti_h2_conn_t;
+
+
+/*
+ * The HTTP/2 connections to one service from one set of pools, kept in its client pool
+ */
+typedef struct {
+    ngx_http_ziti_h2_conn_t            *conns;
+    ngx_msec_t                          keepalive_timeout;
+    uv_loop_t                          *uv_loop;
+    ziti_context                        ztx;
+    char                               *servicename;
+    ngx_http_ziti_shm_stats_t          *stats;
+
+    /* posted by the nginx thread when it has taken response data, see ngx_http_ziti_h2_consumed() */
+    uv_async_t                          async;
+    /* guards the consumed counts of the streams */
+    uv_mutex_t                          lock;
+    unsigned                            async_closed:1;
+    unsigned                            closing:1;
+} ngx_http_ziti_h2_pool_t;
+
+
+struct ngx_http_ziti_h2_conn_s {
+    ngx_http_ziti_h2_conn_t            *next;
+    ngx_http_ziti_h2_pool_t            *pool;
+    ziti_connection                     conn;
+    nghttp2_session                    *session;
+    uv_timer_t                          timer;
+    /* streams submitted on the session and not closed yet */
+    ngx_queue_t                         streams;
+    ngx_uint_t                          nstreams;
+    /* the last stream the service may have processed, once it sent GOAWAY */
+    int32_t                             last_stream_id;
+    unsigned                            goaway:1;
+    unsigned                            connected:1;
+    unsigned                            writing:1;
+    /* inside nghttp2_session_mem_recv(), whose callbacks must not send */
+    unsigned                            receiving:1;
+    /* takes no new streams: GOAWAY received, stream ids used up, or idle and not the first */
+    unsigned                            draining:1;
+    unsigned                            closing:1;
+};
+
+
+struct ngx_http_ziti_h2_stream_s {
+    ngx_queue_t                         queue;
+    ngx_http_ziti_request_ctx_t        *request_ctx;
+    ngx_http_ziti_loc_conf_t           *zlcf;
+    ngx_http_ziti_h2_pool_t            *pool;
+    ngx_http_ziti_h2_conn_t            *conn;
+    HttpsReq                           *attempt;
+    uv_work_t                           work;
+    int32_t                             id;
+
+    /* request head, built on the nginx thread; nghttp2 copies it when the stream is submitted */
+    nghttp2_nv                         *nva;
+    size_t                              nvlen;
+
+    /* request body left to send */
+    ngx_chain_t                        *body;
+    off_t                               body_offset;
+
+    /* response bytes handed to the nginx thread, and how many of them were credited back */
+    size_t                              received;
+    size_t                              credited;
+    /* taken by the nginx thread and not credited yet; under pool->lock */
+    size_t                              consumed;
+
+    /* response trailers, in request_ctx->pool, copied to r once the response is complete */
+    ngx_array_t                        *trailers;
+
+    /* when the stream last sent or received a frame, for ziti_read_timeout */
+    ngx_msec_t                          active;
+
+    /* :status of the header block being received */
+    ngx_uint_t                          block_status;
+    /* the request's HEADERS frame went out, so the service may have acted on it */
+    unsigned                            headers_sent:1;
+    unsigned                            in_trailers:1;
+    unsigned                            header_sent:1;
+    unsigned                            refused:1;
+    unsigned                            failed:1;
+};
+
+
+static void ngx_http_ziti_h2_dispatch(ngx_http_ziti_h2_stream_t *stream);
+static void ngx_http_ziti_h2_flush(ngx_http_ziti_h2_conn_t *conn);
+static void ngx_http_ziti_h2_conn_close(ngx_http_ziti_h2_conn_t *conn);
+static void ngx_http_ziti_h2_conn_timer(ngx_http_ziti_h2_conn_t *conn);
+
+
+/*
+ * nginx thread side
+ */
+
+/**
+ * Build the HTTP/2 request head: the pseudo-headers, then the request headers with their names
+ * in lower case and without the ones that only mean something to an HTTP/1 connection
+ */
+static ngx_int_t
+ngx_http_ziti_h2_head(ngx_http_request_t *r, ngx_http_ziti_h2_stream_t *stream)
+{
+    ngx_list_part_t               *part;
+    ngx_table_elt_t               *h;
+    nghttp2_nv                    *nv;
+    ngx_uint_t                     i, n;
+    u_char                        *name;
+
+    n = 4;
+
+    for (part = &r->headers_in.headers.part; part; part = part->next) {
+        n += part->nelts;
+    }
+
+    stream->nva = ngx_palloc(r->pool, n * sizeof(nghttp2_nv));
+    if (stream->nva == NULL) {
+        return NGX_ERROR;
+    }
+
+    nv = stream->nva;
+
+#define ngx_http_ziti_h2_nv(nv, n, nl, v, vl)                                 \
+    (nv)->name = (uint8_t *) (n); (nv)->namelen = (nl);                       \
+    (nv)->value = (uint8_t *) (v); (nv)->valuelen = (vl);                     \
+    (nv)->flags = NGHTTP2_NV_FLAG_NONE; (nv)++
+
+    ngx_http_ziti_h2_nv(nv, ":method", sizeof(":method") - 1, r->method_name.data, r->method_name.len);
+    ngx_http_ziti_h2_nv(nv, ":scheme", sizeof(":scheme") - 1, "http", sizeof("http") - 1);
+    ngx_http_ziti_h2_nv(nv, ":path", sizeof(":path") - 1, r->unparsed_uri.data, r->unparsed_uri.len);
+
+    if (r->headers_in.host) {
+        ngx_http_ziti_h2_nv(nv, ":authority", sizeof(":authority") - 1,
+                            r->headers_in.host->value.data, r->headers_in.host->value.len);
+    } else {
+        ngx_http_ziti_h2_nv(nv, ":authority", sizeof(":authority") - 1,
+                            stream->request_ctx->servicename, ngx_strlen(stream->request_ctx->servicename));
+    }
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == sizeof("TE") - 1
+            && ngx_strncasecmp(h[i].key.data, (u_char *) "TE", h[i].key.len) == 0)
+        {
+            // "te: trailers" is the only TE allowed, and gRPC requires it
+            if (ngx_strlcasestrn(h[i].value.data, h[i].value.data + h[i].value.len,
+                                 (u_char *) "trailers", sizeof("trailers") - 2) != NULL)
+            {
+                ngx_http_ziti_h2_nv(nv, "te", sizeof("te") - 1, "trailers", sizeof("trailers") - 1);
+            }
+
+            continue;
+        }
+
+        if ((h[i].key.len == sizeof("Host") - 1
+             && ngx_strncasecmp(h[i].key.data, (u_char *) "Host", h[i].key.len) == 0)
+            || (h[i].key.len == sizeof("Connection") - 1
+                && ngx_strncasecmp(h[i].key.data, (u_char *) "Connection", h[i].key.len) == 0)
+            || (h[i].key.len == sizeof("Keep-Alive") - 1
+                && ngx_strncasecmp(h[i].key.data, (u_char *) "Keep-Alive", h[i].key.len) == 0)
+            || (h[i].key.len == sizeof("Proxy-Connection") - 1
+                && ngx_strncasecmp(h[i].key.data, (u_char *) "Proxy-Connection", h[i].key.len) == 0)
+            || (h[i].key.len == sizeof("Transfer-Encoding") - 1
+                && ngx_strncasecmp(h[i].key.data, (u_char *) "Transfer-Encoding", h[i].key.len) == 0)
+            || (h[i].key.len == sizeof("Upgrade") - 1
+                && ngx_strncasecmp(h[i].key.data, (u_char *) "Upgrade", h[i].key.len) == 0))
+        {
+            continue;
+        }
+
+        name = ngx_pnalloc(r->pool, h[i].key.len);
+        if (name == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_strlow(name, h[i].key.data, h[i].key.len);
+
+        ngx_http_ziti_h2_nv(nv, name, h[i].key.len, h[i].value.data, h[i].value.len);
+    }
+
+#undef ngx_http_ziti_h2_nv
+
+    stream->nvlen = nv - stream->nva;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_ziti_h2_nop(uv_work_t *req)
+{
+    /* runs on the uv thread pool; the stream is dispatched in ngx_http_ziti_h2_submit_cb() */
+}
+
+
+/**
+ * First thing on the loop thread: count the attempt and dispatch the stream
+ */
+static void
+ngx_http_ziti_h2_submit_cb(uv_work_t *req, int status)
+{
+    ngx_http_ziti_h2_stream_t     *stream = req->data;
+
+    ngx_http_ziti_h2_dispatch(stream);
+}
+
+
+/**
+ * The request body has been read, if there was one: hand the stream to the loop thread
+ */
+static void
+ngx_http_ziti_h2_body_read(ngx_http_request_t *r)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx;
+    ngx_http_ziti_h2_stream_t     *stream;
+
+    request_ctx = ngx_http_get_module_ctx(r, ngx_http_ziti_module);
+    stream = request_ctx->h2;
+
+    ngx_http_ziti_body_read_done(request_ctx);
+
+    stream->body = r->request_body ? r->request_body->bufs : NULL;
+
+    stream->work.data = stream;
+
+    uv_queue_work(request_ctx->loop->uv_thread_loop, &stream->work, ngx_http_ziti_h2_nop, ngx_http_ziti_h2_submit_cb);
+}
+
+
+/**
+ * Start the request as an HTTP/2 stream.  The request body is read in full first; it is then
+ * sent as DATA frames as the stream's window allows.  Returns NGX_DONE, or the status to
+ * finish the request with.
+ */
+ngx_int_t
+ngx_http_ziti_h2_start(ngx_http_request_t *r, ngx_http_ziti_request_ctx_t *request_ctx)
+{
+    ngx_http_ziti_h2_stream_t     *stream;
+    ngx_int_t                      rc;
+
+    stream = ngx_pcalloc(request_ctx->pool, sizeof(ngx_http_ziti_h2_stream_t));
+    if (stream == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    stream->request_ctx = request_ctx;
+    stream->zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
+
+    if (ngx_http_ziti_h2_head(r, stream) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    stream->attempt = ngx_http_ziti_attempt_create(request_ctx);
+    if (stream->attempt == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    request_ctx->h2 = stream;
+    request_ctx->body_pending = 1;
+
+    rc = ngx_http_read_client_request_body(r, ngx_http_ziti_h2_body_read);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        request_ctx->body_pending = 0;
+        return rc;
+    }
+
+    return NGX_DONE;
+}
+
+
+/**
+ * The nginx thread took size bytes of the response: let the service send that much more
+ */
+void
+ngx_http_ziti_h2_consumed(ngx_http_ziti_request_ctx_t *request_ctx, size_t size)
+{
+    ngx_http_ziti_h2_stream_t     *stream = request_ctx->h2;
+
+    if (size == 0) {
+        return;
+    }
+
+    uv_mutex_lock(&stream->pool->lock);
+    stream->consumed += size;
+    uv_mutex_unlock(&stream->pool->lock);
+
+    uv_async_send(&stream->pool->async);
+}
+
+
+/**
+ * Copy the response trailers, if any, to r before the last of the response goes out
+ */
+ngx_int_t
+ngx_http_ziti_h2_trailers(ngx_http_request_t *r, ngx_http_ziti_request_ctx_t *request_ctx)
+{
+    ngx_http_ziti_h2_stream_t     *stream = request_ctx->h2;
+    ngx_table_elt_t               *t, *h;
+    ngx_uint_t                     i;
+
+    if (stream->trailers == NULL) {
+        return NGX_OK;
+    }
+
+    t = stream->trailers->elts;
+
+    for (i = 0; i < stream->trailers->nelts; i++) {
+
+        h = ngx_list_push(&r->headers_out.trailers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        // request_ctx->pool goes away before the response may be fully written
+        h->hash = 1;
+        h->key.len = t[i].key.len;
+        h->value.len = t[i].value.len;
+        h->key.data = ngx_pstrdup(r->pool, &t[i].key);
+        h->value.data = ngx_pstrdup(r->pool, &t[i].value);
+
+        if (h->key.data == NULL || h->value.data == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Loop thread side
+ */
+
+/**
+ * Finish the request of a stream that is done with: completed, or failed with the given status
+ */
+static void
+ngx_http_ziti_h2_stream_done(ngx_http_ziti_h2_stream_t *stream, ngx_int_t status)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+
+    if (status) {
+        ngx_http_ziti_stat_add(stream->pool->stats, errors, 1);
+    }
+
+    if (status == 0) {
+        ngx_http_ziti_probe3(body__eof, request_ctx->r, request_ctx->bytes_received, uv_hrtime() - request_ctx->t_start);
+    }
+
+    ngx_http_ziti_resp_done(request_ctx, status);
+}
+
+
+/**
+ * Whether a stream the service may have processed can still be sent again: like
+ * proxy_next_upstream, its method is idempotent or non_idempotent is set
+ */
+static ngx_uint_t
+ngx_http_ziti_h2_replayable(ngx_http_ziti_h2_stream_t *stream)
+{
+    return !(stream->request_ctx->r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH))
+           || (stream->zlcf->next_upstream & NGX_HTTP_UPSTREAM_FT_NON_IDEMPOTENT);
+}
+
+
+/**
+ * Whether the service cannot have acted on the stream: its HEADERS never went out, or the
+ * service's GOAWAY says it was not processed
+ */
+static ngx_uint_t
+ngx_http_ziti_h2_unprocessed(ngx_http_ziti_h2_conn_t *conn, ngx_http_ziti_h2_stream_t *stream)
+{
+    return !stream->headers_sent || (conn->goaway && stream->id > conn->last_stream_id);
+}
+
+
+/**
+ * The stream never got a response.  If it may be sent again, as when it did not reach the
+ * service, try it on the next service named on ziti_pass as ziti_next_upstream allows;
+ * otherwise fail the request.
+ */
+static void
+ngx_http_ziti_h2_stream_fail(ngx_http_ziti_h2_stream_t *stream, ngx_uint_t replayable, int code)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+    ngx_http_ziti_loc_conf_t      *zlcf = stream->zlcf;
+    ngx_uint_t                     ft_type;
+
+    ngx_http_ziti_breaker_record(stream->attempt, code);
+
+    ft_type = (code == UV_ETIMEDOUT) ? NGX_HTTP_UPSTREAM_FT_TIMEOUT : NGX_HTTP_UPSTREAM_FT_ERROR;
+
+    if (replayable
+        && (zlcf->next_upstream & ft_type)
+        && request_ctx->tries < zlcf->next_upstream_tries)
+    {
+        ngx_log_error(NGX_LOG_WARN, request_ctx->r->connection->log, 0,
+                      "ziti: service \"%s\" failed over HTTP/2 (%s), retrying request, attempt %ui of %ui",
+                      request_ctx->servicename, ziti_errorstr(code), request_ctx->tries + 1, zlcf->next_upstream_tries);
+
+        ngx_http_ziti_stat_add(stream->pool->stats, errors, 1);
+        ngx_http_ziti_stat_add(stream->pool->stats, retries, 1);
+
+        request_ctx->service_index = (request_ctx->service_index + 1) % zlcf->servicenames->nelts;
+        request_ctx->servicename = ((char **) zlcf->servicenames->elts)[request_ctx->service_index];
+
+        stream->attempt = ngx_http_ziti_attempt_create(request_ctx);
+
+        if (stream->attempt != NULL) {
+            stream->body = request_ctx->r->request_body ? request_ctx->r->request_body->bufs : NULL;
+            stream->body_offset = 0;
+
+            ngx_http_ziti_h2_dispatch(stream);
+            return;
+        }
+    }
+
+    ngx_http_ziti_h2_stream_done(stream, (code == UV_ETIMEDOUT) ? NGX_HTTP_GATEWAY_TIME_OUT : NGX_HTTP_BAD_GATEWAY);
+}
+
+
+/**
+ * Take the stream off its connection.  Whatever the nginx thread will not credit any more is
+ * given back to the connection window, so that the other streams keep flowing.
+ */
+static void
+ngx_http_ziti_h2_stream_detach(ngx_http_ziti_h2_stream_t *stream)
+{
+    ngx_http_ziti_h2_conn_t       *conn = stream->conn;
+
+    ngx_queue_remove(&stream->queue);
+    conn->nstreams--;
+
+    stream->conn = NULL;
+
+    if (conn->session && stream->received > stream->credited) {
+        nghttp2_session_consume_connection(conn->session, stream->received - stream->credited);
+        stream->credited = stream->received;
+    }
+
+    // keep the newest connection for the next requests, and let the others go once idle
+    if (conn->nstreams == 0 && conn != conn->pool->conns) {
+        conn->draining = 1;
+    }
+
+    if (conn->nstreams == 0) {
+        ngx_http_ziti_h2_conn_timer(conn);
+    }
+}
+
+
+/**
+ * Fail every stream still on a connection that broke.  Streams the service cannot have acted
+ * on, and idempotent ones, may be retried elsewhere.
+ */
+static void
+ngx_http_ziti_h2_conn_fail(ngx_http_ziti_h2_conn_t *conn, int code)
+{
+    ngx_http_ziti_h2_stream_t     *stream;
+    ngx_queue_t                   *q;
+    ngx_uint_t                     unprocessed;
+
+    conn->draining = 1;
+
+    while (!ngx_queue_empty(&conn->streams)) {
+
+        q = ngx_queue_head(&conn->streams);
+        stream = ngx_queue_data(q, ngx_http_ziti_h2_stream_t, queue);
+
+        unprocessed = ngx_http_ziti_h2_unprocessed(conn, stream);
+
+        ngx_http_ziti_h2_stream_detach(stream);
+
+        if (stream->header_sent) {
+            ngx_log_error(NGX_LOG_ERR, stream->request_ctx->r->connection->log, 0,
+                          "ziti: response from service \"%s\" failed mid-stream (%s) after %O bytes",
+                          stream->pool->servicename, ziti_errorstr(code), stream->request_ctx->bytes_received);
+
+            ngx_http_ziti_h2_stream_done(stream, NGX_ERROR);
+            continue;
+        }
+
+        ngx_http_ziti_h2_stream_fail(stream, unprocessed || ngx_http_ziti_h2_replayable(stream), code);
+    }
+
+    ngx_http_ziti_h2_conn_close(conn);
+}
+
+
+/**
+ * A stream went ziti_read_timeout without a frame either way: reset it, and fail it like a
+ * stream on a broken connection
+ */
+static void
+ngx_http_ziti_h2_stream_timeout(ngx_http_ziti_h2_conn_t *conn, ngx_http_ziti_h2_stream_t *stream)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+    ngx_uint_t                     unprocessed;
+
+    unprocessed = ngx_http_ziti_h2_unprocessed(conn, stream);
+
+    ngx_http_ziti_h2_stream_detach(stream);
+
+    // nothing the session still does on the stream may reach the request any more
+    nghttp2_session_set_stream_user_data(conn->session, stream->id, NULL);
+    nghttp2_submit_rst_stream(conn->session, NGHTTP2_FLAG_NONE, stream->id, NGHTTP2_CANCEL);
+
+    if (stream->header_sent) {
+        ngx_log_error(NGX_LOG_ERR, request_ctx->r->connection->log, 0,
+                      "ziti: response from service \"%s\" timed out mid-stream after %O bytes",
+                      stream->pool->servicename, request_ctx->bytes_received);
+
+        ngx_http_ziti_h2_stream_done(stream, NGX_ERROR);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, request_ctx->r->connection->log, 0,
+                  "ziti: HTTP/2 stream to service \"%s\" timed out reading the response", stream->pool->servicename);
+
+    ngx_http_ziti_h2_stream_fail(stream, unprocessed || ngx_http_ziti_h2_replayable(stream), UV_ETIMEDOUT);
+}
+
+
+/**
+ * The connection timer: fail the dial, the streams past ziti_read_timeout, or close an idle
+ * connection
+ */
+static void
+ngx_http_ziti_h2_conn_timeout(uv_timer_t *timer)
+{
+    ngx_http_ziti_h2_conn_t       *conn = timer->data;
+    ngx_http_ziti_h2_stream_t     *stream;
+    ngx_queue_t                   *q;
+    ngx_msec_t                     now;
+
+    if (conn->closing) {
+        return;
+    }
+
+    if (!conn->connected) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: dial of service \"%s\" for HTTP/2 timed out",
+                      conn->pool->servicename);
+
+        ngx_http_ziti_h2_conn_fail(conn, UV_ETIMEDOUT);
+        return;
+    }
+
+    if (conn->nstreams == 0) {
+        conn->draining = 1;
+        ngx_http_ziti_h2_conn_close(conn);
+        return;
+    }
+
+    now = uv_now(conn->pool->uv_loop);
+
+    /*
+     * Each pass fails one stream, which may resubmit it here, or fail the whole connection if
+     * that write fails, so the queue is walked again from the start.  A resubmitted stream
+     * starts its timeout over.
+     */
+    for ( ;; ) {
+
+        for (q = ngx_queue_head(&conn->streams); q != ngx_queue_sentinel(&conn->streams); q = ngx_queue_next(q)) {
+
+            stream = ngx_queue_data(q, ngx_http_ziti_h2_stream_t, queue);
+
+            if (now - stream->active >= stream->zlcf->read_timeout) {
+                break;
+            }
+        }
+
+        if (q == ngx_queue_sentinel(&conn->streams)) {
+            break;
+        }
+
+        ngx_http_ziti_h2_stream_timeout(conn, stream);
+
+        if (conn->closing) {
+            return;
+        }
+    }
+
+    ngx_http_ziti_h2_conn_timer(conn);
+
+    // the resets
+    ngx_http_ziti_h2_flush(conn);
+}
+
+
+/**
+ * Arm the connection timer for whatever the connection waits on next.  A dial keeps the timer
+ * it was given in ngx_http_ziti_h2_conn_create().
+ */
+static void
+ngx_http_ziti_h2_conn_timer(ngx_http_ziti_h2_conn_t *conn)
+{
+    ngx_http_ziti_h2_stream_t     *stream;
+    ngx_queue_t                   *q;
+    ngx_msec_t                     now, idle, left, deadline;
+
+    if (conn->closing || !conn->connected) {
+        return;
+    }
+
+    if (conn->nstreams == 0) {
+        uv_timer_start(&conn->timer, ngx_http_ziti_h2_conn_timeout, conn->pool->keepalive_timeout, 0);
+        return;
+    }
+
+    now = uv_now(conn->pool->uv_loop);
+    deadline = (ngx_msec_t) -1;
+
+    for (q = ngx_queue_head(&conn->streams); q != ngx_queue_sentinel(&conn->streams); q = ngx_queue_next(q)) {
+
+        stream = ngx_queue_data(q, ngx_http_ziti_h2_stream_t, queue);
+
+        idle = now - stream->active;
+        left = (idle >= stream->zlcf->read_timeout) ? 0 : stream->zlcf->read_timeout - idle;
+
+        deadline = ngx_min(deadline, left);
+    }
+
+    uv_timer_start(&conn->timer, ngx_http_ziti_h2_conn_timeout, deadline, 0);
+}
+
+
+/**
+ * Free the set of connections once the last of them is closed
+ */
+static void
+ngx_http_ziti_h2_pool_release(ngx_http_ziti_h2_pool_t *pool)
+{
+    if (!pool->closing || pool->conns != NULL || !pool->async_closed) {
+        return;
+    }
+
+    uv_mutex_destroy(&pool->lock);
+
+    ngx_free(pool->servicename);
+    ngx_free(pool);
+}
+
+
+static void
+ngx_http_ziti_h2_conn_timer_closed(uv_handle_t *handle)
+{
+    ngx_http_ziti_h2_conn_t       *conn = handle->data;
+    ngx_http_ziti_h2_pool_t       *pool = conn->pool;
+    ngx_http_ziti_h2_conn_t      **cp;
+
+    for (cp = &pool->conns; *cp; cp = &(*cp)->next) {
+        if (*cp == conn) {
+            *cp = conn->next;
+            break;
+        }
+    }
+
+    ngx_free(conn);
+
+    ngx_http_ziti_h2_pool_release(pool);
+}
+
+
+static void
+ngx_http_ziti_h2_conn_free(ngx_http_ziti_h2_conn_t *conn)
+{
+    uv_close((uv_handle_t *) &conn->timer, ngx_http_ziti_h2_conn_timer_closed);
+}
+
+
+static void
+ngx_http_ziti_h2_conn_closed(ziti_connection zconn)
+{
+    ngx_http_ziti_h2_conn_free(ziti_conn_data(zconn));
+}
+
+
+/**
+ * Close a connection that has no streams left, once any write in flight has completed
+ */
+static void
+ngx_http_ziti_h2_conn_close(ngx_http_ziti_h2_conn_t *conn)
+{
+    if (conn->closing || conn->writing) {
+        return;
+    }
+
+    conn->closing = 1;
+
+    uv_timer_stop(&conn->timer);
+
+    if (conn->session) {
+        nghttp2_session_del(conn->session);
+        conn->session = NULL;
+    }
+
+    if (conn->conn) {
+        ziti_close(conn->conn, ngx_http_ziti_h2_conn_closed);
+        return;
+    }
+
+    ngx_http_ziti_h2_conn_free(conn);
+}
+
+
+static void
+ngx_http_ziti_h2_written(ziti_connection zconn, ssize_t status, void *write_ctx)
+{
+    ngx_http_ziti_h2_conn_t       *conn = ziti_conn_data(zconn);
+
+    ngx_free(write_ctx);
+
+    conn->writing = 0;
+
+    if (status < 0) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: write to HTTP/2 connection to service \"%s\" failed: %s",
+                      conn->pool->servicename, ziti_errorstr(status));
+
+        ngx_http_ziti_h2_conn_fail(conn, (int) status);
+        return;
+    }
+
+    ngx_http_ziti_h2_flush(conn);
+}
+
+
+/**
+ * Write whatever nghttp2 has queued, in one buffer of up to NGX_HTTP_ZITI_H2_WRITE_SIZE bytes
+ * (plus the frame that crosses it), one write at a time
+ */
+static void
+ngx_http_ziti_h2_flush(ngx_http_ziti_h2_conn_t *conn)
+{
+    const uint8_t                 *data;
+    u_char                        *buf, *p;
+    size_t                         size, cap;
+    ssize_t                        n;
+    int                            rc;
+
+    if (conn->closing || conn->writing || conn->receiving || !conn->connected) {
+        return;
+    }
+
+    buf = NULL;
+    size = 0;
+    cap = 0;
+
+    while (size < NGX_HTTP_ZITI_H2_WRITE_SIZE) {
+
+        n = nghttp2_session_mem_send(conn->session, &data);
+
+        if (n < 0) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: HTTP/2 connection to service \"%s\" failed: %s",
+                          conn->pool->servicename, nghttp2_strerror((int) n));
+
+            ngx_free(buf);
+            ngx_http_ziti_h2_conn_fail(conn, UV_EPROTO);
+            return;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        if (size + n > cap) {
+            cap = ngx_max(size + n, (size_t) NGX_HTTP_ZITI_H2_WRITE_SIZE);
+
+            p = ngx_alloc(cap, ngx_cycle->log);
+            if (p == NULL) {
+                ngx_free(buf);
+                ngx_http_ziti_h2_conn_fail(conn, UV_ENOMEM);
+                return;
+            }
+
+            if (size) {
+                ngx_memcpy(p, buf, size);
+            }
+
+            ngx_free(buf);
+            buf = p;
+        }
+
+        ngx_memcpy(buf + size, data, n);
+        size += n;
+    }
+
+    if (size == 0) {
+        if (conn->draining && conn->nstreams == 0) {
+            ngx_http_ziti_h2_conn_close(conn);
+        }
+        return;
+    }
+
+    conn->writing = 1;
+
+    rc = ziti_write(conn->conn, buf, size, ngx_http_ziti_h2_written, buf);
+
+    if (rc != ZITI_OK) {
+        conn->writing = 0;
+        ngx_free(buf);
+
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: write to HTTP/2 connection to service \"%s\" failed: %s",
+                      conn->pool->servicename, ziti_errorstr(rc));
+
+        ngx_http_ziti_h2_conn_fail(conn, rc);
+    }
+}
+
+
+/**
+ * Request body for a stream's DATA frames, from memory or from the temporary file nginx spooled it to
+ */
+static ssize_t
+ngx_http_ziti_h2_body(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+    uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+    ngx_http_ziti_h2_stream_t     *stream = source->ptr;
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+    ngx_buf_t                     *b;
+    size_t                         size, n;
+    ssize_t                        rc;
+
+    // a stream reset by ziti_read_timeout, whose request may have moved on
+    if (stream->conn == NULL || stream->id != stream_id) {
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    }
+
+    size = 0;
+
+    while (stream->body && size < length) {
+
+        b = stream->body->buf;
+
+        n = ngx_min((size_t) (ngx_buf_size(b) - stream->body_offset), length - size);
+
+        if (n == 0) {
+            stream->body = stream->body->next;
+            stream->body_offset = 0;
+            continue;
+        }
+
+        if (ngx_buf_in_memory(b)) {
+            ngx_memcpy(buf + size, b->pos + stream->body_offset, n);
+
+        } else {
+            rc = ngx_read_file(b->file, buf + size, n, b->file_pos + stream->body_offset);
+
+            if (rc != (ssize_t) n) {
+                return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+            }
+        }
+
+        stream->body_offset += n;
+        size += n;
+    }
+
+    if (stream->body == NULL) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+
+    if (size) {
+        request_ctx->request_sent = 1;
+        ngx_http_ziti_stat_add(stream->pool->stats, bytes_in, size);
+    }
+
+    return size;
+}
+
+
+/**
+ * Open the stream on a connection of its service
+ */
+static void
+ngx_http_ziti_h2_submit(ngx_http_ziti_h2_conn_t *conn, ngx_http_ziti_h2_stream_t *stream)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+    nghttp2_data_provider          provider, *prd;
+    int32_t                        id;
+
+    prd = NULL;
+
+    if (stream->body) {
+        provider.source.ptr = stream;
+        provider.read_callback = ngx_http_ziti_h2_body;
+        prd = &provider;
+    }
+
+    id = nghttp2_submit_request(conn->session, NULL, stream->nva, stream->nvlen, prd, stream);
+
+    if (id < 0) {
+        ngx_log_error(NGX_LOG_ERR, request_ctx->r->connection->log, 0, "ziti: could not open an HTTP/2 stream to service \"%s\": %s",
+                      conn->pool->servicename, nghttp2_strerror(id));
+
+        if (id == NGHTTP2_ERR_STREAM_ID_NOT_AVAILABLE) {    // out of stream ids: use another connection
+            conn->draining = 1;
+            ngx_http_ziti_h2_dispatch(stream);
+            return;
+        }
+
+        ngx_http_ziti_h2_stream_done(stream, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    stream->id = id;
+    stream->conn = conn;
+    stream->headers_sent = 0;
+    stream->active = uv_now(conn->pool->uv_loop);
+
+    ngx_queue_insert_tail(&conn->streams, &stream->queue);
+    conn->nstreams++;
+
+    ngx_http_ziti_h2_conn_timer(conn);
+
+    ngx_http_ziti_h2_flush(conn);
+}
+
+
+/*
+ * nghttp2 callbacks
+ */
+
+static int
+ngx_http_ziti_h2_begin_headers(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+    ngx_http_ziti_h2_stream_t     *stream;
+
+    stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+
+    if (stream == NULL || frame->hd.type != NGHTTP2_HEADERS) {
+        return 0;
+    }
+
+    stream->active = uv_now(stream->pool->uv_loop);
+
+    // a header block after the response header carries the trailers
+    stream->block_status = 0;
+    stream->in_trailers = stream->header_sent;
+
+    return 0;
+}
+
+
+static int
+ngx_http_ziti_h2_header(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name, size_t namelen,
+    const uint8_t *value, size_t valuelen, uint8_t flags, void *user_data)
+{
+    ngx_http_ziti_h2_stream_t     *stream;
+    ngx_http_ziti_request_ctx_t   *request_ctx;
+    ngx_http_request_t            *r;
+    ngx_table_elt_t               *t;
+    ngx_str_t                      key, val;
+    ngx_int_t                      status;
+
+    stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+
+    if (stream == NULL || frame->hd.type != NGHTTP2_HEADERS) {
+        return 0;
+    }
+
+    request_ctx = stream->request_ctx;
+    r = request_ctx->r;
+
+    if (namelen && name[0] == ':') {
+
+        if (!stream->in_trailers && namelen == sizeof(":status") - 1
+            && ngx_strncmp(name, ":status", namelen) == 0)
+        {
+            status = ngx_atoi((u_char *) value, valuelen);
+            stream->block_status = (status == NGX_ERROR) ? 0 : (ngx_uint_t) status;
+        }
+
+        return 0;
+    }
+
+    if (stream->in_trailers) {
+
+        if (stream->trailers == NULL) {
+            stream->trailers = ngx_array_create(request_ctx->pool, 4, sizeof(ngx_table_elt_t));
+            if (stream->trailers == NULL) {
+                return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+            }
+        }
+
+        t = ngx_array_push(stream->trailers);
+        if (t == NULL) {
+            return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+        }
+
+        t->key.len = namelen;
+        t->key.data = ngx_pnalloc(request_ctx->pool, namelen);
+        t->value.len = valuelen;
+        t->value.data = ngx_pnalloc(request_ctx->pool, valuelen);
+
+        if (t->key.data == NULL || t->value.data == NULL) {
+            return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+        }
+
+        ngx_memcpy(t->key.data, name, namelen);
+        ngx_memcpy(t->value.data, value, valuelen);
+
+        return 0;
+    }
+
+    // interim (1xx) responses are not passed on
+    if (stream->block_status < NGX_HTTP_OK) {
+        return 0;
+    }
+
+    // like on_resp(), the nginx thread does not touch r until the header task runs
+    key.len = namelen;
+    val.len = valuelen;
+
+    key.data = ngx_pnalloc(r->pool, key.len + 1 + val.len + 1);
+    if (key.data == NULL) {
+        return 0;
+    }
+
+    val.data = key.data + key.len + 1;
+
+    ngx_cpystrn(key.data, (u_char *) name, key.len + 1);
+    ngx_cpystrn(val.data, (u_char *) value, val.len + 1);
+
+    ngx_http_ziti_set_header(r, &key, &val);
+
+    return 0;
+}
+
+
+/**
+ * A whole response header block arrived: pass the final response header on to the nginx thread
+ */
+static void
+ngx_http_ziti_h2_response(ngx_http_ziti_h2_stream_t *stream)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+    ngx_http_request_t            *r = request_ctx->r;
+    ngx_http_ziti_loop_t          *loop = request_ctx->loop;
+
+    stream->header_sent = 1;
+
+    r->headers_out.status = stream->block_status;
+
+    ngx_http_ziti_probe3(response, r, (int) stream->block_status, uv_hrtime() - stream->attempt->sent);
+
+    ngx_http_ziti_breaker_record(stream->attempt, (int) stream->block_status);
+
+    if (stream->pool->stats && stream->attempt->start) {
+        ngx_http_ziti_hist_add(&stream->pool->stats->ttfb, (ngx_msec_t) (uv_now(loop->uv_thread_loop) - stream->attempt->start));
+    }
+
+    request_ctx->t_header = uv_hrtime();
+
+#if (nginx_version >= 1013002)
+    // gRPC puts its status in trailers, which HTTP/1.1 clients then get in a chunked response
+    if (r->headers_out.content_type.len >= sizeof("application/grpc") - 1
+        && ngx_strncasecmp(r->headers_out.content_type.data, (u_char *) "application/grpc", sizeof("application/grpc") - 1) == 0)
+    {
+        r->expect_trailers = 1;
+    }
+#endif
+
+    ngx_http_ziti_resp_header(request_ctx);
+}
+
+
+static int
+ngx_http_ziti_h2_frame_recv(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+    ngx_http_ziti_h2_conn_t       *conn = user_data;
+    ngx_http_ziti_h2_stream_t     *stream;
+
+    switch (frame->hd.type) {
+
+    case NGHTTP2_GOAWAY:
+        // streams the service will not process are closed with REFUSED_STREAM, and go elsewhere
+        conn->draining = 1;
+        conn->goaway = 1;
+        conn->last_stream_id = frame->goaway.last_stream_id;
+        break;
+
+    case NGHTTP2_HEADERS:
+        stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+
+        if (stream && !stream->in_trailers && !stream->header_sent && stream->block_status >= NGX_HTTP_OK) {
+            ngx_http_ziti_h2_response(stream);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+
+static int
+ngx_http_ziti_h2_data_chunk(nghttp2_session *session, uint8_t flags, int32_t stream_id, const uint8_t *data,
+    size_t len, void *user_data)
+{
+    ngx_http_ziti_h2_stream_t     *stream;
+    ngx_http_ziti_request_ctx_t   *request_ctx;
+
+    stream = nghttp2_session_get_stream_user_data(session, stream_id);
+
+    if (stream == NULL) {
+        nghttp2_session_consume_connection(session, len);
+        return 0;
+    }
+
+    request_ctx = stream->request_ctx;
+
+    stream->active = uv_now(stream->pool->uv_loop);
+
+    if (!stream->header_sent || stream->failed) {
+        nghttp2_session_consume(session, stream_id, len);
+        return 0;
+    }
+
+    ngx_http_ziti_probe2(body__chunk, request_ctx->r, len);
+
+    ngx_http_ziti_stat_add(stream->pool->stats, bytes_out, len);
+
+    request_ctx->bytes_received += len;
+
+    if (ngx_http_ziti_resp_chunk(request_ctx, (u_char *) data, len) != NGX_OK) {
+        stream->failed = 1;
+        nghttp2_session_consume(session, stream_id, len);
+        nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_INTERNAL_ERROR);
+        return 0;
+    }
+
+    // credited back in ngx_http_ziti_h2_async(), once the nginx thread has taken it
+    stream->received += len;
+
+    return 0;
+}
+
+
+static int
+ngx_http_ziti_h2_frame_send(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+    ngx_http_ziti_h2_stream_t     *stream;
+
+    if (frame->hd.stream_id == 0) {
+        return 0;
+    }
+
+    stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+
+    if (stream == NULL) {
+        return 0;
+    }
+
+    if (frame->hd.type == NGHTTP2_HEADERS) {
+        stream->headers_sent = 1;
+    }
+
+    stream->active = uv_now(stream->pool->uv_loop);
+
+    return 0;
+}
+
+
+static int
+ngx_http_ziti_h2_stream_close(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *user_data)
+{
+    ngx_http_ziti_h2_stream_t     *stream;
+    ngx_http_ziti_request_ctx_t   *request_ctx;
+
+    stream = nghttp2_session_get_stream_user_data(session, stream_id);
+
+    if (stream == NULL || stream->conn == NULL) {
+        return 0;
+    }
+
+    request_ctx = stream->request_ctx;
+
+    ngx_http_ziti_h2_stream_detach(stream);
+
+    if (stream->header_sent) {
+
+        if (error_code == NGHTTP2_NO_ERROR && !stream->failed) {
+            ngx_http_ziti_h2_stream_done(stream, 0);
+            return 0;
+        }
+
+        ngx_log_error(NGX_LOG_ERR, request_ctx->r->connection->log, 0,
+                      "ziti: response from service \"%s\" failed mid-stream (%s) after %O bytes",
+                      stream->pool->servicename, nghttp2_http2_strerror(error_code), request_ctx->bytes_received);
+
+        ngx_http_ziti_h2_stream_done(stream, NGX_ERROR);
+        return 0;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, request_ctx->r->connection->log, 0,
+                  "ziti: HTTP/2 stream to service \"%s\" closed without a response: %s",
+                  stream->pool->servicename, nghttp2_http2_strerror(error_code));
+
+    // a refused stream was not processed, so it is safe to send again, once
+    if (error_code == NGHTTP2_REFUSED_STREAM && !stream->refused) {
+        stream->refused = 1;
+        stream->body = request_ctx->r->request_body ? request_ctx->r->request_body->bufs : NULL;
+        stream->body_offset = 0;
+
+        ngx_http_ziti_h2_dispatch(stream);
+        return 0;
+    }
+
+    ngx_http_ziti_h2_stream_fail(stream, 0, UV_ECONNRESET);
+
+    return 0;
+}
+
+
+/*
+ * Ziti connection
+ */
+
+static ssize_t
+ngx_http_ziti_h2_data(ziti_connection zconn, uint8_t *data, ssize_t len)
+{
+    ngx_http_ziti_h2_conn_t       *conn = ziti_conn_data(zconn);
+    ssize_t                        rc;
+
+    if (conn->closing) {
+        return len;
+    }
+
+    if (len < 0) {
+        if (len != ZITI_EOF || conn->nstreams) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: HTTP/2 connection to service \"%s\" failed: %s",
+                          conn->pool->servicename, ziti_errorstr(len));
+        }
+
+        ngx_http_ziti_h2_conn_fail(conn, (int) len);
+        return len;
+    }
+
+    conn->receiving = 1;
+    rc = nghttp2_session_mem_recv(conn->session, data, len);
+    conn->receiving = 0;
+
+    if (rc < 0) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: HTTP/2 connection to service \"%s\" failed: %s",
+                      conn->pool->servicename, nghttp2_strerror((int) rc));
+
+        ngx_http_ziti_h2_conn_fail(conn, UV_EPROTO);
+        return len;
+    }
+
+    ngx_http_ziti_h2_flush(conn);
+
+    return len;
+}
+
+
+static void
+ngx_http_ziti_h2_connected(ziti_connection zconn, int status)
+{
+    ngx_http_ziti_h2_conn_t       *conn = ziti_conn_data(zconn);
+    ngx_http_ziti_h2_stream_t     *stream;
+    ngx_queue_t                   *q;
+    ngx_msec_t                     now;
+
+    if (status != ZITI_OK) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: dial of service \"%s\" for HTTP/2 failed: %s",
+                      conn->pool->servicename, ziti_errorstr(status));
+
+        ngx_http_ziti_h2_conn_fail(conn, status);
+        return;
+    }
+
+    conn->connected = 1;
+
+    // from here on the streams' ziti_read_timeout counts, from the end of the dial
+    now = uv_now(conn->pool->uv_loop);
+
+    for (q = ngx_queue_head(&conn->streams); q != ngx_queue_sentinel(&conn->streams); q = ngx_queue_next(q)) {
+        stream = ngx_queue_data(q, ngx_http_ziti_h2_stream_t, queue);
+        stream->active = now;
+    }
+
+    ngx_http_ziti_h2_conn_timer(conn);
+
+    // the connection preface, settings and the requests submitted while dialing
+    ngx_http_ziti_h2_flush(conn);
+}
+
+
+/**
+ * A new connection to the pool's service.  Its session exists at once, so streams can be
+ * submitted while the dial is in progress; nothing is written until it completes, or until
+ * connect_timeout fails it.
+ */
+static ngx_http_ziti_h2_conn_t *
+ngx_http_ziti_h2_conn_create(ngx_http_ziti_h2_pool_t *pool, ngx_msec_t connect_timeout)
+{
+    ngx_http_ziti_h2_conn_t       *conn;
+    nghttp2_session_callbacks     *callbacks;
+    nghttp2_option                *option;
+    nghttp2_settings_entry         iv[2];
+    int                            rc;
+
+    conn = ngx_calloc(sizeof(ngx_http_ziti_h2_conn_t), ngx_cycle->log);
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    conn->pool = pool;
+    ngx_queue_init(&conn->streams);
+
+    if (nghttp2_session_callbacks_new(&callbacks) != 0) {
+        ngx_free(conn);
+        return NULL;
+    }
+
+    nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, ngx_http_ziti_h2_begin_headers);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, ngx_http_ziti_h2_header);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, ngx_http_ziti_h2_frame_recv);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, ngx_http_ziti_h2_data_chunk);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, ngx_http_ziti_h2_stream_close);
+    nghttp2_session_callbacks_set_on_frame_send_callback(callbacks, ngx_http_ziti_h2_frame_send);
+
+    if (nghttp2_option_new(&option) != 0) {
+        nghttp2_session_callbacks_del(callbacks);
+        ngx_free(conn);
+        return NULL;
+    }
+
+    // windows are reopened as nginx drains the responses, see ngx_http_ziti_h2_async()
+    nghttp2_option_set_no_auto_window_update(option, 1);
+
+    rc = nghttp2_session_client_new2(&conn->session, callbacks, conn, option);
+
+    nghttp2_option_del(option);
+    nghttp2_session_callbacks_del(callbacks);
+
+    if (rc != 0) {
+        ngx_free(conn);
+        return NULL;
+    }
+
+    iv[0].settings_id = NGHTTP2_SETTINGS_ENABLE_PUSH;
+    iv[0].value = 0;
+    iv[1].settings_id = NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+    iv[1].value = NGX_HTTP_ZITI_H2_STREAM_WINDOW;
+
+    nghttp2_submit_settings(conn->session, NGHTTP2_FLAG_NONE, iv, 2);
+
+    // room for every stream to fill its window, so that a stalled one holds up no other
+    nghttp2_session_set_local_window_size(conn->session, NGHTTP2_FLAG_NONE, 0,
+                                          NGX_HTTP_ZITI_H2_STREAMS * NGX_HTTP_ZITI_H2_STREAM_WINDOW);
+
+    uv_timer_init(pool->uv_loop, &conn->timer);
+    conn->timer.data = conn;
+
+    uv_timer_start(&conn->timer, ngx_http_ziti_h2_conn_timeout, connect_timeout, 0);
+
+    rc = ziti_conn_init(pool->ztx, &conn->conn, conn);
+
+    if (rc == ZITI_OK) {
+        rc = ziti_dial(conn->conn, pool->servicename, ngx_http_ziti_h2_connected, ngx_http_ziti_h2_data);
+    } else {
+        conn->conn = NULL;
+    }
+
+    conn->next = pool->conns;
+    pool->conns = conn;
+
+    if (rc != ZITI_OK) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: could not dial service \"%s\" for HTTP/2: %s",
+                      pool->servicename, ziti_errorstr(rc));
+
+        // fails the first stream once it is submitted
+        conn->draining = 1;
+    }
+
+    return conn;
+}
+
+
+/**
+ * The nginx thread took response data: credit it to the windows of the streams it came from
+ */
+static void
+ngx_http_ziti_h2_async(uv_async_t *async)
+{
+    ngx_http_ziti_h2_pool_t       *pool = async->data;
+    ngx_http_ziti_h2_conn_t       *conn;
+    ngx_http_ziti_h2_stream_t     *stream;
+    ngx_queue_t                   *q;
+    size_t                         n;
+
+    for (conn = pool->conns; conn; conn = conn->next) {
+
+        if (conn->closing) {
+            continue;
+        }
+
+        for (q = ngx_queue_head(&conn->streams); q != ngx_queue_sentinel(&conn->streams); q = ngx_queue_next(q)) {
+
+            stream = ngx_queue_data(q, ngx_http_ziti_h2_stream_t, queue);
+
+            uv_mutex_lock(&pool->lock);
+            n = stream->consumed;
+            stream->consumed = 0;
+            uv_mutex_unlock(&pool->lock);
+
+            n = ngx_min(n, stream->received - stream->credited);
+
+            if (n) {
+                nghttp2_session_consume(conn->session, stream->id, n);
+                stream->credited += n;
+            }
+        }
+
+        ngx_http_ziti_h2_flush(conn);
+    }
+}
+
+
+static void
+ngx_http_ziti_h2_async_closed(uv_handle_t *handle)
+{
+    ngx_http_ziti_h2_pool_t       *pool = handle->data;
+
+    pool->async_closed = 1;
+
+    ngx_http_ziti_h2_pool_release(pool);
+}
+
+
+/**
+ * The HTTP/2 connections of the stream's current service, created on first use
+ */
+static ngx_http_ziti_h2_pool_t *
+ngx_http_ziti_h2_pool_get(ngx_http_ziti_h2_stream_t *stream)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+    ngx_http_ziti_h2_pool_t       *pool;
+    void                         **slot;
+    size_t                         len;
+
+    slot = ngx_http_ziti_pool_h2(request_ctx);
+
+    if (*slot) {
+        return *slot;
+    }
+
+    pool = ngx_calloc(sizeof(ngx_http_ziti_h2_pool_t), ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    len = ngx_strlen(request_ctx->servicename) + 1;
+
+    pool->servicename = ngx_alloc(len, ngx_cycle->log);
+    if (pool->servicename == NULL) {
+        ngx_free(pool);
+        return NULL;
+    }
+
+    ngx_memcpy(pool->servicename, request_ctx->servicename, len);
+
+    pool->ztx = ngx_http_ziti_pools_ztx(request_ctx->pools);
+    pool->stats = ngx_http_ziti_shm_stats_get(request_ctx->loop->identity->index, pool->servicename);
+    pool->keepalive_timeout = stream->zlcf->keepalive_timeout;
+    pool->uv_loop = request_ctx->loop->uv_thread_loop;
+
+    uv_mutex_init(&pool->lock);
+    uv_async_init(request_ctx->loop->uv_thread_loop, &pool->async, ngx_http_ziti_h2_async);
+    pool->async.data = pool;
+
+    *slot = pool;
+
+    return pool;
+}
+
+
+/**
+ * Put the stream on the first connection of its service with room for it, or on a new one
+ */
+static void
+ngx_http_ziti_h2_dispatch(ngx_http_ziti_h2_stream_t *stream)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx = stream->request_ctx;
+    ngx_http_ziti_h2_pool_t       *pool;
+    ngx_http_ziti_h2_conn_t       *conn;
+    ngx_uint_t                     limit;
+
+    pool = ngx_http_ziti_h2_pool_get(stream);
+    if (pool == NULL) {
+        ngx_http_ziti_resp_done(request_ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    stream->pool = pool;
+
+    stream->attempt->start = uv_now(request_ctx->loop->uv_thread_loop);
+    stream->attempt->sent = uv_hrtime();
+
+    request_ctx->tries++;
+    request_ctx->request_sent = 0;
+    request_ctx->state = ZS_REQ_PROCESSING;
+
+    for (conn = pool->conns; conn; conn = conn->next) {
+
+        if (conn->draining || conn->closing) {
+            continue;
+        }
+
+        limit = NGX_HTTP_ZITI_H2_STREAMS;
+
+        if (conn->connected) {
+            limit = ngx_min(limit, nghttp2_session_get_remote_settings(conn->session, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS));
+        }
+
+        if (conn->nstreams < limit) {
+            break;
+        }
+    }
+
+    if (conn == NULL) {
+        conn = ngx_http_ziti_h2_conn_create(pool, stream->zlcf->connect_timeout);
+
+        if (conn == NULL) {
+            ngx_http_ziti_resp_done(request_ctx, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        if (conn->draining) {       // the dial could not even be started
+            ngx_http_ziti_h2_conn_close(conn);
+            ngx_http_ziti_h2_stream_fail(stream, 1, UV_ECONNREFUSED);
+            return;
+        }
+    }
+
+    request_ctx->t_connect = uv_hrtime();
+
+    ngx_http_ziti_probe4(request__sent, request_ctx->r, pool->servicename, conn, 0);
+
+    ngx_http_ziti_h2_submit(conn, stream);
+}
+
+
+/**
+ * Close the HTTP/2 connections of a set of pools that is being freed; no stream is left on them
+ */
+void
+ngx_http_ziti_h2_pool_free(void *h2)
+{
+    ngx_http_ziti_h2_pool_t       *pool = h2;
+    ngx_http_ziti_h2_conn_t       *conn, *next;
+
+    pool->closing = 1;
+
+    for (conn = pool->conns; conn; conn = next) {
+        next = conn->next;
+        conn->draining = 1;
+        ngx_http_ziti_h2_conn_close(conn);
+    }
+
+    uv_close((uv_handle_t *) &pool->async, ngx_http_ziti_h2_async_closed);
+}
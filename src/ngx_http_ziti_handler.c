@@ -23,9 +23,20 @@ limitations under the License.
 #include "ngx_http_ziti_module.h"
 #include "ngx_http_ziti_handler.h"
 #include "ngx_http_ziti_upstream.h"
+#include "ngx_http_ziti_shm.h"
+#include "ngx_http_ziti_probes.h"
+#include "ngx_http_ziti_tunnel.h"
+#include "ngx_http_ziti_h1.h"
+#if (NGX_HTTP_ZITI_HAVE_NGHTTP2)
+#include "ngx_http_ziti_h2.h"
+#endif
 
 
 static ngx_int_t ngx_http_ziti_get_buf(ngx_http_request_t *r, ngx_http_ziti_request_ctx_t *request_ctx, ssize_t len, ngx_buf_t **out_buf);
+void on_client(uv_work_t* req, int status);
+static void ngx_http_ziti_send_request(HttpsReq *httpsReq);
+static void ngx_http_ziti_fail_request(ngx_http_ziti_request_ctx_t *request_ctx, ngx_int_t status);
+static void ngx_http_ziti_client_close_cb(um_http_t *clt);
 
 typedef struct {
     char          *name;
@@ -56,8 +67,6 @@ ngx_http_ziti_method_t ngx_http_ziti_methods[] = {
 enum { listMapCapacity = 1000 };
 
 
-struct ListMap* HttpsClientListMap;
-
 struct key_value {
     char* key;
     void* value;
@@ -67,27 +76,60 @@ struct ListMap {
     struct   key_value kvPairs[listMapCapacity];
     size_t   count;
     uv_sem_t sem;
+    /* client pools only: slots of purged clients still to be taken out of sem, under client_pool_lock */
+    ngx_uint_t retire;
+    ngx_http_ziti_breaker_t breaker;
+    /* the Ziti context the clients dial through */
+    ziti_context ztx;
+    /* set of pools only: requests pinned to it, see ngx_http_ziti_pools_busy() */
+    ngx_atomic_t refs;
+    /* counters of the service in the ziti_shared_zone, NULL without one */
+    ngx_http_ziti_shm_stats_t *stats;
+
+    /* client pools only: what is needed to rebuild clients off the request path */
+    ngx_http_ziti_loc_conf_t *zlcf;
+    ngx_http_ziti_loop_t *loop;
+    char    *servicename;
+    char    *scheme_host_port;
+    uv_timer_t maint_timer;
+    bool     maint_started;
+    uint64_t last_health_check;
+    /* ziti_http_version 2: the service's HTTP/2 connections, see ngx_http_ziti_h2.c */
+    void    *h2;
+    /* ziti_http_engine native: the service's raw HTTP/1.1 connections, see ngx_http_ziti_h1.c */
+    void    *h1;
 };
 
-struct ListMap* newListMap(ngx_http_request_t *r) {
-    struct ListMap* listMap = ngx_calloc(sizeof *listMap, r->connection->log);
+
+/*
+ * An in-flight ziti_health_check probe
+ */
+typedef struct {
+    struct ListMap *clientListMap;
+    HttpsClient    *httpsClient;
+} ngx_http_ziti_health_probe_t;
+
+struct ListMap* newListMap(ngx_log_t *log) {
+    struct ListMap* listMap = ngx_calloc(sizeof *listMap, log);
     return listMap;
 }
 
 uv_mutex_t client_pool_lock;
+static bool client_pool_lock_ready;
 
-bool listMapInsert(struct ListMap* collection, ngx_http_ziti_request_ctx_t *request_ctx, void* value) 
+bool listMapInsert(struct ListMap* collection, ngx_log_t *log, char* key, void* value) 
 {
-    ngx_http_request_t          *r = request_ctx->r;
-    ngx_http_ziti_loc_conf_t    *zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
-
-    if (collection->count == zlcf->client_pool_size) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0, "max services already at capacity [%d], insert FAIL", zlcf->client_pool_size);
+    if (collection->count == listMapCapacity) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0, "max services already at capacity [%d], insert FAIL", listMapCapacity);
         return false;
     }
     
-    collection->kvPairs[collection->count].key = strdup(request_ctx->scheme_host_port);
+    collection->kvPairs[collection->count].key = strdup(key);
     collection->kvPairs[collection->count].value = value;
+
+    // other threads look entries up without a lock: they must never see the count before the entry
+    ngx_memory_barrier();
+
     collection->count++;
 
     return true;
@@ -106,29 +148,115 @@ struct ListMap* getInnerListMapValueForKey(struct ListMap* collection, char* key
 }
 
 
-HttpsClient* getHttpsClientForKey(struct ListMap* collection, char* key, ngx_http_request_t *r)  
+/**
+ * Whether a pool built for one location also fits another: the two must agree on everything
+ * the pool, its clients and its health checks are built from
+ */
+static ngx_uint_t
+ngx_http_ziti_pool_fits(ngx_http_ziti_loc_conf_t *a, ngx_http_ziti_loc_conf_t *b)
 {
-    ngx_http_ziti_loc_conf_t    *zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
+    if (a == b) {
+        return 1;
+    }
+
+    if (a->client_pool_size != b->client_pool_size
+        || a->client_requests != b->client_requests
+        || a->buf_size != b->buf_size
+        || a->health_interval != b->health_interval)
+    {
+        return 0;
+    }
+
+    if (a->health_uri == NULL || b->health_uri == NULL) {
+        return a->health_uri == b->health_uri;
+    }
+
+    return ngx_strcmp(a->health_uri, b->health_uri) == 0;
+}
+
+
+/**
+ * Look up the client pool for a service in a loop's set of pools.  Locations whose pool
+ * settings differ get pools of their own, so zlcf picks the one built with its settings.
+ * Without a zlcf any pool of the service will do; they all share its counters.
+ */
+static struct ListMap *
+ngx_http_ziti_pool_get(struct ListMap *pools, ngx_http_ziti_loc_conf_t *zlcf, char *servicename)
+{
+    struct ListMap              *clientListMap;
+
+    if (pools == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0 ; i < pools->count ; ++i) {
+
+        if (strcmp(pools->kvPairs[i].key, servicename) != 0) {
+            continue;
+        }
+
+        clientListMap = pools->kvPairs[i].value;
+
+        if (zlcf == NULL || ngx_http_ziti_pool_fits(clientListMap->zlcf, zlcf)) {
+            return clientListMap;
+        }
+    }
+
+    return NULL;
+}
+
 
+/**
+ * Check out the least loaded usable client of a pool.  A client carries up to client_requests
+ * requests at once; um_http queues those beyond the first and sends each as soon as the
+ * response before it is complete, on the same Ziti connection.  An exclusive checkout takes
+ * an idle client and keeps other requests from queueing behind it until it is released.
+ */
+HttpsClient* getHttpsClientForKey(struct ListMap* collection, char* key, ngx_http_request_t *r, bool exclusive)
+{
     HttpsClient* value = NULL;
+    HttpsClient* candidate;
     size_t busyCount = 0;
-    for (size_t i = 0 ; i < collection->count && value == NULL ; ++i) {
-        if (strcmp(collection->kvPairs[i].key, key) == 0) {
-          value = collection->kvPairs[i].value;
-            if (value->active) {      // if it's in use
-                value = NULL;         //  then keep searching
-            }
-            else if (value->purge) {  // if it's broken
-                value = NULL;         //  then keep searching
-            } else {
-                value->active = true; // mark the one we will return as 'in use'
-            }
+    ngx_uint_t limit;
+
+    limit = exclusive ? 1 : collection->zlcf->client_requests;
+
+    uv_mutex_lock(&client_pool_lock);
+
+    for (size_t i = 0 ; i < collection->count ; ++i) {
+        if (strcmp(collection->kvPairs[i].key, key) != 0) {
+            continue;
+        }
+
+        candidate = collection->kvPairs[i].value;
+
+        if (candidate->active) {
+            busyCount++;
+        }
+
+        if (candidate->purge || candidate->exclusive || candidate->active >= limit) {   // broken, or carrying all it may
+            continue;
+        }
+
+        if (value == NULL || candidate->active < value->active) {
+            value = candidate;
+        }
+    }
+
+    if (value != NULL) {
+        value->exclusive = exclusive;
+
+        if (value->active++ == 0) {
+            ngx_http_ziti_stat_add(collection->stats, active, 1);
             busyCount++;
         }
     }
+
+    uv_mutex_unlock(&client_pool_lock);
+
     ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "returning value '%p', collection->count is: [%d], busy-count is: [%d]", value, collection->count, busyCount);
 
-    if (busyCount == zlcf->client_pool_size) {
+    if (busyCount == collection->count && value == NULL) {
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "All available clients [%d] now in use; additional requests will be queued until clients are returned to pool", busyCount);
     }
 
@@ -148,273 +276,1256 @@ void freeListMap(struct ListMap* collection) {
 
 
 /**
- * 
+ * Take n pool slots without blocking.  An exclusive checkout holds all the slots of its client.
  */
-static int purge_and_replace_bad_clients(struct ListMap* clientListMap, ngx_http_ziti_request_ctx_t *request_ctx) 
+static bool
+ngx_http_ziti_pool_trywait(struct ListMap* clientListMap, ngx_uint_t n)
 {
-    ngx_http_request_t          *r = request_ctx->r;
-    ngx_http_ziti_loc_conf_t    *zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
+    for (ngx_uint_t i = 0; i < n; i++) {
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "purge_and_replace_bad_clients() entered");
+        if (uv_sem_trywait(&(clientListMap->sem)) != 0) {
+            while (i--) {
+                uv_sem_post(&(clientListMap->sem));
+            }
+            return false;
+        }
+    }
 
-    int numReplaced = 0;
-    for (size_t i = 0; i < zlcf->client_pool_size; i++) {
+    return true;
+}
 
-        HttpsClient* httpsClient = clientListMap->kvPairs[i].value;
 
-        ZITI_LOG(DEBUG, "httpsClient is: %p", httpsClient);
+/**
+ * Give back n pool slots.  Those owed by purged clients are retired instead.
+ */
+static void
+ngx_http_ziti_pool_post(struct ListMap* clientListMap, ngx_uint_t n)
+{
+    ngx_uint_t  retired;
 
-        if (httpsClient->purge) {
+    uv_mutex_lock(&client_pool_lock);
 
-            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "*********** purging client [%p] from slot [%d]", httpsClient, i);
+    retired = ngx_min(n, clientListMap->retire);
+    clientListMap->retire -= retired;
 
-            httpsClient = ngx_calloc(sizeof *httpsClient, r->connection->log);
+    uv_mutex_unlock(&client_pool_lock);
 
-            httpsClient->scheme_host_port = strdup(request_ctx->scheme_host_port);
-            ziti_src_init(zlcf->uv_thread_loop, &(httpsClient->ziti_src), zlcf->servicename, zlcf->ztx);
-            um_http_init_with_src(zlcf->uv_thread_loop, &(httpsClient->client), request_ctx->scheme_host_port, (um_src_t *)&(httpsClient->ziti_src) );
+    for (n -= retired; n; n--) {
+        uv_sem_post(&(clientListMap->sem));
+    }
+}
 
-            clientListMap->kvPairs[i].value = httpsClient;
 
-            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "*********** new client [%p] now occupying slot [%d]", httpsClient, i);
+/**
+ * Take the slots of a just-purged client out of circulation, so that a checkout never gets a
+ * slot that only the purged client stands behind.  Idle slots go at once, the rest as they are
+ * given back; the client's replacement brings them back.  Called with client_pool_lock held.
+ */
+static void
+ngx_http_ziti_pool_retire(struct ListMap* clientListMap)
+{
+    clientListMap->retire += clientListMap->zlcf->client_requests;
 
-            numReplaced++;
-        }
+    while (clientListMap->retire && uv_sem_trywait(&(clientListMap->sem)) == 0) {
+        clientListMap->retire--;
     }
-    return numReplaced;
 }
 
 
 /**
- * 
+ * Rebuild every purged client that is not checked out.  Runs on the uv loop thread that owns
+ * the pool (from its maintenance timer), never while a request waits for a client.
  */
-static void allocate_client(uv_work_t* req) 
+static int purge_and_replace_bad_clients(struct ListMap* clientListMap) 
 {
-    ngx_http_ziti_request_ctx_t *request_ctx = (ngx_http_ziti_request_ctx_t*)req->data;
-    ngx_http_request_t          *r = request_ctx->r;
-    ngx_http_ziti_loc_conf_t    *zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
+    ngx_http_ziti_loop_t        *loop = clientListMap->loop;
+    HttpsClient                 *httpsClient, *newClient;
+    ngx_uint_t                   slots, owed;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "allocate_client() entered, uv_work_t is: %p, request_ctx is: %p", req, request_ctx);
+    int numReplaced = 0;
+    bool skip;
 
-    HttpsReq* httpsReq = (HttpsReq*) ngx_pcalloc(request_ctx->pool, sizeof(HttpsReq));
+    for (size_t i = 0; i < clientListMap->count; i++) {
 
-    request_ctx->httpsReq = httpsReq;
-    httpsReq->request_ctx = request_ctx;
+        uv_mutex_lock(&client_pool_lock);
+
+        httpsClient = clientListMap->kvPairs[i].value;
+        skip = !httpsClient->purge || httpsClient->active;
 
-    struct ListMap* clientListMap = getInnerListMapValueForKey(HttpsClientListMap, request_ctx->scheme_host_port);
+        uv_mutex_unlock(&client_pool_lock);
 
-    if (NULL == clientListMap) { // If first time seeing this key, spawn a pool of clients for it
+        // a purged client is never checked out again, so it cannot turn active from here on
+        if (skip) {
+            continue;
+        }
+
+        newClient = ngx_calloc(sizeof *newClient, ngx_cycle->log);
+        if (newClient == NULL) {
+            break;
+        }
 
-        clientListMap = newListMap(r);
-        listMapInsert(HttpsClientListMap, request_ctx, (void*)clientListMap);
+        newClient->scheme_host_port = clientListMap->scheme_host_port;
+        newClient->loop = loop->index;
+        newClient->slot = i;
+        ziti_src_init(loop->uv_thread_loop, &(newClient->ziti_src), clientListMap->servicename, clientListMap->ztx);
+        um_http_init_with_src(loop->uv_thread_loop, &(newClient->client), clientListMap->scheme_host_port, (um_src_t *)&(newClient->ziti_src) );
 
-        uv_sem_init(&(clientListMap->sem), zlcf->client_pool_size);
+        uv_mutex_lock(&client_pool_lock);
 
-        for (size_t i = 0; i < zlcf->client_pool_size; i++) {
+        clientListMap->kvPairs[i].value = newClient;
 
-            HttpsClient* httpsClient = ngx_calloc(sizeof *httpsClient, r->connection->log);
-            httpsClient->scheme_host_port = strdup(request_ctx->scheme_host_port);
-            ziti_src_init(zlcf->uv_thread_loop, &(httpsClient->ziti_src), zlcf->servicename, zlcf->ztx );
-            um_http_init_with_src(zlcf->uv_thread_loop, &(httpsClient->client), request_ctx->scheme_host_port, (um_src_t *)&(httpsClient->ziti_src) );
+        // the new client's slots, less those of the purged one that were never retired
+        slots = clientListMap->zlcf->client_requests;
+        owed = ngx_min(slots, clientListMap->retire);
+        clientListMap->retire -= owed;
 
-            listMapInsert(clientListMap, request_ctx, (void*)httpsClient);
+        uv_mutex_unlock(&client_pool_lock);
 
+        for (slots -= owed; slots; slots--) {
+            uv_sem_post(&(clientListMap->sem));
         }
-    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "----------> acquiring sem");
-    uv_sem_wait(&(clientListMap->sem));
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "----------> successfully acquired sem");
+        ngx_http_ziti_stat_add(clientListMap->stats, purged, -1);
 
-    request_ctx->httpsClient = getHttpsClientForKey(clientListMap, request_ctx->scheme_host_port, r);
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "----------> client is: [%p]", request_ctx->httpsClient);
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "*********** purged client [%p] replaced by [%p] in slot [%d]", httpsClient, newClient, i);
 
-    if (NULL == request_ctx->httpsClient) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "----------> client is NULL, so we must purge_and_replace_bad_clients");
-        purge_and_replace_bad_clients(clientListMap, request_ctx);
+        // nothing refers to the purged client any more
+        um_http_close(&httpsClient->client, ngx_http_ziti_client_close_cb);
 
-        request_ctx->httpsClient = getHttpsClientForKey(clientListMap, request_ctx->scheme_host_port, r);
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "----------> client is: [%p]", request_ctx->httpsClient);
+        numReplaced++;
     }
 
-    if (NULL == request_ctx->httpsClient) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "----------> client is NULL, so we are in an unrecoverable state!");
+    if (numReplaced) {
+        ZITI_LOG(DEBUG, "replaced %d client(s) in pool for service '%s'", numReplaced, clientListMap->servicename);
     }
+
+    return numReplaced;
 }
 
 
 /**
- * 
+ * ziti_health_check response: a client that cannot answer is purged, to be rebuilt on the next tick
  */
-void propagate_headers_to_request(um_http_req_t *ur, ngx_http_request_t *r) {
-    ngx_list_part_t            *part;
-    ngx_table_elt_t            *h;
-    ngx_uint_t                  i;
+static void
+ngx_http_ziti_health_check_resp(um_http_resp_t *resp, void *data)
+{
+    ngx_http_ziti_health_probe_t *probe = data;
+    HttpsClient                  *httpsClient = probe->httpsClient;
+    ngx_http_ziti_loc_conf_t     *zlcf = probe->clientListMap->zlcf;
+    bool                          purge;
 
-    // Get the first part of the list. There is usual only one part.
-    part = &r->headers_in.headers.part;
-    h = part->elts;
+    purge = (resp->code < 0 || resp->code >= NGX_HTTP_INTERNAL_SERVER_ERROR);
 
-    // Headers list array may consist of more than one part, so loop through all of it
-    for (i = 0; /* void */ ; i++) {
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                /* The last part, we're done. */
-                break;
-            }
+    if (purge) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "ziti: health check of service \"%s\" failed [%d], purging client [%p]",
+                      probe->clientListMap->servicename, resp->code, httpsClient);
+    }
 
-            part = part->next;
-            h = part->elts;
-            i = 0;
-        }
+    // the flags are read by checkouts on the uv work threads
+    uv_mutex_lock(&client_pool_lock);
 
-        um_http_req_header(ur, (char*)h[i].key.data, (char*)h[i].value.data);
-        
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "added header to um_http_req_t: '%s:%s'", h[i].key.data, h[i].value.data);
+    if (purge && !httpsClient->purge) {
+        httpsClient->purge = true;
+        ngx_http_ziti_pool_retire(probe->clientListMap);
+        ngx_http_ziti_stat_add(probe->clientListMap->stats, purged, 1);
+        ngx_http_ziti_probe3(client__purge, probe->clientListMap->servicename, httpsClient, httpsClient->slot);
     }
-}
 
+    purge = httpsClient->purge;
+    httpsClient->active--;
+    httpsClient->exclusive = false;
 
-static void
-ngx_http_ziti_req_complete_func(void *data, ngx_log_t *log)
-{
-    /* this function is executed in a thread from the ziti thread_pool */
+    uv_mutex_unlock(&client_pool_lock);
 
-    //
-    // This function is a nop.
-    // It's only purpose is to terminate and cause the
-    //  ngx_http_ziti_req_thread_completion func to run over on the Nginx thread loop
-    //
+    ngx_http_ziti_pool_post(probe->clientListMap, zlcf->client_requests);
+
+    if (purge) {
+        purge_and_replace_bad_clients(probe->clientListMap);
+    }
+
+    ngx_free(probe);
 }
 
 
+/**
+ * Send the ziti_health_check request over every idle client in the pool.  A client being
+ * probed holds all its pool slots, like a hedge, so checkout never finds it busy unexpectedly.
+ */
 static void
-ngx_http_ziti_req_thread_completion(ngx_event_t *ev)
+ngx_http_ziti_health_check(struct ListMap* clientListMap)
 {
-    ngx_http_ziti_req_complete_thread_ctx_t *req_complete_thread_ctx = ev->data;
-    ngx_http_request_t                      *r = req_complete_thread_ctx->r;
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_req_thread_completion() entered, r: %p", r);
+    ngx_http_ziti_loc_conf_t     *zlcf = clientListMap->zlcf;
+    ngx_http_ziti_health_probe_t *probe;
+    HttpsClient                  *httpsClient;
 
-    /* this function is executed in nginx event loop */
+    // requests to the service do not use the clients
+    if (zlcf->http_version == NGX_HTTP_VERSION_20 || zlcf->http_engine == NGX_HTTP_ZITI_ENGINE_NATIVE) {
+        return;
+    }
 
-    // Cause a re-drive of our main request handler so it can transmit the now-completed response
-    r->blocked--;
-    r->aio = 0;
+    for (size_t i = 0; i < clientListMap->count; i++) {
 
-    req_complete_thread_ctx->request_ctx->state = ZS_RESP_BODY_DONE;
+        if (!ngx_http_ziti_pool_trywait(clientListMap, zlcf->client_requests)) {   // pool is busy, leave it alone
+            return;
+        }
 
-    ngx_http_handler(r);
-}
+        uv_mutex_lock(&client_pool_lock);
 
+        httpsClient = clientListMap->kvPairs[i].value;
 
-/**
- * 
- */
-static ngx_int_t
-ngx_http_ziti_get_buf(ngx_http_request_t *r, ngx_http_ziti_request_ctx_t *request_ctx, ssize_t len, ngx_buf_t **out_buf)
-{
-    ngx_buf_t *buf;
+        if (httpsClient->active || httpsClient->purge) {
+            httpsClient = NULL;
+        } else {
+            httpsClient->active++;
+            httpsClient->exclusive = true;
+        }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_get_buf() entered, len: %d", len);
+        uv_mutex_unlock(&client_pool_lock);
 
-    buf = ngx_create_temp_buf(request_ctx->pool, len);
+        if (httpsClient == NULL) {
+            ngx_http_ziti_pool_post(clientListMap, zlcf->client_requests);
+            continue;
+        }
 
-    if (buf == NULL) {
-        return NGX_ERROR;
-    }
+        probe = ngx_alloc(sizeof(ngx_http_ziti_health_probe_t), ngx_cycle->log);
+        if (probe == NULL) {
+            uv_mutex_lock(&client_pool_lock);
+            httpsClient->active--;
+            httpsClient->exclusive = false;
+            uv_mutex_unlock(&client_pool_lock);
 
-    buf->tag = (ngx_buf_tag_t) &ngx_http_ziti_module;
-    buf->recycled = 1;
+            ngx_http_ziti_pool_post(clientListMap, zlcf->client_requests);
+            return;
+        }
 
-    *out_buf = buf;
+        probe->clientListMap = clientListMap;
+        probe->httpsClient = httpsClient;
 
-    return NGX_OK;
+        um_http_req(&(httpsClient->client), "GET", zlcf->health_uri, ngx_http_ziti_health_check_resp, probe);
+    }
 }
 
 
 /**
- * 
+ * Pool maintenance tick: replace purged clients and, when due, health-check the idle ones
  */
-static ngx_int_t
-ngx_http_ziti_submit_mem(ngx_http_request_t *r, ngx_http_ziti_request_ctx_t *request_ctx, ngx_buf_t *out_buf)
+static void
+ngx_http_ziti_pool_maint_cb(uv_timer_t *timer)
 {
-    ngx_chain_t     *cl;
-    ngx_chain_t     *existing_cl;
-
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_submit_mem() entered, r: %p, len: %d", r, (int)(out_buf->last - out_buf->pos));
+    struct ListMap              *clientListMap = timer->data;
+    ngx_http_ziti_loc_conf_t    *zlcf = clientListMap->zlcf;
+    uint64_t                     now;
 
+    purge_and_replace_bad_clients(clientListMap);
 
-    if (request_ctx->out_bufs == NULL) {    // if no queued bufs
-
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_submit_mem() allocating new chain of out_bufs");
+    if (zlcf->health_uri == NULL) {
+        return;
+    }
 
-        cl = ngx_alloc_chain_link(request_ctx->pool);
-        if (cl == NULL) {
-            goto failed;
-        }
+    now = uv_now(clientListMap->loop->uv_thread_loop);
 
-        cl->buf = out_buf;
-        cl->next = NULL;
+    if (now - clientListMap->last_health_check >= zlcf->health_interval) {
+        clientListMap->last_health_check = now;
+        ngx_http_ziti_health_check(clientListMap);
+    }
+}
 
-        out_buf->last_buf = 1;
 
-        request_ctx->out_bufs = cl;
+/**
+ * Start the maintenance timer of a pool.  Must run on the pool's uv loop thread.
+ */
+static void
+ngx_http_ziti_pool_maint_start(struct ListMap* clientListMap)
+{
+    if (clientListMap->maint_started) {
+        return;
+    }
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_submit_mem() attaching out_buf to new chain");
+    clientListMap->maint_started = true;
+    clientListMap->last_health_check = uv_now(clientListMap->loop->uv_thread_loop);
 
-    } else {
+    uv_timer_init(clientListMap->loop->uv_thread_loop, &clientListMap->maint_timer);
+    clientListMap->maint_timer.data = clientListMap;
 
-        cl = ngx_alloc_chain_link(request_ctx->pool);
-        if (cl == NULL) {
-            goto failed;
-        }
+    uv_timer_start(&clientListMap->maint_timer, ngx_http_ziti_pool_maint_cb,
+                   NGX_HTTP_ZITI_POOL_MAINT_INTERVAL, NGX_HTTP_ZITI_POOL_MAINT_INTERVAL);
+}
 
-        cl->buf = out_buf;
-        cl->next = NULL;
 
-        out_buf->last_buf = 1;
+/**
+ * Have the maintenance timer run on the next loop iteration, to replace a just-purged client
+ */
+static void
+ngx_http_ziti_pool_maint_kick(struct ListMap* clientListMap)
+{
+    if (!clientListMap->maint_started) {
+        return;
+    }
 
-        existing_cl = request_ctx->out_bufs;
+    uv_timer_start(&clientListMap->maint_timer, ngx_http_ziti_pool_maint_cb,
+                   0, NGX_HTTP_ZITI_POOL_MAINT_INTERVAL);
+}
 
-        while (existing_cl->next) {
-            existing_cl = existing_cl->next;
-        }
 
-        existing_cl->next = cl;
-        existing_cl->buf->last_buf = 0;
+/**
+ * Spawn the pool of clients for a service in one of a loop's sets of pools.  Only the loop thread
+ * that owns the set calls this, so no two threads can insert the same pool.
+ */
+static struct ListMap *
+ngx_http_ziti_pool_create(ngx_http_ziti_loop_t *loop, struct ListMap *pools, ngx_http_ziti_loc_conf_t *zlcf, char *servicename, ngx_log_t *log)
+{
+    struct ListMap* clientListMap = newListMap(log);
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_submit_mem() attaching out_buf to existing chain");
-    }
+    clientListMap->zlcf = zlcf;
+    clientListMap->loop = loop;
+    clientListMap->ztx = pools->ztx;
+    clientListMap->stats = ngx_http_ziti_shm_stats_get(loop->identity->index, servicename);
+    clientListMap->servicename = strdup(servicename);
+    clientListMap->scheme_host_port = strdup(NGX_HTTP_ZITI_SCHEME_HOST_PORT);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_submit_mem() exiting");
+    // one slot per request a client may carry, see getHttpsClientForKey()
+    uv_sem_init(&(clientListMap->sem), zlcf->client_pool_size * zlcf->client_requests);
 
+    for (size_t i = 0; i < zlcf->client_pool_size; i++) {
 
-    return NGX_OK;
+        HttpsClient* httpsClient = ngx_calloc(sizeof *httpsClient, log);
+        httpsClient->scheme_host_port = clientListMap->scheme_host_port;
+        httpsClient->loop = loop->index;
+        httpsClient->slot = i;
+        ziti_src_init(loop->uv_thread_loop, &(httpsClient->ziti_src), servicename, clientListMap->ztx );
+        um_http_init_with_src(loop->uv_thread_loop, &(httpsClient->client), clientListMap->scheme_host_port, (um_src_t *)&(httpsClient->ziti_src) );
 
-failed:
+        listMapInsert(clientListMap, log, clientListMap->scheme_host_port, (void*)httpsClient);
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_submit_mem() exiting with ERROR");
+    ngx_http_ziti_stat_add(clientListMap->stats, pool_size, zlcf->client_pool_size);
 
+    // Publish the pool only once it is fully populated
+    listMapInsert(pools, log, servicename, (void*)clientListMap);
 
-    return NGX_ERROR;
+    return clientListMap;
 }
 
 
-static void
-ngx_http_ziti_resp_chunk_func(void *data, ngx_log_t *log)
+/**
+ * Create the (empty) set of client pools for a loop
+ */
+struct ListMap *
+ngx_http_ziti_pools_create(ngx_log_t *log)
 {
-    /* this function is executed in a thread from the ziti thread_pool */
+    if (!client_pool_lock_ready) {     // called from init_process, before any loop thread runs
+        uv_mutex_init(&client_pool_lock);
+        client_pool_lock_ready = true;
+    }
 
-    //
-    // This function is a nop.
-    // It's only purpose is to terminate and cause the
-    //  ngx_http_ziti_resp_header_transmit_thread_completion func to run over on the Nginx thread loop
-    //
+    return newListMap(log);
 }
 
 
-static void
+/**
+ * Attach a set of pools to the Ziti context its clients are to dial through
+ */
+void
+ngx_http_ziti_pools_bind(struct ListMap *pools, ziti_context ztx)
+{
+    pools->ztx = ztx;
+}
+
+
+/**
+ * The Ziti context a set of pools dials through
+ */
+ziti_context
+ngx_http_ziti_pools_ztx(struct ListMap *pools)
+{
+    return pools->ztx;
+}
+
+
+/**
+ * Pin the loop's current set of pools, and its context, for as long as something dials
+ * through them; a reload only frees them once every pin is released.  Taken under the lock
+ * the reload swaps loop->pools with, so that no pin lands on a set already being drained.
+ */
+struct ListMap *
+ngx_http_ziti_pools_acquire(ngx_http_ziti_loop_t *loop)
+{
+    struct ListMap              *pools;
+
+    uv_mutex_lock(&loop->pools_lock);
+
+    pools = loop->pools;
+    ngx_atomic_fetch_add(&pools->refs, 1);
+
+    uv_mutex_unlock(&loop->pools_lock);
+
+    return pools;
+}
+
+
+void
+ngx_http_ziti_pools_release(struct ListMap *pools)
+{
+    ngx_atomic_fetch_add(&pools->refs, -1);
+}
+
+
+/**
+ * Non-zero while requests are still pinned to a set of pools, or any of its clients is in use
+ */
+ngx_uint_t
+ngx_http_ziti_pools_busy(struct ListMap *pools)
+{
+    struct ListMap              *clientListMap;
+    HttpsClient                 *httpsClient;
+    ngx_uint_t                   busy;
+
+    busy = pools->refs;
+
+    uv_mutex_lock(&client_pool_lock);
+
+    for (size_t i = 0; i < pools->count; i++) {
+
+        clientListMap = pools->kvPairs[i].value;
+
+        for (size_t n = 0; n < clientListMap->count; n++) {
+            httpsClient = clientListMap->kvPairs[n].value;
+            busy += httpsClient->active;
+        }
+    }
+
+    uv_mutex_unlock(&client_pool_lock);
+
+    return busy;
+}
+
+
+static void
+ngx_http_ziti_client_close_cb(um_http_t *clt)
+{
+    HttpsClient *httpsClient = (HttpsClient *) ((u_char *) clt - offsetof(HttpsClient, client));
+
+    ngx_free(httpsClient);
+}
+
+
+static void
+ngx_http_ziti_pool_close_cb(uv_handle_t *handle)
+{
+    struct ListMap *clientListMap = handle->data;
+
+    free(clientListMap->servicename);
+    free(clientListMap->scheme_host_port);
+    ngx_free(clientListMap);
+}
+
+
+/**
+ * Close every client of a drained set of pools and free it.  Runs on the loop thread.
+ */
+void
+ngx_http_ziti_pools_free(struct ListMap *pools)
+{
+    struct ListMap              *clientListMap;
+    HttpsClient                 *httpsClient;
+
+    for (size_t i = 0; i < pools->count; i++) {
+
+        clientListMap = pools->kvPairs[i].value;
+
+        ngx_http_ziti_stat_add(clientListMap->stats, pool_size, -(ngx_atomic_int_t) clientListMap->count);
+
+        for (size_t n = 0; n < clientListMap->count; n++) {
+            httpsClient = clientListMap->kvPairs[n].value;
+
+            if (httpsClient->purge) {
+                ngx_http_ziti_stat_add(clientListMap->stats, purged, -1);
+            }
+
+            um_http_close(&httpsClient->client, ngx_http_ziti_client_close_cb);
+            free(clientListMap->kvPairs[n].key);
+        }
+
+        uv_sem_destroy(&clientListMap->sem);
+
+#if (NGX_HTTP_ZITI_HAVE_NGHTTP2)
+        if (clientListMap->h2) {
+            ngx_http_ziti_h2_pool_free(clientListMap->h2);
+        }
+#endif
+
+        if (clientListMap->h1) {
+            ngx_http_ziti_h1_pool_free(clientListMap->h1);
+        }
+
+        if (clientListMap->maint_started) {
+            uv_close((uv_handle_t *) &clientListMap->maint_timer, ngx_http_ziti_pool_close_cb);
+        } else {
+            clientListMap->maint_timer.data = clientListMap;
+            ngx_http_ziti_pool_close_cb((uv_handle_t *) &clientListMap->maint_timer);
+        }
+
+        free(pools->kvPairs[i].key);
+    }
+
+    ngx_free(pools);
+}
+
+
+/**
+ * Build the pools for every service a location routes to, as soon as the loop's Ziti context is
+ * up, so that the first requests find them ready.  Runs on the loop thread.
+ */
+void
+ngx_http_ziti_pool_prewarm(ngx_http_ziti_loop_t *loop, struct ListMap *pools, ngx_http_ziti_loc_conf_t *zlcf, ngx_log_t *log)
+{
+    struct ListMap              *clientListMap;
+    char                       **names;
+    ngx_uint_t                   i;
+
+    names = zlcf->servicenames->elts;
+
+    for (i = 0; i < zlcf->servicenames->nelts; i++) {
+
+        if (ngx_http_ziti_pool_get(pools, zlcf, names[i]) != NULL) {
+            continue;
+        }
+
+        clientListMap = ngx_http_ziti_pool_create(loop, pools, zlcf, names[i], log);
+
+        ngx_http_ziti_pool_maint_start(clientListMap);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "ziti: pre-warmed pool for service \"%s\" on loop %d", names[i], loop->index);
+    }
+}
+
+
+/**
+ * The client pool of the request's current service, created on first use.  Runs on the loop thread.
+ */
+static struct ListMap *
+ngx_http_ziti_pool_current(ngx_http_ziti_request_ctx_t *request_ctx)
+{
+    ngx_http_request_t          *r = request_ctx->r;
+    ngx_http_ziti_loc_conf_t    *zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
+    struct ListMap              *clientListMap;
+
+    clientListMap = ngx_http_ziti_pool_get(request_ctx->pools, zlcf, request_ctx->servicename);
+
+    if (clientListMap == NULL) {
+        clientListMap = ngx_http_ziti_pool_create(request_ctx->loop, request_ctx->pools, zlcf,
+                                                  request_ctx->servicename, r->connection->log);
+    }
+
+    return clientListMap;
+}
+
+
+/**
+ * Where the ziti_http_version 2 connections of the request's current service are kept: next to
+ * its client pool, which also holds its circuit breaker and counters.  Runs on the loop thread.
+ */
+void **
+ngx_http_ziti_pool_h2(ngx_http_ziti_request_ctx_t *request_ctx)
+{
+    return &ngx_http_ziti_pool_current(request_ctx)->h2;
+}
+
+
+/**
+ * Likewise for the ziti_http_engine native connections
+ */
+void **
+ngx_http_ziti_pool_h1(ngx_http_ziti_request_ctx_t *request_ctx)
+{
+    return &ngx_http_ziti_pool_current(request_ctx)->h1;
+}
+
+
+/**
+ * 
+ */
+static void allocate_client(uv_work_t* req) 
+{
+    HttpsReq                    *httpsReq = (HttpsReq*)req->data;
+    ngx_http_ziti_request_ctx_t *request_ctx = httpsReq->request_ctx;
+    ngx_http_request_t          *r = request_ctx->r;
+    ngx_http_ziti_loc_conf_t    *zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
+    uint64_t                     start;
+    ngx_uint_t                   owed;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "allocate_client() entered, uv_work_t is: %p, httpsReq is: %p", req, httpsReq);
+
+    struct ListMap* clientListMap = ngx_http_ziti_pool_get(request_ctx->pools, zlcf, httpsReq->servicename);
+
+    if (NULL == clientListMap) {
+        // Pools are only built on the loop thread, which on_client() does before checking out again
+        httpsReq->httpsClient = NULL;
+        return;
+    }
+
+    ngx_http_ziti_stat_add(clientListMap->stats, waiting, 1);
+    ngx_http_ziti_probe2(checkout__start, r, httpsReq->servicename);
+    start = uv_hrtime();
+
+    for ( ;; ) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "----------> acquiring sem");
+        uv_sem_wait(&(clientListMap->sem));
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "----------> successfully acquired sem");
+
+        httpsReq->httpsClient = getHttpsClientForKey(clientListMap, request_ctx->scheme_host_port, r, false);
+
+        if (httpsReq->httpsClient != NULL) {
+            break;
+        }
+
+        // The slot was taken before a client purged meanwhile could retire it: retire it now and wait for another
+        uv_mutex_lock(&client_pool_lock);
+
+        owed = clientListMap->retire;
+
+        if (owed) {
+            clientListMap->retire--;
+        }
+
+        uv_mutex_unlock(&client_pool_lock);
+
+        if (!owed) {
+            break;
+        }
+    }
+
+    ngx_http_ziti_stat_add(clientListMap->stats, waiting, -1);
+
+    start = uv_hrtime() - start;
+
+    request_ctx->pool_wait += start;
+
+    if (clientListMap->stats) {
+        ngx_http_ziti_hist_add(&clientListMap->stats->checkout, (ngx_msec_t) (start / 1000000));
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "----------> client is: [%p]", httpsReq->httpsClient);
+
+    ngx_http_ziti_probe4(checkout__done, r, httpsReq->servicename, start, httpsReq->httpsClient);
+
+    if (NULL == httpsReq->httpsClient) {
+        // Broken clients are rebuilt on the uv loop thread, see on_client()
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "----------> client is NULL, pool maintenance has not caught up with purged clients");
+    }
+}
+
+
+/**
+ * Create a new attempt for the request, routed to the service currently selected for it
+ */
+HttpsReq *
+ngx_http_ziti_attempt_create(ngx_http_ziti_request_ctx_t *request_ctx)
+{
+    HttpsReq   *httpsReq;
+
+    httpsReq = (HttpsReq*) ngx_pcalloc(request_ctx->pool, sizeof(HttpsReq));
+    if (httpsReq == NULL) {
+        return NULL;
+    }
+
+    httpsReq->request_ctx = request_ctx;
+    httpsReq->servicename = request_ctx->servicename;
+    httpsReq->uv_req.data = httpsReq;
+
+    httpsReq->next = request_ctx->attempts;
+    request_ctx->attempts = httpsReq;
+    request_ctx->inflight++;
+
+    return httpsReq;
+}
+
+
+/**
+ * Return the client used by an attempt back to its pool.  A purged client is
+ * replaced with a fresh one the next time the pool runs dry.
+ */
+static void
+ngx_http_ziti_release_client(HttpsReq *httpsReq, bool purge)
+{
+    ngx_http_ziti_request_ctx_t *request_ctx = httpsReq->request_ctx;
+    ngx_http_request_t          *r = request_ctx->r;
+    struct ListMap              *clientListMap;
+    ngx_uint_t                   slots;
+    bool                         idle;
+
+    if (httpsReq->released) {
+        return;
+    }
+
+    httpsReq->released = 1;
+    request_ctx->inflight--;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "<--------- returning httpsClient [%p] back to pool, purge: [%d]", httpsReq->httpsClient, purge);
+
+    clientListMap = ngx_http_ziti_pool_get(request_ctx->pools, ngx_http_get_module_loc_conf(r, ngx_http_ziti_module),
+                                           httpsReq->servicename);
+
+    slots = 1;
+
+    if (httpsReq->httpsClient) {
+
+        uv_mutex_lock(&client_pool_lock);
+
+        if (httpsReq->httpsClient->exclusive) {
+            slots = clientListMap->zlcf->client_requests;
+        }
+
+        if (purge && !httpsReq->httpsClient->purge) {
+            // Before we fully release this client (via uv_sem_post) let's indicate purge is needed, because after errs happen on a client, 
+            // subsequent requests using that client never get processed.
+            httpsReq->httpsClient->purge = true;
+            ngx_http_ziti_pool_retire(clientListMap);
+            ngx_http_ziti_stat_add(clientListMap->stats, purged, 1);
+            ngx_http_ziti_probe3(client__purge, httpsReq->servicename, httpsReq->httpsClient, httpsReq->httpsClient->slot);
+        }
+
+        idle = (--httpsReq->httpsClient->active == 0);
+
+        if (idle) {
+            httpsReq->httpsClient->exclusive = false;
+        }
+
+        uv_mutex_unlock(&client_pool_lock);
+
+        if (idle) {
+            ngx_http_ziti_stat_add(clientListMap->stats, active, -1);
+        }
+    }
+
+    if (purge && httpsReq->httpsClient) {
+        ngx_http_ziti_pool_maint_kick(clientListMap);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "<-------- returning sem for client: [%p] ", httpsReq->httpsClient);
+    ngx_http_ziti_pool_post(clientListMap, slots);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "          after returning sem for client: [%p] ", httpsReq->httpsClient);
+}
+
+
+/**
+ * Take an idle client from the service's pool without blocking.  Used for hedges, which
+ * only ever run on spare pool capacity.
+ */
+static HttpsClient *
+ngx_http_ziti_try_allocate_client(ngx_http_ziti_request_ctx_t *request_ctx, char *servicename)
+{
+    struct ListMap              *clientListMap;
+    HttpsClient                 *httpsClient;
+
+    clientListMap = ngx_http_ziti_pool_get(request_ctx->pools,
+                                           ngx_http_get_module_loc_conf(request_ctx->r, ngx_http_ziti_module),
+                                           servicename);
+    if (clientListMap == NULL) {
+        return NULL;
+    }
+
+    // a hedge queued behind another request would gain nothing, and a losing one is cancelled
+    // along with its connection, so it takes an idle client all to itself
+    if (!ngx_http_ziti_pool_trywait(clientListMap, clientListMap->zlcf->client_requests)) {
+        return NULL;
+    }
+
+    httpsClient = getHttpsClientForKey(clientListMap, request_ctx->scheme_host_port, request_ctx->r, true);
+    if (httpsClient == NULL) {
+        ngx_http_ziti_pool_post(clientListMap, clientListMap->zlcf->client_requests);
+    }
+
+    return httpsClient;
+}
+
+
+/**
+ * Return the circuit breaker guarding the given service in a set of pools, or NULL if no request has
+ * been routed to it yet (its pool, and thus its breaker, does not exist until then).
+ */
+static ngx_http_ziti_breaker_t *
+ngx_http_ziti_breaker_get(ngx_http_ziti_loc_conf_t *zlcf, struct ListMap *pools, char *servicename)
+{
+    struct ListMap              *clientListMap;
+
+    clientListMap = ngx_http_ziti_pool_get(pools, zlcf, servicename);
+    if (clientListMap == NULL) {
+        return NULL;
+    }
+
+    return &clientListMap->breaker;
+}
+
+
+/**
+ * Return the ziti_shared_zone counters of the given service in a set of pools, or NULL
+ */
+static ngx_http_ziti_shm_stats_t *
+ngx_http_ziti_stats_get(struct ListMap *pools, char *servicename)
+{
+    struct ListMap              *clientListMap;
+
+    clientListMap = ngx_http_ziti_pool_get(pools, NULL, servicename);
+    if (clientListMap == NULL) {
+        return NULL;
+    }
+
+    return clientListMap->stats;
+}
+
+
+/**
+ * Decide, on the nginx thread, whether a new request may be routed to the service.  While the
+ * breaker is open requests are refused outright; once the open period has elapsed it turns
+ * half-open and lets through up to "probes" requests at a time, flagged via *probe.
+ */
+static ngx_int_t
+ngx_http_ziti_breaker_allow(ngx_http_ziti_loc_conf_t *zlcf, struct ListMap *pools, char *servicename, ngx_uint_t *probe)
+{
+    ngx_http_ziti_breaker_t     *breaker;
+    ngx_atomic_uint_t            opened_at;
+
+    *probe = 0;
+
+    if (zlcf->breaker_errors == 0) {
+        return NGX_OK;
+    }
+
+    breaker = ngx_http_ziti_breaker_get(zlcf, pools, servicename);
+    if (breaker == NULL) {
+        return NGX_OK;
+    }
+
+    switch (breaker->state) {
+
+    case ZS_BREAKER_CLOSED:
+        return NGX_OK;
+
+    case ZS_BREAKER_OPEN:
+        opened_at = breaker->opened_at;
+
+        if (ngx_current_msec - opened_at < zlcf->breaker_open_time) {
+            return NGX_DECLINED;
+        }
+
+        //
+        // Whoever moves opened_at on owns the transition.  The probe counters are reset before
+        // the state lets probes through, so no probe is counted against the previous ones.
+        //
+        if (ngx_atomic_cmp_set(&breaker->opened_at, opened_at, ngx_current_msec)) {
+            breaker->successes = 0;
+            breaker->probes = 0;
+
+            ngx_memory_barrier();
+
+            if (ngx_atomic_cmp_set(&breaker->state, ZS_BREAKER_OPEN, ZS_BREAKER_HALF_OPEN)) {
+                ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0, "ziti: circuit breaker for service \"%s\" half-open, probing", servicename);
+            }
+        }
+
+        if (breaker->state != ZS_BREAKER_HALF_OPEN) {
+            return (breaker->state == ZS_BREAKER_CLOSED) ? NGX_OK : NGX_DECLINED;
+        }
+
+        /* fall through */
+
+    default: /* ZS_BREAKER_HALF_OPEN */
+
+        //
+        // Probes that never reported back (e.g. the client went away) must not wedge the breaker;
+        // the same opened_at handoff decides who resets them
+        //
+        opened_at = breaker->opened_at;
+
+        if (breaker->probes >= zlcf->breaker_probes
+            && ngx_current_msec - opened_at >= zlcf->breaker_open_time
+            && ngx_atomic_cmp_set(&breaker->opened_at, opened_at, ngx_current_msec))
+        {
+            breaker->probes = 0;
+        }
+
+        if ((ngx_uint_t) ngx_atomic_fetch_add(&breaker->probes, 1) >= zlcf->breaker_probes) {
+            ngx_atomic_fetch_add(&breaker->probes, -1);
+            return NGX_DECLINED;
+        }
+
+        *probe = 1;
+        return NGX_OK;
+    }
+}
+
+
+/**
+ * Cheap check, from either thread, whether the service's breaker is refusing requests
+ */
+static ngx_uint_t
+ngx_http_ziti_breaker_is_open(ngx_http_ziti_loc_conf_t *zlcf, struct ListMap *pools, char *servicename)
+{
+    ngx_http_ziti_breaker_t     *breaker;
+
+    if (zlcf->breaker_errors == 0) {
+        return 0;
+    }
+
+    breaker = ngx_http_ziti_breaker_get(zlcf, pools, servicename);
+
+    return breaker != NULL && breaker->state != ZS_BREAKER_CLOSED;
+}
+
+
+/**
+ * Feed the outcome of an attempt into its service's breaker.  Runs on the uv loop thread.
+ *
+ * An attempt counts as failed when it got no response at all, when the service answered
+ * 502/503/504, or when the response headers took longer than the configured latency.
+ */
+void
+ngx_http_ziti_breaker_record(HttpsReq *httpsReq, int code)
+{
+    ngx_http_ziti_request_ctx_t *request_ctx = httpsReq->request_ctx;
+    ngx_http_request_t          *r = request_ctx->r;
+    ngx_http_ziti_loc_conf_t    *zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
+    ngx_http_ziti_breaker_t     *breaker;
+    ngx_uint_t                   failed, probe;
+    ngx_atomic_uint_t            probes;
+    ngx_msec_t                   now;
+
+    if (zlcf->breaker_errors == 0) {
+        return;
+    }
+
+    breaker = ngx_http_ziti_breaker_get(zlcf, request_ctx->pools, httpsReq->servicename);
+    if (breaker == NULL) {
+        return;
+    }
+
+    probe = request_ctx->probe;
+    request_ctx->probe = 0;
+
+    failed = (code < 0
+              || code == NGX_HTTP_BAD_GATEWAY
+              || code == NGX_HTTP_SERVICE_UNAVAILABLE
+              || code == NGX_HTTP_GATEWAY_TIME_OUT);
+
+    if (!failed && zlcf->breaker_latency && httpsReq->start
+        && uv_now(request_ctx->loop->uv_thread_loop) - httpsReq->start > zlcf->breaker_latency)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ziti_circuit_breaker: slow response from service \"%s\"", httpsReq->servicename);
+        failed = 1;
+    }
+
+    now = ngx_current_msec;
+
+    switch (breaker->state) {
+
+    case ZS_BREAKER_HALF_OPEN:
+        if (!probe) {   // a straggler from before the breaker opened
+            return;
+        }
+
+        // never below 0: the nginx thread may have written off this probe as lost already
+        for ( ;; ) {
+            probes = breaker->probes;
+
+            if (probes == 0 || ngx_atomic_cmp_set(&breaker->probes, probes, probes - 1)) {
+                break;
+            }
+        }
+
+        if (failed) {
+            // opened_at first: whoever sees the breaker open must also see when it opened
+            breaker->opened_at = now;
+
+            ngx_memory_barrier();
+
+            if (ngx_atomic_cmp_set(&breaker->state, ZS_BREAKER_HALF_OPEN, ZS_BREAKER_OPEN)) {
+                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ziti: circuit breaker for service \"%s\" probe failed, re-opened", httpsReq->servicename);
+            }
+            return;
+        }
+
+        if ((ngx_uint_t) ngx_atomic_fetch_add(&breaker->successes, 1) + 1 >= zlcf->breaker_probes) {
+            breaker->window_start = now;
+            breaker->requests = 0;
+            breaker->failures = 0;
+
+            if (ngx_atomic_cmp_set(&breaker->state, ZS_BREAKER_HALF_OPEN, ZS_BREAKER_CLOSED)) {
+                ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0, "ziti: circuit breaker for service \"%s\" closed", httpsReq->servicename);
+            }
+        }
+        return;
+
+    case ZS_BREAKER_OPEN:
+        return;
+
+    default: /* ZS_BREAKER_CLOSED */
+        break;
+    }
+
+    if (now - breaker->window_start >= zlcf->breaker_window) {
+        breaker->window_start = now;
+        breaker->requests = 0;
+        breaker->failures = 0;
+    }
+
+    ngx_atomic_fetch_add(&breaker->requests, 1);
+
+    if (!failed) {
+        return;
+    }
+
+    ngx_atomic_fetch_add(&breaker->failures, 1);
+
+    if (breaker->requests < zlcf->breaker_min_requests
+        || breaker->failures * 100 < breaker->requests * zlcf->breaker_errors)
+    {
+        return;
+    }
+
+    breaker->opened_at = now;
+
+    ngx_memory_barrier();
+
+    if (ngx_atomic_cmp_set(&breaker->state, ZS_BREAKER_CLOSED, ZS_BREAKER_OPEN)) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "ziti: circuit breaker for service \"%s\" opened, %ui of %ui requests failed",
+                      httpsReq->servicename, (ngx_uint_t) breaker->failures, (ngx_uint_t) breaker->requests);
+    }
+}
+
+
+/**
+ * 
+ */
+void propagate_headers_to_request(um_http_req_t *ur, ngx_http_request_t *r) {
+    ngx_list_part_t            *part;
+    ngx_table_elt_t            *h;
+    ngx_uint_t                  i;
+
+    // Get the first part of the list. There is usual only one part.
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    // Headers list array may consist of more than one part, so loop through all of it
+    for (i = 0; /* void */ ; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                /* The last part, we're done. */
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        // hop-by-hop: the pooled client keeps its own connection to the service, and Upgrade
+        // requests only switch protocols over ziti_upgrade.  A chunked body has been read in
+        // full by now, and goes out with its length instead.
+        if ((h[i].key.len == sizeof("Connection") - 1
+             && ngx_strncasecmp(h[i].key.data, (u_char *) "Connection", h[i].key.len) == 0)
+            || (h[i].key.len == sizeof("Upgrade") - 1
+                && ngx_strncasecmp(h[i].key.data, (u_char *) "Upgrade", h[i].key.len) == 0)
+            || (h[i].key.len == sizeof("Transfer-Encoding") - 1
+                && ngx_strncasecmp(h[i].key.data, (u_char *) "Transfer-Encoding", h[i].key.len) == 0))
+        {
+            continue;
+        }
+
+        um_http_req_header(ur, (char*)h[i].key.data, (char*)h[i].value.data);
+        
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "added header to um_http_req_t: '%s:%s'", h[i].key.data, h[i].value.data);
+    }
+
+    if (r->headers_in.chunked && r->request_body) {
+        ngx_http_ziti_request_ctx_t *request_ctx = ngx_http_get_module_ctx(r, ngx_http_ziti_module);
+        ngx_chain_t                 *cl;
+        off_t                        len = 0;
+        u_char                      *value;
+
+        for (cl = r->request_body->bufs; cl; cl = cl->next) {
+            len += ngx_buf_size(cl->buf);
+        }
+
+        value = ngx_pnalloc(request_ctx->pool, NGX_OFF_T_LEN + 1);
+        if (value != NULL) {
+            ngx_sprintf(value, "%O%Z", len);
+            um_http_req_header(ur, "Content-Length", (char *) value);
+        }
+    }
+}
+
+
+static void
+ngx_http_ziti_req_complete_func(void *data, ngx_log_t *log)
+{
+    /* this function is executed in a thread from the ziti thread_pool */
+
+    //
+    // This function is a nop.
+    // It's only purpose is to terminate and cause the
+    //  ngx_http_ziti_req_thread_completion func to run over on the Nginx thread loop
+    //
+}
+
+
+static void
+ngx_http_ziti_req_thread_completion(ngx_event_t *ev)
+{
+    ngx_http_ziti_req_complete_thread_ctx_t *req_complete_thread_ctx = ev->data;
+    ngx_http_request_t                      *r = req_complete_thread_ctx->r;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_req_thread_completion() entered, r: %p", r);
+
+    /* this function is executed in nginx event loop */
+
+    // Cause a re-drive of our main request handler so it can transmit the now-completed response
+    r->blocked--;
+    r->aio = 0;
+
+    req_complete_thread_ctx->request_ctx->state = ZS_RESP_BODY_DONE;
+
+    ngx_http_handler(r);
+}
+
+
+/**
+ * Launch thread that will kick the Nginx threadloop once the response is complete
+ */
+static void
+ngx_http_ziti_post_req_complete(ngx_http_ziti_request_ctx_t *request_ctx)
+{
+    ngx_http_request_t                      *r = request_ctx->r;
+    ngx_thread_task_t                       *task_ReqComplete;
+    ngx_thread_pool_t                       *tp;
+
+    request_ctx->t_done = uv_hrtime();
+
+    task_ReqComplete = request_ctx->done_task;
+
+    tp = ngx_thread_pool_get((ngx_cycle_t* ) ngx_cycle, &ngx_http_ziti_thread_pool_name);
+    if (tp == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_post_req_complete: ngx_thread_pool_get failed");
+        return;
+    }
+
+    if (ngx_thread_task_post(tp, task_ReqComplete) != NGX_OK) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_post_req_complete: ngx_thread_task_post failed");
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_post_req_complete: started thread for ngx_http_ziti_req_complete_func()");
+}
+
+
+/**
+ * 
+ */
+static ngx_int_t
+ngx_http_ziti_get_buf(ngx_http_request_t *r, ngx_http_ziti_request_ctx_t *request_ctx, ssize_t len, ngx_buf_t **out_buf)
+{
+    ngx_buf_t *buf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_get_buf() entered, len: %d", len);
+
+    buf = ngx_create_temp_buf(request_ctx->pool, len);
+
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    buf->tag = (ngx_buf_tag_t) &ngx_http_ziti_module;
+    buf->recycled = 1;
+
+    *out_buf = buf;
+
+    return NGX_OK;
+}
+
+
+/**
+ * 
+ */
+static ngx_int_t
+ngx_http_ziti_submit_mem(ngx_http_request_t *r, ngx_http_ziti_request_ctx_t *request_ctx, ngx_buf_t *out_buf)
+{
+    ngx_chain_t     *cl;
+    ngx_chain_t     *existing_cl;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_submit_mem() entered, r: %p, len: %d", r, (int)(out_buf->last - out_buf->pos));
+
+
+    if (request_ctx->out_bufs == NULL) {    // if no queued bufs
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_submit_mem() allocating new chain of out_bufs");
+
+        cl = ngx_alloc_chain_link(request_ctx->pool);
+        if (cl == NULL) {
+            goto failed;
+        }
+
+        cl->buf = out_buf;
+        cl->next = NULL;
+
+        out_buf->last_buf = 1;
+
+        request_ctx->out_bufs = cl;
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_submit_mem() attaching out_buf to new chain");
+
+    } else {
+
+        cl = ngx_alloc_chain_link(request_ctx->pool);
+        if (cl == NULL) {
+            goto failed;
+        }
+
+        cl->buf = out_buf;
+        cl->next = NULL;
+
+        out_buf->last_buf = 1;
+
+        existing_cl = request_ctx->out_bufs;
+
+        while (existing_cl->next) {
+            existing_cl = existing_cl->next;
+        }
+
+        existing_cl->next = cl;
+        existing_cl->buf->last_buf = 0;
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_submit_mem() attaching out_buf to existing chain");
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_submit_mem() exiting");
+
+
+    return NGX_OK;
+
+failed:
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_submit_mem() exiting with ERROR");
+
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_ziti_resp_chunk_func(void *data, ngx_log_t *log)
+{
+    /* this function is executed in a thread from the ziti thread_pool */
+
+    //
+    // This function is a nop.
+    // It's only purpose is to terminate and cause the
+    //  ngx_http_ziti_resp_header_transmit_thread_completion func to run over on the Nginx thread loop
+    //
+}
+
+
+static void
 ngx_http_ziti_resp_chunk_thread_completion(ngx_event_t *ev)
 {
     ngx_http_ziti_resp_chunk_thread_ctx_t *resp_chunk_thread_ctx = ev->data;
@@ -431,128 +1542,135 @@ ngx_http_ziti_resp_chunk_thread_completion(ngx_event_t *ev)
 
 
 /**
- * 
+ * Queue a piece of the response body for the nginx thread, and wake it up unless a wakeup is
+ * already pending.  Runs on the uv loop thread.
  */
-void 
-on_resp_body(um_http_req_t *req, const char *body, ssize_t len) 
+ngx_int_t
+ngx_http_ziti_resp_chunk(ngx_http_ziti_request_ctx_t *request_ctx, u_char *data, size_t len)
 {
-    ngx_http_ziti_request_ctx_t *request_ctx = (ngx_http_ziti_request_ctx_t*)req->data;
     ngx_http_request_t          *r = request_ctx->r;
-    ngx_http_ziti_loc_conf_t    *zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
-    ngx_http_ziti_resp_chunk_thread_ctx_t *resp_chunk_thread_ctx;
-    ngx_thread_task_t           *task_RespChunk;
-    ngx_http_ziti_req_complete_thread_ctx_t  *req_complete_thread_ctx;
-    ngx_thread_task_t           *task_ReqComplete;
     ngx_thread_pool_t           *tp;
     ngx_buf_t                   *out_buf;
     ngx_int_t                    rc;
+    ngx_uint_t                   post;
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp_body() entered, body: %p, len: %d, httpsClient: %p", body, len, request_ctx->httpsClient);
-
-    if (NULL != body) 
-    {
-        /* acquire lock */
-        uv_sem_wait(&(request_ctx->out_bufs_sem));
+    /* acquire lock */
+    uv_sem_wait(&(request_ctx->out_bufs_sem));
 
-        /* alloc buffer */
-        rc = ngx_http_ziti_get_buf(r, request_ctx, len, &out_buf);
-        if (rc != NGX_OK) {
-            ZITI_LOG(ERROR, "ngx_http_ziti_get_buf() returned %d", rc);
-            return;
-        }
+    /* alloc buffer */
+    rc = ngx_http_ziti_get_buf(r, request_ctx, len, &out_buf);
 
+    if (rc == NGX_OK) {
         /* fill in the buffer */
-        out_buf->last = ngx_copy(out_buf->start, body, (uint32_t) len);
+        out_buf->last = ngx_copy(out_buf->start, data, len);
 
-        if ((ssize_t) (out_buf->last - out_buf->pos) != len) {
-            ZITI_LOG(DEBUG, "len %d", (int) len);
+        /* queue buffer for transmit */
+        rc = ngx_http_ziti_submit_mem(r, request_ctx, out_buf);
+    }
 
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ziti: FATAL: output on_resp_body buffer error");
-            return;
-        }
+    // one wakeup flushes every buffer queued by then, so only post one if none is pending
+    post = (rc == NGX_OK && !request_ctx->chunk_posted);
 
-        /* queue buffer for transmit */
-        ngx_http_ziti_submit_mem(r, request_ctx, out_buf);
+    if (post) {
+        request_ctx->chunk_posted = 1;
+    }
 
-        /* release lock */
-        uv_sem_post(&(request_ctx->out_bufs_sem));
+    /* release lock */
+    uv_sem_post(&(request_ctx->out_bufs_sem));
 
-        // ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp_body() body: %s", body);
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-        //
-        // Launch thread that will kick the Nginx threadloop
-        //
-        task_RespChunk = ngx_thread_task_alloc(zlcf->pool, sizeof(ngx_http_ziti_resp_chunk_thread_ctx_t));
-        if (task_RespChunk == NULL) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp_body: ngx_thread_task_alloc failed");
-            return;
-        }
-        resp_chunk_thread_ctx = task_RespChunk->ctx;
-        resp_chunk_thread_ctx->r = r;
-        resp_chunk_thread_ctx->request_ctx = request_ctx;
-        resp_chunk_thread_ctx->zlcf = zlcf;
+    if (!post) {
+        return NGX_OK;
+    }
+
+    //
+    // Launch thread that will kick the Nginx threadloop
+    //
+    tp = ngx_thread_pool_get((ngx_cycle_t* ) ngx_cycle, &ngx_http_ziti_thread_pool_name);
+    if (tp == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_resp_chunk: ngx_thread_pool_get failed");
+        return NGX_OK;
+    }
 
-        task_RespChunk->handler = ngx_http_ziti_resp_chunk_func;
-        task_RespChunk->event.handler = ngx_http_ziti_resp_chunk_thread_completion;
-        task_RespChunk->event.data = resp_chunk_thread_ctx;
+    if (ngx_thread_task_post(tp, request_ctx->chunk_task) != NGX_OK) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_resp_chunk: ngx_thread_task_post failed");
+        return NGX_OK;
+    }
 
-        tp = ngx_thread_pool_get((ngx_cycle_t* ) ngx_cycle, &ngx_http_ziti_thread_pool_name);
-        if (tp == NULL) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp_body: ngx_thread_pool_get failed");
-            return;
-        }
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_resp_chunk: started thread for ngx_http_ziti_resp_chunk_func()");
 
-        if (ngx_thread_task_post(tp, task_RespChunk) != NGX_OK) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp_body: ngx_thread_task_post failed");
-            return;
-        }
+    return NGX_OK;
+}
+
+
+/**
+ * The response broke off after its header went out, or its body could not be queued.  All that
+ * is left is to drop the client connection, so that it sees a truncated response rather than
+ * waiting on one that never ends; the Ziti client is purged, as it may be mid-stream.
+ */
+static void
+ngx_http_ziti_stream_error(HttpsReq *httpsReq, ssize_t status)
+{
+    ngx_http_ziti_request_ctx_t *request_ctx = httpsReq->request_ctx;
+
+    ngx_log_error(NGX_LOG_ERR, request_ctx->r->connection->log, 0, "ziti: response from service \"%s\" failed mid-stream (%s) after %O bytes",
+                  httpsReq->servicename, status < 0 ? uv_strerror((int) status) : "out of memory", request_ctx->bytes_received);
+
+    ngx_http_ziti_stat_add(ngx_http_ziti_stats_get(request_ctx->pools, httpsReq->servicename), errors, 1);
+
+    // ignore whatever um_http still delivers for this attempt
+    httpsReq->cancelled = 1;
+
+    ngx_http_ziti_release_client(httpsReq, true);
+
+    ngx_http_ziti_fail_request(request_ctx, NGX_ERROR);
+}
+
+
+/**
+ * 
+ */
+void 
+on_resp_body(um_http_req_t *req, const char *body, ssize_t len) 
+{
+    HttpsReq                    *httpsReq = (HttpsReq*)req->data;
+    ngx_http_ziti_request_ctx_t *request_ctx = httpsReq->request_ctx;
+    ngx_http_request_t          *r = request_ctx->r;
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp_body: started thread for ngx_http_ziti_resp_chunk_func()");
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp_body() entered, body: %p, len: %d, httpsClient: %p", body, len, httpsReq->httpsClient);
 
+    if (httpsReq->cancelled) {  // a losing hedge being torn down, or a broken stream
+        return;
     }
 
-    else if ((NULL == body) && (UV_EOF == len)) 
+    if (NULL != body) 
     {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "<--------- returning httpsClient [%p] back to pool", request_ctx->httpsClient);
-        request_ctx->httpsClient->active = false;
+        ngx_http_ziti_probe2(body__chunk, r, len);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "request_ctx->scheme_host_port: [%s] ", request_ctx->scheme_host_port);
-        struct ListMap* clientListMap = getInnerListMapValueForKey(HttpsClientListMap, request_ctx->scheme_host_port);
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "clientListMap: [%p] ", clientListMap);
+        ngx_http_ziti_stat_add(ngx_http_ziti_stats_get(request_ctx->pools, httpsReq->servicename), bytes_out, len);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "<-------- returning sem for client: [%p] ", request_ctx->httpsClient);
-        uv_sem_post(&(clientListMap->sem));
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "          after returning sem for client: [%p] ", request_ctx->httpsClient);
+        request_ctx->bytes_received += len;
 
-        //
-        // Launch thread that will kick the Nginx threadloop
-        //
-        task_ReqComplete = ngx_thread_task_alloc(zlcf->pool, sizeof(ngx_http_ziti_req_complete_thread_ctx_t));
-        if (task_ReqComplete == NULL) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp_body: ngx_thread_task_alloc failed");
-            return;
+        if (ngx_http_ziti_resp_chunk(request_ctx, (u_char *) body, len) != NGX_OK) {
+            ngx_http_ziti_stream_error(httpsReq, 0);
         }
-        req_complete_thread_ctx = task_ReqComplete->ctx;
-        req_complete_thread_ctx->r = r;
-        req_complete_thread_ctx->request_ctx = request_ctx;
-        req_complete_thread_ctx->zlcf = zlcf;
+    }
 
-        task_ReqComplete->handler = ngx_http_ziti_req_complete_func;
-        task_ReqComplete->event.handler = ngx_http_ziti_req_thread_completion;
-        task_ReqComplete->event.data = req_complete_thread_ctx;
+    else if ((NULL == body) && (UV_EOF == len)) 
+    {
+        ngx_http_ziti_probe3(body__eof, r, request_ctx->bytes_received, uv_hrtime() - request_ctx->t_start);
 
-        tp = ngx_thread_pool_get((ngx_cycle_t* ) ngx_cycle, &ngx_http_ziti_thread_pool_name);
-        if (tp == NULL) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp_body: ngx_thread_pool_get failed");
-            return;
-        }
+        ngx_http_ziti_release_client(httpsReq, false);
 
-        if (ngx_thread_task_post(tp, task_ReqComplete) != NGX_OK) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp_body: ngx_thread_task_post failed");
-            return;
-        }
+        ngx_http_ziti_post_req_complete(request_ctx);
+    }
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp_body: started thread for ngx_http_ziti_req_complete_func()");
+    else if (len < 0)   // connection reset, Ziti service went away, ...
+    {
+        ngx_http_ziti_stream_error(httpsReq, len);
     }
 
 }
@@ -660,21 +1778,420 @@ ngx_http_ziti_resp_header_transmit_thread_completion(ngx_event_t *ev)
 }
 
 
+/**
+ * Map a um_http response code onto the ziti_next_upstream condition it represents (0 if none)
+ */
+static ngx_uint_t
+ngx_http_ziti_next_upstream_type(int code)
+{
+    switch (code) {
+
+    case UV_ETIMEDOUT:
+        return NGX_HTTP_UPSTREAM_FT_TIMEOUT;
+
+    case NGX_HTTP_INTERNAL_SERVER_ERROR:
+        return NGX_HTTP_UPSTREAM_FT_HTTP_500;
+
+    case NGX_HTTP_BAD_GATEWAY:
+        return NGX_HTTP_UPSTREAM_FT_HTTP_502;
+
+    case NGX_HTTP_SERVICE_UNAVAILABLE:
+        return NGX_HTTP_UPSTREAM_FT_HTTP_503;
+
+    case NGX_HTTP_GATEWAY_TIME_OUT:
+        return NGX_HTTP_UPSTREAM_FT_HTTP_504;
+
+    case NGX_HTTP_FORBIDDEN:
+        return NGX_HTTP_UPSTREAM_FT_HTTP_403;
+
+    case NGX_HTTP_NOT_FOUND:
+        return NGX_HTTP_UPSTREAM_FT_HTTP_404;
+
+    case NGX_HTTP_TOO_MANY_REQUESTS:
+        return NGX_HTTP_UPSTREAM_FT_HTTP_429;
+
+    default:
+        break;
+    }
+
+    if (code < 0) {     // dial failure, circuit broken, connection reset, ...
+        return NGX_HTTP_UPSTREAM_FT_ERROR;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Decide whether the failed attempt may be retried, and if so re-queue it on a fresh pooled
+ * client of the next service named on ziti_pass.  Returns NGX_DECLINED if the failure must be
+ * passed through to the client instead.
+ *
+ * Like proxy_next_upstream, non-idempotent requests (POST, LOCK, PATCH) are only retried when
+ * "non_idempotent" is set, or when the failure happened before any of the request body was
+ * written.  Bodyless non-idempotent requests are never retried since we cannot tell whether
+ * they reached the service.
+ */
+static ngx_int_t
+ngx_http_ziti_next_upstream(HttpsReq *httpsReq, ngx_uint_t ft_type)
+{
+    ngx_http_ziti_request_ctx_t *request_ctx = httpsReq->request_ctx;
+    ngx_http_request_t          *r = request_ctx->r;
+    ngx_http_ziti_loc_conf_t    *zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
+    ngx_uint_t                   connect_failure, n;
+
+    if (ft_type == 0 || !(zlcf->next_upstream & ft_type)) {
+        return NGX_DECLINED;
+    }
+
+    if (request_ctx->tries >= zlcf->next_upstream_tries) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ziti_next_upstream: tries exhausted [%d]", request_ctx->tries);
+        return NGX_DECLINED;
+    }
+
+    for (n = 0; n < zlcf->servicenames->nelts; n++) {
+        if (!ngx_http_ziti_breaker_is_open(zlcf, request_ctx->pools, ((char **) zlcf->servicenames->elts)[n])) {
+            break;
+        }
+    }
+
+    if (n == zlcf->servicenames->nelts) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ziti_next_upstream: every service has an open circuit breaker");
+        return NGX_DECLINED;
+    }
+
+    connect_failure = ft_type & (NGX_HTTP_UPSTREAM_FT_ERROR|NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+
+    if ((r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH))
+        && !(zlcf->next_upstream & NGX_HTTP_UPSTREAM_FT_NON_IDEMPOTENT))
+    {
+        if (!connect_failure
+            || request_ctx->request_sent
+            || (r->headers_in.content_length_n <= 0 && !r->headers_in.chunked))
+        {
+            return NGX_DECLINED;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "ziti: service \"%s\" failed (%ui), retrying request, attempt %ui of %ui",
+                  request_ctx->servicename, ft_type, request_ctx->tries + 1, zlcf->next_upstream_tries);
+
+    ngx_http_ziti_stat_add(ngx_http_ziti_stats_get(request_ctx->pools, request_ctx->servicename), retries, 1);
+
+    // A client that saw a transport-level error is unusable; one that returned an HTTP status can be reused
+    ngx_http_ziti_release_client(httpsReq, connect_failure ? true : false);
+
+    //
+    // Move on to the next service whose circuit breaker is closed (possibly this same one again)
+    //
+    for (n = 0; n < zlcf->servicenames->nelts; n++) {
+        request_ctx->service_index = (request_ctx->service_index + 1) % zlcf->servicenames->nelts;
+        request_ctx->servicename = ((char **) zlcf->servicenames->elts)[request_ctx->service_index];
+
+        if (!ngx_http_ziti_breaker_is_open(zlcf, request_ctx->pools, request_ctx->servicename)) {
+            break;
+        }
+    }
+
+    httpsReq = ngx_http_ziti_attempt_create(request_ctx);
+    if (httpsReq == NULL) {
+        return NGX_DECLINED;
+    }
+
+    // counted now, so that ziti_next_upstream_tries bounds attempts that never got a client too
+    request_ctx->tries++;
+
+    // We are on the uv loop thread here, so the work item can be queued directly
+    request_ctx->pending_alloc++;
+    uv_queue_work(request_ctx->loop->uv_thread_loop, &httpsReq->uv_req, allocate_client, on_client);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_ziti_hedge_timer_close_cb(uv_handle_t *handle)
+{
+    ngx_free(handle);
+}
+
+
+/**
+ * Disarm the hedge timer, if any.  Must run on the uv loop thread.
+ */
+static void
+ngx_http_ziti_hedge_stop(ngx_http_ziti_request_ctx_t *request_ctx)
+{
+    if (request_ctx->hedge_timer == NULL) {
+        return;
+    }
+
+    uv_timer_stop(request_ctx->hedge_timer);
+    uv_close((uv_handle_t *) request_ctx->hedge_timer, ngx_http_ziti_hedge_timer_close_cb);
+
+    request_ctx->hedge_timer = NULL;
+}
+
+
+/**
+ * Bank hedge budget for one more eligible request, up to NGX_HTTP_ZITI_HEDGE_BURST hedges
+ */
+static void
+ngx_http_ziti_hedge_budget_add(ngx_http_ziti_loc_conf_t *zlcf)
+{
+    ngx_atomic_uint_t            credits, cap;
+
+    cap = NGX_HTTP_ZITI_HEDGE_BURST * 100;
+
+    for ( ;; ) {
+        credits = zlcf->hedge_credits;
+
+        if (credits >= cap) {
+            return;
+        }
+
+        if (ngx_atomic_cmp_set(&zlcf->hedge_credits, credits, ngx_min(credits + zlcf->hedge_rate, cap))) {
+            return;
+        }
+    }
+}
+
+
+/**
+ * Spend the budget for one hedge.  Returns 0 if the hedging rate cap has been reached.
+ */
+static ngx_uint_t
+ngx_http_ziti_hedge_budget_take(ngx_http_ziti_loc_conf_t *zlcf)
+{
+    ngx_atomic_uint_t            credits;
+
+    for ( ;; ) {
+        credits = zlcf->hedge_credits;
+
+        if (credits < 100) {
+            return 0;
+        }
+
+        if (ngx_atomic_cmp_set(&zlcf->hedge_credits, credits, credits - 100)) {
+            return 1;
+        }
+    }
+}
+
+
+/**
+ * The hedge delay expired without response headers; issue another attempt on an idle client
+ */
+static void
+ngx_http_ziti_hedge_timer_cb(uv_timer_t *timer)
+{
+    ngx_http_ziti_request_ctx_t *request_ctx = timer->data;
+    ngx_http_request_t          *r = request_ctx->r;
+    ngx_http_ziti_loc_conf_t    *zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
+    HttpsClient                 *httpsClient;
+    HttpsReq                    *httpsReq;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_hedge_timer_cb() entered, hedges: %d, inflight: %d", request_ctx->hedges, request_ctx->inflight);
+
+    if (request_ctx->winner != NULL || request_ctx->hedges >= zlcf->hedge_max) {
+        return;
+    }
+
+    //
+    // Never hedge while a retry is still waiting for a client; that one is already "another attempt"
+    //
+    if (request_ctx->pending_alloc == 0) {
+
+        if (!ngx_http_ziti_hedge_budget_take(zlcf)) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ziti_hedge: rate cap reached, not hedging");
+
+        } else if ((httpsClient = ngx_http_ziti_try_allocate_client(request_ctx, request_ctx->servicename)) == NULL) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ziti_hedge: no idle client, not hedging");
+
+            ngx_atomic_fetch_add(&zlcf->hedge_credits, 100);
+
+        } else {
+            httpsReq = ngx_http_ziti_attempt_create(request_ctx);
+            if (httpsReq == NULL) {
+                return;
+            }
+
+            httpsReq->hedge = 1;
+            httpsReq->httpsClient = httpsClient;
+            request_ctx->hedges++;
+
+            ngx_http_ziti_stat_add(ngx_http_ziti_stats_get(request_ctx->pools, request_ctx->servicename), hedges, 1);
+
+            ngx_http_ziti_send_request(httpsReq);
+        }
+    }
+
+    if (request_ctx->hedges < zlcf->hedge_max) {
+        uv_timer_start(timer, ngx_http_ziti_hedge_timer_cb, zlcf->hedge_after, 0);
+    }
+}
+
+
+/**
+ * The given attempt produced the response headers: it wins, every other attempt still in
+ * flight is cancelled and its client returned to the pool.
+ */
+static void
+ngx_http_ziti_hedge_settle(ngx_http_ziti_request_ctx_t *request_ctx, HttpsReq *winner)
+{
+    HttpsReq                    *httpsReq;
+
+    request_ctx->winner = winner;
+    request_ctx->httpsReq = winner;
+    request_ctx->httpsClient = winner->httpsClient;
+
+    ngx_http_ziti_hedge_stop(request_ctx);
+
+    for (httpsReq = request_ctx->attempts; httpsReq; httpsReq = httpsReq->next) {
+
+        if (httpsReq == winner || httpsReq->released) {
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request_ctx->r->connection->log, 0, "ziti_hedge: cancelling losing attempt [%p]", httpsReq);
+
+        httpsReq->cancelled = 1;
+
+        if (httpsReq->req) {
+            um_http_req_cancel(&(httpsReq->httpsClient->client), httpsReq->req);
+        }
+
+        ngx_http_ziti_release_client(httpsReq, true);
+    }
+}
+
+
+/**
+ * No attempt produced a response; finish the request with the given error status
+ */
+static void
+ngx_http_ziti_fail_request(ngx_http_ziti_request_ctx_t *request_ctx, ngx_int_t status)
+{
+    ngx_http_ziti_hedge_stop(request_ctx);
+
+    request_ctx->err = status;
+
+    ngx_http_ziti_post_req_complete(request_ctx);
+}
+
+
+/**
+ * The response headers are set on r: have the nginx thread send them.  Runs on the uv loop thread.
+ */
+void
+ngx_http_ziti_resp_header(ngx_http_ziti_request_ctx_t *request_ctx)
+{
+    ngx_http_request_t          *r = request_ctx->r;
+    ngx_thread_pool_t           *tp;
+
+    //
+    // Launch thread that will kick the Nginx threadloop
+    //
+    tp = ngx_thread_pool_get((ngx_cycle_t* ) ngx_cycle, &ngx_http_ziti_thread_pool_name);
+    if (tp == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_resp_header: ngx_thread_pool_get failed");
+        return;
+    }
+
+    if (ngx_thread_task_post(tp, request_ctx->header_task) != NGX_OK) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_resp_header: ngx_thread_task_post failed");
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_resp_header: started thread for ngx_http_ziti_resp_header_transmit_func()");
+}
+
+
+/**
+ * The response is complete, or failed with the given status before its header was sent (NGX_ERROR
+ * once it was).  Runs on the uv loop thread.
+ */
+void
+ngx_http_ziti_resp_done(ngx_http_ziti_request_ctx_t *request_ctx, ngx_int_t status)
+{
+    if (status) {
+        ngx_http_ziti_fail_request(request_ctx, status);
+        return;
+    }
+
+    ngx_http_ziti_post_req_complete(request_ctx);
+}
+
+
 /**
  * 
  */
 void 
 on_resp(um_http_resp_t *resp, void *data) 
 {
-    ngx_http_ziti_request_ctx_t *request_ctx = (ngx_http_ziti_request_ctx_t*)data;
+    HttpsReq                    *httpsReq = (HttpsReq*)data;
+    ngx_http_ziti_request_ctx_t *request_ctx = httpsReq->request_ctx;
     ngx_http_request_t          *r = request_ctx->r;
     ngx_http_ziti_loc_conf_t    *zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
     ngx_str_t                    key, value;
-    ngx_http_ziti_resp_header_transmit_thread_ctx_t *resp_header_transmit_thread_ctx;
-    ngx_thread_task_t           *task_transmitRespHeader;
-    ngx_thread_pool_t           *tp;
+    ngx_uint_t                   ft_type;
+    ngx_http_ziti_shm_stats_t   *stats;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp() entered for resp: %p, httpsReq: %p", resp, request_ctx->httpsReq);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp() entered for resp: %p, httpsReq: %p", resp, httpsReq);
+
+    if (httpsReq->cancelled) {  // a losing hedge being torn down by um_http_req_cancel
+        return;
+    }
+
+    ngx_http_ziti_probe3(response, r, resp->code, uv_hrtime() - httpsReq->sent);
+
+    ngx_http_ziti_breaker_record(httpsReq, resp->code);
+
+    stats = ngx_http_ziti_stats_get(request_ctx->pools, httpsReq->servicename);
+
+    if (resp->code < 0) {
+        ngx_http_ziti_stat_add(stats, errors, 1);
+
+    } else if (stats && httpsReq->start) {
+        ngx_http_ziti_hist_add(&stats->ttfb, (ngx_msec_t) (uv_now(request_ctx->loop->uv_thread_loop) - httpsReq->start));
+    }
+
+    ft_type = ngx_http_ziti_next_upstream_type(resp->code);
+
+    //
+    // If a hedge partner is still in flight, a failed attempt simply drops out and lets the other one answer
+    //
+    if (request_ctx->inflight > 1 && (resp->code < 0 || (zlcf->next_upstream & ft_type))) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ziti_hedge: attempt [%p] failed [%d], awaiting the other attempt", httpsReq, resp->code);
+
+        ngx_http_ziti_release_client(httpsReq, resp->code < 0);
+        return;
+    }
+
+    //
+    // Give ziti_next_upstream a chance to transparently retry the request before anything reaches the client
+    //
+    if (ngx_http_ziti_next_upstream(httpsReq, ft_type) == NGX_OK) {
+        return;
+    }
+
+    if ((UV_EOF == resp->code) || (resp->code < 0)) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "*********** due to error [%d], purge now necessary for client: [%p]", resp->code, httpsReq->httpsClient);
+
+        ngx_http_ziti_release_client(httpsReq, true);
+
+        ngx_http_ziti_fail_request(request_ctx, (resp->code == UV_ETIMEDOUT) ? NGX_HTTP_GATEWAY_TIME_OUT : NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+    ngx_http_ziti_hedge_settle(request_ctx, httpsReq);
+
+    request_ctx->t_connect = httpsReq->sent;
+    request_ctx->t_header = uv_hrtime();
+    request_ctx->client_loop = httpsReq->httpsClient->loop;
+    request_ctx->client_slot = httpsReq->httpsClient->slot;
+    request_ctx->has_client = 1;
 
     // status code
     r->headers_out.status = resp->code;
@@ -682,121 +2199,134 @@ on_resp(um_http_resp_t *resp, void *data)
     // headers
     um_http_hdr *h;
     LIST_FOREACH(h, &resp->headers, _next) {
-        key.data = (u_char *) strdup(h->name);
         key.len  = strlen(h->name);
-        value.data = (u_char *) strdup(h->value);
         value.len = strlen(h->value);
+
+        key.data = ngx_pnalloc(r->pool, key.len + 1 + value.len + 1);
+        if (key.data == NULL) {
+            continue;
+        }
+
+        value.data = key.data + key.len + 1;
+
+        ngx_cpystrn(key.data, (u_char *) h->name, key.len + 1);
+        ngx_cpystrn(value.data, (u_char *) h->value, value.len + 1);
+
         ngx_http_ziti_set_header(r, &key, &value);
     }
 
-    if ((UV_EOF == resp->code) || (resp->code < 0)) {
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "<--------- returning httpsClient [%p] back to pool due to error: [%d]", request_ctx->httpsClient, resp->code);
-        request_ctx->httpsClient->active = false;
+    // We need body of the HTTP response, so wire up that callback now
+    resp->body_cb = on_resp_body;
 
-        // Before we fully release this client (via uv_sem_post) let's indicate purge is needed, because after errs happen on a client, 
-        // subsequent requests using that client never get processed.
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "*********** due to error, purge now necessary for client: [%p]", request_ctx->httpsClient);
+    ngx_http_ziti_resp_header(request_ctx);
+}
 
-        request_ctx->httpsClient->purge = true;
 
-        struct ListMap* clientListMap = getInnerListMapValueForKey(HttpsClientListMap, request_ctx->scheme_host_port);
+static void ngx_http_ziti_send_body(HttpsReq *httpsReq);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "<-------- returning sem for client: [%p] ", request_ctx->httpsClient);
-        uv_sem_post(&(clientListMap->sem));
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "          after returning sem for client: [%p] ", request_ctx->httpsClient);
-    }
 
-    if (UV_EOF != resp->code) {
-        // We need body of the HTTP response, so wire up that callback now
-        resp->body_cb = on_resp_body;
-    }
+/**
+ * um_http is done with a piece of the request body
+ */
+void
+on_req_body(um_http_req_t *req, const char *body, ssize_t status) 
+{
+    HttpsReq                    *httpsReq = (HttpsReq*)req->data;
+    ngx_http_ziti_request_ctx_t *request_ctx = httpsReq->request_ctx;
 
-    //
-    // Launch thread that will kick the Nginx threadloop
-    //
-    task_transmitRespHeader = ngx_thread_task_alloc(zlcf->pool, sizeof(ngx_http_ziti_resp_header_transmit_thread_ctx_t));
-    if (task_transmitRespHeader == NULL) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp: ngx_thread_task_alloc failed");
+    if (status < 0 || httpsReq->released || httpsReq->cancelled) {    // on_resp() deals with the failure
         return;
     }
-    resp_header_transmit_thread_ctx = task_transmitRespHeader->ctx;
-    resp_header_transmit_thread_ctx->r = r;
-    resp_header_transmit_thread_ctx->request_ctx = request_ctx;
-    resp_header_transmit_thread_ctx->zlcf = zlcf;
 
-    task_transmitRespHeader->handler = ngx_http_ziti_resp_header_transmit_func;
-    task_transmitRespHeader->event.handler = ngx_http_ziti_resp_header_transmit_thread_completion;
-    task_transmitRespHeader->event.data = resp_header_transmit_thread_ctx;
+    // Once body bytes are on the wire, a non-idempotent request is no longer safe to replay
+    request_ctx->request_sent = 1;
 
-    tp = ngx_thread_pool_get((ngx_cycle_t* ) ngx_cycle, &ngx_http_ziti_thread_pool_name);
-    if (tp == NULL) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp: ngx_thread_pool_get failed");
-        return;
+    // a piece read from a file buffer went out; body_buf is free for the next one
+    if (httpsReq->body_buf && body == (const char *) httpsReq->body_buf) {
+        ngx_http_ziti_send_body(httpsReq);
     }
+}
 
-    if (ngx_thread_task_post(tp, task_transmitRespHeader) != NGX_OK) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp: ngx_thread_task_post failed");
-        return;
-    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_resp: started thread for ngx_http_ziti_resp_header_transmit_func()");
-}
+/**
+ * Write the request body to the attempt's request, from r->request_body->bufs.  The nginx thread
+ * read them in full before the request was queued, and they stay attached to r for its whole
+ * life, so every ziti_next_upstream attempt replays the same buffers.  In-memory buffers are
+ * handed to um_http as they are; file buffers are read NGX_HTTP_ZITI_BODY_CHUNK bytes at a time
+ * into body_buf, the next piece once um_http has written the previous one.
+ */
+static void
+ngx_http_ziti_send_body(HttpsReq *httpsReq)
+{
+    ngx_http_ziti_request_ctx_t *request_ctx = httpsReq->request_ctx;
+    ngx_http_request_t          *r = request_ctx->r;
+    ngx_buf_t                   *b;
+    u_char                      *data;
+    size_t                       size;
+    ssize_t                      n;
+
+    while (httpsReq->body) {
+
+        b = httpsReq->body->buf;
+        size = (size_t) (ngx_buf_size(b) - httpsReq->body_offset);
+
+        if (size == 0) {
+            httpsReq->body = httpsReq->body->next;
+            httpsReq->body_offset = 0;
+            continue;
+        }
+
+        if (ngx_buf_in_memory(b)) {
+            data = b->pos + httpsReq->body_offset;
 
+        } else {
+            size = ngx_min(size, (size_t) NGX_HTTP_ZITI_BODY_CHUNK);
 
-/**
- * 
- */
-void
-on_req_body(um_http_req_t *req, const char *body, ssize_t status) 
-{
-    /* nop */
-}
+            if (httpsReq->body_buf == NULL) {
+                httpsReq->body_buf = ngx_palloc(request_ctx->pool, NGX_HTTP_ZITI_BODY_CHUNK);
+            }
 
+            n = (httpsReq->body_buf == NULL) ? NGX_ERROR
+                : ngx_read_file(b->file, httpsReq->body_buf, size, b->file_pos + httpsReq->body_offset);
 
-/**
- * 
- */
-void
-on_client_data(ngx_http_request_t *r)
-{
-    ngx_http_ziti_request_ctx_t   *request_ctx;
-    off_t                          len;
-    ngx_chain_t                   *in;
-    um_http_req_t                 *ur;
+            if (n != (ssize_t) size) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "ziti: could not read the request body for service \"%s\"", httpsReq->servicename);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_client_data() entered");
+                // on_resp() gets the cancelled request, and fails or retries the attempt
+                um_http_req_cancel(&(httpsReq->httpsClient->client), httpsReq->req);
+                return;
+            }
 
-    if (r->request_body == NULL) {
-        return;
-    }
+            data = httpsReq->body_buf;
+        }
 
-    request_ctx = (ngx_http_ziti_request_ctx_t*)ngx_http_get_module_ctx(r, ngx_http_ziti_module);
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_send_body() chunk len is: %uz", size);
 
-    ur = request_ctx->httpsReq->req;
+        httpsReq->body_offset += size;
 
-    for (in = r->request_body->bufs; in; in = in->next) 
-    {
-        len = ngx_buf_size(in->buf);
+        um_http_req_data(httpsReq->req, (const char *) data, size, on_req_body);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_client_data() chunk len is: %d", len);
+        ngx_http_ziti_stat_add(ngx_http_ziti_stats_get(request_ctx->pools, httpsReq->servicename), bytes_in, size);
 
-        // write the data over to the Ziti service
-        um_http_req_data(ur, (void*)in->buf->start, len, on_req_body );
+        if (data == httpsReq->body_buf) {   // on_req_body() carries on once this piece is out
+            return;
+        }
     }
 }
 
 
 /**
- * 
+ * Issue the HTTP request for an attempt on the client it was given
  */
-void on_client(uv_work_t* req, int status) 
+static void
+ngx_http_ziti_send_request(HttpsReq *httpsReq)
 {
-    ngx_http_ziti_request_ctx_t *request_ctx = (ngx_http_ziti_request_ctx_t*)req->data;
+    ngx_http_ziti_request_ctx_t *request_ctx = httpsReq->request_ctx;
     ngx_http_request_t          *r = request_ctx->r;
+    ngx_http_ziti_loc_conf_t    *zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
     ngx_http_ziti_method_t      *method;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_client() entered, uv_work_t is: %p, status is: %d", req, status);
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "client is: [%p]", request_ctx->httpsClient);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_send_request() entered, httpsReq: %p, client is: [%p]", httpsReq, httpsReq->httpsClient);
 
     for (method = ngx_http_ziti_methods; method->name; method++) {
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "method->key is: [%d], method->name is: [%s]", method->key, method->name);
@@ -811,26 +2341,123 @@ void on_client(uv_work_t* req, int status)
     ngx_copy(uri_path, r->uri.data, r->uri.len);
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "uri_path  is: [%s]", uri_path);
 
+    httpsReq->start = uv_now(request_ctx->loop->uv_thread_loop);
+    httpsReq->sent = uv_hrtime();
+
     // Initiate the request:   HTTP -> TLS -> Ziti -> Service 
     um_http_req_t *ur = um_http_req(
-        &(request_ctx->httpsClient->client),
+        &(httpsReq->httpsClient->client),
         method->name,
         uri_path,
         on_resp,
-        request_ctx  /* Pass our request_ctx around so we can eventually mark it complete */
+        httpsReq  /* Pass our attempt around so we can eventually mark it complete */
     );
 
     request_ctx->state = ZS_REQ_PROCESSING;
 
+    ngx_http_ziti_probe4(request__sent, r, httpsReq->servicename, httpsReq->httpsClient, (int) httpsReq->hedge);
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "um_http_req_t: %p", ur);
 
-    request_ctx->httpsReq->req = ur;
+    httpsReq->req = ur;
 
     // Add headers to request
     propagate_headers_to_request(ur, r);
 
-    // Ask Nginx for the client (POST|PUT) data
-    ngx_http_read_client_request_body(r, on_client_data);
+    if (httpsReq->hedge) {  // only bodyless GET/HEAD requests are hedged
+        return;
+    }
+
+    request_ctx->httpsReq = httpsReq;
+    request_ctx->httpsClient = httpsReq->httpsClient;
+    request_ctx->request_sent = 0;
+
+    // Send the client (POST|PUT) data, which the nginx thread read before queueing the request
+    if (r->request_body) {
+        httpsReq->body = r->request_body->bufs;
+        httpsReq->body_offset = 0;
+
+        ngx_http_ziti_send_body(httpsReq);
+    }
+
+    //
+    // Arm ziti_hedge for eligible requests on their first attempt
+    //
+    if (zlcf->hedge_after && request_ctx->tries == 1 && (r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))
+        && r->headers_in.content_length_n <= 0 && !r->headers_in.chunked)
+    {
+        ngx_http_ziti_hedge_budget_add(zlcf);
+
+        request_ctx->hedge_timer = ngx_alloc(sizeof(uv_timer_t), r->connection->log);
+
+        if (request_ctx->hedge_timer != NULL) {
+            uv_timer_init(request_ctx->loop->uv_thread_loop, request_ctx->hedge_timer);
+            request_ctx->hedge_timer->data = request_ctx;
+            uv_timer_start(request_ctx->hedge_timer, ngx_http_ziti_hedge_timer_cb, zlcf->hedge_after, 0);
+        }
+    }
+}
+
+
+/**
+ * 
+ */
+void on_client(uv_work_t* req, int status) 
+{
+    HttpsReq                    *httpsReq = (HttpsReq*)req->data;
+    ngx_http_ziti_request_ctx_t *request_ctx = httpsReq->request_ctx;
+    ngx_http_request_t          *r = request_ctx->r;
+    struct ListMap              *clientListMap;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_client() entered, uv_work_t is: %p, status is: %d", req, status);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "client is: [%p]", httpsReq->httpsClient);
+
+    request_ctx->pending_alloc--;
+
+    clientListMap = ngx_http_ziti_pool_get(request_ctx->pools, ngx_http_get_module_loc_conf(r, ngx_http_ziti_module),
+                                           httpsReq->servicename);
+
+    if (clientListMap == NULL) {
+        //
+        // No location pre-warmed a pool with these settings for the service: build it here, on
+        // the loop thread that owns the set of pools, and check out again
+        //
+        clientListMap = ngx_http_ziti_pool_create(request_ctx->loop, request_ctx->pools,
+                                                  ngx_http_get_module_loc_conf(r, ngx_http_ziti_module),
+                                                  httpsReq->servicename, r->connection->log);
+
+        ngx_http_ziti_pool_maint_start(clientListMap);
+
+        request_ctx->pending_alloc++;
+        uv_queue_work(request_ctx->loop->uv_thread_loop, &httpsReq->uv_req, allocate_client, on_client);
+        return;
+    }
+
+    ngx_http_ziti_pool_maint_start(clientListMap);
+
+    if (NULL == httpsReq->httpsClient) {
+        //
+        // Every idle client was purged and maintenance has not run yet; rebuild them now, on
+        // the loop thread, while still holding the pool slot allocate_client() reserved
+        //
+        if (purge_and_replace_bad_clients(clientListMap)) {
+            httpsReq->httpsClient = getHttpsClientForKey(clientListMap, request_ctx->scheme_host_port, r, false);
+        }
+    }
+
+    if (NULL == httpsReq->httpsClient) {
+        //
+        // No usable client behind the slot yet, which is no fault of the service: give the slot
+        // back and wait for another, as for any checkout
+        //
+        ngx_http_ziti_pool_post(clientListMap, 1);
+
+        request_ctx->pending_alloc++;
+        uv_queue_work(request_ctx->loop->uv_thread_loop, &httpsReq->uv_req, allocate_client, on_client);
+        return;
+    }
+
+    ngx_http_ziti_send_request(httpsReq);
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "on_client() exiting");
 }
@@ -856,7 +2483,7 @@ ngx_http_ziti_await_init_complete_func(void *data, ngx_log_t *log)
     /* this function is executed in a thread from the ziti thread_pool */
 
     ngx_http_ziti_await_init_thread_ctx_t   *ctx = data;
-    ngx_http_ziti_loc_conf_t                *zlcf = ctx->zlcf;
+    ngx_http_ziti_loop_t                    *loop = ctx->loop;
     ngx_uint_t                               msec_sleep = 100;
 
     ZITI_LOG(DEBUG, "ngx_http_ziti_await_init_complete_func() entered");
@@ -864,7 +2491,7 @@ ngx_http_ziti_await_init_complete_func(void *data, ngx_log_t *log)
     do {
         ZITI_LOG(DEBUG, "ngx_http_ziti_await_init_complete_func() sleeping");
         ngx_msleep(msec_sleep);
-    } while (zlcf->state < ZS_LOC_ZITI_INIT_COMPLETED);
+    } while (loop->state < ZS_LOC_ZITI_INIT_COMPLETED && !loop->unavailable);
 
     ZITI_LOG(DEBUG, "ngx_http_ziti_await_init_complete_func() exiting");
 }
@@ -889,7 +2516,7 @@ ngx_http_ziti_await_init_complete_completion(ngx_event_t *ev)
 }
 
 ngx_int_t
-ngx_http_ziti_await_init(ngx_http_ziti_loc_conf_t *zlcf, ngx_http_request_t *r)
+ngx_http_ziti_await_init(ngx_http_ziti_loc_conf_t *zlcf, ngx_http_ziti_loop_t *loop, ngx_http_request_t *r)
 {
     ngx_thread_pool_t             *tp;
 
@@ -899,7 +2526,7 @@ ngx_http_ziti_await_init(ngx_http_ziti_loc_conf_t *zlcf, ngx_http_request_t *r)
     //
     // Launch thread to await completion of Ziti init (Controller connection)
     //
-    task_awaitInit = ngx_thread_task_alloc(zlcf->pool, sizeof(ngx_http_ziti_await_init_thread_ctx_t));
+    task_awaitInit = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_ziti_await_init_thread_ctx_t));
     if (task_awaitInit == NULL) {
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_await_init: ngx_thread_task_alloc failed");
         return NGX_ERROR;
@@ -908,6 +2535,7 @@ ngx_http_ziti_await_init(ngx_http_ziti_loc_conf_t *zlcf, ngx_http_request_t *r)
     await_init_thread_ctx = task_awaitInit->ctx;
     await_init_thread_ctx->r = r;
     await_init_thread_ctx->zlcf = zlcf;
+    await_init_thread_ctx->loop = loop;
 
     task_awaitInit->handler = ngx_http_ziti_await_init_complete_func;
     task_awaitInit->event.handler = ngx_http_ziti_await_init_complete_completion;
@@ -930,6 +2558,156 @@ ngx_http_ziti_await_init(ngx_http_ziti_loc_conf_t *zlcf, ngx_http_request_t *r)
 }
 
 
+/**
+ * Pick the loop with the fewest requests in flight, starting the scan round-robin so that
+ * idle loops take turns
+ */
+ngx_http_ziti_loop_t *
+ngx_http_ziti_loop_select(ngx_http_ziti_identity_t *identity)
+{
+    ngx_http_ziti_loop_t          *loop, *best;
+    ngx_uint_t                     i, n;
+
+    n = identity->next_loop++;
+    best = &identity->loops[n % identity->nloops];
+
+    for (i = 1; i < identity->nloops && best->load; i++) {
+        loop = &identity->loops[(n + i) % identity->nloops];
+
+        if (loop->load < best->load) {
+            best = loop;
+        }
+    }
+
+    return best;
+}
+
+
+static void
+ngx_http_ziti_loop_release(void *data)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx = data;
+
+    request_ctx->loop->load--;
+
+    // the client went away while its request body was being read; the loop never saw the request
+    if (request_ctx->body_pending) {
+        ngx_destroy_pool(request_ctx->pool);
+    }
+
+    ngx_http_ziti_pools_release(request_ctx->pools);
+}
+
+
+/**
+ * The request body has been read: from here on the request belongs to its loop, until the loop
+ * wakes the nginx thread up with the response.  Called from the body post handlers, on the nginx
+ * thread, right before the request is queued to the loop.
+ */
+void
+ngx_http_ziti_body_read_done(ngx_http_ziti_request_ctx_t *request_ctx)
+{
+    ngx_http_request_t          *r = request_ctx->r;
+
+    request_ctx->body_pending = 0;
+
+    r->main->blocked++;
+    r->aio = 1;
+}
+
+
+/**
+ * Count a finished request against the service that answered it
+ */
+static void
+ngx_http_ziti_stats_done(ngx_http_ziti_request_ctx_t *request_ctx)
+{
+    ngx_http_ziti_shm_stats_t     *stats;
+    ngx_uint_t                     status;
+
+    stats = ngx_http_ziti_stats_get(request_ctx->pools, request_ctx->servicename);
+    if (stats == NULL) {
+        return;
+    }
+
+    status = request_ctx->err ? (ngx_uint_t) request_ctx->err : request_ctx->r->headers_out.status;
+
+    if (status >= 100 && status < 600) {
+        ngx_atomic_fetch_add(&stats->responses[status / 100 - 1], 1);
+    }
+
+    ngx_http_ziti_hist_add(&stats->total, ngx_current_msec - request_ctx->start);
+}
+
+
+/**
+ * Allocate one of the thread tasks the uv loop thread posts to wake the request up.  They come
+ * from the request pool, on the nginx thread, and are reused for as long as the request lives.
+ */
+static ngx_thread_task_t *
+ngx_http_ziti_task_create(ngx_http_request_t *r, ngx_http_ziti_request_ctx_t *request_ctx,
+    void (*handler)(void *data, ngx_log_t *log), ngx_event_handler_pt completion)
+{
+    ngx_thread_task_t                       *task;
+    ngx_http_ziti_req_complete_thread_ctx_t *thread_ctx;
+
+    // the header, chunk and completion task contexts all share this layout
+    task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_ziti_req_complete_thread_ctx_t));
+    if (task == NULL) {
+        return NULL;
+    }
+
+    thread_ctx = task->ctx;
+    thread_ctx->r = r;
+    thread_ctx->request_ctx = request_ctx;
+    thread_ctx->zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
+
+    task->handler = handler;
+    task->event.handler = completion;
+    task->event.data = thread_ctx;
+
+    return task;
+}
+
+
+/**
+ * The request body has been read, if there was one: queue the HTTP request.  First thing that
+ * happens in the flow is to allocate a client from the pool.
+ */
+static void
+ngx_http_ziti_body_read(ngx_http_request_t *r)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx;
+    HttpsReq                      *httpsReq;
+
+    request_ctx = (ngx_http_ziti_request_ctx_t*)ngx_http_get_module_ctx(r, ngx_http_ziti_module);
+
+    httpsReq = ngx_http_ziti_attempt_create(request_ctx);
+    if (httpsReq == NULL) {
+        request_ctx->body_pending = 0;
+
+        ngx_destroy_pool(request_ctx->pool);
+
+        ngx_http_set_ctx(r, NULL, ngx_http_ziti_module);
+
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    request_ctx->tries++;
+
+    //
+    // Mark the HTTP request as blocked/pending until the loop wakes it up
+    //
+    ngx_http_ziti_body_read_done(request_ctx);
+
+    request_ctx->pending_alloc++;
+    uv_queue_work(request_ctx->loop->uv_thread_loop, &httpsReq->uv_req, allocate_client, on_client);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_body_read: uv_queue_work of allocate_client returned req: %p", &httpsReq->uv_req);
+}
+
+
 /**
  * 
  */
@@ -939,6 +2717,9 @@ ngx_http_ziti_handler(ngx_http_request_t *r)
     ngx_http_ziti_loc_conf_t      *zlcf;
     ngx_http_ziti_request_ctx_t   *request_ctx;
     ngx_int_t                      rc;
+    ngx_uint_t                     i, probe;
+    char                         **names;
+    ngx_pool_cleanup_t            *cln;
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_handler: Entering handler, r->count: %d, r->blocked: %d", r->count, r->blocked);
 
@@ -968,23 +2749,75 @@ ngx_http_ziti_handler(ngx_http_request_t *r)
             return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
 
-        request_ctx->scheme_host_port = "http://example:80"; // keep um_http_init_with_src() happy
+        request_ctx->scheme_host_port = NGX_HTTP_ZITI_SCHEME_HOST_PORT;
+
+        request_ctx->servicename = zlcf->servicename;
+        request_ctx->service_index = 0;
+        request_ctx->start = ngx_current_msec;
+        request_ctx->t_start = uv_hrtime();
 
-        if (NULL == HttpsClientListMap) {
-            HttpsClientListMap = newListMap(r);
+        //
+        // Run the request on the least-loaded of the identity's loops
+        //
+        request_ctx->loop = ngx_http_ziti_loop_select(zlcf->identity);
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
 
+        request_ctx->loop->load++;
+
+        //
+        // Pin the request to the loop's current pools; after an identity reload it drains on
+        // them while new requests use the new context's pools
+        //
+        request_ctx->pools = ngx_http_ziti_pools_acquire(request_ctx->loop);
+
+        cln->handler = ngx_http_ziti_loop_release;
+        cln->data = request_ctx;
+
         uv_sem_init(&(request_ctx->out_bufs_sem), 1);
 
+        request_ctx->header_task = ngx_http_ziti_task_create(r, request_ctx, ngx_http_ziti_resp_header_transmit_func,
+                                                             ngx_http_ziti_resp_header_transmit_thread_completion);
+        request_ctx->chunk_task = ngx_http_ziti_task_create(r, request_ctx, ngx_http_ziti_resp_chunk_func,
+                                                            ngx_http_ziti_resp_chunk_thread_completion);
+        request_ctx->done_task = ngx_http_ziti_task_create(r, request_ctx, ngx_http_ziti_req_complete_func,
+                                                           ngx_http_ziti_req_thread_completion);
+
+        if (request_ctx->header_task == NULL || request_ctx->chunk_task == NULL || request_ctx->done_task == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
         request_ctx->last_out = &request_ctx->out_bufs;
     }
 
+    ngx_http_ziti_probe2(handler__entry, r, request_ctx->state);
+
+    //
+    // Fail fast while the controller has never let this loop's context come up; it is being
+    // reconnected in the background
+    //
+    if (request_ctx->loop->state < ZS_LOC_ZITI_INIT_COMPLETED && request_ctx->loop->unavailable) {
+
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ziti: controller unavailable for identity %s, failing fast", zlcf->identity->identity_path);
+
+        ngx_http_ziti_stat_add(zlcf->identity->stats, unavailable, 1);
+
+        ngx_destroy_pool(request_ctx->pool);
+
+        ngx_http_set_ctx(r, NULL, ngx_http_ziti_module);
+
+        return zlcf->unavailable_status;
+    }
+
     //
-    // Await the Ziti init if necessary
+    // Await the Ziti init (started by this worker in init_process) if necessary
     //
-    if (zlcf->state < ZS_LOC_UV_LOOP_STARTED) {
+    if (request_ctx->loop->state < ZS_LOC_ZITI_INIT_COMPLETED) {
 
-        rc = ngx_http_ziti_await_init(zlcf, r);
+        rc = ngx_http_ziti_await_init(zlcf, request_ctx->loop, r);
 
         if (rc != NGX_OK) {
             return NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -997,34 +2830,121 @@ ngx_http_ziti_handler(ngx_http_request_t *r)
         return NGX_AGAIN;
     }
 
-    //
-    // If location-scoped Ziti initialization is not completed, exit and await next iteration
-    //
-    if (zlcf->state < ZS_LOC_ZITI_INIT_COMPLETED) {
-        return NGX_AGAIN;
-    }
-
     //
     // If we get this far, the location-scope is fully initialized, and we can now orchestrate the request over Ziti
     //
     if (request_ctx->state == ZS_REQ_INIT)  // If we haven't actually started the request yet
     {
         //
-        // Queue the HTTP request.  First thing that happens in the flow is to allocate a client from the pool
+        // ziti_upgrade: a request switching protocols gets a Ziti connection of its own, which
+        // relays it until either side closes
         //
-        request_ctx->uv_req.data = request_ctx;
-        uv_queue_work(zlcf->uv_thread_loop, &request_ctx->uv_req, allocate_client, on_client);
+        if (zlcf->upgrade && ngx_http_ziti_tunnel_requested(r)) {
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_handler: uv_queue_work of allocate_client returned req: %p", request_ctx->uv_req);
+            rc = ngx_http_ziti_tunnel_start(r, request_ctx);
+
+            if (rc != NGX_DONE) {
+                ngx_destroy_pool(request_ctx->pool);
+
+                ngx_http_set_ctx(r, NULL, ngx_http_ziti_module);
+            }
+
+            return rc;
+        }
 
         //
-        // Mark the HTTP request as blocked/pending, and exit back to the Nginx loop
+        // Route to the first service named on ziti_pass whose circuit breaker lets us through,
+        // and fail fast if none does
         //
-        r->main->blocked++;
-        r->main->count++;
-        r->aio = 1;
+        names = zlcf->servicenames->elts;
 
-        return NGX_AGAIN;
+        for (i = 0; i < zlcf->servicenames->nelts; i++) {
+            if (ngx_http_ziti_breaker_allow(zlcf, request_ctx->pools, names[i], &probe) == NGX_OK) {
+                break;
+            }
+        }
+
+        if (i == zlcf->servicenames->nelts) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "ziti: circuit breaker open for service \"%s\", failing fast", zlcf->servicename);
+
+            ngx_http_ziti_stat_add(ngx_http_ziti_stats_get(request_ctx->pools, zlcf->servicename), breaker_rejects, 1);
+
+            ngx_destroy_pool(request_ctx->pool);
+
+            ngx_http_set_ctx(r, NULL, ngx_http_ziti_module);
+
+            return zlcf->breaker_status;
+        }
+
+        request_ctx->service_index = i;
+        request_ctx->servicename = names[i];
+        request_ctx->probe = probe;
+
+        ngx_http_ziti_stat_add(ngx_http_ziti_stats_get(request_ctx->pools, request_ctx->servicename), requests, 1);
+
+#if (NGX_HTTP_ZITI_HAVE_NGHTTP2)
+        //
+        // ziti_http_version 2: the request becomes a stream on one of the service's shared
+        // HTTP/2 connections once its body is read
+        //
+        if (zlcf->http_version == NGX_HTTP_VERSION_20) {
+
+            rc = ngx_http_ziti_h2_start(r, request_ctx);
+
+            if (rc != NGX_DONE) {
+                ngx_destroy_pool(request_ctx->pool);
+
+                ngx_http_set_ctx(r, NULL, ngx_http_ziti_module);
+            }
+
+            //
+            // NGX_DONE drops the reference ngx_http_read_client_request_body() took on r->main;
+            // the body post handler blocks the request once the body is in
+            //
+            return rc;
+        }
+#endif
+
+        //
+        // ziti_http_engine native: the request is written on a raw Ziti connection once its
+        // body is read, without a um_http client
+        //
+        if (zlcf->http_engine == NGX_HTTP_ZITI_ENGINE_NATIVE && zlcf->http_version == NGX_HTTP_VERSION_11) {
+
+            rc = ngx_http_ziti_h1_start(r, request_ctx);
+
+            if (rc != NGX_DONE) {
+                ngx_destroy_pool(request_ctx->pool);
+
+                ngx_http_set_ctx(r, NULL, ngx_http_ziti_module);
+            }
+
+            //
+            // Like proxy_pass: NGX_DONE drops the reference ngx_http_read_client_request_body()
+            // took, and leaves the body read handlers in place if the body is still arriving
+            //
+            return rc;
+        }
+
+        //
+        // Read the client (POST|PUT) data here, on the nginx thread; ngx_http_ziti_body_read()
+        // queues the request once it is in.  NGX_DONE drops the reference the body read took.
+        //
+        request_ctx->body_pending = 1;
+
+        rc = ngx_http_read_client_request_body(r, ngx_http_ziti_body_read);
+
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            request_ctx->body_pending = 0;
+
+            ngx_destroy_pool(request_ctx->pool);
+
+            ngx_http_set_ctx(r, NULL, ngx_http_ziti_module);
+
+            return rc;
+        }
+
+        return NGX_DONE;
     }
 
     //
@@ -1061,14 +2981,35 @@ ngx_http_ziti_handler(ngx_http_request_t *r)
         /* acquire lock */
         uv_sem_wait(&(request_ctx->out_bufs_sem));
 
+#if (NGX_HTTP_ZITI_HAVE_NGHTTP2)
+        size_t           consumed = 0;
+        ngx_chain_t     *cl;
+
+        if (request_ctx->h2) {
+            for (cl = request_ctx->out_bufs; cl; cl = cl->next) {
+                consumed += ngx_buf_size(cl->buf);
+            }
+        }
+#endif
+
         /* Send the body chunk(s) */
         ngx_http_output_filter(r, request_ctx->out_bufs);
 
         request_ctx->out_bufs = NULL;
+        request_ctx->chunk_posted = 0;
 
         /* release lock */
         uv_sem_post(&(request_ctx->out_bufs_sem));
 
+#if (NGX_HTTP_ZITI_HAVE_NGHTTP2)
+        //
+        // Reopen the HTTP/2 stream's window for what the output filter took
+        //
+        if (request_ctx->h2) {
+            ngx_http_ziti_h2_consumed(request_ctx, consumed);
+        }
+#endif
+
         return NGX_AGAIN;
     }
 
@@ -1078,12 +3019,31 @@ ngx_http_ziti_handler(ngx_http_request_t *r)
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_http_ziti_handler: Exiting handler <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<");
 
+    ngx_http_ziti_stats_done(request_ctx);
+
+    //
+    // If every attempt failed before a response arrived, finalize with the error status instead
+    //
+    if (request_ctx->err) {
+        rc = request_ctx->err;
+
+        ngx_destroy_pool(request_ctx->pool);
+
+        return rc;
+    }
+
+#if (NGX_HTTP_ZITI_HAVE_NGHTTP2)
+    if (request_ctx->h2 && ngx_http_ziti_h2_trailers(r, request_ctx) != NGX_OK) {
+        ngx_destroy_pool(request_ctx->pool);
+
+        return NGX_ERROR;
+    }
+#endif
+
     /* Send any remaining body fragments, and return the status code of the output filter chain. */
     int outrc = ngx_http_output_filter(r, request_ctx->out_bufs);
 
     ngx_destroy_pool(request_ctx->pool);
 
-    ngx_pfree(r->pool, request_ctx);
-
     return outrc;
 }
@@ -33,10 +33,47 @@ typedef enum ZITI_REQ_STATE_tag
 
 
 
+/* keep um_http_init_with_src() happy; the Ziti service is what actually gets dialed */
+#define NGX_HTTP_ZITI_SCHEME_HOST_PORT  "http://example:80"
+
+/* how much of a request body spooled to file is read and written at a time */
+#define NGX_HTTP_ZITI_BODY_CHUNK  (64 * 1024)
+
+
+typedef enum ZITI_BREAKER_STATE_tag
+{
+    ZS_BREAKER_CLOSED = 0,
+    ZS_BREAKER_OPEN,
+    ZS_BREAKER_HALF_OPEN
+} ZITI_BREAKER_STATE;
+
+
+/*
+ * Per-service circuit breaker (ziti_circuit_breaker).  Read on the nginx thread when a request
+ * starts, updated on the uv loop thread as attempts complete, hence the atomics.
+ */
+typedef struct {
+    ngx_atomic_t                        state;
+    ngx_atomic_t                        opened_at;
+    ngx_atomic_t                        window_start;
+    ngx_atomic_t                        requests;
+    ngx_atomic_t                        failures;
+    /* half-open probes in flight, and how many of them succeeded */
+    ngx_atomic_t                        probes;
+    ngx_atomic_t                        successes;
+} ngx_http_ziti_breaker_t;
+
+
 typedef void(*ngx_http_ziti_request_callback_t)(void* context, ngx_int_t rc);
 
 typedef struct ngx_http_ziti_request_ctx_s ngx_http_ziti_request_ctx_t;
 
+typedef struct ngx_http_ziti_tunnel_s ngx_http_ziti_tunnel_t;
+
+typedef struct ngx_http_ziti_h2_stream_s ngx_http_ziti_h2_stream_t;
+
+typedef struct ngx_http_ziti_h1_stream_s ngx_http_ziti_h1_stream_t;
+
 
 typedef struct HttpsRespItem {
   um_http_req_t *req;
@@ -53,23 +90,48 @@ typedef struct HttpsRespBodyItem {
 } HttpsRespBodyItem;
 
 
-typedef struct HttpsReq {
-    um_http_req_t *req;
-    bool on_resp_has_fired;
-    int respCode;
-    struct ngx_http_ziti_request_ctx_s   *request_ctx;
-} HttpsReq;
-
-
 typedef struct {
+    /* owned by the client's pool */
     char* scheme_host_port;
     um_http_t client;
     um_src_t ziti_src;
-    bool active;
+    /* requests issued on the client and not finished yet; it carries up to requests= at once */
+    ngx_uint_t active;
+    /* checked out by a hedge, nothing may queue behind it */
+    bool exclusive;
     bool purge;
+    /* loop and pool slot, for $ziti_client_id */
+    ngx_uint_t loop;
+    ngx_uint_t slot;
 } HttpsClient;
 
 
+/*
+ * One attempt at sending the request to a Ziti service.  A request normally has a single
+ * attempt; ziti_next_upstream retries and ziti_hedge hedges each add another.
+ */
+typedef struct HttpsReq {
+    um_http_req_t *req;
+    bool on_resp_has_fired;
+    int respCode;
+    struct ngx_http_ziti_request_ctx_s   *request_ctx;
+    HttpsClient *httpsClient;
+    char *servicename;
+    uv_work_t uv_req;
+    struct HttpsReq *next;
+    uint64_t start;
+    /* uv_hrtime() when the request was handed to the client */
+    uint64_t sent;
+    /* request body still to be written for this attempt; file buffers go through body_buf */
+    ngx_chain_t *body;
+    off_t body_offset;
+    u_char *body_buf;
+    unsigned hedge:1;
+    unsigned cancelled:1;
+    unsigned released:1;
+} HttpsReq;
+
+
 typedef struct ngx_http_ziti_request_ctx_s {
     ZITI_REQ_STATE                      state;    
     ngx_http_request_t                 *r;
@@ -92,10 +154,65 @@ typedef struct ngx_http_ziti_request_ctx_s {
     ngx_chain_t                         out_chain;
     ngx_http_ziti_request_callback_t    callback;
     ngx_int_t                           err;
-    uv_work_t                           uv_req;
     HttpsClient                        *httpsClient;
     HttpsReq                           *httpsReq;
     char                               *scheme_host_port;
+    /* the uv loop (of the location's identity) this request runs on, and the pools it uses */
+    ngx_http_ziti_loop_t               *loop;
+    struct ListMap                     *pools;
+    /* service the current attempt is routed to, and its index in zlcf->servicenames */
+    char                               *servicename;
+    ngx_uint_t                          service_index;
+    /* when the request reached the handler, for the ziti_status latency histograms */
+    ngx_msec_t                          start;
+
+    /*
+     * $ziti_* variables.  uv_hrtime() stamps, since the loop thread cannot rely on the nginx
+     * time cache; 0 until the request gets that far.
+     */
+    uint64_t                            t_start;
+    uint64_t                            t_connect;
+    uint64_t                            t_header;
+    uint64_t                            t_done;
+    uint64_t                            pool_wait;
+    off_t                               bytes_received;
+    /* "<loop>:<slot>" of the pooled client that answered, for $ziti_client_id */
+    ngx_uint_t                          client_loop;
+    ngx_uint_t                          client_slot;
+    /* number of attempts made so far (ziti_next_upstream_tries) */
+    ngx_uint_t                          tries;
+    unsigned                            request_sent:1;
+    /* request was let through a half-open circuit breaker as a probe */
+    unsigned                            probe:1;
+    unsigned                            has_client:1;
+    /* the request body is being read, and the request has not been handed to its loop yet */
+    unsigned                            body_pending:1;
+
+    /* every attempt issued for this request, most recent first */
+    HttpsReq                           *attempts;
+    /* the attempt whose response is being relayed to the client */
+    HttpsReq                           *winner;
+    ngx_uint_t                          inflight;
+    ngx_uint_t                          pending_alloc;
+    ngx_uint_t                          hedges;
+    uv_timer_t                         *hedge_timer;
+
+    /* thread tasks that wake the request up on the nginx thread, allocated once per request */
+    ngx_thread_task_t                  *header_task;
+    ngx_thread_task_t                  *chunk_task;
+    ngx_thread_task_t                  *done_task;
+    /* chunk_task is posted and has not flushed out_bufs yet; guarded by out_bufs_sem */
+    unsigned                            chunk_posted:1;
+
+    /* ziti_upgrade: the request switched protocols and is relayed by this tunnel */
+    ngx_http_ziti_tunnel_t             *tunnel;
+
+    /* ziti_http_version 2: the request is a stream on a shared HTTP/2 connection */
+    ngx_http_ziti_h2_stream_t          *h2;
+
+    /* ziti_http_engine native: the request is on a raw Ziti connection of its own */
+    ngx_http_ziti_h1_stream_t          *h1;
+
 
 } ngx_http_ziti_request_ctx_t;
 
@@ -126,6 +243,26 @@ typedef struct {
 
 
 ngx_int_t ngx_http_ziti_handler(ngx_http_request_t *r);
+ngx_http_ziti_loop_t *ngx_http_ziti_loop_select(ngx_http_ziti_identity_t *identity);
+struct ListMap *ngx_http_ziti_pools_create(ngx_log_t *log);
+void ngx_http_ziti_pools_bind(struct ListMap *pools, ziti_context ztx);
+ziti_context ngx_http_ziti_pools_ztx(struct ListMap *pools);
+struct ListMap *ngx_http_ziti_pools_acquire(ngx_http_ziti_loop_t *loop);
+void ngx_http_ziti_pools_release(struct ListMap *pools);
+ngx_uint_t ngx_http_ziti_pools_busy(struct ListMap *pools);
+void ngx_http_ziti_pools_free(struct ListMap *pools);
+void ngx_http_ziti_pool_prewarm(ngx_http_ziti_loop_t *loop, struct ListMap *pools, ngx_http_ziti_loc_conf_t *zlcf, ngx_log_t *log);
+
+/* response delivery and bookkeeping, shared with the HTTP/2 and native HTTP/1.1 transports */
+HttpsReq *ngx_http_ziti_attempt_create(ngx_http_ziti_request_ctx_t *request_ctx);
+void ngx_http_ziti_breaker_record(HttpsReq *httpsReq, int code);
+ngx_int_t ngx_http_ziti_set_header(ngx_http_request_t *r, ngx_str_t *key, ngx_str_t *value);
+void ngx_http_ziti_resp_header(ngx_http_ziti_request_ctx_t *request_ctx);
+ngx_int_t ngx_http_ziti_resp_chunk(ngx_http_ziti_request_ctx_t *request_ctx, u_char *data, size_t len);
+void ngx_http_ziti_resp_done(ngx_http_ziti_request_ctx_t *request_ctx, ngx_int_t status);
+void **ngx_http_ziti_pool_h2(ngx_http_ziti_request_ctx_t *request_ctx);
+void **ngx_http_ziti_pool_h1(ngx_http_ziti_request_ctx_t *request_ctx);
+void ngx_http_ziti_body_read_done(ngx_http_ziti_request_ctx_t *request_ctx);
 
 
 #endif /* NGX_HTTP_ZITI_HANDLER_H */
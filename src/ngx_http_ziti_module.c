@@ -23,6 +23,9 @@ limitations under the License.
 #include "ngx_http_ziti_module.h"
 #include "ngx_http_ziti_handler.h"
 #include "ngx_http_ziti_upstream.h"
+#include "ngx_http_ziti_shm.h"
+#include "ngx_http_ziti_status.h"
+#include "ngx_http_ziti_bind.h"
 
 
 #ifndef NGX_THREADS
@@ -38,9 +41,65 @@ static char *ngx_http_ziti_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_ziti_identity(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_ziti_client_pool_size(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_ziti_buffer_size(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_ziti_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_ziti_circuit_breaker(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_ziti_health_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_ziti_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void *ngx_http_ziti_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_ziti_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_http_ziti_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_ziti_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
+static ngx_int_t ngx_http_ziti_init_process(ngx_cycle_t *cycle);
+static char *ngx_http_ziti_loop_cpu_affinity(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_ziti_config_types(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_ziti_identity_watch_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_ziti_add_variables(ngx_conf_t *cf);
+
+
+static ngx_conf_bitmask_t  ngx_http_ziti_next_upstream_masks[] = {
+    { ngx_string("error"),          NGX_HTTP_UPSTREAM_FT_ERROR },
+    { ngx_string("timeout"),        NGX_HTTP_UPSTREAM_FT_TIMEOUT },
+    { ngx_string("http_500"),       NGX_HTTP_UPSTREAM_FT_HTTP_500 },
+    { ngx_string("http_502"),       NGX_HTTP_UPSTREAM_FT_HTTP_502 },
+    { ngx_string("http_503"),       NGX_HTTP_UPSTREAM_FT_HTTP_503 },
+    { ngx_string("http_504"),       NGX_HTTP_UPSTREAM_FT_HTTP_504 },
+    { ngx_string("http_403"),       NGX_HTTP_UPSTREAM_FT_HTTP_403 },
+    { ngx_string("http_404"),       NGX_HTTP_UPSTREAM_FT_HTTP_404 },
+    { ngx_string("http_429"),       NGX_HTTP_UPSTREAM_FT_HTTP_429 },
+    { ngx_string("non_idempotent"), NGX_HTTP_UPSTREAM_FT_NON_IDEMPOTENT },
+    { ngx_string("off"),            NGX_HTTP_UPSTREAM_FT_OFF },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_conf_enum_t  ngx_http_ziti_metrics_types[] = {
+    { ngx_string("ewma_1m"),        EWMA_1m },
+    { ngx_string("ewma_5m"),        EWMA_5m },
+    { ngx_string("ewma_15m"),       EWMA_15m },
+    { ngx_string("mma_1m"),         MMA_1m },
+    { ngx_string("cma_1m"),         CMA_1m },
+    { ngx_string("instant"),        INSTANT },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_conf_enum_t  ngx_http_ziti_http_engines[] = {
+    { ngx_string("um_http"),        NGX_HTTP_ZITI_ENGINE_UM_HTTP },
+    { ngx_string("native"),         NGX_HTTP_ZITI_ENGINE_NATIVE },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_conf_enum_t  ngx_http_ziti_http_versions[] = {
+    { ngx_string("1.1"),            NGX_HTTP_VERSION_11 },
+    { ngx_string("2"),              NGX_HTTP_VERSION_20 },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_conf_num_bounds_t  ngx_http_ziti_status_bounds = {
+    ngx_conf_check_num_bounds, 400, 599
+};
 
 
 /* config directives for ngx_http_ziti module */
@@ -67,6 +126,167 @@ static ngx_command_t ngx_http_ziti_cmds[] = {
       offsetof(ngx_http_ziti_loc_conf_t, buf_size),
       NULL },
 
+    { ngx_string("ziti_next_upstream"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ziti_loc_conf_t, next_upstream),
+      &ngx_http_ziti_next_upstream_masks },
+
+    { ngx_string("ziti_next_upstream_tries"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ziti_loc_conf_t, next_upstream_tries),
+      NULL },
+
+    { ngx_string("ziti_hedge"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_ziti_hedge,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ziti_circuit_breaker"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_ziti_circuit_breaker,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ziti_health_check"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_ziti_health_check,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ziti_unavailable_status"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ziti_loc_conf_t, unavailable_status),
+      &ngx_http_ziti_status_bounds },
+
+    { ngx_string("ziti_http_engine"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ziti_loc_conf_t, http_engine),
+      &ngx_http_ziti_http_engines },
+
+    { ngx_string("ziti_http_version"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ziti_loc_conf_t, http_version),
+      &ngx_http_ziti_http_versions },
+
+    { ngx_string("ziti_upgrade"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ziti_loc_conf_t, upgrade),
+      NULL },
+
+    { ngx_string("ziti_upgrade_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ziti_loc_conf_t, upgrade_timeout),
+      NULL },
+
+    { ngx_string("ziti_connect_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ziti_loc_conf_t, connect_timeout),
+      NULL },
+
+    { ngx_string("ziti_read_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ziti_loc_conf_t, read_timeout),
+      NULL },
+
+    { ngx_string("ziti_keepalive_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ziti_loc_conf_t, keepalive_timeout),
+      NULL },
+
+    { ngx_string("ziti_loops"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_ziti_main_conf_t, loops),
+      NULL },
+
+    { ngx_string("ziti_loop_cpu_affinity"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_ziti_loop_cpu_affinity,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ziti_loop_thread_name"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_ziti_main_conf_t, loop_thread_name),
+      NULL },
+
+    { ngx_string("ziti_refresh_interval"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_ziti_main_conf_t, refresh_interval),
+      NULL },
+
+    { ngx_string("ziti_router_keepalive"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_ziti_main_conf_t, router_keepalive),
+      NULL },
+
+    { ngx_string("ziti_metrics"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_ziti_main_conf_t, metrics_type),
+      &ngx_http_ziti_metrics_types },
+
+    { ngx_string("ziti_config_types"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_ziti_config_types,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ziti_identity_watch"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_ziti_identity_watch_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_ziti_main_conf_t, identity_watch),
+      NULL },
+
+    { ngx_string("ziti_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_ziti_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ziti_shared_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_ziti_shared_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("ziti_identity"),
       NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
       ngx_http_ziti_identity,
@@ -74,6 +294,13 @@ static ngx_command_t ngx_http_ziti_cmds[] = {
       0,
       NULL },
 
+    { ngx_string("ziti_bind"),
+      NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_http_ziti_bind,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     ngx_null_command
 };
 
@@ -85,8 +312,10 @@ static ngx_http_module_t ngx_http_ziti_module_ctx = {
     ngx_http_ziti_postconfiguration,
             /* postconfiguration */
 
-    NULL,    /* create_main_conf */
-    NULL,    /* merge_main_conf */
+    ngx_http_ziti_create_main_conf,
+             /* create_main_conf */
+    ngx_http_ziti_init_main_conf,
+             /* init_main_conf */
 
     ngx_http_upstream_ziti_create_srv_conf,
              /* create_srv_conf */
@@ -104,7 +333,7 @@ ngx_module_t ngx_http_ziti_module = {
     NGX_HTTP_MODULE,                 /* module type */
     NULL,    /* init master */
     NULL,    /* init module */
-    NULL,    /* init process */
+    ngx_http_ziti_init_process,      /* init process */
     NULL,    /* init thread */
     NULL,    /* exit thread */
     NULL,    /* exit process */
@@ -127,12 +356,6 @@ ngx_ziti_http_method_t ngx_ziti_http_methods[] = {
 
 uv_loop_t *uv_thread_loop;
 
-static const char *ALL_CONFIG_TYPES[] = {
-        "all",
-        NULL
-};
-
-
 /**
  * 
  */
@@ -149,7 +372,7 @@ ngx_http_ziti_preconfiguration(ngx_conf_t *cf)
 
     uv_thread_loop = uv_default_loop();
 
-    return NGX_OK;
+    return ngx_http_ziti_add_variables(cf);
 }
 
 
@@ -159,7 +382,11 @@ ngx_http_ziti_preconfiguration(ngx_conf_t *cf)
 static ngx_int_t
 ngx_http_ziti_postconfiguration(ngx_conf_t *cf)
 {
-    return NGX_OK;
+    ngx_http_ziti_main_conf_t  *zmcf;
+
+    zmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_ziti_module);
+
+    return ngx_http_ziti_bind_postconfiguration(cf, zmcf);
 }
 
 
@@ -213,6 +440,72 @@ ngx_conf_str_set(ngx_conf_t *cf, ngx_conf_str_t *cfs, ngx_str_t *s,
 }
 
 
+static void *
+ngx_http_ziti_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_ziti_main_conf_t            *zmcf;
+
+    zmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_ziti_main_conf_t));
+    if (zmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&zmcf->identities, cf->pool, 4, sizeof(ngx_http_ziti_identity_t *)) != NGX_OK) {
+        return NULL;
+    }
+
+    zmcf->loops = NGX_CONF_UNSET_UINT;
+    zmcf->loop_thread_name = NGX_CONF_UNSET;
+    zmcf->refresh_interval = NGX_CONF_UNSET;
+    zmcf->router_keepalive = NGX_CONF_UNSET;
+    zmcf->metrics_type = NGX_CONF_UNSET_UINT;
+    zmcf->config_types = NGX_CONF_UNSET_PTR;
+    zmcf->identity_watch = NGX_CONF_UNSET_MSEC;
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     zmcf->loop_cpu_affinity_auto = 0;
+     *     zmcf->loop_cpu_affinity = NULL;
+     *     zmcf->shm_zone = NULL;
+     *     zmcf->follower_refresh = 0;
+     *     zmcf->shm_leader = 0;
+     *     zmcf->status_used = 0;
+     */
+
+    return zmcf;
+}
+
+
+static char *
+ngx_http_ziti_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_ziti_main_conf_t            *zmcf = conf;
+
+    ngx_conf_init_uint_value(zmcf->loops, 1);
+    ngx_conf_init_value(zmcf->loop_thread_name, 0);
+    ngx_conf_init_value(zmcf->refresh_interval, 60);
+    ngx_conf_init_value(zmcf->router_keepalive, 10);
+    ngx_conf_init_uint_value(zmcf->metrics_type, INSTANT);
+    ngx_conf_init_ptr_value(zmcf->config_types, NULL);
+    ngx_conf_init_msec_value(zmcf->identity_watch, 0);
+
+    if (zmcf->status_used && zmcf->shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"ziti_status\" requires \"ziti_shared_zone\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (zmcf->loops < 1 || zmcf->loops > NGX_HTTP_ZITI_MAX_LOOPS) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"ziti_loops\" must be between 1 and %d", NGX_HTTP_ZITI_MAX_LOOPS);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 static void *
 ngx_http_ziti_create_loc_conf(ngx_conf_t *cf)
 {
@@ -224,6 +517,26 @@ ngx_http_ziti_create_loc_conf(ngx_conf_t *cf)
     }
 
     conf->buf_size = NGX_CONF_UNSET_SIZE;
+    conf->next_upstream_tries = NGX_CONF_UNSET_UINT;
+    conf->hedge_after = NGX_CONF_UNSET_MSEC;
+    conf->breaker_errors = NGX_CONF_UNSET_UINT;
+    conf->health_interval = NGX_CONF_UNSET_MSEC;
+    conf->unavailable_status = NGX_CONF_UNSET;
+    conf->upgrade = NGX_CONF_UNSET;
+    conf->upgrade_timeout = NGX_CONF_UNSET_MSEC;
+    conf->connect_timeout = NGX_CONF_UNSET_MSEC;
+    conf->read_timeout = NGX_CONF_UNSET_MSEC;
+    conf->keepalive_timeout = NGX_CONF_UNSET_MSEC;
+    conf->http_version = NGX_CONF_UNSET_UINT;
+    conf->http_engine = NGX_CONF_UNSET_UINT;
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->next_upstream = 0;
+     *     conf->client_pool_size = 0;
+     *     conf->client_requests = 0;
+     */
 
     return conf;
 }
@@ -234,9 +547,96 @@ ngx_http_ziti_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 {
     ngx_http_ziti_loc_conf_t *prev = parent;
     ngx_http_ziti_loc_conf_t *conf = child;
+    ngx_http_ziti_loc_conf_t **zlcfp;
 
     ngx_conf_merge_size_value(conf->buf_size, prev->buf_size, (size_t) ngx_pagesize);
 
+    if (conf->identity == NULL) {
+        conf->identity = prev->identity;
+        conf->pool = prev->pool;
+    }
+
+    if (conf->servicenames != NULL) {
+
+        if (conf->identity == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"ziti_pass\" requires a \"ziti_identity\"");
+            return NGX_CONF_ERROR;
+        }
+
+        // remember the location, so its services can be pre-warmed once the identity is up
+        zlcfp = ngx_array_push(&conf->identity->locations);
+        if (zlcfp == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *zlcfp = conf;
+    }
+
+    ngx_conf_merge_bitmask_value(conf->next_upstream, prev->next_upstream,
+                                 (NGX_CONF_BITMASK_SET
+                                  |NGX_HTTP_UPSTREAM_FT_ERROR
+                                  |NGX_HTTP_UPSTREAM_FT_TIMEOUT));
+
+    if (conf->next_upstream & NGX_HTTP_UPSTREAM_FT_OFF) {
+        conf->next_upstream = NGX_CONF_BITMASK_SET
+                              |NGX_HTTP_UPSTREAM_FT_OFF;
+    }
+
+    ngx_conf_merge_uint_value(conf->next_upstream_tries, prev->next_upstream_tries, 3);
+
+    if (conf->client_pool_size == 0 && conf->client_requests == 0) {
+        conf->client_pool_size = prev->client_pool_size;
+        conf->client_requests = prev->client_requests;
+    }
+
+    if (conf->client_pool_size == 0) {
+        conf->client_pool_size = 10;
+    }
+
+    if (conf->client_requests == 0) {
+        conf->client_requests = 1;
+    }
+
+    if (conf->hedge_after == NGX_CONF_UNSET_MSEC) {
+        conf->hedge_after = (prev->hedge_after == NGX_CONF_UNSET_MSEC) ? 0 : prev->hedge_after;
+        conf->hedge_max = prev->hedge_max;
+        conf->hedge_rate = prev->hedge_rate;
+    }
+
+    if (conf->breaker_errors == NGX_CONF_UNSET_UINT) {
+        conf->breaker_errors = (prev->breaker_errors == NGX_CONF_UNSET_UINT) ? 0 : prev->breaker_errors;
+        conf->breaker_min_requests = prev->breaker_min_requests;
+        conf->breaker_window = prev->breaker_window;
+        conf->breaker_open_time = prev->breaker_open_time;
+        conf->breaker_latency = prev->breaker_latency;
+        conf->breaker_probes = prev->breaker_probes;
+        conf->breaker_status = prev->breaker_status;
+    }
+
+    if (conf->health_interval == NGX_CONF_UNSET_MSEC) {
+        conf->health_interval = prev->health_interval;
+        conf->health_uri = prev->health_uri;
+    }
+
+    ngx_conf_merge_value(conf->unavailable_status, prev->unavailable_status, NGX_HTTP_SERVICE_UNAVAILABLE);
+
+    ngx_conf_merge_value(conf->upgrade, prev->upgrade, 0);
+    ngx_conf_merge_msec_value(conf->upgrade_timeout, prev->upgrade_timeout, 60000);
+
+    ngx_conf_merge_msec_value(conf->connect_timeout, prev->connect_timeout, 60000);
+    ngx_conf_merge_msec_value(conf->read_timeout, prev->read_timeout, 60000);
+    ngx_conf_merge_msec_value(conf->keepalive_timeout, prev->keepalive_timeout, 60000);
+
+    ngx_conf_merge_uint_value(conf->http_version, prev->http_version, NGX_HTTP_VERSION_11);
+    ngx_conf_merge_uint_value(conf->http_engine, prev->http_engine, NGX_HTTP_ZITI_ENGINE_UM_HTTP);
+
+#if !(NGX_HTTP_ZITI_HAVE_NGHTTP2)
+    if (conf->http_version == NGX_HTTP_VERSION_20) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"ziti_http_version 2\" requires the module to be built with libnghttp2");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
     return NGX_CONF_OK;
 }
 
@@ -248,19 +648,39 @@ ngx_http_ziti_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_ziti_loc_conf_t   *zlcf = conf;
     ngx_str_t                  *value = cf->args->elts;
     ngx_conf_str_t              servicename;
+    ngx_uint_t                  i;
+    char                      **name;
 
     if (zlcf->servicename != NULL) {
         return "is duplicate";
     }
 
-    if (ngx_conf_str_set(cf, &servicename, &value[1], "ziti_pass", &cmd->name, 1))
-    {
+    zlcf->servicenames = ngx_array_create(cf->pool, cf->args->nelts - 1, sizeof(char *));
+    if (zlcf->servicenames == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    ZITI_LOG(INFO, "servicename is: %s", servicename.sv.data);
+    //
+    // Any services beyond the first are failover targets used by ziti_next_upstream
+    //
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_conf_str_set(cf, &servicename, &value[i], "ziti_pass", &cmd->name, 1))
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        ZITI_LOG(INFO, "servicename is: %s", servicename.sv.data);
+
+        name = ngx_array_push(zlcf->servicenames);
+        if (name == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *name = strdup((char*)servicename.sv.data);
+    }
 
-    zlcf->servicename = strdup((char*)servicename.sv.data);  
+    zlcf->servicename = ((char **) zlcf->servicenames->elts)[0];
 
     clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
 
@@ -286,185 +706,1699 @@ uv_thread_loop_func(void *data){
 /**
  * 
  */
-static void on_ziti_event(ziti_context _ztx, const ziti_event_t *event) {
+/**
+ * Result of the service lookup issued when a context comes up
+ */
+static void
+on_ziti_service_available(ziti_context ztx, ziti_service *service, int status, void *data)
+{
+    ngx_http_ziti_loop_t *loop = ziti_app_ctx(ztx);
+    char                 *servicename = data;
 
-    ngx_http_ziti_loc_conf_t *zlcf;
+    if (status != ZITI_OK) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: service \"%s\" is not available to identity \"%s\": %s",
+                      servicename, loop->identity->identity_path, ziti_errorstr(status));
+        return;
+    }
 
-    switch (event->type) {
+    ZITI_LOG(DEBUG, "service '%s' available on loop %lu", servicename, (unsigned long) loop->index);
+}
 
-    case ZitiContextEvent:
 
-        zlcf = (ngx_http_ziti_loc_conf_t*)ziti_app_ctx(_ztx);
+/**
+ * Fetch the services routed to by every location using this loop's identity and build their
+ * client pools, so none of that waits for the first request
+ */
+static void
+ngx_http_ziti_prewarm(ngx_http_ziti_loop_t *loop, ziti_context ztx, struct ListMap *pools)
+{
+    ngx_http_ziti_loc_conf_t  **locations;
+    char                      **names;
+    ngx_uint_t                  i, n;
 
-        // Save the global ztx context variable in the zlcf
-        zlcf->ztx = _ztx;
+    locations = loop->identity->locations.elts;
 
-        if (event->event.ctx.ctrl_status == ZITI_OK) {
+    for (i = 0; i < loop->identity->locations.nelts; i++) {
 
-            const ziti_version *ctrl_ver = ziti_get_controller_version(_ztx);
-            const ziti_identity *proxy_id = ziti_get_identity(_ztx);
+        names = locations[i]->servicenames->elts;
 
-            ZITI_LOG(INFO, "controller version = %s(%s)[%s]", ctrl_ver->version, ctrl_ver->revision, ctrl_ver->build_date);
-            ZITI_LOG(INFO, "identity = <%s>[%s]@%s", proxy_id->name, proxy_id->id, ziti_get_controller(zlcf->ztx));
+        for (n = 0; n < locations[i]->servicenames->nelts; n++) {
+            ziti_service_available(ztx, names[n], on_ziti_service_available, names[n]);
+        }
 
-            zlcf->state = ZS_LOC_ZITI_INIT_COMPLETED;
+        ngx_http_ziti_pool_prewarm(loop, pools, locations[i], ngx_cycle->log);
+    }
+}
 
-        }
-        else {
 
-            ZITI_LOG(ERROR, "Failed to connect to controller: %s", event->event.ctx.err);
+static void on_ziti_event(ziti_context _ztx, const ziti_event_t *event);
+static void ngx_http_ziti_reload_start(ngx_http_ziti_loop_t *loop);
 
-            exit(-1);
-        }
-        break;
 
-    default:
-        break;
+/**
+ * Runs on the loop thread while the pools of the previous context drain.  Once no request or
+ * session is pinned to them and none of their clients is in use, the old context is shut down
+ * and its pools freed.  Pins are taken under pools_lock, so none can come after the switch.
+ */
+static void
+ngx_http_ziti_drain(uv_timer_t *timer)
+{
+    ngx_http_ziti_loop_t *loop = timer->data;
+
+    if (ngx_http_ziti_pools_busy(loop->draining_pools)) {
+        return;
+    }
+
+    uv_timer_stop(timer);
+
+    ZITI_LOG(INFO, "identity %s, loop %lu: previous context drained, shutting it down",
+             loop->identity->identity_path, (unsigned long) loop->index);
+
+    ngx_http_ziti_pools_free(loop->draining_pools);
+    loop->draining_pools = NULL;
+
+    loop->retired = loop->draining_ztx;
+    loop->draining_ztx = NULL;
+    ziti_shutdown(loop->retired);
+
+    if (loop->reload_pending) {
+        ngx_http_ziti_reload_start(loop);
     }
 }
 
 
-ngx_int_t
-ngx_http_ziti_start_uv_loop(ngx_http_ziti_loc_conf_t *zlcf, ngx_log_t *log)
+/**
+ * The context built from the rotated identity file came up: give it pools, then switch new
+ * requests over to it and let the old one drain
+ */
+static void
+ngx_http_ziti_reload_event(ngx_http_ziti_loop_t *loop, ziti_context ztx, const ziti_event_t *event)
 {
-    ngx_int_t                      rc;
+    if (event->event.ctx.ctrl_status != ZITI_OK) {
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "ngx_http_ziti_start_uv_loop: entered");
+        ZITI_LOG(ERROR, "identity %s, loop %lu: reloaded identity failed (%s), keeping the current one",
+                 loop->identity->identity_path, (unsigned long) loop->index, event->event.ctx.err);
 
-    zlcf->ztx = NGX_CONF_UNSET_PTR;
-    zlcf->uv_thread_loop = uv_loop_new();
-    uv_async_init(zlcf->uv_thread_loop, &zlcf->async, (uv_async_cb)nop);
+        ngx_http_ziti_pools_free(loop->next_pools);
+        loop->next_pools = NULL;
+        loop->reloading = 0;
 
-    // Create the libuv thread loop
-    zlcf->uv_thread_loop = uv_loop_new();
-    uv_async_init(zlcf->uv_thread_loop, &zlcf->async, (uv_async_cb)nop);
-    uv_thread_create(&zlcf->thread, (uv_thread_cb)uv_thread_loop_func, zlcf->uv_thread_loop);
+        loop->retired = ztx;
+        ziti_shutdown(ztx);
 
-    ziti_options *opts = ngx_calloc(sizeof(ziti_options), log);
+        if (loop->reload_pending) {
+            ngx_http_ziti_reload_start(loop);
+        }
 
-    opts->config = (char*)zlcf->identity_path;
+        return;
+    }
 
-    opts->events = ZitiContextEvent;
-    opts->event_cb = on_ziti_event;
-    opts->refresh_interval = 60;
-    opts->router_keepalive = 10;
-    opts->app_ctx = zlcf;
-    opts->config_types = ALL_CONFIG_TYPES;
-    opts->metrics_type = INSTANT;
+    ngx_http_ziti_pools_bind(loop->next_pools, ztx);
 
-    rc = ziti_init_opts(opts, zlcf->uv_thread_loop);
+    ngx_http_ziti_prewarm(loop, ztx, loop->next_pools);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "ziti_init_opts returned %d", rc);
+    loop->draining_pools = loop->pools;
+    loop->draining_ztx = loop->ztx;
 
-    return NGX_OK;
-}
+    uv_mutex_lock(&loop->pools_lock);
+    loop->pools = loop->next_pools;
+    uv_mutex_unlock(&loop->pools_lock);
 
+    loop->ztx = ztx;
 
-static char *
-ngx_http_ziti_identity(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_ziti_loc_conf_t   *zlcf = conf;
-    ngx_str_t                  *value = cf->args->elts;
-    ngx_conf_str_t              identity_path;
+    loop->next_pools = NULL;
+    loop->reloading = 0;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "ngx_http_ziti_identity: entered");
+    ngx_atomic_fetch_add(&loop->reloads, 1);
+    ngx_http_ziti_stat_add(loop->identity->stats, reloads, 1);
 
-    if (zlcf->identity_path != NULL) {
-        return "is duplicate";
-    }
+    ZITI_LOG(INFO, "identity %s, loop %lu: switched to the reloaded identity", loop->identity->identity_path, (unsigned long) loop->index);
 
-    zlcf->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cf->log);
-    if (zlcf->pool == NULL) {
-        return NGX_CONF_ERROR;
+    if (!loop->drain_timer_ready) {
+        uv_timer_init(loop->uv_thread_loop, &loop->drain_timer);
+        loop->drain_timer.data = loop;
+        loop->drain_timer_ready = 1;
     }
 
-    if (ngx_conf_str_set(cf, &identity_path, &value[1], "ziti_identity", &cmd->name, 1))
-    {
-        return NGX_CONF_ERROR;
+    uv_timer_start(&loop->drain_timer, ngx_http_ziti_drain, NGX_HTTP_ZITI_POOL_MAINT_INTERVAL, NGX_HTTP_ZITI_POOL_MAINT_INTERVAL);
+}
+
+
+/**
+ * ziti_identity_watch: the identity file changed, bring up a second context from it
+ */
+static void
+ngx_http_ziti_identity_changed(uv_fs_poll_t *handle, int status, const uv_stat_t *prev, const uv_stat_t *curr)
+{
+    ngx_http_ziti_loop_t *loop = handle->data;
+
+    if (status != 0) {
+        ZITI_LOG(WARN, "cannot watch identity %s: %s", loop->identity->identity_path, uv_strerror(status));
+        return;
     }
 
-    zlcf->identity_path = strdup((char*)identity_path.sv.data);  
+    if (loop->reloading || loop->draining_pools) {
+        ZITI_LOG(INFO, "identity %s changed while a reload is still in progress on loop %lu, reloading it once that is over",
+                 loop->identity->identity_path, (unsigned long) loop->index);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "identity_path is: %s", zlcf->identity_path);
+        loop->reload_pending = 1;
+        return;
+    }
 
-    ngx_http_ziti_start_uv_loop(zlcf, cf->log);
+    ZITI_LOG(INFO, "identity %s changed, reloading it on loop %lu", loop->identity->identity_path, (unsigned long) loop->index);
 
-    return NGX_CONF_OK;
+    ngx_http_ziti_reload_start(loop);
 }
 
 
-static char *
-ngx_http_ziti_client_pool_size(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+/**
+ * Bring up a second context from the identity file, see ngx_http_ziti_reload_event()
+ */
+static void
+ngx_http_ziti_reload_start(ngx_http_ziti_loop_t *loop)
 {
-    ngx_http_ziti_loc_conf_t                    *zlcf = conf;
-    ngx_str_t                                   *value;
-    ngx_uint_t                                   i;
-    ngx_int_t                                    n;
-    u_char                                      *data;
-    ngx_uint_t                                   len;
+    loop->reload_pending = 0;
 
-    if (zlcf->client_pool_size) {
-        return "is duplicate";
+    loop->next_pools = ngx_http_ziti_pools_create(ngx_cycle->log);
+    if (loop->next_pools == NULL) {
+        return;
     }
 
-    value = cf->args->elts;
+    loop->reloading = 1;
 
-    for (i = 1; i < cf->args->nelts; i++) {
+    ziti_init_opts(loop->opts, loop->uv_thread_loop);
+}
 
-        if (ngx_http_ziti_strcmp_const(value[i].data, "max=") == 0)
-        {
-            len = value[i].len - (sizeof("max=") - 1);
-            data = &value[i].data[sizeof("max=") - 1];
 
-            n = ngx_atoi(data, len);
+static void
+ngx_http_ziti_identity_watch(ngx_http_ziti_loop_t *loop)
+{
+    ngx_http_ziti_main_conf_t *zmcf;
 
-            if (n == NGX_ERROR || n < 5) {  // enforce a minimum of 5 clients
+    zmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_ziti_module);
+
+    // identities named only in stream{} have no http{} settings to go by
+    if (zmcf == NULL || zmcf->identity_watch == 0) {
+        return;
+    }
+
+    uv_fs_poll_init(loop->uv_thread_loop, &loop->identity_poll);
+    loop->identity_poll.data = loop;
+
+    uv_fs_poll_start(&loop->identity_poll, ngx_http_ziti_identity_changed, loop->identity->identity_path,
+                     (unsigned int) zmcf->identity_watch);
+}
+
+
+/**
+ * Runs on the loop thread once the backoff has elapsed: drop the context the controller refused
+ * and bring up a fresh one
+ */
+static void
+ngx_http_ziti_reconnect(uv_timer_t *timer)
+{
+    ngx_http_ziti_loop_t *loop = timer->data;
+
+    if (loop->state == ZS_LOC_ZITI_INIT_COMPLETED) {
+        return;
+    }
+
+    ngx_atomic_fetch_add(&loop->reconnects, 1);
+    ngx_http_ziti_stat_add(loop->identity->stats, reconnects, 1);
+
+    ZITI_LOG(INFO, "reconnecting identity %s, loop %lu (attempt %lu)", loop->identity->identity_path,
+             (unsigned long) loop->index, (unsigned long) loop->reconnects);
+
+    if (loop->ztx != NGX_CONF_UNSET_PTR) {
+        loop->retired = loop->ztx;
+        loop->ztx = NGX_CONF_UNSET_PTR;
+        ziti_shutdown(loop->retired);
+    }
+
+    ziti_init_opts(loop->opts, loop->uv_thread_loop);
+}
+
+
+/**
+ * The controller could not be reached.  Never fatal: a context that was up keeps dialing with the
+ * sessions it has, one that never came up is retried with exponential backoff.
+ */
+static void
+ngx_http_ziti_ctrl_down(ngx_http_ziti_loop_t *loop, const ziti_event_t *event)
+{
+    if (!loop->unavailable) {
+        loop->outage_start = uv_now(loop->uv_thread_loop);
+        ngx_atomic_fetch_add(&loop->outages, 1);
+        ngx_http_ziti_stat_add(loop->identity->stats, outages, 1);
+        loop->unavailable = 1;
+    }
+
+    if (loop->state == ZS_LOC_ZITI_INIT_COMPLETED) {
+        ZITI_LOG(WARN, "controller unreachable (%s), loop %lu keeps serving over its existing sessions",
+                 event->event.ctx.err, (unsigned long) loop->index);
+        return;
+    }
+
+    if (!loop->reconnect_timer_ready) {
+        uv_timer_init(loop->uv_thread_loop, &loop->reconnect_timer);
+        loop->reconnect_timer.data = loop;
+        loop->reconnect_timer_ready = 1;
+    }
+
+    if (uv_is_active((uv_handle_t *) &loop->reconnect_timer)) {
+        return;
+    }
+
+    ZITI_LOG(ERROR, "Failed to connect to controller: %s, retrying loop %lu in %lu ms", event->event.ctx.err,
+             (unsigned long) loop->index, (unsigned long) loop->backoff);
+
+    uv_timer_start(&loop->reconnect_timer, ngx_http_ziti_reconnect, loop->backoff, 0);
+
+    loop->backoff = ngx_min(loop->backoff * 2, NGX_HTTP_ZITI_RECONNECT_MAX);
+}
+
+
+static void
+ngx_http_ziti_ctrl_up(ngx_http_ziti_loop_t *loop)
+{
+    uint64_t                    outage;
+
+    loop->backoff = NGX_HTTP_ZITI_RECONNECT_MIN;
+
+    if (!loop->unavailable) {
+        return;
+    }
+
+    outage = uv_now(loop->uv_thread_loop) - loop->outage_start;
+
+    ngx_atomic_fetch_add(&loop->outage_msec, (ngx_atomic_int_t) outage);
+    ngx_http_ziti_stat_add(loop->identity->stats, outage_msec, outage);
+
+    loop->unavailable = 0;
+
+    ZITI_LOG(INFO, "controller reachable again after %lu ms, loop %lu", (unsigned long) outage, (unsigned long) loop->index);
+}
+
+
+/**
+ * Runs on the loop thread: replace this loop's share of its identity's transfer rates with a
+ * fresh sample from libziti
+ */
+static void
+ngx_http_ziti_metrics_sample(uv_timer_t *timer)
+{
+    ngx_http_ziti_loop_t       *loop = timer->data;
+    double                      up, down;
+    ngx_atomic_int_t            rate_up, rate_down;
+
+    if (loop->ztx == NGX_CONF_UNSET_PTR) {
+        return;
+    }
+
+    up = 0;
+    down = 0;
+
+    ziti_get_transfer_rates(loop->ztx, &up, &down);
+
+    rate_up = (ngx_atomic_int_t) up;
+    rate_down = (ngx_atomic_int_t) down;
+
+    ngx_http_ziti_stat_add(loop->identity->stats, rate_up, rate_up - loop->rate_up);
+    ngx_http_ziti_stat_add(loop->identity->stats, rate_down, rate_down - loop->rate_down);
+
+    loop->rate_up = rate_up;
+    loop->rate_down = rate_down;
+}
+
+
+static void
+ngx_http_ziti_metrics_start(ngx_http_ziti_loop_t *loop)
+{
+    if (loop->identity->stats == NULL || loop->metrics_timer_ready) {
+        return;
+    }
+
+    uv_timer_init(loop->uv_thread_loop, &loop->metrics_timer);
+    loop->metrics_timer.data = loop;
+    loop->metrics_timer_ready = 1;
+
+    uv_timer_start(&loop->metrics_timer, ngx_http_ziti_metrics_sample, NGX_HTTP_ZITI_METRICS_INTERVAL, NGX_HTTP_ZITI_METRICS_INTERVAL);
+}
+
+
+/**
+ * ziti_shared_zone follower: the leader saw this identity's services change, so refresh this
+ * loop's context now instead of waiting for follower_refresh
+ */
+static void
+ngx_http_ziti_follow(uv_timer_t *timer)
+{
+    ngx_http_ziti_loop_t       *loop = timer->data;
+    ngx_atomic_uint_t           generation;
+
+    generation = loop->identity->stats->generation;
+
+    if (generation == loop->generation || loop->ztx == NGX_CONF_UNSET_PTR) {
+        return;
+    }
+
+    ZITI_LOG(DEBUG, "identity %s, loop %lu: leader saw services change, refreshing",
+             loop->identity->identity_path, (unsigned long) loop->index);
+
+    loop->generation = generation;
+
+    ziti_refresh(loop->ztx);
+}
+
+
+static void
+ngx_http_ziti_follow_start(ngx_http_ziti_loop_t *loop)
+{
+    ngx_http_ziti_main_conf_t  *zmcf;
+
+    zmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_ziti_module);
+
+    if (zmcf->shm_leader || loop->identity->stats == NULL || loop->follow_timer_ready) {
+        return;
+    }
+
+    // the context has just loaded its services
+    loop->generation = loop->identity->stats->generation;
+
+    uv_timer_init(loop->uv_thread_loop, &loop->follow_timer);
+    loop->follow_timer.data = loop;
+    loop->follow_timer_ready = 1;
+
+    uv_timer_start(&loop->follow_timer, ngx_http_ziti_follow, NGX_HTTP_ZITI_FOLLOW_INTERVAL, NGX_HTTP_ZITI_FOLLOW_INTERVAL);
+}
+
+
+/**
+ * Keep the ziti_shared_zone edge router table up to date.  A loop counts once per router however
+ * many of its contexts (during an identity reload) are connected to it.
+ */
+static void
+ngx_http_ziti_router_event(ngx_http_ziti_loop_t *loop, const struct ziti_router_event *event)
+{
+    ngx_http_ziti_shm_router_t *er;
+    ngx_uint_t                  i;
+
+    er = ngx_http_ziti_shm_router_get(loop->identity->index, event);
+    if (er == NULL) {
+        return;
+    }
+
+    for (i = 0; i < loop->nrouters; i++) {
+        if (loop->routers[i] == er) {
+            break;
+        }
+    }
+
+    switch (event->status) {
+
+    case EdgeRouterConnected:
+
+        ZITI_LOG(INFO, "identity %s, loop %lu: connected to edge router %s (%s)", loop->identity->identity_path,
+                 (unsigned long) loop->index, event->name, event->address ? event->address : "-");
+
+        ngx_atomic_fetch_add(&er->connects, 1);
+
+        if (i == loop->nrouters && loop->nrouters < NGX_HTTP_ZITI_MAX_ROUTERS) {
+            loop->routers[loop->nrouters++] = er;
+            ngx_atomic_fetch_add(&er->connected, 1);
+        }
+        break;
+
+    case EdgeRouterDisconnected:
+    case EdgeRouterRemoved:
+
+        ZITI_LOG(WARN, "identity %s, loop %lu: %s edge router %s", loop->identity->identity_path,
+                 (unsigned long) loop->index, event->status == EdgeRouterRemoved ? "removed" : "disconnected from",
+                 event->name);
+
+        if (event->status == EdgeRouterDisconnected) {
+            ngx_atomic_fetch_add(&er->disconnects, 1);
+        }
+
+        if (i < loop->nrouters) {
+            loop->routers[i] = loop->routers[--loop->nrouters];
+            ngx_atomic_fetch_add(&er->connected, -1);
+        }
+        break;
+
+    case EdgeRouterUnavailable:
+
+        ZITI_LOG(WARN, "identity %s, loop %lu: edge router %s is unavailable", loop->identity->identity_path,
+                 (unsigned long) loop->index, event->name);
+
+        ngx_atomic_fetch_add(&er->failures, 1);
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+static void on_ziti_event(ziti_context _ztx, const ziti_event_t *event) {
+
+    ngx_http_ziti_loop_t *loop;
+    ngx_http_ziti_main_conf_t *zmcf;
+
+    loop = (ngx_http_ziti_loop_t*)ziti_app_ctx(_ztx);
+
+    // Ignore whatever a context that was shut down or is draining still reports
+    if (_ztx == loop->retired || _ztx == loop->draining_ztx) {
+        return;
+    }
+
+    if (loop->reloading && _ztx != loop->ztx) {
+        if (event->type == ZitiContextEvent) {
+            ngx_http_ziti_reload_event(loop, _ztx, event);
+
+        } else if (event->type == ZitiRouterEvent) {
+            ngx_http_ziti_router_event(loop, &event->event.router);
+        }
+        return;
+    }
+
+    // ... or a context this loop has already moved away from
+    if (loop->ztx != NGX_CONF_UNSET_PTR && _ztx != loop->ztx) {
+        return;
+    }
+
+    switch (event->type) {
+
+    case ZitiContextEvent:
+
+        // Save the ztx context in the loop shared by all locations using its identity
+        loop->ztx = _ztx;
+
+        if (event->event.ctx.ctrl_status == ZITI_OK) {
+
+            const ziti_version *ctrl_ver = ziti_get_controller_version(_ztx);
+            const ziti_identity *proxy_id = ziti_get_identity(_ztx);
+
+            ZITI_LOG(INFO, "controller version = %s(%s)[%s]", ctrl_ver->version, ctrl_ver->revision, ctrl_ver->build_date);
+            ZITI_LOG(INFO, "identity = <%s>[%s]@%s, loop %lu", proxy_id->name, proxy_id->id, ziti_get_controller(loop->ztx), (unsigned long) loop->index);
+
+            ngx_http_ziti_ctrl_up(loop);
+
+            if (loop->state != ZS_LOC_ZITI_INIT_COMPLETED) {
+                ngx_http_ziti_pools_bind(loop->pools, _ztx);
+
+                ngx_http_ziti_prewarm(loop, _ztx, loop->pools);
+
+                loop->state = ZS_LOC_ZITI_INIT_COMPLETED;
+
+                ngx_http_ziti_identity_watch(loop);
+
+                ngx_http_ziti_metrics_start(loop);
+
+                ngx_http_ziti_follow_start(loop);
+            }
+
+        }
+        else {
+
+            ngx_http_ziti_ctrl_down(loop, event);
+        }
+        break;
+
+    case ZitiServiceEvent:
+
+        zmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_ziti_module);
+
+        // the first event only lists what the context loaded at startup, which followers load too
+        if (loop->services_loaded) {
+            ngx_http_ziti_shm_services_changed(zmcf, loop->identity, &event->event.service);
+        }
+
+        loop->services_loaded = 1;
+        break;
+
+    case ZitiRouterEvent:
+
+        ngx_http_ziti_router_event(loop, &event->event.router);
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+ngx_int_t
+ngx_http_ziti_start_uv_loop(ngx_http_ziti_main_conf_t *zmcf, ngx_http_ziti_loop_t *loop, ngx_log_t *log)
+{
+    ngx_int_t                      rc;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "ngx_http_ziti_start_uv_loop: entered for identity %s, loop %d", loop->identity->identity_path, loop->index);
+
+    loop->ztx = NGX_CONF_UNSET_PTR;
+
+    // Create the libuv thread loop
+    loop->uv_thread_loop = uv_loop_new();
+    uv_async_init(loop->uv_thread_loop, &loop->async, (uv_async_cb)nop);
+    uv_thread_create(&loop->thread, (uv_thread_cb)uv_thread_loop_func, loop->uv_thread_loop);
+
+    loop->state = ZS_LOC_ZITI_INIT_STARTED;
+
+    ziti_options *opts = ngx_calloc(sizeof(ziti_options), log);
+
+    opts->config = (char*)loop->identity->identity_path;
+
+    opts->events = ZitiContextEvent;
+    opts->event_cb = on_ziti_event;
+    opts->refresh_interval = zmcf->refresh_interval;
+
+    //
+    // With ziti_shared_zone only the leader polls the controller at the usual rate, and only its
+    // first loop per identity reports service changes; followers refresh when it does, and
+    // otherwise fall back to follower_refresh
+    //
+    if (zmcf->shm_zone) {
+        if (!zmcf->shm_leader) {
+            opts->refresh_interval = zmcf->follower_refresh / 1000;
+
+        } else if (loop->index == 0) {
+            opts->events |= ZitiServiceEvent;
+        }
+
+        // every loop has edge router connections of its own
+        opts->events |= ZitiRouterEvent;
+    }
+    opts->router_keepalive = (int) zmcf->router_keepalive;
+    opts->app_ctx = loop;
+    opts->config_types = zmcf->config_types;
+    opts->metrics_type = (rate_type) zmcf->metrics_type;
+
+    // kept for ngx_http_ziti_reconnect()
+    loop->opts = opts;
+    loop->backoff = NGX_HTTP_ZITI_RECONNECT_MIN;
+
+    rc = ziti_init_opts(opts, loop->uv_thread_loop);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "ziti_init_opts returned %d", rc);
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_ziti_identity(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ziti_loc_conf_t   *zlcf = conf;
+    ngx_str_t                  *value = cf->args->elts;
+    ngx_conf_str_t              identity_path;
+    ngx_http_ziti_main_conf_t  *zmcf;
+    ngx_http_ziti_identity_t  **identities, **idp, *identity;
+    ngx_uint_t                  i;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "ngx_http_ziti_identity: entered");
+
+    if (zlcf->identity != NULL) {
+        return "is duplicate";
+    }
+
+    zlcf->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cf->log);
+    if (zlcf->pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_conf_str_set(cf, &identity_path, &value[1], "ziti_identity", &cmd->name, 1))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "identity_path is: %V", &identity_path.sv);
+
+    //
+    // Every location naming the same identity file shares one Ziti context
+    //
+    zmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_ziti_module);
+
+    identities = zmcf->identities.elts;
+
+    for (i = 0; i < zmcf->identities.nelts; i++) {
+        if (ngx_strcmp(identities[i]->identity_path, identity_path.sv.data) == 0) {
+            zlcf->identity = identities[i];
+            return NGX_CONF_OK;
+        }
+    }
+
+    identity = ngx_pcalloc(cf->pool, sizeof(ngx_http_ziti_identity_t));
+    if (identity == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    identity->identity_path = strdup((char*)identity_path.sv.data);  
+    identity->index = zmcf->identities.nelts;
+
+    if (ngx_array_init(&identity->locations, cf->pool, 4, sizeof(ngx_http_ziti_loc_conf_t *)) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    idp = ngx_array_push(&zmcf->identities);
+    if (idp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *idp = identity;
+
+    zlcf->identity = identity;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_ziti_client_pool_size(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ziti_loc_conf_t                    *zlcf = conf;
+    ngx_str_t                                   *value;
+    ngx_uint_t                                   i;
+    ngx_int_t                                    n;
+    u_char                                      *data;
+    ngx_uint_t                                   len;
+
+    if (zlcf->client_pool_size || zlcf->client_requests) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_http_ziti_strcmp_const(value[i].data, "max=") == 0)
+        {
+            len = value[i].len - (sizeof("max=") - 1);
+            data = &value[i].data[sizeof("max=") - 1];
+
+            n = ngx_atoi(data, len);
+
+            if (n == NGX_ERROR || n < 5) {  // enforce a minimum of 5 clients
+
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"max\" value \"%V\" "
+                                   "in \"%V\" directive; must be at least 5",
+                                   &value[i], &cmd->name);
+
+                return NGX_CONF_ERROR;
+            }
+
+            zlcf->client_pool_size = n;
+
+            ZITI_LOG(INFO, "client_pool_size is: %d", zlcf->client_pool_size);
+
+            continue;
+        }
+
+        if (ngx_http_ziti_strcmp_const(value[i].data, "requests=") == 0)
+        {
+            len = value[i].len - (sizeof("requests=") - 1);
+            data = &value[i].data[sizeof("requests=") - 1];
+
+            n = ngx_atoi(data, len);
+
+            if (n == NGX_ERROR || n < 1) {
+
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"requests\" value \"%V\" "
+                                   "in \"%V\" directive; must be at least 1",
+                                   &value[i], &cmd->name);
+
+                return NGX_CONF_ERROR;
+            }
+
+            zlcf->client_requests = n;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "ngx_http_ziti_module: invalid parameter \"%V\" in"
+                           " \"%V\" directive",
+                           &value[i], &cmd->name);
+
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_http_ziti_buffer_size(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char            *p = conf;
+    size_t           *sp;
+    ngx_str_t        *value;
+
+    sp = (size_t *) (p + cmd->offset);
+    if (*sp != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    *sp = ngx_parse_size(&value[1]);
+    if (*sp == (size_t) NGX_ERROR) {
+        return "invalid value";
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_ziti_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ziti_loc_conf_t                    *zlcf = conf;
+    ngx_str_t                                   *value, s;
+    ngx_uint_t                                   i;
+    ngx_int_t                                    n;
+    ngx_msec_t                                   after;
+
+    if (zlcf->hedge_after != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        zlcf->hedge_after = 0;
+        return NGX_CONF_OK;
+    }
+
+    after = 0;
+    zlcf->hedge_max = 1;
+    zlcf->hedge_rate = 10;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_http_ziti_strcmp_const(value[i].data, "after=") == 0)
+        {
+            s.len = value[i].len - (sizeof("after=") - 1);
+            s.data = &value[i].data[sizeof("after=") - 1];
+
+            after = ngx_parse_time(&s, 0);
+
+            if (after == (ngx_msec_t) NGX_ERROR || after == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"after\" value \"%V\" "
+                                   "in \"%V\" directive",
+                                   &value[i], &cmd->name);
+
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_http_ziti_strcmp_const(value[i].data, "max=") == 0)
+        {
+            n = ngx_atoi(&value[i].data[sizeof("max=") - 1], value[i].len - (sizeof("max=") - 1));
+
+            if (n == NGX_ERROR || n < 1) {
 
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                                    "invalid \"max\" value \"%V\" "
-                                   "in \"%V\" directive; must be at least 5",
+                                   "in \"%V\" directive; must be at least 1",
+                                   &value[i], &cmd->name);
+
+                return NGX_CONF_ERROR;
+            }
+
+            zlcf->hedge_max = n;
+
+            continue;
+        }
+
+        if (ngx_http_ziti_strcmp_const(value[i].data, "rate=") == 0)
+        {
+            n = ngx_atoi(&value[i].data[sizeof("rate=") - 1], value[i].len - (sizeof("rate=") - 1));
+
+            if (n == NGX_ERROR || n < 1 || n > 100) {
+
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"rate\" value \"%V\" "
+                                   "in \"%V\" directive; must be between 1 and 100",
+                                   &value[i], &cmd->name);
+
+                return NGX_CONF_ERROR;
+            }
+
+            zlcf->hedge_rate = n;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "ngx_http_ziti_module: invalid parameter \"%V\" in"
+                           " \"%V\" directive",
+                           &value[i], &cmd->name);
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (after == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"after\" is required in \"%V\" directive",
+                           &cmd->name);
+
+        return NGX_CONF_ERROR;
+    }
+
+    zlcf->hedge_after = after;
+
+    ZITI_LOG(INFO, "hedging after %lums, max: %lu, rate: %lu%%", (unsigned long) after, (unsigned long) zlcf->hedge_max, (unsigned long) zlcf->hedge_rate);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_ziti_circuit_breaker(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ziti_loc_conf_t                    *zlcf = conf;
+    ngx_str_t                                   *value, s;
+    ngx_uint_t                                   i;
+    ngx_int_t                                    n;
+    ngx_msec_t                                   ms, *msp;
+
+    if (zlcf->breaker_errors != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        zlcf->breaker_errors = 0;
+        return NGX_CONF_OK;
+    }
+
+    zlcf->breaker_errors = 0;
+    zlcf->breaker_min_requests = 20;
+    zlcf->breaker_window = 10000;
+    zlcf->breaker_open_time = 10000;
+    zlcf->breaker_latency = 0;
+    zlcf->breaker_probes = 3;
+    zlcf->breaker_status = NGX_HTTP_SERVICE_UNAVAILABLE;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_http_ziti_strcmp_const(value[i].data, "errors=") == 0)
+        {
+            s.len = value[i].len - (sizeof("errors=") - 1);
+            s.data = &value[i].data[sizeof("errors=") - 1];
+
+            if (s.len && s.data[s.len - 1] == '%') {
+                s.len--;
+            }
+
+            n = ngx_atoi(s.data, s.len);
+
+            if (n == NGX_ERROR || n < 1 || n > 100) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"errors\" value \"%V\" "
+                                   "in \"%V\" directive; must be between 1 and 100 percent",
+                                   &value[i], &cmd->name);
+
+                return NGX_CONF_ERROR;
+            }
+
+            zlcf->breaker_errors = n;
+
+            continue;
+        }
+
+        if (ngx_http_ziti_strcmp_const(value[i].data, "min_requests=") == 0)
+        {
+            n = ngx_atoi(&value[i].data[sizeof("min_requests=") - 1], value[i].len - (sizeof("min_requests=") - 1));
+
+            if (n == NGX_ERROR || n < 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"min_requests\" value \"%V\" "
+                                   "in \"%V\" directive; must be at least 1",
+                                   &value[i], &cmd->name);
+
+                return NGX_CONF_ERROR;
+            }
+
+            zlcf->breaker_min_requests = n;
+
+            continue;
+        }
+
+        if (ngx_http_ziti_strcmp_const(value[i].data, "probes=") == 0)
+        {
+            n = ngx_atoi(&value[i].data[sizeof("probes=") - 1], value[i].len - (sizeof("probes=") - 1));
+
+            if (n == NGX_ERROR || n < 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"probes\" value \"%V\" "
+                                   "in \"%V\" directive; must be at least 1",
+                                   &value[i], &cmd->name);
+
+                return NGX_CONF_ERROR;
+            }
+
+            zlcf->breaker_probes = n;
+
+            continue;
+        }
+
+        if (ngx_http_ziti_strcmp_const(value[i].data, "status=") == 0)
+        {
+            n = ngx_atoi(&value[i].data[sizeof("status=") - 1], value[i].len - (sizeof("status=") - 1));
+
+            if (n == NGX_ERROR || n < 400 || n > 599) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"status\" value \"%V\" "
+                                   "in \"%V\" directive; must be between 400 and 599",
+                                   &value[i], &cmd->name);
+
+                return NGX_CONF_ERROR;
+            }
+
+            zlcf->breaker_status = n;
+
+            continue;
+        }
+
+        //
+        // The remaining parameters are all times
+        //
+        if (ngx_http_ziti_strcmp_const(value[i].data, "window=") == 0) {
+            s.len = sizeof("window=") - 1;
+            msp = &zlcf->breaker_window;
+
+        } else if (ngx_http_ziti_strcmp_const(value[i].data, "open=") == 0) {
+            s.len = sizeof("open=") - 1;
+            msp = &zlcf->breaker_open_time;
+
+        } else if (ngx_http_ziti_strcmp_const(value[i].data, "latency=") == 0) {
+            s.len = sizeof("latency=") - 1;
+            msp = &zlcf->breaker_latency;
+
+        } else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "ngx_http_ziti_module: invalid parameter \"%V\" in"
+                               " \"%V\" directive",
+                               &value[i], &cmd->name);
+
+            return NGX_CONF_ERROR;
+        }
+
+        s.data = &value[i].data[s.len];
+        s.len = value[i].len - s.len;
+
+        ms = ngx_parse_time(&s, 0);
+
+        if (ms == (ngx_msec_t) NGX_ERROR || ms == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid time \"%V\" in \"%V\" directive",
+                               &value[i], &cmd->name);
+
+            return NGX_CONF_ERROR;
+        }
+
+        *msp = ms;
+    }
+
+    if (zlcf->breaker_errors == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"errors\" is required in \"%V\" directive",
+                           &cmd->name);
+
+        return NGX_CONF_ERROR;
+    }
+
+    ZITI_LOG(INFO, "circuit breaker at %lu%% errors over %lums (min %lu requests), open for %lums, %lu probes",
+             (unsigned long) zlcf->breaker_errors, (unsigned long) zlcf->breaker_window, (unsigned long) zlcf->breaker_min_requests,
+             (unsigned long) zlcf->breaker_open_time, (unsigned long) zlcf->breaker_probes);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_ziti_health_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ziti_loc_conf_t                    *zlcf = conf;
+    ngx_str_t                                   *value, s;
+    ngx_uint_t                                   i;
+    ngx_msec_t                                   interval;
+
+    if (zlcf->health_interval != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        zlcf->health_interval = 0;
+        zlcf->health_uri = NULL;
+        return NGX_CONF_OK;
+    }
+
+    interval = 5000;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_http_ziti_strcmp_const(value[i].data, "uri=") == 0)
+        {
+            if (value[i].len <= sizeof("uri=") - 1 || value[i].data[sizeof("uri=") - 1] != '/') {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"uri\" value \"%V\" "
+                                   "in \"%V\" directive; must start with \"/\"",
+                                   &value[i], &cmd->name);
+
+                return NGX_CONF_ERROR;
+            }
+
+            zlcf->health_uri = strdup((char *) &value[i].data[sizeof("uri=") - 1]);
+
+            continue;
+        }
+
+        if (ngx_http_ziti_strcmp_const(value[i].data, "interval=") == 0)
+        {
+            s.len = value[i].len - (sizeof("interval=") - 1);
+            s.data = &value[i].data[sizeof("interval=") - 1];
+
+            interval = ngx_parse_time(&s, 0);
+
+            if (interval == (ngx_msec_t) NGX_ERROR || interval < NGX_HTTP_ZITI_POOL_MAINT_INTERVAL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"interval\" value \"%V\" "
+                                   "in \"%V\" directive; must be at least 1s",
                                    &value[i], &cmd->name);
 
-                return NGX_CONF_ERROR;
-            }
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "ngx_http_ziti_module: invalid parameter \"%V\" in"
+                           " \"%V\" directive",
+                           &value[i], &cmd->name);
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (zlcf->health_uri == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"uri\" is required in \"%V\" directive",
+                           &cmd->name);
+
+        return NGX_CONF_ERROR;
+    }
+
+    zlcf->health_interval = interval;
+
+    ZITI_LOG(INFO, "health checking '%s' every %lums", zlcf->health_uri, (unsigned long) interval);
+
+    return NGX_CONF_OK;
+}
+
+
+#if (NGX_HAVE_SCHED_SETAFFINITY)
+
+/**
+ * Find a hyperthread sibling of the given CPU, i.e. one sharing its L1/L2.  Returns the CPU
+ * itself if it has none or the topology cannot be read.
+ */
+static int
+ngx_http_ziti_cpu_sibling(int cpu, ngx_log_t *log)
+{
+    u_char                      path[NGX_MAX_PATH], buf[128], *p, *last;
+    ngx_fd_t                    fd;
+    ssize_t                     n;
+    int                         sibling, hi;
+
+    ngx_snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list%Z", cpu);
+
+    fd = ngx_open_file(path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        return cpu;
+    }
+
+    n = ngx_read_fd(fd, buf, sizeof(buf) - 1);
+
+    ngx_close_file(fd);
+
+    if (n <= 0) {
+        return cpu;
+    }
+
+    last = buf + n;
+
+    /* the list looks like "2,6" or "2-3" */
+
+    for (p = buf; p < last; ) {
+
+        if (*p < '0' || *p > '9') {
+            p++;
+            continue;
+        }
+
+        sibling = 0;
+        while (p < last && *p >= '0' && *p <= '9') {
+            sibling = sibling * 10 + (*p++ - '0');
+        }
+
+        hi = sibling;
+
+        if (p < last && *p == '-') {
+            p++;
+            hi = 0;
+            while (p < last && *p >= '0' && *p <= '9') {
+                hi = hi * 10 + (*p++ - '0');
+            }
+        }
+
+        for ( /* void */ ; sibling <= hi; sibling++) {
+            if (sibling != cpu) {
+                return sibling;
+            }
+        }
+    }
+
+    return cpu;
+}
+
+#endif
+
+
+/**
+ * Apply ziti_loop_cpu_affinity and ziti_loop_thread_name to a freshly started loop thread
+ */
+static void
+ngx_http_ziti_loop_thread_setup(ngx_http_ziti_main_conf_t *zmcf, ngx_http_ziti_loop_t *loop, ngx_uint_t id, ngx_log_t *log)
+{
+#if (NGX_LINUX)
+    char                        name[16];
+#endif
+#if (NGX_HAVE_SCHED_SETAFFINITY)
+    cpu_set_t                   mask, worker;
+    ngx_cpuset_t               *masks;
+    int                         i, cpu;
+#endif
 
-            zlcf->client_pool_size = n;
+#if (NGX_LINUX)
+    if (zmcf->loop_thread_name) {
 
-            ZITI_LOG(INFO, "client_pool_size is: %d", zlcf->client_pool_size);
+        /* thread names are limited to 15 characters, e.g. "ziti/w3/i0/l1" */
+        ngx_snprintf((u_char *) name, sizeof(name) - 1, "ziti/w%ui/i%ui/l%ui%Z", ngx_worker, id, loop->index);
+        name[sizeof(name) - 1] = '\0';
 
-            continue;
+        if (pthread_setname_np(loop->thread, name) != 0) {
+            ngx_log_error(NGX_LOG_WARN, log, 0, "ziti: pthread_setname_np(\"%s\") failed", name);
         }
+    }
+#endif
 
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "ngx_http_ziti_module: invalid parameter \"%V\" in"
-                           " \"%V\" directive",
-                           &value[i], &cmd->name);
+#if (NGX_HAVE_SCHED_SETAFFINITY)
+    if (zmcf->loop_cpu_affinity == NULL && !zmcf->loop_cpu_affinity_auto) {
+        return;     // the thread inherits the worker's own affinity
+    }
+
+    if (zmcf->loop_cpu_affinity_auto) {
+
+        //
+        // Run next to the worker: on a hyperthread sibling of the CPU it is pinned to, or on
+        // that CPU itself.  A worker that is not pinned to one CPU leaves its loops alone.
+        //
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &worker) == -1 || CPU_COUNT(&worker) != 1) {
+            return;
+        }
+
+        for (cpu = 0; cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &worker); cpu++) { /* void */ }
+
+        CPU_ZERO(&mask);
+        CPU_SET(ngx_http_ziti_cpu_sibling(cpu, log), &mask);
+
+    } else {
+        masks = zmcf->loop_cpu_affinity->elts;
+        mask = masks[ngx_worker % zmcf->loop_cpu_affinity->nelts];
+    }
+
+    if (pthread_setaffinity_np(loop->thread, sizeof(cpu_set_t), &mask) != 0) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "ziti: pthread_setaffinity_np() failed for loop %ui", loop->index);
+        return;
+    }
+
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &mask)) {
+            ngx_log_error(NGX_LOG_NOTICE, log, 0, "ziti: loop %ui of worker %ui bound to CPU%d", loop->index, ngx_worker, i);
+        }
+    }
+#endif
+}
+
+
+/**
+ * Start an identity's ziti_loops uv loops, each with its own Ziti context.  Also used by
+ * ngx_stream_ziti_module for identities no http{} location names.
+ */
+ngx_int_t
+ngx_http_ziti_identity_start(ngx_http_ziti_main_conf_t *zmcf, ngx_http_ziti_identity_t *identity, ngx_cycle_t *cycle)
+{
+    ngx_uint_t                  n;
+
+    identity->stats = ngx_http_ziti_shm_stats_get(identity->index, "");
+
+    identity->nloops = zmcf->loops;
+    identity->loops = ngx_pcalloc(cycle->pool, identity->nloops * sizeof(ngx_http_ziti_loop_t));
+    if (identity->loops == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (n = 0; n < identity->nloops; n++) {
+
+        identity->loops[n].identity = identity;
+        identity->loops[n].index = n;
+
+        identity->loops[n].pools = ngx_http_ziti_pools_create(cycle->log);
+        if (identity->loops[n].pools == NULL) {
+            return NGX_ERROR;
+        }
+
+        uv_mutex_init(&identity->loops[n].pools_lock);
+
+        if (ngx_http_ziti_start_uv_loop(zmcf, &identity->loops[n], cycle->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_ziti_loop_thread_setup(zmcf, &identity->loops[n], identity->index, cycle->log);
+    }
+
+    return NGX_OK;
+}
+
+
+/**
+ * Start ziti_loops uv loops, each with its own Ziti context, per distinct identity in each worker
+ */
+static ngx_int_t
+ngx_http_ziti_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_ziti_main_conf_t  *zmcf;
+    ngx_http_ziti_identity_t  **identities;
+    ngx_uint_t                  i;
+
+    zmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_ziti_module);
+    if (zmcf == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_http_ziti_shm_init_process(zmcf, cycle);
+
+    identities = zmcf->identities.elts;
 
+    for (i = 0; i < zmcf->identities.nelts; i++) {
+        if (ngx_http_ziti_identity_start(zmcf, identities[i], cycle) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_http_ziti_bind_init_process(zmcf, cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ZITI_LOG(INFO, "started %lu Ziti context(s) with %lu loop(s) each", (unsigned long) zmcf->identities.nelts, (unsigned long) zmcf->loops);
+
+    return NGX_OK;
+}
+
+
+/**
+ * ziti_loop_cpu_affinity auto | <mask> ...;  masks use the worker_cpu_affinity notation
+ */
+static char *
+ngx_http_ziti_loop_cpu_affinity(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_HAVE_SCHED_SETAFFINITY)
+    ngx_http_ziti_main_conf_t                   *zmcf = conf;
+    ngx_str_t                                   *value;
+    ngx_cpuset_t                                *mask;
+    ngx_uint_t                                   i, n;
+    u_char                                       ch, *p;
+
+    if (zmcf->loop_cpu_affinity || zmcf->loop_cpu_affinity_auto) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "auto") == 0) {
+
+        if (cf->args->nelts > 2) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid number of arguments in \"%V\" directive", &cmd->name);
+            return NGX_CONF_ERROR;
+        }
+
+        zmcf->loop_cpu_affinity_auto = 1;
+
+        return NGX_CONF_OK;
+    }
+
+    zmcf->loop_cpu_affinity = ngx_array_create(cf->pool, cf->args->nelts - 1, sizeof(ngx_cpuset_t));
+    if (zmcf->loop_cpu_affinity == NULL) {
         return NGX_CONF_ERROR;
     }
 
+    for (n = 1; n < cf->args->nelts; n++) {
+
+        if (value[n].len > CPU_SETSIZE) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"%V\" supports up to %d CPUs only", &cmd->name, CPU_SETSIZE);
+            return NGX_CONF_ERROR;
+        }
+
+        mask = ngx_array_push(zmcf->loop_cpu_affinity);
+        if (mask == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        CPU_ZERO(mask);
+
+        /* the rightmost digit is CPU0 */
+
+        p = value[n].data + value[n].len - 1;
+
+        for (i = 0; i < value[n].len; i++) {
+
+            ch = *p--;
+
+            if (ch == ' ') {
+                continue;
+            }
+
+            if (ch == '1') {
+                CPU_SET(i, mask);
+                continue;
+            }
+
+            if (ch != '0') {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid character \"%c\" in \"%V\"", ch, &cmd->name);
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        if (CPU_COUNT(mask) == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "empty CPU mask \"%V\" in \"%V\"", &value[n], &cmd->name);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                       "\"%V\" is not supported on this platform, ignored", &cmd->name);
+
+#endif
+
     return NGX_CONF_OK;
 }
 
 
-char *
-ngx_http_ziti_buffer_size(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+/**
+ * ziti_config_types none | all | <config type> ...;
+ */
+static char *
+ngx_http_ziti_config_types(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    char            *p = conf;
-    size_t           *sp;
-    ngx_str_t        *value;
+    ngx_http_ziti_main_conf_t   *zmcf = conf;
+    ngx_str_t                   *value;
+    ngx_uint_t                   i;
+    const char                 **types;
 
-    sp = (size_t *) (p + cmd->offset);
-    if (*sp != NGX_CONF_UNSET_SIZE) {
+    if (zmcf->config_types != NGX_CONF_UNSET_PTR) {
         return "is duplicate";
     }
 
     value = cf->args->elts;
 
-    *sp = ngx_parse_size(&value[1]);
-    if (*sp == (size_t) NGX_ERROR) {
-        return "invalid value";
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "none") == 0) {
+        zmcf->config_types = NULL;
+        return NGX_CONF_OK;
+    }
+
+    types = ngx_pcalloc(cf->pool, cf->args->nelts * sizeof(char *));
+    if (types == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strcmp(value[i].data, "none") == 0
+            || (ngx_strcmp(value[i].data, "all") == 0 && cf->args->nelts > 2))
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"%V\" cannot be combined with other values in \"%V\" directive",
+                               &value[i], &cmd->name);
+            return NGX_CONF_ERROR;
+        }
+
+        /* ngx_str_t values are null terminated when read from the config file */
+        types[i - 1] = (const char *) value[i].data;
     }
 
+    zmcf->config_types = types;
+
     return NGX_CONF_OK;
 }
+
+
+/**
+ * ziti_identity_watch off | <interval>;
+ */
+static char *
+ngx_http_ziti_identity_watch_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ziti_main_conf_t   *zmcf = conf;
+    ngx_str_t                   *value;
+
+    if (zmcf->identity_watch != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        zmcf->identity_watch = 0;
+        return NGX_CONF_OK;
+    }
+
+    return ngx_conf_set_msec_slot(cf, cmd, conf);
+}
+
+
+enum {
+    NGX_HTTP_ZITI_VAR_POOL_WAIT = 0,
+    NGX_HTTP_ZITI_VAR_CONNECT,
+    NGX_HTTP_ZITI_VAR_HEADER,
+    NGX_HTTP_ZITI_VAR_RESPONSE
+};
+
+
+static ngx_int_t
+ngx_http_ziti_variable_service(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx;
+
+    request_ctx = ngx_http_get_module_ctx(r, ngx_http_ziti_module);
+
+    if (request_ctx == NULL || request_ctx->servicename == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = ngx_strlen(request_ctx->servicename);
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = (u_char *) request_ctx->servicename;
+
+    return NGX_OK;
+}
+
+
+/**
+ * $ziti_pool_wait_time, $ziti_connect_time, $ziti_header_time, $ziti_response_time: seconds
+ * with millisecond resolution, counted from when the request reached the handler, as
+ * $upstream_*_time are
+ */
+static ngx_int_t
+ngx_http_ziti_variable_time(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx;
+    uint64_t                       ns;
+    ngx_msec_t                     ms;
+    u_char                        *p;
+
+    request_ctx = ngx_http_get_module_ctx(r, ngx_http_ziti_module);
+
+    if (request_ctx == NULL || request_ctx->t_start == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    switch (data) {
+
+    case NGX_HTTP_ZITI_VAR_POOL_WAIT:
+        ns = request_ctx->pool_wait;
+        break;
+
+    case NGX_HTTP_ZITI_VAR_CONNECT:
+        ns = request_ctx->t_connect ? request_ctx->t_connect - request_ctx->t_start : 0;
+        break;
+
+    case NGX_HTTP_ZITI_VAR_HEADER:
+        ns = request_ctx->t_header ? request_ctx->t_header - request_ctx->t_start : 0;
+        break;
+
+    default: /* NGX_HTTP_ZITI_VAR_RESPONSE */
+        ns = request_ctx->t_done ? request_ctx->t_done - request_ctx->t_start : 0;
+        break;
+    }
+
+    if (ns == 0 && data != NGX_HTTP_ZITI_VAR_POOL_WAIT) {
+        v->len = 1;
+        v->data = (u_char *) "-";
+
+    } else {
+        p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        ms = (ngx_msec_t) (ns / 1000000);
+
+        v->len = ngx_sprintf(p, "%T.%03M", (time_t) ms / 1000, ms % 1000) - p;
+        v->data = p;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_ziti_variable_bytes_received(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx;
+    u_char                        *p;
+
+    request_ctx = ngx_http_get_module_ctx(r, ngx_http_ziti_module);
+
+    if (request_ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%O", request_ctx->bytes_received) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_ziti_variable_client_id(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx;
+    u_char                        *p;
+
+    request_ctx = ngx_http_get_module_ctx(r, ngx_http_ziti_module);
+
+    if (request_ctx == NULL || !request_ctx->has_client) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, 2 * NGX_INT_T_LEN + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui:%ui", request_ctx->client_loop, request_ctx->client_slot) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_http_variable_t  ngx_http_ziti_vars[] = {
+
+    { ngx_string("ziti_service"), NULL,
+      ngx_http_ziti_variable_service, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ziti_pool_wait_time"), NULL,
+      ngx_http_ziti_variable_time, NGX_HTTP_ZITI_VAR_POOL_WAIT,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ziti_connect_time"), NULL,
+      ngx_http_ziti_variable_time, NGX_HTTP_ZITI_VAR_CONNECT,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ziti_header_time"), NULL,
+      ngx_http_ziti_variable_time, NGX_HTTP_ZITI_VAR_HEADER,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ziti_response_time"), NULL,
+      ngx_http_ziti_variable_time, NGX_HTTP_ZITI_VAR_RESPONSE,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ziti_bytes_received"), NULL,
+      ngx_http_ziti_variable_bytes_received, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ziti_client_id"), NULL,
+      ngx_http_ziti_variable_client_id, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    ngx_http_null_variable
+};
+
+
+static ngx_int_t
+ngx_http_ziti_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_ziti_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
@@ -38,6 +38,33 @@ limitations under the License.
 #define ngx_http_ziti_module_version_string  "0.1.1"
 
 
+/* hedge budget is kept in hundredths of a hedge; at most this many hedges can be banked */
+#define NGX_HTTP_ZITI_HEDGE_BURST    10
+
+/* upper bound for ziti_loops */
+#define NGX_HTTP_ZITI_MAX_LOOPS      64
+
+/* how often (ms) each client pool is checked for purged clients to rebuild */
+#define NGX_HTTP_ZITI_POOL_MAINT_INTERVAL  1000
+
+/* backoff bounds (ms) between attempts to bring up a Ziti context the controller refused */
+#define NGX_HTTP_ZITI_RECONNECT_MIN   1000
+#define NGX_HTTP_ZITI_RECONNECT_MAX   60000
+
+/* how often (ms) libziti transfer rates are sampled into the ziti_shared_zone */
+#define NGX_HTTP_ZITI_METRICS_INTERVAL  5000
+
+/* how often (ms) a follower checks the ziti_shared_zone for service changes the leader saw */
+#define NGX_HTTP_ZITI_FOLLOW_INTERVAL   1000
+
+/* edge routers a loop keeps track of its connections to */
+#define NGX_HTTP_ZITI_MAX_ROUTERS     32
+
+/* ziti_http_engine */
+#define NGX_HTTP_ZITI_ENGINE_UM_HTTP  0
+#define NGX_HTTP_ZITI_ENGINE_NATIVE   1
+
+
 #define ngx_str_last(str)            (u_char *) ((str)->data + (str)->len)
 #define ngx_conf_str_empty(str)      ((str)->sv.len == 0 && (str)->cv == NULL)
 #define ngx_http_ziti_strcmp_const(a, b) ngx_strncmp(a, b, sizeof(b) - 1)
@@ -80,20 +107,187 @@ typedef enum ZITI_LOC_STATE_tag
 } ZITI_LOC_STATE;
 
 
+struct ListMap;
+
+typedef struct ngx_http_ziti_shm_stats_s ngx_http_ziti_shm_stats_t;
+
+typedef struct ngx_http_ziti_shm_router_s ngx_http_ziti_shm_router_t;
+
+typedef struct ngx_http_ziti_identity_s ngx_http_ziti_identity_t;
+
+
+/*
+ * One uv loop, on its own thread, running a Ziti context for an identity.  Requests are
+ * spread over the ziti_loops loops of their identity; each loop has its own client pools.
+ */
 typedef struct {
+    ngx_http_ziti_identity_t           *identity;
+    ngx_uint_t                          index;
     uv_loop_t                          *uv_thread_loop;
     ZITI_LOC_STATE                      state;    
-    ngx_pool_t                          *pool;
+    uv_thread_t                         thread;
+    uv_async_t                          async;
+    ziti_context                        ztx;
+    /* client pools, keyed by service name; swapped on reload under pools_lock */
+    struct ListMap                     *pools;
+    uv_mutex_t                          pools_lock;
+    /* requests currently assigned to this loop; only touched on the nginx thread */
+    ngx_uint_t                          load;
+
+    /*
+     * Controller outages.  A context that never came up is reconnected with backoff while its
+     * requests fail fast; one that was up keeps serving from its existing sessions.
+     */
+    ziti_options                       *opts;
+    ziti_context                        retired;
+    uv_timer_t                          reconnect_timer;
+    unsigned                            reconnect_timer_ready:1;
+    ngx_msec_t                          backoff;
+    uint64_t                            outage_start;
+    /* set while the controller cannot be reached; read on the nginx thread */
+    ngx_atomic_t                        unavailable;
+    /* counters */
+    ngx_atomic_t                        reconnects;
+    ngx_atomic_t                        outages;
+    ngx_atomic_t                        outage_msec;
+
+    /*
+     * ziti_identity_watch.  A changed identity file gets a second context with its own pools;
+     * new requests switch to it once it is up, while those in flight drain on the old one.
+     * One reload runs at a time: a change seen meanwhile is picked up once it is over.
+     */
+    uv_fs_poll_t                        identity_poll;
+    unsigned                            reloading:1;
+    unsigned                            reload_pending:1;
+    unsigned                            drain_timer_ready:1;
+    struct ListMap                     *next_pools;
+    struct ListMap                     *draining_pools;
+    ziti_context                        draining_ztx;
+    uv_timer_t                          drain_timer;
+    ngx_atomic_t                        reloads;
+
+    /*
+     * Fabric metrics for the ziti_shared_zone: the transfer rates this loop last added to its
+     * identity's counters, and the edge routers it is connected to
+     */
+    uv_timer_t                          metrics_timer;
+    unsigned                            metrics_timer_ready:1;
+    ngx_atomic_int_t                    rate_up;
+    ngx_atomic_int_t                    rate_down;
+    ngx_http_ziti_shm_router_t         *routers[NGX_HTTP_ZITI_MAX_ROUTERS];
+    ngx_uint_t                          nrouters;
+
+    /*
+     * ziti_shared_zone followers: the generation of the identity's services this loop last
+     * refreshed for.  The leader's first loop: whether its context has reported its services.
+     */
+    uv_timer_t                          follow_timer;
+    unsigned                            follow_timer_ready:1;
+    unsigned                            services_loaded:1;
+    ngx_atomic_uint_t                   generation;
+} ngx_http_ziti_loop_t;
+
+
+/*
+ * A Ziti identity, shared by every location (and ngx_stream_ziti_module server) that names the
+ * same identity file.  Its loops are started per worker.
+ */
+struct ngx_http_ziti_identity_s {
     /* abs path to ziti identity */
     char                               *identity_path;
+    /* position in the main conf registry; names the identity in the shared zone */
+    ngx_uint_t                          index;
+    ngx_uint_t                          nloops;
+    ngx_http_ziti_loop_t               *loops;
+    /* where least-loaded loop selection starts, so ties are spread round-robin */
+    ngx_uint_t                          next_loop;
+    /* ngx_http_ziti_loc_conf_t * of every location doing ziti_pass with this identity */
+    ngx_array_t                         locations;
+    /* identity-wide counters in the ziti_shared_zone, NULL without one */
+    ngx_http_ziti_shm_stats_t          *stats;
+    /* per-service counters found by the nginx thread, see ngx_http_ziti_shm_stats_cached() */
+    ngx_array_t                        *service_stats;
+};
+
+
+typedef struct {
+    /* registry of ngx_http_ziti_identity_t *, one per distinct identity path */
+    ngx_array_t                         identities;
+    /* ziti_loops */
+    ngx_uint_t                          loops;
+    /* ziti_loop_cpu_affinity: auto, or one mask per worker process as in worker_cpu_affinity */
+    ngx_uint_t                          loop_cpu_affinity_auto;
+    ngx_array_t                        *loop_cpu_affinity;
+    /* ziti_loop_thread_name */
+    ngx_flag_t                          loop_thread_name;
+    /* ziti_refresh_interval, ziti_router_keepalive, ziti_metrics, ziti_config_types */
+    time_t                              refresh_interval;
+    time_t                              router_keepalive;
+    ngx_uint_t                          metrics_type;
+    /* NULL terminated, or NULL for none */
+    const char                        **config_types;
+    /* ziti_identity_watch; 0 means off */
+    ngx_msec_t                          identity_watch;
+    /* ziti_shared_zone */
+    ngx_shm_zone_t                     *shm_zone;
+    ngx_msec_t                          follower_refresh;
+    /* this worker refreshes controller state and publishes it to the shared zone */
+    ngx_uint_t                          shm_leader;
+    /* some location uses ziti_status, which reads the shared zone */
+    ngx_uint_t                          status_used;
+    /* ziti_bind, one entry per bound service and server; NULL if there are none */
+    ngx_array_t                        *binds;
+} ngx_http_ziti_main_conf_t;
+
+
+typedef struct {
+    ngx_http_ziti_identity_t           *identity;
+    ngx_pool_t                          *pool;
     /* ziti service name */
     char                               *servicename;
+    /* all ziti service names given to ziti_pass, in failover order */
+    ngx_array_t                        *servicenames;
     size_t                               buf_size;
-    uv_thread_t                          thread;
-    uv_async_t                           async;
-    ziti_context                         ztx;
 	ngx_thread_pool_t                   *thread_pool;
     size_t                               client_pool_size;
+    /* requests a pooled client may carry at once (ziti_client_pool_size requests=) */
+    ngx_uint_t                           client_requests;
+    ngx_uint_t                           next_upstream;
+    ngx_uint_t                           next_upstream_tries;
+    /* ziti_hedge; hedge_after == 0 means hedging is off */
+    ngx_msec_t                           hedge_after;
+    ngx_uint_t                           hedge_max;
+    ngx_uint_t                           hedge_rate;
+    ngx_atomic_t                         hedge_credits;
+    /* ziti_circuit_breaker; breaker_errors == 0 means the breaker is off */
+    ngx_uint_t                           breaker_errors;
+    ngx_uint_t                           breaker_min_requests;
+    ngx_msec_t                           breaker_window;
+    ngx_msec_t                           breaker_open_time;
+    ngx_msec_t                           breaker_latency;
+    ngx_uint_t                           breaker_probes;
+    ngx_uint_t                           breaker_status;
+    /* ziti_health_check; health_uri == NULL means no probes are sent */
+    char                                *health_uri;
+    ngx_msec_t                           health_interval;
+    /* ziti_unavailable_status */
+    ngx_int_t                            unavailable_status;
+    /* ziti_upgrade, ziti_upgrade_timeout */
+    ngx_flag_t                           upgrade;
+    ngx_msec_t                           upgrade_timeout;
+    /*
+     * ziti_connect_timeout, ziti_read_timeout, ziti_keepalive_timeout: ziti_http_engine native
+     * and ziti_http_version 2
+     */
+    ngx_msec_t                           connect_timeout;
+    ngx_msec_t                           read_timeout;
+    ngx_msec_t                           keepalive_timeout;
+    /* ziti_http_version: NGX_HTTP_VERSION_11, or NGX_HTTP_VERSION_20 for h2c over Ziti */
+    ngx_uint_t                           http_version;
+    /* ziti_http_engine: what speaks HTTP/1.1 to the service, NGX_HTTP_ZITI_ENGINE_* */
+    ngx_uint_t                           http_engine;
+    /* ziti_status output format, 0 if this is not a ziti_status location */
+    ngx_uint_t                           status_format;
 } ngx_http_ziti_loc_conf_t;
 
 
@@ -110,7 +304,11 @@ typedef struct {
 typedef struct {
     ngx_http_request_t *r;
     ngx_http_ziti_loc_conf_t *zlcf;
+    ngx_http_ziti_loop_t *loop;
 } ngx_http_ziti_await_init_thread_ctx_t;
 
 
+ngx_int_t ngx_http_ziti_identity_start(ngx_http_ziti_main_conf_t *zmcf, ngx_http_ziti_identity_t *identity, ngx_cycle_t *cycle);
+
+
 #endif /* NGX_HTTP_ZITI_MODULE_H */
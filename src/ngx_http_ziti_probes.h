@@ -0,0 +1,60 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef NGX_HTTP_ZITI_PROBES_H
+#define NGX_HTTP_ZITI_PROBES_H
+
+
+/*
+ * USDT probes, provider "ziti".  Built in when ./configure finds <sys/sdt.h>; each probe is then
+ * a single nop until a tracer attaches to it.  Without <sys/sdt.h> they compile to nothing.
+ *
+ *   handler__entry    (r, state)                        ngx_http_ziti_handler() entered
+ *   checkout__start   (r, servicename)                  about to wait for a pooled client
+ *   checkout__done    (r, servicename, wait_ns, client) got one, or NULL
+ *   client__purge     (servicename, client, slot)       client marked for rebuild
+ *   request__sent     (r, servicename, client, hedge)   um_http_req() issued
+ *   response          (r, code, ns)                     on_resp(), ns since the request was sent
+ *   body__chunk       (r, len)                          on_resp_body() data
+ *   body__eof         (r, bytes, ns)                    on_resp_body() EOF, ns since handler entry
+ *
+ * The bpftrace scripts in tools/ are built on them.
+ */
+
+#if (NGX_HTTP_ZITI_HAVE_SDT)
+
+#include <sys/sdt.h>
+
+#define ngx_http_ziti_probe1(name, a)                                         \
+    DTRACE_PROBE1(ziti, name, a)
+#define ngx_http_ziti_probe2(name, a, b)                                      \
+    DTRACE_PROBE2(ziti, name, a, b)
+#define ngx_http_ziti_probe3(name, a, b, c)                                   \
+    DTRACE_PROBE3(ziti, name, a, b, c)
+#define ngx_http_ziti_probe4(name, a, b, c, d)                                \
+    DTRACE_PROBE4(ziti, name, a, b, c, d)
+
+#else
+
+#define ngx_http_ziti_probe1(name, a)
+#define ngx_http_ziti_probe2(name, a, b)
+#define ngx_http_ziti_probe3(name, a, b, c)
+#define ngx_http_ziti_probe4(name, a, b, c, d)
+
+#endif
+
+
+#endif /* NGX_HTTP_ZITI_PROBES_H */
@@ -0,0 +1,486 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef DDEBUG
+#define DDEBUG 1
+#endif
+#include "ddebug.h"
+
+#include "ngx_http_ziti_module.h"
+#include "ngx_http_ziti_shm.h"
+#include "ngx_http_ziti_relay.h"
+
+
+static void ngx_http_ziti_relay_dial(ngx_http_ziti_relay_t *relay);
+static void ngx_http_ziti_relay_shutdown(ngx_http_ziti_relay_t *relay);
+
+
+static void
+ngx_http_ziti_relay_wake_func(void *data, ngx_log_t *log)
+{
+    /* this function is executed in a thread from the ziti thread_pool; see ngx_http_ziti_relay_woken() */
+}
+
+
+/**
+ * Ask the nginx thread to look at the relay again.  Runs on the loop thread; a wakeup already
+ * pending covers whatever changed since it was posted.
+ */
+static void
+ngx_http_ziti_relay_wake(ngx_http_ziti_relay_t *relay)
+{
+    ngx_thread_pool_t             *tp;
+    ngx_uint_t                     post;
+
+    uv_mutex_lock(&relay->lock);
+
+    post = !relay->wake_posted;
+    relay->wake_posted = 1;
+
+    uv_mutex_unlock(&relay->lock);
+
+    if (!post) {
+        return;
+    }
+
+    tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &ngx_http_ziti_thread_pool_name);
+
+    if (tp == NULL || ngx_thread_task_post(tp, relay->wake) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0, "ziti: could not wake up the nginx thread for %s", relay->what);
+    }
+}
+
+
+/*
+ * Loop thread side
+ */
+
+static void
+ngx_http_ziti_relay_async_closed(uv_handle_t *handle)
+{
+    ngx_http_ziti_relay_t         *relay = handle->data;
+
+    uv_mutex_lock(&relay->lock);
+    relay->closed = 1;
+    uv_mutex_unlock(&relay->lock);
+
+    ngx_http_ziti_relay_wake(relay);
+}
+
+
+static void
+ngx_http_ziti_relay_conn_closed(ziti_connection conn)
+{
+    ngx_http_ziti_relay_t         *relay = ziti_conn_data(conn);
+
+    relay->conn = NULL;
+    relay->conn_closing = 0;
+
+    if (relay->closing) {
+        uv_close((uv_handle_t *) &relay->async, ngx_http_ziti_relay_async_closed);
+        return;
+    }
+
+    if (relay->redial) {
+        relay->redial = 0;
+        ngx_http_ziti_relay_dial(relay);
+    }
+}
+
+
+static void
+ngx_http_ziti_relay_conn_release(ngx_http_ziti_relay_t *relay)
+{
+    if (relay->conn && !relay->conn_closing) {
+        relay->conn_closing = 1;
+        ziti_close(relay->conn, ngx_http_ziti_relay_conn_closed);
+    }
+}
+
+
+/**
+ * Tear the loop side down; the nginx thread is woken once nothing refers to the relay any more
+ */
+static void
+ngx_http_ziti_relay_shutdown(ngx_http_ziti_relay_t *relay)
+{
+    if (relay->closing) {
+        return;
+    }
+
+    relay->closing = 1;
+
+    if (relay->conn) {
+        // ngx_http_ziti_relay_conn_closed() closes the async handle
+        ngx_http_ziti_relay_conn_release(relay);
+        return;
+    }
+
+    uv_close((uv_handle_t *) &relay->async, ngx_http_ziti_relay_async_closed);
+}
+
+
+static void
+ngx_http_ziti_relay_fail(ngx_http_ziti_relay_t *relay)
+{
+    uv_mutex_lock(&relay->lock);
+    relay->error = 1;
+    uv_mutex_unlock(&relay->lock);
+
+    ngx_http_ziti_relay_wake(relay);
+}
+
+
+static void
+ngx_http_ziti_relay_written(ziti_connection conn, ssize_t status, void *write_ctx)
+{
+    ngx_http_ziti_relay_t         *relay = write_ctx;
+
+    relay->writing = 0;
+
+    uv_mutex_lock(&relay->lock);
+
+    relay->up_busy = 0;
+
+    if (status < 0) {
+        relay->error = 1;
+    }
+
+    uv_mutex_unlock(&relay->lock);
+
+    if (status < 0) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: write to %s failed: %s", relay->what, ziti_errorstr(status));
+    }
+
+    ngx_http_ziti_relay_wake(relay);
+}
+
+
+/**
+ * The nginx thread has something for the loop: client data in relay->up, or a request to close
+ */
+static void
+ngx_http_ziti_relay_async(uv_async_t *async)
+{
+    ngx_http_ziti_relay_t         *relay = async->data;
+    ngx_uint_t                     write, close;
+    int                            rc;
+
+    uv_mutex_lock(&relay->lock);
+
+    close = relay->want_close;
+    write = relay->up_busy && relay->connected;
+
+    uv_mutex_unlock(&relay->lock);
+
+    if (close) {
+        ngx_http_ziti_relay_shutdown(relay);
+        return;
+    }
+
+    if (!write || relay->writing) {
+        return;
+    }
+
+    relay->writing = 1;
+
+    rc = ziti_write(relay->conn, relay->up->pos, relay->up->last - relay->up->pos, ngx_http_ziti_relay_written, relay);
+
+    if (rc != ZITI_OK) {
+        relay->writing = 0;
+
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: write to %s failed: %s", relay->what, ziti_errorstr(rc));
+
+        ngx_http_ziti_relay_fail(relay);
+    }
+}
+
+
+/**
+ * Data from the service.  Whatever does not fit in relay->down is left with the SDK, which
+ * offers it again later; that is the backpressure on the service side.
+ */
+static ssize_t
+ngx_http_ziti_relay_data(ziti_connection conn, uint8_t *data, ssize_t len)
+{
+    ngx_http_ziti_relay_t         *relay = ziti_conn_data(conn);
+    ngx_buf_t                     *down = relay->down;
+    size_t                         n;
+
+    if (len < 0) {
+        if (len != ZITI_EOF) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: %s to service \"%s\" failed: %s", relay->what,
+                          ((char **) relay->servicenames->elts)[relay->service_index], ziti_errorstr(len));
+        }
+
+        uv_mutex_lock(&relay->lock);
+        relay->eof = 1;
+        uv_mutex_unlock(&relay->lock);
+
+        ngx_http_ziti_relay_wake(relay);
+
+        return len;
+    }
+
+    uv_mutex_lock(&relay->lock);
+
+    if (down->pos == down->last) {
+        down->pos = down->start;
+        down->last = down->start;
+    }
+
+    n = ngx_min((size_t) len, (size_t) (down->end - down->last));
+
+    down->last = ngx_cpymem(down->last, data, n);
+
+    uv_mutex_unlock(&relay->lock);
+
+    if (n) {
+        ngx_http_ziti_relay_wake(relay);
+    }
+
+    return n;
+}
+
+
+static void
+ngx_http_ziti_relay_connected(ziti_connection conn, int status)
+{
+    ngx_http_ziti_relay_t         *relay = ziti_conn_data(conn);
+    char                         **names = relay->servicenames->elts;
+    ngx_uint_t                     close;
+
+    if (status == ZITI_OK) {
+
+        uv_mutex_lock(&relay->lock);
+        relay->connected_at = uv_hrtime();
+        relay->connected = 1;
+        close = relay->want_close;
+        uv_mutex_unlock(&relay->lock);
+
+        if (close) {
+            ngx_http_ziti_relay_shutdown(relay);
+            return;
+        }
+
+        // send whatever the client sent while the service was being dialed
+        ngx_http_ziti_relay_async(&relay->async);
+        ngx_http_ziti_relay_wake(relay);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: dial of service \"%s\" for %s failed: %s",
+                  names[relay->service_index], relay->what, ziti_errorstr(status));
+
+    ngx_http_ziti_stat_add(relay->stats, errors, 1);
+
+    // fail over to the next service named on ziti_pass
+    if (relay->failover && relay->service_index + 1 < relay->servicenames->nelts) {
+        relay->service_index++;
+        relay->redial = 1;
+
+    } else {
+        ngx_http_ziti_relay_fail(relay);
+    }
+
+    ngx_http_ziti_relay_conn_release(relay);
+}
+
+
+static void
+ngx_http_ziti_relay_dial(ngx_http_ziti_relay_t *relay)
+{
+    char                         **names = relay->servicenames->elts;
+    int                            rc;
+
+    rc = ziti_conn_init(relay->ztx, &relay->conn, relay);
+
+    if (rc == ZITI_OK) {
+        rc = ziti_dial(relay->conn, names[relay->service_index], ngx_http_ziti_relay_connected, ngx_http_ziti_relay_data);
+
+        if (rc != ZITI_OK) {
+            ngx_http_ziti_relay_conn_release(relay);
+        }
+
+    } else {
+        relay->conn = NULL;
+    }
+
+    if (rc != ZITI_OK) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "ziti: could not dial service \"%s\" for %s: %s",
+                      names[relay->service_index], relay->what, ziti_errorstr(rc));
+
+        ngx_http_ziti_relay_fail(relay);
+    }
+}
+
+
+static void
+ngx_http_ziti_relay_nop(uv_work_t *req)
+{
+    /* runs on the uv thread pool; the dial itself happens in ngx_http_ziti_relay_dial_start() */
+}
+
+
+/**
+ * First thing on the loop thread: set up the handle the nginx thread signals, then dial
+ */
+static void
+ngx_http_ziti_relay_dial_start(uv_work_t *req, int status)
+{
+    ngx_http_ziti_relay_t         *relay = req->data;
+    ngx_uint_t                     close;
+
+    uv_async_init(relay->uv_loop, &relay->async, ngx_http_ziti_relay_async);
+    relay->async.data = relay;
+
+    uv_mutex_lock(&relay->lock);
+    relay->async_ready = 1;
+    close = relay->want_close;
+    uv_mutex_unlock(&relay->lock);
+
+    if (close) {
+        ngx_http_ziti_relay_shutdown(relay);
+        return;
+    }
+
+    ngx_http_ziti_relay_dial(relay);
+}
+
+
+/*
+ * nginx thread side
+ */
+
+/**
+ * Completion of relay->wake
+ */
+static void
+ngx_http_ziti_relay_woken(ngx_event_t *ev)
+{
+    ngx_http_ziti_relay_t         *relay = ev->data;
+
+    uv_mutex_lock(&relay->lock);
+    relay->wake_posted = 0;
+    uv_mutex_unlock(&relay->lock);
+
+    relay->handler(relay);
+}
+
+
+/**
+ * Allocate the buffers and the wakeup task of a relay from the client connection's pool
+ */
+ngx_int_t
+ngx_http_ziti_relay_init(ngx_http_ziti_relay_t *relay, ngx_pool_t *pool, size_t up_size, size_t down_size)
+{
+    relay->up = ngx_create_temp_buf(pool, up_size);
+    relay->down = ngx_create_temp_buf(pool, down_size);
+
+    relay->wake = ngx_thread_task_alloc(pool, 0);
+
+    if (relay->up == NULL || relay->down == NULL || relay->wake == NULL) {
+        return NGX_ERROR;
+    }
+
+    relay->wake->handler = ngx_http_ziti_relay_wake_func;
+    relay->wake->event.handler = ngx_http_ziti_relay_woken;
+    relay->wake->event.data = relay;
+
+    relay->dial_req.data = relay;
+
+    if (uv_mutex_init(&relay->lock) != 0) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/**
+ * Dial relay->servicenames[relay->service_index] on relay->uv_loop.  Whatever the owner left in
+ * relay->up, with up_busy set, is written to the service first.
+ */
+void
+ngx_http_ziti_relay_start(ngx_http_ziti_relay_t *relay)
+{
+    uv_queue_work(relay->uv_loop, &relay->dial_req, ngx_http_ziti_relay_nop, ngx_http_ziti_relay_dial_start);
+}
+
+
+/**
+ * Hand relay->up, just filled with client data, to the loop for writing
+ */
+void
+ngx_http_ziti_relay_write(ngx_http_ziti_relay_t *relay)
+{
+    uv_mutex_lock(&relay->lock);
+    relay->up_busy = 1;
+    uv_mutex_unlock(&relay->lock);
+
+    uv_async_send(&relay->async);
+}
+
+
+/**
+ * n bytes of relay->down went to the client
+ */
+void
+ngx_http_ziti_relay_consumed(ngx_http_ziti_relay_t *relay, size_t n)
+{
+    ngx_buf_t                     *down = relay->down;
+
+    uv_mutex_lock(&relay->lock);
+
+    down->pos += n;
+
+    if (down->pos == down->last) {
+        down->pos = down->start;
+        down->last = down->start;
+    }
+
+    uv_mutex_unlock(&relay->lock);
+}
+
+
+/**
+ * Have the loop close the Ziti connection.  The handler sees relay->closed once it has.
+ */
+void
+ngx_http_ziti_relay_close(ngx_http_ziti_relay_t *relay)
+{
+    ngx_uint_t                     signal;
+
+    uv_mutex_lock(&relay->lock);
+    relay->want_close = 1;
+    signal = relay->async_ready;
+    uv_mutex_unlock(&relay->lock);
+
+    // before the loop has picked the relay up, ngx_http_ziti_relay_dial_start() sees want_close
+    if (signal) {
+        uv_async_send(&relay->async);
+    }
+}
+
+
+/**
+ * Once relay->closed is seen, or if the relay was never started
+ */
+void
+ngx_http_ziti_relay_free(ngx_http_ziti_relay_t *relay)
+{
+    uv_mutex_destroy(&relay->lock);
+}
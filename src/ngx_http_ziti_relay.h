@@ -0,0 +1,99 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef NGX_HTTP_ZITI_RELAY_H
+#define NGX_HTTP_ZITI_RELAY_H
+
+
+#include <ngx_core.h>
+#include "ngx_http_ziti_module.h"
+#include "ngx_http_ziti_shm.h"
+
+
+typedef struct ngx_http_ziti_relay_s ngx_http_ziti_relay_t;
+
+typedef void (*ngx_http_ziti_relay_handler_pt)(ngx_http_ziti_relay_t *relay);
+
+
+/*
+ * A client connection relayed byte for byte over a raw Ziti connection, as done by ziti_upgrade
+ * and by ziti_pass in stream{}.  This is the Ziti side: the dial and failover, and the copying
+ * into and out of the two buffers.  The owner embeds the relay, reads and writes the client
+ * connection on the nginx thread, and is called back through handler whenever the Ziti side
+ * has changed.
+ *
+ * The Ziti connection lives on a uv loop thread and the client connection on the nginx thread.
+ * Each direction has one buffer, allocated with the relay; the side that fills it stops reading
+ * until the other side has drained it, which is what pushes back on a fast sender.  The nginx
+ * thread hands work to the loop with relay->async, and the loop wakes the nginx thread with
+ * relay->wake through the ziti thread pool.
+ */
+struct ngx_http_ziti_relay_s {
+    /* set by the owner before ngx_http_ziti_relay_start() */
+    ziti_context                        ztx;
+    uv_loop_t                          *uv_loop;
+    /* ziti_pass service names, in failover order, and the one being dialed */
+    ngx_array_t                        *servicenames;
+    ngx_uint_t                          service_index;
+    /* on a dial error, try the next service */
+    unsigned                            failover:1;
+    ngx_http_ziti_shm_stats_t          *stats;
+    /* what the relay is, for log messages: "upgraded connection", "stream session" */
+    const char                         *what;
+    ngx_http_ziti_relay_handler_pt      handler;
+    void                               *data;
+
+    /* loop thread only */
+    ziti_connection                     conn;
+    uv_work_t                           dial_req;
+    uv_async_t                          async;
+    unsigned                            writing:1;
+    unsigned                            redial:1;
+    unsigned                            conn_closing:1;
+    unsigned                            closing:1;
+
+    /* nginx thread only */
+    ngx_thread_task_t                  *wake;
+
+    /*
+     * Shared, under lock.  up holds what the client sent, owned by the loop thread while
+     * up_busy is set; down holds what the service sent, appended by the loop thread and
+     * consumed by the nginx thread.  connected_at is set before connected.
+     */
+    uv_mutex_t                          lock;
+    ngx_buf_t                          *up;
+    ngx_buf_t                          *down;
+    uint64_t                            connected_at;
+    unsigned                            up_busy:1;
+    unsigned                            async_ready:1;
+    unsigned                            connected:1;
+    unsigned                            eof:1;
+    unsigned                            error:1;
+    unsigned                            want_close:1;
+    unsigned                            closed:1;
+    unsigned                            wake_posted:1;
+};
+
+
+ngx_int_t ngx_http_ziti_relay_init(ngx_http_ziti_relay_t *relay, ngx_pool_t *pool, size_t up_size, size_t down_size);
+void ngx_http_ziti_relay_start(ngx_http_ziti_relay_t *relay);
+void ngx_http_ziti_relay_write(ngx_http_ziti_relay_t *relay);
+void ngx_http_ziti_relay_consumed(ngx_http_ziti_relay_t *relay, size_t n);
+void ngx_http_ziti_relay_close(ngx_http_ziti_relay_t *relay);
+void ngx_http_ziti_relay_free(ngx_http_ziti_relay_t *relay);
+
+
+#endif /* NGX_HTTP_ZITI_RELAY_H */
@@ -0,0 +1,423 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef DDEBUG
+#define DDEBUG 1
+#endif
+#include "ddebug.h"
+
+#include "ngx_http_ziti_module.h"
+#include "ngx_http_ziti_shm.h"
+
+
+/* an identity's service_stats entry */
+typedef struct {
+    const char                 *name;
+    ngx_http_ziti_shm_stats_t  *stats;
+} ngx_http_ziti_stats_cache_t;
+
+
+ngx_msec_t ngx_http_ziti_hist_bounds[NGX_HTTP_ZITI_HIST_BUCKETS] = {
+    1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+
+static ngx_int_t
+ngx_http_ziti_shm_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_ziti_shm_t        *osh = data;
+    ngx_http_ziti_shm_t        *sh;
+    ngx_slab_pool_t            *shpool;
+    size_t                      avail;
+
+    if (osh) {
+        //
+        // Reload: keep the zone, but let the new generation of workers elect a leader of its
+        // own (the old leader may still be draining).  The counters carry on; workers of both
+        // generations keep updating them.
+        //
+        shm_zone->data = osh;
+
+        osh->leader = 0;
+
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_calloc(shpool, sizeof(ngx_http_ziti_shm_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = sh;
+    shm_zone->data = sh;
+
+    // use about half of what is left for the counters and a quarter for edge routers; slab
+    // bookkeeping needs the rest
+    avail = (size_t) (shpool->end - shpool->start) / 2;
+
+    sh->max_stats = avail / sizeof(ngx_http_ziti_shm_stats_t);
+
+    sh->stats = ngx_slab_calloc(shpool, sh->max_stats * sizeof(ngx_http_ziti_shm_stats_t));
+    if (sh->stats == NULL) {
+        return NGX_ERROR;
+    }
+
+    sh->max_routers = avail / 2 / sizeof(ngx_http_ziti_shm_router_t);
+
+    sh->routers = ngx_slab_calloc(shpool, sh->max_routers * sizeof(ngx_http_ziti_shm_router_t));
+    if (sh->routers == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0, "ziti: shared zone \"%V\" holds up to %ui counter sets and %ui edge routers",
+                  &shm_zone->shm.name, sh->max_stats, sh->max_routers);
+
+    return NGX_OK;
+}
+
+
+/**
+ * ziti_shared_zone <name>:<size> [follower_refresh=<time>];
+ */
+char *
+ngx_http_ziti_shared_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ziti_main_conf_t                   *zmcf = conf;
+    ngx_str_t                                   *value, name, s;
+    ngx_uint_t                                   i;
+    ngx_int_t                                    n;
+    ssize_t                                      size;
+    u_char                                      *p;
+
+    if (zmcf->shm_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    p = (u_char *) ngx_strchr(value[1].data, ':');
+
+    if (p == NULL || p == value[1].data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\" in \"%V\" directive, expected <name>:<size>",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data;
+    name.len = p - value[1].data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\" in \"%V\" directive",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    zmcf->follower_refresh = 600000;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_http_ziti_strcmp_const(value[i].data, "follower_refresh=") == 0)
+        {
+            s.len = value[i].len - (sizeof("follower_refresh=") - 1);
+            s.data = &value[i].data[sizeof("follower_refresh=") - 1];
+
+            n = ngx_parse_time(&s, 1);
+
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid \"follower_refresh\" value \"%V\" "
+                                   "in \"%V\" directive",
+                                   &value[i], &cmd->name);
+                return NGX_CONF_ERROR;
+            }
+
+            zmcf->follower_refresh = (ngx_msec_t) n * 1000;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "ngx_http_ziti_module: invalid parameter \"%V\" in"
+                           " \"%V\" directive",
+                           &value[i], &cmd->name);
+
+        return NGX_CONF_ERROR;
+    }
+
+    zmcf->shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_ziti_module);
+    if (zmcf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (zmcf->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    zmcf->shm_zone->init = ngx_http_ziti_shm_init_zone;
+    zmcf->shm_zone->data = NULL;
+
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Elect this worker as the leader if there is none, or if the previous one has died.  Only the
+ * leader polls the controller at the configured refresh interval and publishes what it learns.
+ */
+void
+ngx_http_ziti_shm_init_process(ngx_http_ziti_main_conf_t *zmcf, ngx_cycle_t *cycle)
+{
+    ngx_http_ziti_shm_t        *sh;
+    ngx_atomic_uint_t           leader;
+
+    zmcf->shm_leader = 1;
+
+    if (zmcf->shm_zone == NULL) {
+        return;
+    }
+
+    sh = zmcf->shm_zone->data;
+
+    leader = sh->leader;
+
+    if (leader != 0 && kill((ngx_pid_t) leader, 0) == -1 && ngx_errno == NGX_ESRCH) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "ziti: leader worker %P is gone", (ngx_pid_t) leader);
+        ngx_atomic_cmp_set(&sh->leader, leader, 0);
+    }
+
+    zmcf->shm_leader = ngx_atomic_cmp_set(&sh->leader, 0, ngx_pid) || sh->leader == (ngx_atomic_uint_t) ngx_pid;
+
+    ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "ziti: worker %P is the controller refresh %s",
+                  ngx_pid, zmcf->shm_leader ? "leader" : "follower");
+}
+
+
+/**
+ * A ZitiServiceEvent seen by the leader: let the followers know, so that they refresh their
+ * contexts of the identity now rather than at the next follower_refresh.  Runs on the leader's
+ * first loop thread of the identity.
+ */
+void
+ngx_http_ziti_shm_services_changed(ngx_http_ziti_main_conf_t *zmcf, ngx_http_ziti_identity_t *identity,
+    const struct ziti_service_event *event)
+{
+    ngx_http_ziti_shm_t        *sh;
+
+    if (zmcf->shm_zone == NULL || !zmcf->shm_leader || identity->stats == NULL) {
+        return;
+    }
+
+    if ((event->removed == NULL || *event->removed == NULL)
+        && (event->changed == NULL || *event->changed == NULL)
+        && (event->added == NULL || *event->added == NULL))
+    {
+        return;
+    }
+
+    sh = zmcf->shm_zone->data;
+
+    sh->updated = ngx_time();
+
+    ngx_atomic_fetch_add(&identity->stats->generation, 1);
+}
+
+
+/**
+ * Find, or add, the counters of a service of an identity ("" for the identity itself).  Returns
+ * NULL without a ziti_shared_zone, or once the zone is full; counting then simply stops.
+ */
+ngx_http_ziti_shm_stats_t *
+ngx_http_ziti_shm_stats_get(ngx_uint_t identity, const char *name)
+{
+    ngx_http_ziti_main_conf_t  *zmcf;
+    ngx_http_ziti_shm_t        *sh;
+    ngx_slab_pool_t            *shpool;
+    ngx_http_ziti_shm_stats_t  *st;
+    ngx_uint_t                  i;
+
+    zmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_ziti_module);
+
+    if (zmcf == NULL || zmcf->shm_zone == NULL) {
+        return NULL;
+    }
+
+    sh = zmcf->shm_zone->data;
+    shpool = (ngx_slab_pool_t *) zmcf->shm_zone->shm.addr;
+
+    st = NULL;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (i = 0; i < sh->nstats; i++) {
+        if (sh->stats[i].identity == identity
+            && ngx_strcmp(sh->stats[i].name, name) == 0)
+        {
+            st = &sh->stats[i];
+            break;
+        }
+    }
+
+    if (st == NULL && sh->nstats < sh->max_stats) {
+        st = &sh->stats[sh->nstats];
+
+        st->identity = identity;
+        ngx_cpystrn(st->name, (u_char *) name, ZITI_SHM_SERVICE_NAME_SIZE);
+
+        sh->nstats++;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (st == NULL) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "ziti: shared zone is full, service \"%s\" is not counted", name);
+    }
+
+    return st;
+}
+
+
+/**
+ * ngx_http_ziti_shm_stats_get() for the nginx thread, which looks each service of an identity up
+ * in the zone only once and keeps the pointer, as the client pools do.  name must live as long
+ * as the configuration.
+ */
+ngx_http_ziti_shm_stats_t *
+ngx_http_ziti_shm_stats_cached(ngx_http_ziti_identity_t *identity, const char *name)
+{
+    ngx_http_ziti_stats_cache_t  *entry;
+    ngx_http_ziti_shm_stats_t    *st;
+    ngx_uint_t                    i;
+
+    if (identity->service_stats) {
+        entry = identity->service_stats->elts;
+
+        for (i = 0; i < identity->service_stats->nelts; i++) {
+            if (ngx_strcmp(entry[i].name, name) == 0) {
+                return entry[i].stats;
+            }
+        }
+
+    } else {
+        identity->service_stats = ngx_array_create(ngx_cycle->pool, 4, sizeof(ngx_http_ziti_stats_cache_t));
+    }
+
+    st = ngx_http_ziti_shm_stats_get(identity->index, name);
+
+    if (identity->service_stats) {
+        entry = ngx_array_push(identity->service_stats);
+
+        if (entry) {
+            entry->name = name;
+            entry->stats = st;
+        }
+    }
+
+    return st;
+}
+
+
+/**
+ * Find, or add, the edge router a ZitiRouterEvent is about, and note its address.  Returns NULL
+ * without a ziti_shared_zone, or once the zone is full.
+ */
+ngx_http_ziti_shm_router_t *
+ngx_http_ziti_shm_router_get(ngx_uint_t identity, const struct ziti_router_event *event)
+{
+    ngx_http_ziti_main_conf_t  *zmcf;
+    ngx_http_ziti_shm_t        *sh;
+    ngx_slab_pool_t            *shpool;
+    ngx_http_ziti_shm_router_t *er;
+    ngx_uint_t                  i;
+
+    zmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_ziti_module);
+
+    if (zmcf == NULL || zmcf->shm_zone == NULL || event->name == NULL) {
+        return NULL;
+    }
+
+    sh = zmcf->shm_zone->data;
+    shpool = (ngx_slab_pool_t *) zmcf->shm_zone->shm.addr;
+
+    er = NULL;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (i = 0; i < sh->nrouters; i++) {
+        if (sh->routers[i].identity == identity
+            && ngx_strcmp(sh->routers[i].name, event->name) == 0)
+        {
+            er = &sh->routers[i];
+            break;
+        }
+    }
+
+    if (er == NULL && sh->nrouters < sh->max_routers) {
+        er = &sh->routers[sh->nrouters];
+
+        er->identity = identity;
+        ngx_cpystrn(er->name, (u_char *) event->name, ZITI_SHM_ROUTER_NAME_SIZE);
+
+        sh->nrouters++;
+    }
+
+    if (er) {
+        if (event->address) {
+            ngx_cpystrn(er->address, (u_char *) event->address, ZITI_SHM_ROUTER_ADDR_SIZE);
+        }
+
+        er->changed = ngx_time();
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (er == NULL) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "ziti: shared zone is full, edge router \"%s\" is not counted", event->name);
+    }
+
+    return er;
+}
+
+
+void
+ngx_http_ziti_hist_add(ngx_http_ziti_hist_t *hist, ngx_msec_t ms)
+{
+    ngx_uint_t                  i;
+
+    for (i = 0; i < NGX_HTTP_ZITI_HIST_BUCKETS; i++) {
+        if (ms <= ngx_http_ziti_hist_bounds[i]) {
+            break;
+        }
+    }
+
+    ngx_atomic_fetch_add(&hist->bucket[i], 1);
+    ngx_atomic_fetch_add(&hist->sum, ms);
+    ngx_atomic_fetch_add(&hist->count, 1);
+}
@@ -0,0 +1,135 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef NGX_HTTP_ZITI_SHM_H
+#define NGX_HTTP_ZITI_SHM_H
+
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <nginx.h>
+#include "ngx_http_ziti_module.h"
+
+
+#define ZITI_SHM_SERVICE_NAME_SIZE  128
+#define ZITI_SHM_ROUTER_NAME_SIZE   64
+#define ZITI_SHM_ROUTER_ADDR_SIZE   128
+
+/* latency histogram buckets (ms), plus one for +Inf */
+#define NGX_HTTP_ZITI_HIST_BUCKETS  12
+
+
+typedef struct {
+    ngx_atomic_t                        bucket[NGX_HTTP_ZITI_HIST_BUCKETS + 1];
+    ngx_atomic_t                        sum;
+    ngx_atomic_t                        count;
+} ngx_http_ziti_hist_t;
+
+
+/*
+ * Counters of one service of an identity, summed over every worker and loop.  The entry with
+ * an empty name holds what concerns the identity as a whole.  Updated lock-free from any thread.
+ */
+struct ngx_http_ziti_shm_stats_s {
+    ngx_uint_t                          identity;
+    u_char                              name[ZITI_SHM_SERVICE_NAME_SIZE];
+
+    /* client pools: gauges */
+    ngx_atomic_t                        pool_size;
+    ngx_atomic_t                        active;
+    ngx_atomic_t                        purged;
+    ngx_atomic_t                        waiting;
+
+    /* requests, by how they ended; responses are counted per status class 1xx..5xx */
+    ngx_atomic_t                        requests;
+    ngx_atomic_t                        responses[5];
+    ngx_atomic_t                        errors;
+    ngx_atomic_t                        retries;
+    ngx_atomic_t                        hedges;
+    ngx_atomic_t                        breaker_rejects;
+    ngx_atomic_t                        bytes_in;
+    ngx_atomic_t                        bytes_out;
+
+    ngx_http_ziti_hist_t                checkout;
+    ngx_http_ziti_hist_t                ttfb;
+    ngx_http_ziti_hist_t                total;
+
+    /* identity entry only; unavailable counts requests refused by ziti_unavailable_status */
+    ngx_atomic_t                        unavailable;
+    ngx_atomic_t                        reconnects;
+    ngx_atomic_t                        outages;
+    ngx_atomic_t                        outage_msec;
+    ngx_atomic_t                        reloads;
+    /* identity entry only; libziti transfer rates in bytes/s, summed over every loop */
+    ngx_atomic_t                        rate_up;
+    ngx_atomic_t                        rate_down;
+    /* identity entry only; bumped when the leader sees the identity's services change */
+    ngx_atomic_t                        generation;
+};
+
+
+/*
+ * An edge router an identity's contexts connect to.  connected counts the loops, in every
+ * worker, that currently have a connection to it.
+ */
+struct ngx_http_ziti_shm_router_s {
+    ngx_uint_t                          identity;
+    u_char                              name[ZITI_SHM_ROUTER_NAME_SIZE];
+    u_char                              address[ZITI_SHM_ROUTER_ADDR_SIZE];
+    ngx_atomic_t                        connected;
+    ngx_atomic_t                        connects;
+    ngx_atomic_t                        disconnects;
+    /* connection attempts that failed */
+    ngx_atomic_t                        failures;
+    time_t                              changed;
+};
+
+
+#define ngx_http_ziti_stat_add(st, field, n)                                  \
+    if (st) { (void) ngx_atomic_fetch_add(&(st)->field, (ngx_atomic_int_t) (n)); }
+
+
+/*
+ * ziti_shared_zone: which worker refreshes controller state, and when it last saw services
+ * change.  Which identity's services changed is in its counters' generation.
+ */
+typedef struct {
+    /* pid of the leader worker, 0 if none */
+    ngx_atomic_t                        leader;
+    time_t                              updated;
+    ngx_uint_t                          nstats;
+    ngx_uint_t                          max_stats;
+    ngx_http_ziti_shm_stats_t          *stats;
+    ngx_uint_t                          nrouters;
+    ngx_uint_t                          max_routers;
+    ngx_http_ziti_shm_router_t         *routers;
+} ngx_http_ziti_shm_t;
+
+
+extern ngx_msec_t ngx_http_ziti_hist_bounds[NGX_HTTP_ZITI_HIST_BUCKETS];
+
+
+char *ngx_http_ziti_shared_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+void ngx_http_ziti_shm_init_process(ngx_http_ziti_main_conf_t *zmcf, ngx_cycle_t *cycle);
+void ngx_http_ziti_shm_services_changed(ngx_http_ziti_main_conf_t *zmcf,
+    ngx_http_ziti_identity_t *identity, const struct ziti_service_event *event);
+ngx_http_ziti_shm_stats_t *ngx_http_ziti_shm_stats_get(ngx_uint_t identity, const char *name);
+ngx_http_ziti_shm_stats_t *ngx_http_ziti_shm_stats_cached(ngx_http_ziti_identity_t *identity, const char *name);
+ngx_http_ziti_shm_router_t *ngx_http_ziti_shm_router_get(ngx_uint_t identity, const struct ziti_router_event *event);
+void ngx_http_ziti_hist_add(ngx_http_ziti_hist_t *hist, ngx_msec_t ms);
+
+
+#endif /* NGX_HTTP_ZITI_SHM_H */
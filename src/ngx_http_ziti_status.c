@@ -0,0 +1,539 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef DDEBUG
+#define DDEBUG 1
+#endif
+#include "ddebug.h"
+
+#include "ngx_http_ziti_module.h"
+#include "ngx_http_ziti_shm.h"
+#include "ngx_http_ziti_status.h"
+
+
+/* room for one output line besides the escaped identity and service names */
+#define NGX_HTTP_ZITI_STATUS_LINE  160
+
+/* output lines per service, and per identity */
+#define NGX_HTTP_ZITI_STATUS_SERVICE_LINES   (20 + 3 * (NGX_HTTP_ZITI_HIST_BUCKETS + 3))
+#define NGX_HTTP_ZITI_STATUS_IDENTITY_LINES  10
+#define NGX_HTTP_ZITI_STATUS_ROUTER_LINES    5
+
+
+static u_char *
+ngx_http_ziti_status_escape(ngx_pool_t *pool, u_char *src)
+{
+    size_t                      len;
+    uintptr_t                   n;
+    u_char                     *dst, *p;
+
+    len = ngx_strlen(src);
+    n = ngx_escape_json(NULL, src, len);
+
+    dst = ngx_pnalloc(pool, len + n + 1);
+    if (dst == NULL) {
+        return NULL;
+    }
+
+    p = (u_char *) ngx_escape_json(dst, src, len);
+    *p = '\0';
+
+    return dst;
+}
+
+
+static u_char *
+ngx_http_ziti_status_json_hist(u_char *p, const char *name, ngx_http_ziti_hist_t *hist)
+{
+    ngx_uint_t                  i;
+
+    p = ngx_sprintf(p, "\"%s\":{\"buckets\":{", name);
+
+    for (i = 0; i < NGX_HTTP_ZITI_HIST_BUCKETS; i++) {
+        p = ngx_sprintf(p, "\"%M\":%uA,", ngx_http_ziti_hist_bounds[i], hist->bucket[i]);
+    }
+
+    return ngx_sprintf(p, "\"+Inf\":%uA},\"sum\":%uA,\"count\":%uA}",
+                       hist->bucket[NGX_HTTP_ZITI_HIST_BUCKETS], hist->sum, hist->count);
+}
+
+
+/*
+ * A copy of the ziti_shared_zone tables, with their names escaped for output
+ */
+typedef struct {
+    ngx_http_ziti_shm_stats_t  *stats;
+    ngx_uint_t                  nstats;
+    ngx_http_ziti_shm_router_t *routers;
+    ngx_uint_t                  nrouters;
+    /* escaped identity paths by identity index, service names by counter, routers by router */
+    u_char                    **ids;
+    u_char                    **svcs;
+    u_char                    **ers;
+    u_char                    **addrs;
+} ngx_http_ziti_status_t;
+
+
+static u_char *
+ngx_http_ziti_status_json(u_char *p, ngx_http_ziti_shm_t *sh, ngx_http_ziti_status_t *status)
+{
+    ngx_http_ziti_shm_stats_t  *st, *stats;
+    ngx_http_ziti_shm_router_t *er;
+    ngx_uint_t                  i, nstats;
+    u_char                    **ids, **svcs;
+    ngx_int_t                   idle;
+    ngx_flag_t                  first;
+
+    stats = status->stats;
+    nstats = status->nstats;
+    ids = status->ids;
+    svcs = status->svcs;
+
+    p = ngx_sprintf(p, "{\"version\":\"%s\",\"leader\":%uA,\"updated\":%T,\"identities\":{",
+                    ngx_http_ziti_module_version_string, sh->leader, sh->updated);
+
+    first = 1;
+
+    for (i = 0; i < nstats; i++) {
+
+        st = &stats[i];
+
+        if (st->name[0] != '\0') {
+            continue;
+        }
+
+        p = ngx_sprintf(p, "%s\"%s\":{\"unavailable\":%uA,\"reconnects\":%uA,\"outages\":%uA,"
+                        "\"outage_msec\":%uA,\"reloads\":%uA,\"generation\":%uA,"
+                        "\"transfer_rate\":{\"up\":%i,\"down\":%i}}",
+                        first ? "" : ",", ids[st->identity], st->unavailable, st->reconnects,
+                        st->outages, st->outage_msec, st->reloads, st->generation,
+                        ngx_max((ngx_int_t) st->rate_up, 0), ngx_max((ngx_int_t) st->rate_down, 0));
+        first = 0;
+    }
+
+    p = ngx_sprintf(p, "},\"services\":[");
+
+    first = 1;
+
+    for (i = 0; i < nstats; i++) {
+
+        st = &stats[i];
+
+        if (st->name[0] == '\0') {
+            continue;
+        }
+
+        idle = (ngx_int_t) (st->pool_size - st->active - st->purged);
+
+        p = ngx_sprintf(p, "%s{\"identity\":\"%s\",\"service\":\"%s\","
+                        "\"pool\":{\"size\":%uA,\"active\":%uA,\"idle\":%i,\"purged\":%uA,\"waiting\":%uA},"
+                        "\"requests\":%uA,"
+                        "\"responses\":{\"1xx\":%uA,\"2xx\":%uA,\"3xx\":%uA,\"4xx\":%uA,\"5xx\":%uA},"
+                        "\"errors\":%uA,\"retries\":%uA,\"hedges\":%uA,\"breaker_rejects\":%uA,"
+                        "\"bytes\":{\"in\":%uA,\"out\":%uA},\"latency_ms\":{",
+                        first ? "" : ",", ids[st->identity], svcs[i],
+                        st->pool_size, st->active, ngx_max(idle, 0), st->purged, st->waiting,
+                        st->requests,
+                        st->responses[0], st->responses[1], st->responses[2], st->responses[3], st->responses[4],
+                        st->errors, st->retries, st->hedges, st->breaker_rejects,
+                        st->bytes_in, st->bytes_out);
+
+        p = ngx_http_ziti_status_json_hist(p, "checkout", &st->checkout);
+        *p++ = ',';
+        p = ngx_http_ziti_status_json_hist(p, "ttfb", &st->ttfb);
+        *p++ = ',';
+        p = ngx_http_ziti_status_json_hist(p, "total", &st->total);
+
+        p = ngx_sprintf(p, "}}");
+        first = 0;
+    }
+
+    p = ngx_sprintf(p, "],\"routers\":[");
+
+    for (i = 0; i < status->nrouters; i++) {
+
+        er = &status->routers[i];
+
+        p = ngx_sprintf(p, "%s{\"identity\":\"%s\",\"router\":\"%s\",\"address\":\"%s\","
+                        "\"connected\":%i,\"connects\":%uA,\"disconnects\":%uA,\"failures\":%uA,\"changed\":%T}",
+                        i ? "," : "", ids[er->identity], status->ers[i], status->addrs[i],
+                        ngx_max((ngx_int_t) er->connected, 0), er->connects, er->disconnects, er->failures,
+                        er->changed);
+    }
+
+    return ngx_sprintf(p, "]}\n");
+}
+
+
+static u_char *
+ngx_http_ziti_status_prom_hist(u_char *p, const char *name, u_char *identity, u_char *service,
+    ngx_http_ziti_hist_t *hist)
+{
+    ngx_uint_t                  i;
+    ngx_atomic_uint_t           cumulative;
+
+    cumulative = 0;
+
+    for (i = 0; i < NGX_HTTP_ZITI_HIST_BUCKETS; i++) {
+        cumulative += hist->bucket[i];
+
+        p = ngx_sprintf(p, "ziti_%s_milliseconds_bucket{identity=\"%s\",service=\"%s\",le=\"%M\"} %uA\n",
+                        name, identity, service, ngx_http_ziti_hist_bounds[i], cumulative);
+    }
+
+    cumulative += hist->bucket[NGX_HTTP_ZITI_HIST_BUCKETS];
+
+    p = ngx_sprintf(p, "ziti_%s_milliseconds_bucket{identity=\"%s\",service=\"%s\",le=\"+Inf\"} %uA\n",
+                    name, identity, service, cumulative);
+    p = ngx_sprintf(p, "ziti_%s_milliseconds_sum{identity=\"%s\",service=\"%s\"} %uA\n",
+                    name, identity, service, hist->sum);
+
+    return ngx_sprintf(p, "ziti_%s_milliseconds_count{identity=\"%s\",service=\"%s\"} %uA\n",
+                       name, identity, service, hist->count);
+}
+
+
+static u_char *
+ngx_http_ziti_status_prometheus(u_char *p, ngx_http_ziti_status_t *status)
+{
+    ngx_http_ziti_shm_stats_t  *st, *stats;
+    ngx_http_ziti_shm_router_t *er;
+    ngx_uint_t                  i, n, nstats;
+    ngx_int_t                   idle;
+    u_char                     *id, *svc, **ids, **svcs;
+
+    static const char *classes[] = { "1xx", "2xx", "3xx", "4xx", "5xx" };
+
+    stats = status->stats;
+    nstats = status->nstats;
+    ids = status->ids;
+    svcs = status->svcs;
+
+    p = ngx_sprintf(p, "# TYPE ziti_unavailable_total counter\n"
+                       "# TYPE ziti_reconnects_total counter\n"
+                       "# TYPE ziti_outages_total counter\n"
+                       "# TYPE ziti_outage_milliseconds_total counter\n"
+                       "# TYPE ziti_identity_reloads_total counter\n"
+                       "# TYPE ziti_transfer_rate_bytes gauge\n"
+                       "# TYPE ziti_router_connections gauge\n"
+                       "# TYPE ziti_router_connects_total counter\n"
+                       "# TYPE ziti_router_disconnects_total counter\n"
+                       "# TYPE ziti_router_failures_total counter\n"
+                       "# TYPE ziti_pool_clients gauge\n"
+                       "# TYPE ziti_pool_waiting gauge\n"
+                       "# TYPE ziti_requests_total counter\n"
+                       "# TYPE ziti_responses_total counter\n"
+                       "# TYPE ziti_errors_total counter\n"
+                       "# TYPE ziti_retries_total counter\n"
+                       "# TYPE ziti_hedges_total counter\n"
+                       "# TYPE ziti_breaker_rejects_total counter\n"
+                       "# TYPE ziti_bytes_total counter\n"
+                       "# TYPE ziti_checkout_milliseconds histogram\n"
+                       "# TYPE ziti_ttfb_milliseconds histogram\n"
+                       "# TYPE ziti_total_milliseconds histogram\n");
+
+    for (i = 0; i < nstats; i++) {
+
+        st = &stats[i];
+        id = ids[st->identity];
+
+        if (st->name[0] == '\0') {
+            p = ngx_sprintf(p, "ziti_unavailable_total{identity=\"%s\"} %uA\n"
+                               "ziti_reconnects_total{identity=\"%s\"} %uA\n"
+                               "ziti_outages_total{identity=\"%s\"} %uA\n"
+                               "ziti_outage_milliseconds_total{identity=\"%s\"} %uA\n"
+                               "ziti_identity_reloads_total{identity=\"%s\"} %uA\n"
+                               "ziti_transfer_rate_bytes{identity=\"%s\",direction=\"up\"} %i\n"
+                               "ziti_transfer_rate_bytes{identity=\"%s\",direction=\"down\"} %i\n",
+                            id, st->unavailable, id, st->reconnects, id, st->outages,
+                            id, st->outage_msec, id, st->reloads,
+                            id, ngx_max((ngx_int_t) st->rate_up, 0), id, ngx_max((ngx_int_t) st->rate_down, 0));
+            continue;
+        }
+
+        svc = svcs[i];
+
+        idle = (ngx_int_t) (st->pool_size - st->active - st->purged);
+
+        p = ngx_sprintf(p, "ziti_pool_clients{identity=\"%s\",service=\"%s\",state=\"active\"} %uA\n"
+                           "ziti_pool_clients{identity=\"%s\",service=\"%s\",state=\"idle\"} %i\n"
+                           "ziti_pool_clients{identity=\"%s\",service=\"%s\",state=\"purged\"} %uA\n"
+                           "ziti_pool_waiting{identity=\"%s\",service=\"%s\"} %uA\n"
+                           "ziti_requests_total{identity=\"%s\",service=\"%s\"} %uA\n",
+                        id, svc, st->active, id, svc, ngx_max(idle, 0), id, svc, st->purged,
+                        id, svc, st->waiting, id, svc, st->requests);
+
+        for (n = 0; n < 5; n++) {
+            p = ngx_sprintf(p, "ziti_responses_total{identity=\"%s\",service=\"%s\",class=\"%s\"} %uA\n",
+                            id, svc, classes[n], st->responses[n]);
+        }
+
+        p = ngx_sprintf(p, "ziti_errors_total{identity=\"%s\",service=\"%s\"} %uA\n"
+                           "ziti_retries_total{identity=\"%s\",service=\"%s\"} %uA\n"
+                           "ziti_hedges_total{identity=\"%s\",service=\"%s\"} %uA\n"
+                           "ziti_breaker_rejects_total{identity=\"%s\",service=\"%s\"} %uA\n"
+                           "ziti_bytes_total{identity=\"%s\",service=\"%s\",direction=\"in\"} %uA\n"
+                           "ziti_bytes_total{identity=\"%s\",service=\"%s\",direction=\"out\"} %uA\n",
+                        id, svc, st->errors, id, svc, st->retries, id, svc, st->hedges,
+                        id, svc, st->breaker_rejects, id, svc, st->bytes_in, id, svc, st->bytes_out);
+
+        p = ngx_http_ziti_status_prom_hist(p, "checkout", id, svc, &st->checkout);
+        p = ngx_http_ziti_status_prom_hist(p, "ttfb", id, svc, &st->ttfb);
+        p = ngx_http_ziti_status_prom_hist(p, "total", id, svc, &st->total);
+    }
+
+    for (i = 0; i < status->nrouters; i++) {
+
+        er = &status->routers[i];
+        id = ids[er->identity];
+        svc = status->ers[i];
+
+        p = ngx_sprintf(p, "ziti_router_connections{identity=\"%s\",router=\"%s\"} %i\n"
+                           "ziti_router_connects_total{identity=\"%s\",router=\"%s\"} %uA\n"
+                           "ziti_router_disconnects_total{identity=\"%s\",router=\"%s\"} %uA\n"
+                           "ziti_router_failures_total{identity=\"%s\",router=\"%s\"} %uA\n",
+                        id, svc, ngx_max((ngx_int_t) er->connected, 0), id, svc, er->connects,
+                        id, svc, er->disconnects, id, svc, er->failures);
+    }
+
+    return p;
+}
+
+
+/**
+ * ziti_status content handler: a snapshot of the ziti_shared_zone counters of every worker
+ */
+static ngx_int_t
+ngx_http_ziti_status_handler(ngx_http_request_t *r)
+{
+    ngx_http_ziti_main_conf_t  *zmcf;
+    ngx_http_ziti_loc_conf_t   *zlcf;
+    ngx_http_ziti_identity_t  **identities;
+    ngx_http_ziti_shm_t        *sh;
+    ngx_http_ziti_shm_stats_t  *stats;
+    ngx_http_ziti_shm_router_t *routers;
+    ngx_slab_pool_t            *shpool;
+    ngx_uint_t                  i, nstats, nrouters, format;
+    ngx_int_t                   rc;
+    ngx_str_t                   arg;
+    ngx_buf_t                  *b;
+    ngx_chain_t                 out;
+    ngx_http_ziti_status_t      status;
+    u_char                    **ids, **svcs, **ers, **addrs;
+    size_t                      size, maxid;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    zmcf = ngx_http_get_module_main_conf(r, ngx_http_ziti_module);
+    zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
+
+    format = zlcf->status_format;
+
+    if (ngx_http_arg(r, (u_char *) "format", sizeof("format") - 1, &arg) == NGX_OK) {
+
+        if (arg.len == sizeof("json") - 1 && ngx_strncmp(arg.data, "json", arg.len) == 0) {
+            format = NGX_HTTP_ZITI_STATUS_JSON;
+
+        } else if (arg.len == sizeof("prometheus") - 1 && ngx_strncmp(arg.data, "prometheus", arg.len) == 0) {
+            format = NGX_HTTP_ZITI_STATUS_PROMETHEUS;
+        }
+    }
+
+    sh = zmcf->shm_zone->data;
+    shpool = (ngx_slab_pool_t *) zmcf->shm_zone->shm.addr;
+
+    //
+    // Copy the table out, so that formatting does not hold the zone locked
+    //
+    ngx_shmtx_lock(&shpool->mutex);
+
+    nstats = sh->nstats;
+    nrouters = sh->nrouters;
+
+    stats = ngx_palloc(r->pool, (nstats ? nstats : 1) * sizeof(ngx_http_ziti_shm_stats_t));
+    routers = ngx_palloc(r->pool, (nrouters ? nrouters : 1) * sizeof(ngx_http_ziti_shm_router_t));
+
+    if (stats == NULL || routers == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_memcpy(stats, sh->stats, nstats * sizeof(ngx_http_ziti_shm_stats_t));
+    ngx_memcpy(routers, sh->routers, nrouters * sizeof(ngx_http_ziti_shm_router_t));
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    //
+    // Escaped identity paths, by identity index, with a last one for counters left behind by
+    // identities a reload dropped; escaped service names, by counter; escaped edge router names
+    // and addresses
+    //
+    ids = ngx_palloc(r->pool, (zmcf->identities.nelts + 1) * sizeof(u_char *));
+    svcs = ngx_pcalloc(r->pool, (nstats ? nstats : 1) * sizeof(u_char *));
+    ers = ngx_palloc(r->pool, (nrouters ? nrouters : 1) * sizeof(u_char *));
+    addrs = ngx_palloc(r->pool, (nrouters ? nrouters : 1) * sizeof(u_char *));
+
+    if (ids == NULL || svcs == NULL || ers == NULL || addrs == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    identities = zmcf->identities.elts;
+    maxid = sizeof("unknown") - 1;
+
+    for (i = 0; i < zmcf->identities.nelts; i++) {
+        ids[i] = ngx_http_ziti_status_escape(r->pool, (u_char *) identities[i]->identity_path);
+        if (ids[i] == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        maxid = ngx_max(maxid, ngx_strlen(ids[i]));
+    }
+
+    ids[zmcf->identities.nelts] = (u_char *) "unknown";
+
+    size = sizeof("{\"version\":\"\",\"leader\":,\"updated\":,\"identities\":{},\"services\":[]}\n")
+           + sizeof(ngx_http_ziti_module_version_string) + 3 * NGX_ATOMIC_T_LEN
+           + 20 * NGX_HTTP_ZITI_STATUS_LINE;
+
+    for (i = 0; i < nstats; i++) {
+
+        if (stats[i].identity > zmcf->identities.nelts) {
+            stats[i].identity = zmcf->identities.nelts;
+        }
+
+        if (stats[i].name[0] == '\0') {
+            size += NGX_HTTP_ZITI_STATUS_IDENTITY_LINES * (NGX_HTTP_ZITI_STATUS_LINE + maxid);
+            continue;
+        }
+
+        svcs[i] = ngx_http_ziti_status_escape(r->pool, stats[i].name);
+        if (svcs[i] == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        size += NGX_HTTP_ZITI_STATUS_SERVICE_LINES * (NGX_HTTP_ZITI_STATUS_LINE + maxid + ngx_strlen(svcs[i]));
+    }
+
+    for (i = 0; i < nrouters; i++) {
+
+        if (routers[i].identity > zmcf->identities.nelts) {
+            routers[i].identity = zmcf->identities.nelts;
+        }
+
+        ers[i] = ngx_http_ziti_status_escape(r->pool, routers[i].name);
+        addrs[i] = ngx_http_ziti_status_escape(r->pool, routers[i].address);
+
+        if (ers[i] == NULL || addrs[i] == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        size += NGX_HTTP_ZITI_STATUS_ROUTER_LINES * (NGX_HTTP_ZITI_STATUS_LINE + maxid + ngx_strlen(ers[i]))
+                + ngx_strlen(addrs[i]);
+    }
+
+    status.stats = stats;
+    status.nstats = nstats;
+    status.routers = routers;
+    status.nrouters = nrouters;
+    status.ids = ids;
+    status.svcs = svcs;
+    status.ers = ers;
+    status.addrs = addrs;
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (format == NGX_HTTP_ZITI_STATUS_PROMETHEUS) {
+        ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+        b->last = ngx_http_ziti_status_prometheus(b->last, &status);
+
+    } else {
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+        b->last = ngx_http_ziti_status_json(b->last, sh, &status);
+    }
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/**
+ * ziti_status [json | prometheus];
+ */
+char *
+ngx_http_ziti_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ziti_loc_conf_t   *zlcf = conf;
+    ngx_http_ziti_main_conf_t  *zmcf;
+    ngx_http_core_loc_conf_t   *clcf;
+    ngx_str_t                  *value;
+
+    if (zlcf->status_format) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    zlcf->status_format = NGX_HTTP_ZITI_STATUS_JSON;
+
+    if (cf->args->nelts == 2) {
+
+        if (ngx_strcmp(value[1].data, "prometheus") == 0) {
+            zlcf->status_format = NGX_HTTP_ZITI_STATUS_PROMETHEUS;
+
+        } else if (ngx_strcmp(value[1].data, "json") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "ngx_http_ziti_module: invalid parameter \"%V\" in"
+                               " \"%V\" directive",
+                               &value[1], &cmd->name);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    // checked once the http block is parsed, since ziti_shared_zone may come later
+    zmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_ziti_module);
+    zmcf->status_used = 1;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_ziti_status_handler;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,34 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef NGX_HTTP_ZITI_STATUS_H
+#define NGX_HTTP_ZITI_STATUS_H
+
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <nginx.h>
+#include "ngx_http_ziti_module.h"
+
+
+#define NGX_HTTP_ZITI_STATUS_JSON        1
+#define NGX_HTTP_ZITI_STATUS_PROMETHEUS  2
+
+
+char *ngx_http_ziti_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+
+#endif /* NGX_HTTP_ZITI_STATUS_H */
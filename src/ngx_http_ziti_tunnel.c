@@ -0,0 +1,479 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef DDEBUG
+#define DDEBUG 1
+#endif
+#include "ddebug.h"
+
+#include "ngx_http_ziti_module.h"
+#include "ngx_http_ziti_handler.h"
+#include "ngx_http_ziti_shm.h"
+#include "ngx_http_ziti_relay.h"
+#include "ngx_http_ziti_tunnel.h"
+
+
+/*
+ * ziti_upgrade: an HTTP Upgrade request (WebSocket and the like) relayed over a raw Ziti
+ * connection instead of a pooled um_http client.  The request head is written to the service
+ * as received; from then on bytes are copied both ways until either side closes, so the 101
+ * and everything after it reach the client untouched.  The Ziti side is an
+ * ngx_http_ziti_relay_t; what is here runs on the nginx thread.
+ */
+struct ngx_http_ziti_tunnel_s {
+    ngx_http_ziti_relay_t               relay;
+    ngx_http_request_t                 *r;
+    ngx_http_ziti_request_ctx_t        *request_ctx;
+    ngx_http_ziti_loc_conf_t           *zlcf;
+    ngx_event_t                         timer;
+    ngx_int_t                           rc;
+    unsigned                            status_seen:1;
+    unsigned                            finishing:1;
+};
+
+
+/**
+ * Non-zero if the request asks to switch protocols.  Only HTTP/1.1 can, and only without a
+ * request body, which would have to be relayed ahead of the switch.
+ */
+ngx_uint_t
+ngx_http_ziti_tunnel_requested(ngx_http_request_t *r)
+{
+    ngx_table_elt_t               *connection = r->headers_in.connection;
+
+    if (r->http_version != NGX_HTTP_VERSION_11 || r->headers_in.upgrade == NULL || connection == NULL) {
+        return 0;
+    }
+
+    if (ngx_strlcasestrn(connection->value.data, connection->value.data + connection->value.len,
+                         (u_char *) "upgrade", 7 - 1) == NULL)
+    {
+        return 0;
+    }
+
+    return r->headers_in.content_length_n <= 0 && !r->headers_in.chunked;
+}
+
+
+/**
+ * Everything on the loop side is gone: account for the request and finalize it
+ */
+static void
+ngx_http_ziti_tunnel_done(ngx_http_ziti_tunnel_t *tunnel)
+{
+    ngx_http_request_t            *r = tunnel->r;
+    ngx_http_ziti_request_ctx_t   *request_ctx = tunnel->request_ctx;
+    ngx_http_ziti_shm_stats_t     *stats = tunnel->relay.stats;
+    ngx_uint_t                     status;
+
+    request_ctx->t_connect = tunnel->relay.connected_at;
+    request_ctx->t_done = uv_hrtime();
+
+    if (stats) {
+        status = tunnel->status_seen ? r->headers_out.status : (ngx_uint_t) tunnel->rc;
+
+        if (status >= 100 && status < 600) {
+            ngx_atomic_fetch_add(&stats->responses[status / 100 - 1], 1);
+        }
+
+        ngx_http_ziti_hist_add(&stats->total, ngx_current_msec - request_ctx->start);
+    }
+
+    ngx_http_ziti_relay_free(&tunnel->relay);
+
+    ngx_destroy_pool(request_ctx->pool);
+
+    ngx_http_finalize_request(r, tunnel->rc);
+}
+
+
+/**
+ * Stop relaying and have the loop close the Ziti connection.  rc is what the request is
+ * finalized with once it has.
+ */
+static void
+ngx_http_ziti_tunnel_finish(ngx_http_ziti_tunnel_t *tunnel, ngx_int_t rc)
+{
+    ngx_http_request_t            *r = tunnel->r;
+
+    if (tunnel->finishing) {
+        return;
+    }
+
+    tunnel->finishing = 1;
+    tunnel->rc = rc;
+
+    if (tunnel->timer.timer_set) {
+        ngx_del_timer(&tunnel->timer);
+    }
+
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    ngx_http_ziti_relay_close(&tunnel->relay);
+}
+
+
+/**
+ * Check the status line of the response, before any of it goes to the client
+ */
+static ngx_int_t
+ngx_http_ziti_tunnel_status(ngx_http_ziti_tunnel_t *tunnel, u_char *pos, u_char *last)
+{
+    ngx_http_request_t            *r = tunnel->r;
+    ngx_int_t                      code;
+
+    // "HTTP/1.1 101"
+    if (last - pos < 12) {
+        return NGX_AGAIN;
+    }
+
+    if (ngx_strncmp(pos, "HTTP/1.", 7) != 0 || pos[8] != ' ') {
+        return NGX_ERROR;
+    }
+
+    code = ngx_atoi(pos + 9, 3);
+    if (code < 100 || code > 599) {
+        return NGX_ERROR;
+    }
+
+    r->headers_out.status = code;
+
+    // the connection is up, so the loop thread is done picking the service; for $ziti_service
+    tunnel->request_ctx->servicename = ((char **) tunnel->zlcf->servicenames->elts)[tunnel->relay.service_index];
+
+    tunnel->status_seen = 1;
+    tunnel->request_ctx->t_header = uv_hrtime();
+
+    if (code != NGX_HTTP_SWITCHING_PROTOCOLS) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "ziti: service answered upgrade request with %i, relaying it", code);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_ziti_tunnel_process(ngx_http_ziti_tunnel_t *tunnel)
+{
+    ngx_http_request_t            *r = tunnel->r;
+    ngx_connection_t              *c = r->connection;
+    ngx_http_ziti_relay_t         *relay = &tunnel->relay;
+    ngx_buf_t                     *up = relay->up;
+    ngx_buf_t                     *down = relay->down;
+    ngx_uint_t                     closed, connected, up_busy, eof, error, active;
+    u_char                        *pos, *last;
+    ssize_t                        n;
+    ngx_int_t                      rc;
+
+    uv_mutex_lock(&relay->lock);
+
+    closed = relay->closed;
+    connected = relay->connected;
+    up_busy = relay->up_busy;
+    error = relay->error;
+
+    uv_mutex_unlock(&relay->lock);
+
+    if (closed) {
+        ngx_http_ziti_tunnel_done(tunnel);
+        return;
+    }
+
+    if (tunnel->finishing) {
+        return;
+    }
+
+    active = 0;
+
+    //
+    // service -> client
+    //
+    for ( ;; ) {
+        uv_mutex_lock(&relay->lock);
+
+        pos = down->pos;
+        last = down->last;
+        eof = relay->eof;
+
+        uv_mutex_unlock(&relay->lock);
+
+        if (pos == last) {
+            break;
+        }
+
+        if (!tunnel->status_seen) {
+            rc = ngx_http_ziti_tunnel_status(tunnel, pos, last);
+
+            if (rc == NGX_AGAIN && !eof) {
+                break;
+            }
+
+            if (rc != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0, "ziti: service sent an invalid response to an upgrade request");
+                ngx_http_ziti_tunnel_finish(tunnel, NGX_HTTP_BAD_GATEWAY);
+                return;
+            }
+        }
+
+        if (!c->write->ready) {
+            break;
+        }
+
+        n = c->send(c, pos, last - pos);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_ziti_tunnel_finish(tunnel, NGX_HTTP_CLOSE);
+            return;
+        }
+
+        ngx_http_ziti_stat_add(relay->stats, bytes_out, n);
+        tunnel->request_ctx->bytes_received += n;
+        active = 1;
+
+        ngx_http_ziti_relay_consumed(relay, n);
+    }
+
+    uv_mutex_lock(&relay->lock);
+    eof = relay->eof;
+    pos = down->pos;
+    last = down->last;
+    uv_mutex_unlock(&relay->lock);
+
+    if ((eof || error) && pos == last) {
+        ngx_http_ziti_tunnel_finish(tunnel, tunnel->status_seen ? NGX_HTTP_CLOSE : NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+    //
+    // client -> service, one buffer at a time
+    //
+    if (connected && !up_busy && c->read->ready) {
+
+        n = c->recv(c, up->start, up->end - up->start);
+
+        if (n == 0 || n == NGX_ERROR) {
+            // the client went away
+            ngx_http_ziti_tunnel_finish(tunnel, NGX_HTTP_CLOSE);
+            return;
+        }
+
+        if (n > 0) {
+            up->pos = up->start;
+            up->last = up->start + n;
+
+            ngx_http_ziti_relay_write(relay);
+
+            ngx_http_ziti_stat_add(relay->stats, bytes_in, n);
+            active = 1;
+        }
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK || ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_ziti_tunnel_finish(tunnel, NGX_HTTP_CLOSE);
+        return;
+    }
+
+    if (active) {
+        ngx_add_timer(&tunnel->timer, tunnel->zlcf->upgrade_timeout);
+    }
+}
+
+
+/**
+ * The Ziti side of the tunnel has changed
+ */
+static void
+ngx_http_ziti_tunnel_woken(ngx_http_ziti_relay_t *relay)
+{
+    ngx_http_ziti_tunnel_t        *tunnel = relay->data;
+    ngx_connection_t              *c = tunnel->r->connection;
+
+    ngx_http_ziti_tunnel_process(tunnel);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_ziti_tunnel_handler(ngx_http_request_t *r)
+{
+    ngx_http_ziti_request_ctx_t   *request_ctx = ngx_http_get_module_ctx(r, ngx_http_ziti_module);
+
+    ngx_http_ziti_tunnel_process(request_ctx->tunnel);
+}
+
+
+static void
+ngx_http_ziti_tunnel_timeout(ngx_event_t *ev)
+{
+    ngx_http_ziti_tunnel_t        *tunnel = ev->data;
+    ngx_connection_t              *c = tunnel->r->connection;
+
+    ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "ziti: upgraded connection timed out");
+
+    ngx_http_ziti_tunnel_finish(tunnel, tunnel->status_seen ? NGX_HTTP_CLOSE : NGX_HTTP_GATEWAY_TIME_OUT);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+/**
+ * Length of the request head as it is written to the service
+ */
+static size_t
+ngx_http_ziti_tunnel_head_len(ngx_http_request_t *r)
+{
+    ngx_list_part_t               *part;
+    ngx_table_elt_t               *h;
+    ngx_uint_t                     i;
+    size_t                         len;
+
+    len = r->method_name.len + 1 + r->unparsed_uri.len + sizeof(" HTTP/1.1" CRLF) - 1 + sizeof(CRLF) - 1;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        len += h[i].key.len + sizeof(": ") - 1 + h[i].value.len + sizeof(CRLF) - 1;
+    }
+
+    return len;
+}
+
+
+static u_char *
+ngx_http_ziti_tunnel_head(ngx_http_request_t *r, u_char *p)
+{
+    ngx_list_part_t               *part;
+    ngx_table_elt_t               *h;
+    ngx_uint_t                     i;
+
+    p = ngx_sprintf(p, "%V %V HTTP/1.1" CRLF, &r->method_name, &r->unparsed_uri);
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        p = ngx_sprintf(p, "%V: %V" CRLF, &h[i].key, &h[i].value);
+    }
+
+    *p++ = CR; *p++ = LF;
+
+    return p;
+}
+
+
+/**
+ * Take the request over: dial the service on the request's loop and relay it.  The request is
+ * finalized by the tunnel once the Ziti connection is closed.
+ */
+ngx_int_t
+ngx_http_ziti_tunnel_start(ngx_http_request_t *r, ngx_http_ziti_request_ctx_t *request_ctx)
+{
+    ngx_http_ziti_loc_conf_t      *zlcf = ngx_http_get_module_loc_conf(r, ngx_http_ziti_module);
+    ngx_http_ziti_tunnel_t        *tunnel;
+    ngx_http_ziti_relay_t         *relay;
+    size_t                         len, preread;
+
+    tunnel = ngx_pcalloc(r->pool, sizeof(ngx_http_ziti_tunnel_t));
+    if (tunnel == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    tunnel->r = r;
+    tunnel->request_ctx = request_ctx;
+    tunnel->zlcf = zlcf;
+
+    relay = &tunnel->relay;
+
+    relay->ztx = ngx_http_ziti_pools_ztx(request_ctx->pools);
+    relay->uv_loop = request_ctx->loop->uv_thread_loop;
+    relay->servicenames = zlcf->servicenames;
+    relay->service_index = request_ctx->service_index;
+    // fail over to the next service named on ziti_pass, as ziti_next_upstream would
+    relay->failover = (zlcf->next_upstream & NGX_HTTP_UPSTREAM_FT_ERROR) != 0;
+    relay->what = "upgraded connection";
+    relay->handler = ngx_http_ziti_tunnel_woken;
+    relay->data = tunnel;
+
+    //
+    // The request head, and whatever the client sent after it, is the first thing written to
+    // the service; the buffer is then reused for client data
+    //
+    len = ngx_http_ziti_tunnel_head_len(r);
+    preread = r->header_in->last - r->header_in->pos;
+
+    if (ngx_http_ziti_relay_init(relay, r->pool, ngx_max(zlcf->buf_size, len + preread), zlcf->buf_size) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    relay->up->last = ngx_http_ziti_tunnel_head(r, relay->up->last);
+    relay->up->last = ngx_cpymem(relay->up->last, r->header_in->pos, preread);
+    r->header_in->pos = r->header_in->last;
+
+    relay->up_busy = 1;
+
+    tunnel->timer.handler = ngx_http_ziti_tunnel_timeout;
+    tunnel->timer.data = tunnel;
+    tunnel->timer.log = r->connection->log;
+
+    relay->stats = ngx_http_ziti_shm_stats_cached(zlcf->identity, request_ctx->servicename);
+
+    ngx_http_ziti_stat_add(relay->stats, requests, 1);
+    ngx_http_ziti_stat_add(relay->stats, bytes_in, relay->up->last - relay->up->pos);
+
+    request_ctx->tunnel = tunnel;
+    request_ctx->state = ZS_REQ_PROCESSING;
+
+    // the connection cannot be reused once it has switched protocols
+    r->keepalive = 0;
+
+    r->read_event_handler = ngx_http_ziti_tunnel_handler;
+    r->write_event_handler = ngx_http_ziti_tunnel_handler;
+
+    ngx_add_timer(&tunnel->timer, zlcf->upgrade_timeout);
+
+    r->main->count++;
+
+    ngx_http_ziti_relay_start(relay);
+
+    return NGX_DONE;
+}
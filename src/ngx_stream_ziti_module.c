@@ -0,0 +1,793 @@
+/*
+Copyright Netfoundry, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef DDEBUG
+#define DDEBUG 1
+#endif
+#include "ddebug.h"
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_http_ziti_module.h"
+#include "ngx_http_ziti_handler.h"
+#include "ngx_http_ziti_shm.h"
+#include "ngx_http_ziti_relay.h"
+
+
+/*
+ * ziti_pass in stream{}: every session of the server is relayed, byte for byte, over a Ziti
+ * connection dialed to the service.  Identities, their loops and Ziti contexts are those of
+ * ngx_http_ziti_module; a stream server naming the same identity file as an http{} location
+ * shares its contexts.
+ *
+ * As with ziti_upgrade, the Ziti side is an ngx_http_ziti_relay_t, with one ziti_buffer_size
+ * buffer each way; what is here runs on the nginx thread.
+ */
+
+
+typedef struct {
+    /* ngx_http_ziti_identity_t * named in stream{}, matched against http{} ones at startup */
+    ngx_array_t                         identities;
+    /* ziti_loops and the like, for when there is no http{} block to take them from */
+    ngx_http_ziti_main_conf_t           defaults;
+} ngx_stream_ziti_main_conf_t;
+
+
+typedef struct {
+    ngx_http_ziti_identity_t           *identity;
+    /* ziti_pass: service names, in failover order */
+    ngx_array_t                        *servicenames;
+    size_t                              buffer_size;
+    ngx_msec_t                          connect_timeout;
+    ngx_msec_t                          timeout;
+} ngx_stream_ziti_srv_conf_t;
+
+
+typedef struct {
+    ngx_http_ziti_relay_t               relay;
+    ngx_stream_session_t               *s;
+    ngx_stream_ziti_srv_conf_t         *zscf;
+    ngx_http_ziti_loop_t               *loop;
+    struct ListMap                     *pools;
+    ngx_event_t                         timer;
+    ngx_event_t                         retry;
+    ngx_uint_t                          rc;
+    unsigned                            started:1;
+    unsigned                            proxying:1;
+    unsigned                            finishing:1;
+} ngx_stream_ziti_session_t;
+
+
+/* how often (ms) a session waiting for its Ziti context to come up looks again */
+#define NGX_STREAM_ZITI_INIT_WAIT  100
+
+
+static ngx_int_t ngx_stream_ziti_preconfiguration(ngx_conf_t *cf);
+static void *ngx_stream_ziti_create_main_conf(ngx_conf_t *cf);
+static char *ngx_stream_ziti_init_main_conf(ngx_conf_t *cf, void *conf);
+static void *ngx_stream_ziti_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_ziti_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child);
+static char *ngx_stream_ziti_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_stream_ziti_identity(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_stream_ziti_init_process(ngx_cycle_t *cycle);
+
+static void ngx_stream_ziti_handler(ngx_stream_session_t *s);
+
+
+static ngx_command_t ngx_stream_ziti_cmds[] = {
+
+    { ngx_string("ziti_pass"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
+      ngx_stream_ziti_pass,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ziti_identity"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_ziti_identity,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ziti_buffer_size"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_ziti_srv_conf_t, buffer_size),
+      NULL },
+
+    { ngx_string("ziti_connect_timeout"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_ziti_srv_conf_t, connect_timeout),
+      NULL },
+
+    { ngx_string("ziti_timeout"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_ziti_srv_conf_t, timeout),
+      NULL },
+
+    ngx_null_command
+};
+
+
+/* Nginx stream subsystem module hooks */
+static ngx_stream_module_t ngx_stream_ziti_module_ctx = {
+    ngx_stream_ziti_preconfiguration,
+            /* preconfiguration */
+    NULL,   /* postconfiguration */
+
+    ngx_stream_ziti_create_main_conf,
+             /* create_main_conf */
+    ngx_stream_ziti_init_main_conf,
+             /* init_main_conf */
+
+    ngx_stream_ziti_create_srv_conf,  /* create_srv_conf */
+    ngx_stream_ziti_merge_srv_conf    /* merge_srv_conf */
+};
+
+
+ngx_module_t ngx_stream_ziti_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_ziti_module_ctx,     /* module context */
+    ngx_stream_ziti_cmds,            /* module directives */
+    NGX_STREAM_MODULE,               /* module type */
+    NULL,    /* init master */
+    NULL,    /* init module */
+    ngx_stream_ziti_init_process,    /* init process */
+    NULL,    /* init thread */
+    NULL,    /* exit thread */
+    NULL,    /* exit process */
+    NULL,    /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_ziti_preconfiguration(ngx_conf_t *cf)
+{
+    // the same pool ngx_http_ziti_module wakes requests up through
+    if (ngx_thread_pool_add(cf, &ngx_http_ziti_thread_pool_name) == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_stream_ziti_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_ziti_main_conf_t          *zsmcf;
+
+    zsmcf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_ziti_main_conf_t));
+    if (zsmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&zsmcf->identities, cf->pool, 4, sizeof(ngx_http_ziti_identity_t *)) != NGX_OK) {
+        return NULL;
+    }
+
+    return zsmcf;
+}
+
+
+/**
+ * The defaults of ngx_http_ziti_init_main_conf(), for identities started without an http{} block
+ */
+static char *
+ngx_stream_ziti_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_stream_ziti_main_conf_t          *zsmcf = conf;
+    ngx_http_ziti_main_conf_t            *defaults = &zsmcf->defaults;
+
+    defaults->loops = 1;
+    defaults->refresh_interval = 60;
+    defaults->router_keepalive = 10;
+    defaults->metrics_type = INSTANT;
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     defaults->identities = { 0 };
+     *     defaults->loop_thread_name = 0;
+     *     defaults->loop_cpu_affinity = NULL;
+     *     defaults->config_types = NULL;
+     *     defaults->identity_watch = 0;
+     *     defaults->shm_zone = NULL;
+     */
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_stream_ziti_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_stream_ziti_srv_conf_t           *zscf;
+
+    zscf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_ziti_srv_conf_t));
+    if (zscf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     zscf->servicenames = NULL;
+     */
+
+    zscf->identity = NGX_CONF_UNSET_PTR;
+    zscf->buffer_size = NGX_CONF_UNSET_SIZE;
+    zscf->connect_timeout = NGX_CONF_UNSET_MSEC;
+    zscf->timeout = NGX_CONF_UNSET_MSEC;
+
+    return zscf;
+}
+
+
+static char *
+ngx_stream_ziti_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_stream_ziti_srv_conf_t           *prev = parent;
+    ngx_stream_ziti_srv_conf_t           *conf = child;
+
+    ngx_conf_merge_ptr_value(conf->identity, prev->identity, NULL);
+    ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size, 65536);
+    ngx_conf_merge_msec_value(conf->connect_timeout, prev->connect_timeout, 60000);
+    ngx_conf_merge_msec_value(conf->timeout, prev->timeout, 600000);
+
+    if (conf->servicenames && conf->identity == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"ziti_pass\" requires \"ziti_identity\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * A NUL terminated copy, as libziti takes service names and identity paths
+ */
+static char *
+ngx_stream_ziti_strdup(ngx_pool_t *pool, ngx_str_t *str)
+{
+    u_char                     *p;
+
+    p = ngx_pnalloc(pool, str->len + 1);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    *ngx_cpymem(p, str->data, str->len) = '\0';
+
+    return (char *) p;
+}
+
+
+static char *
+ngx_stream_ziti_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_core_srv_conf_t *cscf;
+    ngx_stream_ziti_srv_conf_t *zscf = conf;
+    ngx_str_t                  *value = cf->args->elts;
+    ngx_uint_t                  i;
+    char                      **name;
+
+    if (zscf->servicenames != NULL) {
+        return "is duplicate";
+    }
+
+    zscf->servicenames = ngx_array_create(cf->pool, cf->args->nelts - 1, sizeof(char *));
+    if (zscf->servicenames == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    //
+    // Any services beyond the first are dialed in turn when the ones before them fail
+    //
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (value[i].len == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "empty service name in \"%V\"", &cmd->name);
+            return NGX_CONF_ERROR;
+        }
+
+        name = ngx_array_push(zscf->servicenames);
+        if (name == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *name = ngx_stream_ziti_strdup(cf->pool, &value[i]);
+        if (*name == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    cscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_core_module);
+
+    cscf->handler = ngx_stream_ziti_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_ziti_identity(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_ziti_srv_conf_t   *zscf = conf;
+    ngx_str_t                    *value = cf->args->elts;
+    ngx_stream_ziti_main_conf_t  *zsmcf;
+    ngx_http_ziti_identity_t    **identities, **idp, *identity;
+    char                         *path;
+    ngx_uint_t                    i;
+
+    if (zscf->identity != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    // kept as written, like the http{} ziti_identity, so that the two can be matched
+    path = ngx_stream_ziti_strdup(cf->pool, &value[1]);
+    if (path == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    //
+    // Every server naming the same identity file shares one Ziti context per loop
+    //
+    zsmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_ziti_module);
+
+    identities = zsmcf->identities.elts;
+
+    for (i = 0; i < zsmcf->identities.nelts; i++) {
+        if (ngx_strcmp(identities[i]->identity_path, path) == 0) {
+            zscf->identity = identities[i];
+            return NGX_CONF_OK;
+        }
+    }
+
+    identity = ngx_pcalloc(cf->pool, sizeof(ngx_http_ziti_identity_t));
+    if (identity == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    identity->identity_path = path;
+
+    // no http{} locations to prewarm for; see ngx_http_ziti_prewarm()
+    if (ngx_array_init(&identity->locations, cf->pool, 1, sizeof(ngx_http_ziti_loc_conf_t *)) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    idp = ngx_array_push(&zsmcf->identities);
+    if (idp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *idp = identity;
+
+    zscf->identity = identity;
+
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Runs after ngx_http_ziti_init_process().  An identity that an http{} location names too
+ * takes over the loops already started for it; the others get loops of their own, set up as
+ * http{} says or with its defaults.
+ */
+static ngx_int_t
+ngx_stream_ziti_init_process(ngx_cycle_t *cycle)
+{
+    ngx_stream_ziti_main_conf_t  *zsmcf;
+    ngx_http_ziti_main_conf_t    *zmcf;
+    ngx_http_ziti_identity_t    **identities, **shared, *identity;
+    ngx_uint_t                    i, n, started;
+
+    zsmcf = ngx_stream_cycle_get_module_main_conf(cycle, ngx_stream_ziti_module);
+    if (zsmcf == NULL || zsmcf->identities.nelts == 0) {
+        return NGX_OK;
+    }
+
+    zmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_ziti_module);
+    if (zmcf == NULL) {
+        zmcf = &zsmcf->defaults;
+    }
+
+    identities = zsmcf->identities.elts;
+    shared = zmcf->identities.elts;
+    started = 0;
+
+    for (i = 0; i < zsmcf->identities.nelts; i++) {
+
+        identity = identities[i];
+
+        for (n = 0; n < zmcf->identities.nelts; n++) {
+            if (ngx_strcmp(shared[n]->identity_path, identity->identity_path) == 0 && shared[n]->loops) {
+                break;
+            }
+        }
+
+        if (n < zmcf->identities.nelts) {
+            identity->index = shared[n]->index;
+            identity->nloops = shared[n]->nloops;
+            identity->loops = shared[n]->loops;
+            identity->stats = shared[n]->stats;
+            continue;
+        }
+
+        // after the http{} identities, so that the shared zone tells them apart
+        identity->index = zmcf->identities.nelts + i;
+
+        if (ngx_http_ziti_identity_start(zmcf, identity, cycle) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        started++;
+    }
+
+    if (started) {
+        ZITI_LOG(INFO, "stream: started %lu Ziti context(s) with %lu loop(s) each",
+                 (unsigned long) started, (unsigned long) zmcf->loops);
+    }
+
+    return NGX_OK;
+}
+
+
+/**
+ * Nothing on the loop side refers to the relay any more: finalize the session
+ */
+static void
+ngx_stream_ziti_done(ngx_stream_ziti_session_t *ss)
+{
+    ngx_stream_session_t          *s = ss->s;
+    ngx_http_ziti_shm_stats_t     *stats = ss->relay.stats;
+
+    ss->loop->load--;
+
+    if (ss->started) {
+        ngx_http_ziti_pools_release(ss->pools);
+
+        if (stats) {
+            if (ss->rc >= 100 && ss->rc < 600) {
+                ngx_atomic_fetch_add(&stats->responses[ss->rc / 100 - 1], 1);
+            }
+
+            ngx_http_ziti_hist_add(&stats->total, ngx_current_msec - s->start_msec);
+        }
+    }
+
+    ngx_http_ziti_relay_free(&ss->relay);
+
+    ngx_stream_finalize_session(s, ss->rc);
+}
+
+
+/**
+ * Stop relaying and have the loop close the Ziti connection.  rc is what the session is
+ * finalized with once it has.
+ */
+static void
+ngx_stream_ziti_finish(ngx_stream_ziti_session_t *ss, ngx_uint_t rc)
+{
+    ngx_connection_t              *c = ss->s->connection;
+
+    if (ss->finishing) {
+        return;
+    }
+
+    ss->finishing = 1;
+    ss->rc = rc;
+
+    if (ss->timer.timer_set) {
+        ngx_del_timer(&ss->timer);
+    }
+
+    if (ss->retry.timer_set) {
+        ngx_del_timer(&ss->retry);
+    }
+
+    if (c->read->active && ngx_del_event(c->read, NGX_READ_EVENT, 0) != NGX_OK) {
+        c->error = 1;
+    }
+
+    if (!ss->started) {
+        // the service was never dialed, so there is no loop side to wait for
+        ngx_stream_ziti_done(ss);
+        return;
+    }
+
+    ngx_http_ziti_relay_close(&ss->relay);
+}
+
+
+static void
+ngx_stream_ziti_process(ngx_stream_ziti_session_t *ss)
+{
+    ngx_stream_session_t          *s = ss->s;
+    ngx_connection_t              *c = s->connection;
+    ngx_http_ziti_relay_t         *relay = &ss->relay;
+    ngx_buf_t                     *up = relay->up;
+    ngx_buf_t                     *down = relay->down;
+    ngx_uint_t                     closed, connected, up_busy, eof, error, active;
+    u_char                        *pos, *last;
+    ssize_t                        n;
+
+    uv_mutex_lock(&relay->lock);
+
+    closed = relay->closed;
+    connected = relay->connected;
+    up_busy = relay->up_busy;
+    error = relay->error;
+
+    uv_mutex_unlock(&relay->lock);
+
+    if (closed) {
+        ngx_stream_ziti_done(ss);
+        return;
+    }
+
+    if (ss->finishing || !ss->started) {
+        return;
+    }
+
+    if (error && !connected) {
+        ngx_stream_ziti_finish(ss, NGX_STREAM_BAD_GATEWAY);
+        return;
+    }
+
+    active = 0;
+
+    if (connected && !ss->proxying) {
+        ss->proxying = 1;
+        c->log->action = "proxying to ziti service";
+        active = 1;
+    }
+
+    //
+    // service -> client
+    //
+    for ( ;; ) {
+        uv_mutex_lock(&relay->lock);
+
+        pos = down->pos;
+        last = down->last;
+
+        uv_mutex_unlock(&relay->lock);
+
+        if (pos == last || !c->write->ready) {
+            break;
+        }
+
+        n = c->send(c, pos, last - pos);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_stream_ziti_finish(ss, NGX_STREAM_OK);
+            return;
+        }
+
+        ngx_http_ziti_stat_add(relay->stats, bytes_out, n);
+        active = 1;
+
+        ngx_http_ziti_relay_consumed(relay, n);
+    }
+
+    uv_mutex_lock(&relay->lock);
+    eof = relay->eof;
+    pos = down->pos;
+    last = down->last;
+    uv_mutex_unlock(&relay->lock);
+
+    if ((eof || error) && pos == last) {
+        ngx_stream_ziti_finish(ss, NGX_STREAM_OK);
+        return;
+    }
+
+    //
+    // client -> service, one buffer at a time
+    //
+    if (connected && !up_busy && c->read->ready) {
+
+        n = c->recv(c, up->start, up->end - up->start);
+
+        if (n == 0 || n == NGX_ERROR) {
+            // the client went away
+            ngx_stream_ziti_finish(ss, NGX_STREAM_OK);
+            return;
+        }
+
+        if (n > 0) {
+            up->pos = up->start;
+            up->last = up->start + n;
+
+            ngx_http_ziti_relay_write(relay);
+
+            s->received += n;
+            ngx_http_ziti_stat_add(relay->stats, bytes_in, n);
+            active = 1;
+        }
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK || ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_stream_ziti_finish(ss, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (active && ss->proxying) {
+        ngx_add_timer(&ss->timer, ss->zscf->timeout);
+    }
+}
+
+
+/**
+ * The Ziti side of the session has changed
+ */
+static void
+ngx_stream_ziti_woken(ngx_http_ziti_relay_t *relay)
+{
+    ngx_stream_ziti_process(relay->data);
+}
+
+
+static void
+ngx_stream_ziti_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t              *c = ev->data;
+    ngx_stream_session_t          *s = c->data;
+
+    ngx_stream_ziti_process(ngx_stream_get_module_ctx(s, ngx_stream_ziti_module));
+}
+
+
+static void
+ngx_stream_ziti_timeout(ngx_event_t *ev)
+{
+    ngx_stream_ziti_session_t     *ss = ev->data;
+    ngx_connection_t              *c = ss->s->connection;
+
+    ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, ss->proxying ? "ziti: stream session timed out"
+                                                                    : "ziti: connecting to service timed out");
+
+    ngx_stream_ziti_finish(ss, ss->proxying ? NGX_STREAM_OK : NGX_STREAM_BAD_GATEWAY);
+}
+
+
+/**
+ * Hand the session to its loop once the loop's Ziti context is up; until then look again
+ * every NGX_STREAM_ZITI_INIT_WAIT ms, bounded by ziti_connect_timeout
+ */
+static void
+ngx_stream_ziti_start(ngx_event_t *ev)
+{
+    ngx_stream_ziti_session_t     *ss = ev->data;
+    ngx_http_ziti_loop_t          *loop = ss->loop;
+    ngx_connection_t              *c = ss->s->connection;
+    ngx_http_ziti_relay_t         *relay = &ss->relay;
+
+    if (loop->state < ZS_LOC_ZITI_INIT_COMPLETED) {
+
+        if (loop->unavailable) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0, "ziti: controller for identity \"%s\" is unavailable",
+                          loop->identity->identity_path);
+            ngx_stream_ziti_finish(ss, NGX_STREAM_BAD_GATEWAY);
+            return;
+        }
+
+        ngx_add_timer(&ss->retry, NGX_STREAM_ZITI_INIT_WAIT);
+        return;
+    }
+
+    //
+    // Pin the session to the loop's current pools, and with them its context; after an
+    // identity reload it drains on them while new sessions use the new context
+    //
+    ss->pools = ngx_http_ziti_pools_acquire(loop);
+
+    ss->started = 1;
+
+    relay->ztx = ngx_http_ziti_pools_ztx(ss->pools);
+    relay->uv_loop = loop->uv_thread_loop;
+
+    relay->stats = ngx_http_ziti_shm_stats_cached(ss->zscf->identity,
+                                                  ((char **) ss->zscf->servicenames->elts)[0]);
+
+    ngx_http_ziti_stat_add(relay->stats, requests, 1);
+
+    ngx_http_ziti_relay_start(relay);
+}
+
+
+static void
+ngx_stream_ziti_handler(ngx_stream_session_t *s)
+{
+    ngx_connection_t              *c = s->connection;
+    ngx_stream_ziti_srv_conf_t    *zscf;
+    ngx_stream_ziti_session_t     *ss;
+    ngx_http_ziti_relay_t         *relay;
+    size_t                         preread;
+
+    zscf = ngx_stream_get_module_srv_conf(s, ngx_stream_ziti_module);
+
+    c->log->action = "connecting to ziti service";
+
+    ss = ngx_pcalloc(c->pool, sizeof(ngx_stream_ziti_session_t));
+    if (ss == NULL) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ss->s = s;
+    ss->zscf = zscf;
+
+    relay = &ss->relay;
+
+    relay->servicenames = zscf->servicenames;
+    // fail over to the next service named on ziti_pass
+    relay->failover = 1;
+    relay->what = "stream session";
+    relay->handler = ngx_stream_ziti_woken;
+    relay->data = ss;
+
+    //
+    // Anything read ahead of the handler (preread, ssl_preread) is the first thing written
+    // to the service
+    //
+    preread = c->buffer ? (size_t) (c->buffer->last - c->buffer->pos) : 0;
+
+    if (ngx_http_ziti_relay_init(relay, c->pool, ngx_max(zscf->buffer_size, preread), zscf->buffer_size) != NGX_OK) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (preread) {
+        relay->up->last = ngx_cpymem(relay->up->last, c->buffer->pos, preread);
+        c->buffer->pos = c->buffer->last;
+        relay->up_busy = 1;
+        s->received += preread;
+    }
+
+    ss->timer.handler = ngx_stream_ziti_timeout;
+    ss->timer.data = ss;
+    ss->timer.log = c->log;
+
+    ss->retry.handler = ngx_stream_ziti_start;
+    ss->retry.data = ss;
+    ss->retry.log = c->log;
+
+    ss->loop = ngx_http_ziti_loop_select(zscf->identity);
+    ss->loop->load++;
+
+    ngx_stream_set_ctx(s, ss, ngx_stream_ziti_module);
+
+    c->read->handler = ngx_stream_ziti_event_handler;
+    c->write->handler = ngx_stream_ziti_event_handler;
+
+    ngx_add_timer(&ss->timer, zscf->connect_timeout);
+
+    ngx_stream_ziti_start(&ss->retry);
+}
@@ -0,0 +1,69 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use t::Ziti;
+
+plan 'no_plan';
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: more concurrent requests than the pool has clients
+The 19 mirrors and the request itself all want a client at once.  A pool of max=5 clients
+carrying requests=1 each serves 5 of them; the other 15 wait in the pool until a client is
+released.  None may fail or be lost, and the counters must add up.
+--- config
+    location = /slow {
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+
+        ziti_identity  identity.json;
+        ziti_pass  test;
+        ziti_client_pool_size  max=5 requests=1;
+    }
+
+    location = /ziti_status {
+        ziti_status;
+    }
+--- pipelined_requests eval
+["GET /slow", "GET /ziti_status?format=prometheus"]
+--- error_code eval
+[200, 200]
+--- response_body_like eval
+[qr/^x{2047}\n\z/,
+ qr/(?s)^(?=.*ziti_requests_total\{[^}]*service="test"\} 20\n)(?=.*ziti_responses_total\{[^}]*service="test",class="2xx"\} 20\n)(?=.*ziti_errors_total\{[^}]*service="test"\} 0\n)/]
+--- timeout: 15
+
+
+
+=== TEST 2: clients are reused for requests one after another
+--- config
+    location = /small {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+        ziti_client_pool_size  max=5 requests=1;
+    }
+--- pipelined_requests eval
+["GET /small", "GET /small", "GET /small"]
+--- error_code eval
+[200, 200, 200]
+--- response_body eval
+["hello\n", "hello\n", "hello\n"]
+
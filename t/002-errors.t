@@ -0,0 +1,140 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use t::Ziti;
+
+plan 'no_plan';
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: the service closes before a response, every try
+--- config
+    location = /t {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+    }
+--- tcp_listen: $TEST_NGINX_ORIGIN_PORT
+--- tcp_reply:
+--- request
+GET /t
+--- error_code: 502
+--- error_log
+retrying request, attempt 2 of 3
+retrying request, attempt 3 of 3
+
+
+
+=== TEST 2: the service closes before a response, no retries
+--- config
+    location = /t {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+        ziti_next_upstream  off;
+    }
+--- tcp_listen: $TEST_NGINX_ORIGIN_PORT
+--- tcp_reply:
+--- request
+GET /t
+--- error_code: 502
+--- no_error_log
+retrying request
+
+
+
+=== TEST 3: a body cut short of its Content-Length
+The header has gone out, so all that can be done is to drop the client connection.
+--- config
+    location = /t {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+    }
+--- tcp_listen: $TEST_NGINX_ORIGIN_PORT
+--- tcp_reply eval
+"HTTP/1.1 200 OK\r\nContent-Length: 1024\r\n\r\nhello"
+--- request
+GET /t
+--- ignore_response
+--- error_log
+failed mid-stream
+--- no_error_log
+retrying request
+
+
+
+=== TEST 4: a chunked body cut short
+--- config
+    location = /t {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+    }
+--- tcp_listen: $TEST_NGINX_ORIGIN_PORT
+--- tcp_reply eval
+"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n"
+--- request
+GET /t
+--- ignore_response
+--- error_log
+failed mid-stream
+
+
+
+=== TEST 5: a body cut short, ziti_http_engine native
+--- config
+    location = /t {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+        ziti_http_engine  native;
+    }
+--- tcp_listen: $TEST_NGINX_ORIGIN_PORT
+--- tcp_reply eval
+"HTTP/1.1 200 OK\r\nContent-Length: 1024\r\n\r\nhello"
+--- request
+GET /t
+--- ignore_response
+--- error_log
+failed mid-stream
+
+
+
+=== TEST 6: errors are counted
+--- config
+    location = /t {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+        ziti_next_upstream  off;
+    }
+
+    location = /ziti_status {
+        ziti_status;
+    }
+--- tcp_listen: $TEST_NGINX_ORIGIN_PORT
+--- tcp_reply:
+--- pipelined_requests eval
+["GET /t", "GET /ziti_status?format=prometheus"]
+--- error_code eval
+[502, 200]
+--- response_body_like eval
+[qr//,
+ qr/(?s)^(?=.*ziti_requests_total\{[^}]*service="test"\} 1\n)(?=.*ziti_errors_total\{[^}]*service="test"\} 1\n)/]
+
+
+
+=== TEST 7: the service does not answer in time, ziti_http_engine native
+--- config
+    location = /t {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+        ziti_http_engine  native;
+        ziti_read_timeout  200ms;
+        ziti_next_upstream  off;
+    }
+--- tcp_listen: $TEST_NGINX_ORIGIN_PORT
+--- tcp_reply_delay: 1
+--- tcp_reply eval
+"HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello"
+--- request
+GET /t
+--- error_code: 504
+--- error_log
+timed out reading the response
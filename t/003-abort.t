@@ -0,0 +1,86 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use t::Ziti;
+
+plan 'no_plan';
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: the client goes away mid-response
+--- config
+    location = /slow {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+    }
+--- request
+GET /slow
+--- timeout: 0.5
+--- abort
+--- ignore_response
+--- wait: 2
+
+
+
+=== TEST 2: the client goes away while requests wait for pool clients
+The 9 mirrors and the request itself want the pool's 5 clients at once, so half of them are
+still queued in the pool when the client closes the connection, and the rest are mid-response.
+--- config
+    location = /slow {
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+        mirror  /slow;
+
+        ziti_identity  identity.json;
+        ziti_pass  test;
+        ziti_client_pool_size  max=5 requests=1;
+    }
+--- request
+GET /slow
+--- timeout: 0.5
+--- abort
+--- ignore_response
+--- wait: 4
+
+
+
+=== TEST 3: the client goes away mid-upload
+--- config
+    location = /up/file {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+        client_body_buffer_size  1k;
+    }
+--- raw_request eval
+"PUT /up/file HTTP/1.1\r
+Host: localhost\r
+Content-Length: 1048576\r
+\r
+" . ("x" x 4096)
+--- timeout: 0.5
+--- abort
+--- ignore_response
+--- wait: 1
+
+
+
+=== TEST 4: the client goes away mid-response, ziti_http_engine native
+--- config
+    location = /slow {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+        ziti_http_engine  native;
+    }
+--- request
+GET /slow
+--- timeout: 0.5
+--- abort
+--- ignore_response
+--- wait: 2
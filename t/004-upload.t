@@ -0,0 +1,89 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use t::Ziti;
+
+plan 'no_plan';
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: an upload spooled to a temporary file
+The origin stores what it is sent, and the second request reads it back.
+--- config
+    location /up/ {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+        client_body_buffer_size  16k;
+        client_max_body_size  16m;
+    }
+--- pipelined_requests eval
+["PUT /up/large\n$::LargeBody", "GET /up/large"]
+--- error_code eval
+[201, 200]
+--- response_body eval
+["", $::LargeBody]
+--- timeout: 10
+
+
+
+=== TEST 2: an upload spooled to a temporary file, ziti_http_engine native
+--- config
+    location /up/ {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+        ziti_http_engine  native;
+        client_body_buffer_size  16k;
+        client_max_body_size  16m;
+    }
+--- pipelined_requests eval
+["PUT /up/large\n$::LargeBody", "GET /up/large"]
+--- error_code eval
+[201, 200]
+--- response_body eval
+["", $::LargeBody]
+--- timeout: 10
+
+
+
+=== TEST 3: a chunked upload
+--- config
+    location /up/ {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+        client_body_buffer_size  16k;
+        client_max_body_size  16m;
+    }
+--- raw_request eval
+"PUT /up/chunked HTTP/1.1\r
+Host: localhost\r
+Transfer-Encoding: chunked\r
+Connection: close\r
+\r
+" . join("", map { sprintf "%x\r\n%s\r\n", length $_, $_ } unpack "(a65536)*", $::LargeBody) . "0\r\n\r\n"
+--- error_code: 201
+--- response_body:
+--- timeout: 10
+
+
+
+=== TEST 4: a chunked upload, ziti_http_engine native
+--- config
+    location /up/ {
+        ziti_identity  identity.json;
+        ziti_pass  test;
+        ziti_http_engine  native;
+        client_body_buffer_size  16k;
+        client_max_body_size  16m;
+    }
+--- raw_request eval
+"PUT /up/chunked HTTP/1.1\r
+Host: localhost\r
+Transfer-Encoding: chunked\r
+Connection: close\r
+\r
+" . join("", map { sprintf "%x\r\n%s\r\n", length $_, $_ } unpack "(a65536)*", $::LargeBody) . "0\r\n\r\n"
+--- error_code: 201
+--- response_body:
+--- timeout: 10
+
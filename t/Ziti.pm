@@ -0,0 +1,83 @@
+#
+# Shared setup for the Test::Nginx suite in t/.  The nginx under test is the one t/run.sh builds:
+# the module linked against the loopback stand-in for libziti (bench/ziti_loopback.c), which
+# dials a plain TCP origin in place of a Ziti service.  Every block gets that origin on
+# $TEST_NGINX_ORIGIN_PORT, unless it brings its own with --- tcp_listen, and fails on any
+# [alert] or sanitizer report in the error log.  The stand-in never reads the identity file, so
+# ziti_identity can name one that does not exist.
+#
+package t::Ziti;
+
+use Test::Nginx::Socket -Base;
+
+our @EXPORT = qw($LargeBody);
+
+# 2 MB of numbered lines, for uploads too big for client_body_buffer_size
+our $LargeBody = join "", map { sprintf "%07d\n", $_ } 0 .. 262143;
+
+$ENV{TEST_NGINX_ORIGIN_PORT} ||= 18090;
+
+master_on();
+workers(1);
+no_long_string();
+no_shuffle();
+
+# the origin's responses: /small at once, /slow 2 kB at 1 kB/s, /up/ stores what is PUT
+our $Origin = <<'_EOC_';
+    server {
+        listen  127.0.0.1:$TEST_NGINX_ORIGIN_PORT;
+
+        location = /small {
+            return  200 "hello\n";
+        }
+
+        location = /slow {
+            limit_rate  1k;
+            root  html;
+        }
+
+        location /up/ {
+            dav_methods  PUT;
+            create_full_put_path  on;
+            client_max_body_size  16m;
+            root  html;
+        }
+    }
+_EOC_
+
+add_block_preprocessor(sub {
+    my $block = shift;
+
+    # the stand-in reads the origin from its environment; ziti_pass needs the "ziti" thread pool
+    $block->set_value("main_config",
+        "env ZITI_LOOPBACK_ORIGIN=127.0.0.1:$ENV{TEST_NGINX_ORIGIN_PORT};\n"
+        . "thread_pool ziti threads=8;\n"
+        . ($block->main_config // ""));
+
+    my $http_config = "ziti_shared_zone ziti:1m;\n";
+
+    if (defined $block->tcp_listen) {
+        (my $port = $block->tcp_listen) =~ s/\$TEST_NGINX_ORIGIN_PORT/$ENV{TEST_NGINX_ORIGIN_PORT}/;
+        $block->set_value("tcp_listen", $port);
+
+    } else {
+        $http_config .= $Origin;
+    }
+
+    $block->set_value("http_config", $http_config . ($block->http_config // ""));
+
+    if (!defined $block->user_files) {
+        $block->set_value("user_files", ">>> slow\n" . ("x" x 2047) . "\n");
+    }
+
+    my @no_error_log = ("[alert]", "AddressSanitizer", "ThreadSanitizer");
+
+    if (defined $block->no_error_log) {
+        my $logs = $block->no_error_log;
+        unshift @no_error_log, ref $logs ? @$logs : split /\n/, $logs;
+    }
+
+    $block->set_value("no_error_log", \@no_error_log);
+});
+
+1;
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Run the Test::Nginx suite in t/ against nginx with ngx_http_ziti_module linked against the
+# loopback stand-in for libziti (bench/ziti_loopback.c).
+#
+#   t/run.sh [plain|asan|tsan] [prove arguments]
+#
+# plain by default; asan and tsan build with -fsanitize=address and -fsanitize=thread, and a
+# sanitizer report in the error log fails the test that caused it.  Each variant is built once,
+# by bench/build.sh in t/objs-<variant>, and again with REBUILD=1.  NGINX_SRC and ZITI_SDK are
+# passed on to bench/build.sh.  The origin the stand-in dials listens on TEST_NGINX_ORIGIN_PORT
+# (18090).  The prove arguments default to the whole suite, e.g. t/run.sh tsan t/001-pool.t.
+#
+
+set -e
+
+T=$(cd "$(dirname "$0")" && pwd)
+MODULE=$(dirname "$T")
+
+VARIANT=${1:-plain}
+[ $# -gt 0 ] && shift
+
+case $VARIANT in
+    plain)  CFLAGS= ;;
+    asan)   CFLAGS="-fsanitize=address -fno-omit-frame-pointer" ;;
+    tsan)   CFLAGS="-fsanitize=thread" ;;
+    *)      echo "unknown variant \"$VARIANT\", use plain, asan or tsan" >&2; exit 1 ;;
+esac
+
+PREFIX=$T/objs-$VARIANT
+
+command -v prove >/dev/null || { echo "prove not found" >&2; exit 1; }
+
+if [ ! -x "$PREFIX/sbin/nginx" ] || [ -n "$REBUILD" ]; then
+    BENCH_PREFIX=$PREFIX BENCH_CFLAGS=$CFLAGS "$MODULE/bench/build.sh" $NGINX_SRC $ZITI_SDK
+fi
+
+export TEST_NGINX_BINARY=$PREFIX/sbin/nginx
+export TEST_NGINX_ORIGIN_PORT=${TEST_NGINX_ORIGIN_PORT:-18090}
+
+# nginx does not free its pools at exit, so leak checking would only report those
+export ASAN_OPTIONS=${ASAN_OPTIONS:-detect_leaks=0:abort_on_error=0}
+# nginx's signal handlers call functions TSan considers unsafe there
+export TSAN_OPTIONS=${TSAN_OPTIONS:-report_signal_unsafe=0}
+
+[ $# -eq 0 ] && set -- t
+
+cd "$MODULE"
+
+exec prove -I. -r "$@"